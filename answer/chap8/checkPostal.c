@@ -0,0 +1,852 @@
+#include "postalNumber.h"
+#include "textMatch.h"
+#include "textNorm.h"
+#include "textApprox.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MATCH_ROUNDS 20000 /* 実装ごとに試すテキストの数 */
+#define MATCH_MAX_TEXT 300 /* テキストの最大の長さ */
+#define MATCH_MAX_KEY 40   /* 検索キーの最大の長さ */
+#define DB_RECORDS 40000   /* 作るデータベースのレコード数。並列の全件検索を使う数にする */
+#define DELTA_ADDS 200     /* 1つめの差分で追加するレコード数。インデックスを作り直さない数にする */
+#define DELTA_DELS 100     /* 1つめの差分で削除するレコード数 */
+#define FOLD_ADDS 1500     /* 2つめの差分で追加するレコード数。インデックスを作り直す数にする */
+#define SEARCH_KEYS 200    /* 1つの版で試す検索キーの数 */
+#define COMPACT_KEYS 50    /* FM-indexだけを持つ版で試す検索キーの数。出現ごとに文書を求めるので遅い */
+#define APPROX_ROUNDS 20000 /* TextApproxDistanceで試すパターンの数 */
+#define APPROX_MAX_TEXT 120 /* テキストの最大の文字数 */
+#define FUZZY_KEYS 40      /* 1つの版で試すあいまい検索のキーの数 */
+#define FUZZY_MAX_DISTANCE 3 /* PostalNumberSearchFuzzyが許す編集距離の上限 */
+#define BATCH_KEYS 60      /* まとめて検索するキーの数 */
+#define BATCH_ROUNDS 4     /* 1つの版でまとめて検索する回数。FM-indexだけを持つ版では1回 */
+#define PAGE_SIZE 7        /* 途中で打ち切る検索で求める数 */
+#define MAX_LINE 512
+#define MAX_QUERY 256
+#define N_FIELD 7          /* 郵便番号、都道府県名、市区町村名、町域名とその読み */
+
+static const char *kernels[] = {"avx2", "sse2", "scalar"};
+
+/* テキストの文字。一致しかける位置が多くなるよう種類を少なくする */
+static const char alphabet[] = "aab";
+
+/**
+ * text[pos, pos+keyLen)をkeyにして、TextMatchFindとstrstrの結果を比べる
+ * posがテキストの外にはみ出す場合は、はみ出した分を現れない文字にする
+ * @return 一致しなかった場合1
+ */
+static int checkKey(const char *kernel, const char *text, size_t len, size_t pos, size_t keyLen) {
+    char key[MATCH_MAX_KEY+1];
+    for(size_t i = 0; i < keyLen; i++)
+        key[i] = (pos+i < len) ? text[pos+i] : 'c';
+    key[keyLen] = '\0';
+    const char *expect = strstr(text, key);
+    const char *found = TextMatchFind(text, len, key, keyLen);
+    if(found == expect)
+        return 0;
+    printf("textMatch %s: text \"%s\" key \"%s\": %ld, expected %ld\n", kernel, text, key,
+           (found == NULL) ? -1L : (long)(found-text), (expect == NULL) ? -1L : (long)(expect-text));
+    return 1;
+}
+
+/**
+ * TextMatchFindの各実装をstrstrと比べる
+ * 16, 32バイトの区切りをまたぐキー、区切りで終わるキー、テキストの末尾で終わるキーを必ず試す。
+ * テキストはちょうどの大きさで確保するので、AddressSanitizerで読み過ぎも分かる
+ * @return 一致しなかった数
+ */
+static int checkTextMatch(void) {
+    int failures = 0;
+    for(size_t k = 0; k < sizeof(kernels)/sizeof(kernels[0]); k++) {
+        int before = failures;
+        if(!TextMatchSetKernel(kernels[k])) {
+            printf("textMatch %s: not supported, skipped\n", kernels[k]);
+            continue;
+        }
+        for(int round = 0; round < MATCH_ROUNDS; round++) {
+            size_t len = (size_t)rand()%(MATCH_MAX_TEXT+1);
+            size_t skew = (size_t)rand()%32; /* 先頭の位置をずらす */
+            char *buf = (char *)malloc(skew+len+1);
+            if(buf == NULL)
+                return failures+1;
+            char *text = buf+skew;
+            for(size_t i = 0; i < len; i++)
+                text[i] = alphabet[rand()%(sizeof(alphabet)-1)];
+            text[len] = '\0';
+
+            size_t keyLen = (size_t)rand()%(MATCH_MAX_KEY+1);
+            size_t maxPos = (len > keyLen) ? len-keyLen : 0;
+            failures += checkKey(kernels[k], text, len, (size_t)rand()%(maxPos+1), keyLen);
+            /* テキストの末尾で終わるキーと、末尾からはみ出すキー */
+            failures += checkKey(kernels[k], text, len, maxPos, (keyLen < len) ? keyLen : len);
+            if(len > 0)
+                failures += checkKey(kernels[k], text, len, len-1, (keyLen < 2) ? 2 : keyLen);
+            /* 区切りをまたぐキーと、区切りで終わるキー */
+            for(size_t boundary = 16; (boundary <= len) && (boundary <= 64); boundary += 16) {
+                if((keyLen >= 2) && (keyLen <= boundary)) {
+                    failures += checkKey(kernels[k], text, len, boundary-1-(size_t)rand()%(keyLen-1), keyLen);
+                    failures += checkKey(kernels[k], text, len, boundary-keyLen, keyLen);
+                }
+            }
+            free(buf);
+        }
+        printf("textMatch %s: %s\n", kernels[k], (failures == before) ? "ok" : "FAILED");
+    }
+    return failures;
+}
+
+/* 近似照合で使う文字。1〜3バイトの文字を混ぜる */
+static const char *const approxChars[] = {"a", "b", "c", "あ", "ア", "札", "幌", "ﾎ"};
+#define N_APPROX_CHAR (sizeof(approxChars)/sizeof(approxChars[0]))
+
+/**
+ * UTF-8の文字列をコードポイントの列にする（正しいUTF-8であること）
+ * @return 文字数。maxを超える分は捨てる
+ */
+static int decodeUtf8(const char *str, uint32_t *cps, int max) {
+    int n = 0;
+    const unsigned char *p = (const unsigned char *)str;
+    while((*p != '\0') && (n < max)) {
+        int len = (*p < 0x80) ? 1 : (*p < 0xe0) ? 2 : (*p < 0xf0) ? 3 : 4;
+        uint32_t cp = (len == 1) ? *p : (*p & (0xff >> (len+1)));
+        for(int i = 1; i < len; i++)
+            cp = (cp << 6) | (p[i] & 0x3f);
+        cps[n++] = cp;
+        p += len;
+    }
+    return n;
+}
+
+/**
+ * textの部分文字列とpatの編集距離の最小値を、動的計画法で素直に求める
+ * 部分文字列はどこから始めてもよいので、1行目をすべて0にする
+ */
+static int editDistance(const uint32_t *pat, int patLen, const char *text) {
+    uint32_t t[MAX_LINE];
+    int textLen = decodeUtf8(text, t, MAX_LINE);
+    int col[MAX_QUERY+1]; /* 今の列。col[i]はpat[0, i)との距離 */
+    for(int i = 0; i <= patLen; i++)
+        col[i] = i;
+    int best = patLen; /* 空の部分文字列との距離 */
+    for(int j = 0; j < textLen; j++) {
+        int diag = col[0];
+        col[0] = 0;
+        for(int i = 1; i <= patLen; i++) {
+            int up = col[i];
+            int d = diag+(pat[i-1] != t[j]);
+            if(up+1 < d)
+                d = up+1;
+            if(col[i-1]+1 < d)
+                d = col[i-1]+1;
+            col[i] = d;
+            diag = up;
+        }
+        if(col[patLen] < best)
+            best = col[patLen];
+    }
+    return best;
+}
+
+/**
+ * TextApproxDistanceを動的計画法と比べる
+ * ビット列の長さいっぱいのパターンと、長すぎて前処理できないパターンも試す
+ * @return 一致しなかった数
+ */
+static int checkApprox(void) {
+    int failures = 0;
+    for(int round = 0; round < APPROX_ROUNDS; round++) {
+        int keyChars[TEXT_APPROX_MAX+1], textChars[APPROX_MAX_TEXT+2*(TEXT_APPROX_MAX+1)];
+        int keyLen = (rand()%4 == 0) ? TEXT_APPROX_MAX-2+rand()%4 : 1+rand()%16;
+        int textLen = 0, maxText = rand()%(APPROX_MAX_TEXT+1);
+        for(int i = 0; i < keyLen; i++)
+            keyChars[i] = rand()%(int)N_APPROX_CHAR;
+        while(textLen < maxText) {
+            if(rand()%8 != 0) {
+                textChars[textLen++] = rand()%(int)N_APPROX_CHAR;
+                continue;
+            }
+            /* パターンに近い部分が現れるよう、パターンを1文字ずつ崩しながら写す */
+            for(int i = 0; i < keyLen; i++) {
+                int edit = rand()%16;
+                if(edit == 0)
+                    continue; /* 削除 */
+                if(edit == 1)
+                    textChars[textLen++] = rand()%(int)N_APPROX_CHAR; /* 挿入 */
+                textChars[textLen++] = (edit == 2) ? rand()%(int)N_APPROX_CHAR : keyChars[i];
+            }
+        }
+        char key[(TEXT_APPROX_MAX+1)*4+1] = "", text[(APPROX_MAX_TEXT+2*(TEXT_APPROX_MAX+1))*4+1] = "";
+        for(int i = 0; i < keyLen; i++)
+            strcat(key, approxChars[keyChars[i]]);
+        for(int i = 0; i < textLen; i++)
+            strcat(text, approxChars[textChars[i]]);
+
+        TextApproxPattern pat;
+        int compiled = TextApproxCompile(key, &pat);
+        if(compiled != (keyLen <= TEXT_APPROX_MAX)) {
+            printf("textApprox: compiling a %d-character key returned %d\n", keyLen, compiled);
+            failures++;
+            continue;
+        }
+        if(!compiled)
+            continue;
+        uint32_t cps[TEXT_APPROX_MAX];
+        int expect = editDistance(cps, decodeUtf8(key, cps, TEXT_APPROX_MAX), text);
+        int found = TextApproxDistance(&pat, text);
+        if(found != expect) {
+            printf("textApprox: text \"%s\" key \"%s\": %d, expected %d\n", text, key, found, expect);
+            failures++;
+        }
+    }
+    printf("textApprox: %s\n", (failures == 0) ? "ok" : "FAILED");
+    return failures;
+}
+
+/* データベースの住所名を作る部品と、その読み */
+static const char *const prefs[][2] = {
+    {"北海道", "ﾎｯｶｲﾄﾞｳ"}, {"東京都", "ﾄｳｷｮｳﾄ"}, {"大阪府", "ｵｵｻｶﾌ"},
+    {"京都府", "ｷｮｳﾄﾌ"}, {"神奈川県", "ｶﾅｶﾞﾜｹﾝ"}, {"沖縄県", "ｵｷﾅﾜｹﾝ"},
+};
+static const char *const parts[][2] = {
+    {"札幌", "ｻｯﾎﾟﾛ"}, {"中央", "ﾁｭｳｵｳ"}, {"北", "ｷﾀ"}, {"南", "ﾐﾅﾐ"}, {"東", "ﾋｶﾞｼ"},
+    {"西", "ﾆｼ"}, {"港", "ﾐﾅﾄ"}, {"川", "ｶﾜ"}, {"山", "ﾔﾏ"}, {"田", "ﾀ"},
+    {"新", "ｼﾝ"}, {"本町", "ﾎﾝﾁｮｳ"}, {"ひばり", "ﾋﾊﾞﾘ"}, {"ＡＢＣ", "ｴｰﾋﾞｰｼｰ"},
+};
+static const char *const citySuffixes[][2] = {{"市", "ｼ"}, {"区", "ｸ"}, {"町", "ﾏﾁ"}, {"村", "ﾑﾗ"}};
+#define N_PREF (sizeof(prefs)/sizeof(prefs[0]))
+#define N_PART (sizeof(parts)/sizeof(parts[0]))
+#define N_CITY_SUFFIX (sizeof(citySuffixes)/sizeof(citySuffixes[0]))
+
+/* 検索キーの語。フィールド指定と演算子はpostalNumber.hの検索条件と同じ */
+static const char *const fieldPrefixes[] = {"pref:", "city:", "town:"};
+#define N_FIELD_PREFIX (sizeof(fieldPrefixes)/sizeof(fieldPrefixes[0]))
+#define CODE_PREFIX "code:"
+#define CODE_RANGE_SEPARATOR ".."
+
+/* 決まった形で作りにくい検索キー */
+static const char *const fixedKeys[] = {
+    "", " ", "存在しない", "1", "12", "１丁目", "丁目", "ﾋﾞ", "ひばり", "abc", "ＡＢＣ",
+    "NOT", "OR", "NOT NOT", "OR 北", "北 NOT", "北 OR", "NOT 北", "NOT 北 NOT 南",
+    "北 OR NOT 南", "pref:", "city:東 town:1", "code:", "code:1..2", "code:9",
+};
+#define N_FIXED_KEY (sizeof(fixedKeys)/sizeof(fixedKeys[0]))
+
+static char **baseLines = NULL; /* データベースのCSVの各行 */
+static size_t nBaseLine = 0;
+static char checkDir[] = "/tmp/checkPostalXXXXXX";
+static const char *const checkFiles[] = {"KEN_ALL_UTF8.CSV", "ADD_0001.CSV", "DEL_0001.CSV", "ADD_0002.CSV"};
+
+/**
+ * 今の版の削除していないレコード。各フィールドはTextNormalizeしたもの
+ */
+typedef struct {
+    PostalNumberRef ref;
+    char *field[N_FIELD]; /* 郵便番号、都道府県名、市区町村名、町域名、その読みの順 */
+} LiveRecord;
+
+static const char *(*const fieldGetters[N_FIELD])(PostalNumberRef) = {
+    PostalNumberCode, PostalNumberPref, PostalNumberCity, PostalNumberTown,
+    PostalNumberPrefKana, PostalNumberCityKana, PostalNumberTownKana,
+};
+
+/**
+ * 実在しそうな形のCSVの1行を作る
+ * 郵便番号は都道府県ごとに増やし、ときどき前の行と同じにする。町域名には数字を含むものも混ぜる
+ * @param pref 都道府県の番号
+ * @param city 市区町村名を決める値
+ * @param code 郵便番号の通し番号。使った分を進める
+ */
+static char *makeLine(size_t pref, unsigned city, unsigned *code) {
+    char town[128], townKana[128];
+    const char *const *t1 = parts[rand()%N_PART], *const *t2 = parts[rand()%N_PART];
+    int n = rand()%10;
+    if(n == 0) {
+        snprintf(town, sizeof(town), "以下に掲載がない場合");
+        snprintf(townKana, sizeof(townKana), "ｲｶﾆｹｲｻｲｶﾞﾅｲﾊﾞｱｲ");
+    } else if(n <= 2) {
+        snprintf(town, sizeof(town), "%s%s%d丁目", t1[0], t2[0], rand()%20+1);
+        snprintf(townKana, sizeof(townKana), "%s%sﾁｮｳﾒ", t1[1], t2[1]);
+    } else if(n == 3) {
+        snprintf(town, sizeof(town), "%s%s２番地", t1[0], t2[0]);
+        snprintf(townKana, sizeof(townKana), "%s%sﾆﾊﾞﾝﾁ", t1[1], t2[1]);
+    } else if(n == 4) {
+        snprintf(town, sizeof(town), "%s%s（次のビルを除く）", t1[0], t2[0]);
+        snprintf(townKana, sizeof(townKana), "%s%s(ﾂｷﾞﾉﾋﾞﾙｦﾉｿﾞｸ)", t1[1], t2[1]);
+    } else {
+        snprintf(town, sizeof(town), "%s%s", t1[0], t2[0]);
+        snprintf(townKana, sizeof(townKana), "%s%s", t1[1], t2[1]);
+    }
+    if(rand()%10 != 0)
+        *code += 1+rand()%3;
+    const char *const *c1 = parts[city%N_PART], *const *c2 = parts[city/N_PART%N_PART];
+    const char *const *cs = citySuffixes[city/N_PART/N_PART%N_CITY_SUFFIX];
+    char line[MAX_LINE];
+    snprintf(line, sizeof(line), "%02zu101,\"%03u  \",\"%07u\",\"%s\",\"%s%s%s\",\"%s\",\"%s\",\"%s%s%s\",\"%s\",0,0,0,0,0,0\n",
+             pref+1, *code/10000%1000, *code, prefs[pref][1], c1[1], c2[1], cs[1], townKana,
+             prefs[pref][0], c1[0], c2[0], cs[0], town);
+    return strdup(line);
+}
+
+/**
+ * CSVの行を並べたファイルを作る
+ * @return 成功した場合1
+ */
+static int writeLines(const char *path, char *const *lines, size_t n) {
+    FILE *fp = fopen(path, "w");
+    if(fp == NULL)
+        return 0;
+    for(size_t i = 0; i < n; i++)
+        fputs(lines[i], fp);
+    return fclose(fp) == 0;
+}
+
+/**
+ * 一時ディレクトリにデータベースのCSVを作って移り、取り込む
+ * 都道府県、市区町村の順にまとまった並びにする
+ * @return 成功した場合1
+ */
+static int createDB(void) {
+    if((mkdtemp(checkDir) == NULL) || (chdir(checkDir) != 0)) {
+        perror(checkDir);
+        return 0;
+    }
+    baseLines = (char **)calloc(DB_RECORDS, sizeof(char *));
+    if(baseLines == NULL)
+        return 0;
+    for(size_t pref = 0; nBaseLine < DB_RECORDS; pref = (pref+1)%N_PREF) {
+        unsigned code = (unsigned)(pref+1)*1000000;
+        for(int nCity = 20+rand()%40; (nCity > 0) && (nBaseLine < DB_RECORDS); nCity--) {
+            unsigned city = (unsigned)rand();
+            for(int nTown = 1+rand()%40; (nTown > 0) && (nBaseLine < DB_RECORDS); nTown--) {
+                if((baseLines[nBaseLine++] = makeLine(pref, city, &code)) == NULL)
+                    return 0;
+            }
+        }
+    }
+    return writeLines(checkFiles[0], baseLines, nBaseLine) && (PostalNumberLoadDB() == nBaseLine);
+}
+
+/**
+ * 差分ファイルを作って適用する
+ * @param addPath 追加ファイル名
+ * @param nAdd 追加するレコード数
+ * @param delPath 削除ファイル名。NULLなら削除しない
+ * @param nDel 削除するレコード数
+ * @return 成功した場合1
+ */
+static int applyDelta(const char *addPath, size_t nAdd, const char *delPath, size_t nDel) {
+    char **lines = (char **)calloc(nAdd+nDel+1, sizeof(char *));
+    int ok = (lines != NULL);
+    unsigned code = 9000000;
+    for(size_t i = 0; ok && (i < nAdd); i++) {
+        /* 新しい郵便番号と、既存の住所名の組み合わせ */
+        if((lines[i] = makeLine((size_t)rand()%N_PREF, (unsigned)rand(), &code)) == NULL)
+            ok = 0;
+    }
+    ok = ok && writeLines(addPath, lines, nAdd);
+    /* 削除する行は重ならないよう先頭から飛び飛びに選ぶ */
+    for(size_t i = 0; ok && (i < nDel); i++)
+        lines[nAdd+i] = baseLines[(i*(nBaseLine/nDel)+(size_t)rand()%(nBaseLine/nDel))];
+    ok = ok && ((delPath == NULL) || writeLines(delPath, lines+nAdd, nDel));
+    ok = ok && PostalNumberApplyDelta(addPath, delPath);
+    for(size_t i = 0; (lines != NULL) && (i < nAdd); i++)
+        free(lines[i]);
+    free(lines);
+    return ok;
+}
+
+/**
+ * 今の版の全レコードを正規化して取り出す。空文字列の検索は全件を返す
+ * @return レコードの配列。メモリが足りない場合NULL
+ */
+static LiveRecord *getLiveRecords(size_t *n) {
+    PostalNumberRef *refs = (PostalNumberRef *)malloc(2*DB_RECORDS*sizeof(PostalNumberRef));
+    LiveRecord *recs = (LiveRecord *)calloc(2*DB_RECORDS, sizeof(LiveRecord));
+    if((refs == NULL) || (recs == NULL)) {
+        free(refs);
+        free(recs);
+        return NULL;
+    }
+    *n = PostalNumberSearchRef("", refs, 2*DB_RECORDS);
+    for(size_t i = 0; i < *n; i++) {
+        recs[i].ref = refs[i];
+        for(int f = 0; f < N_FIELD; f++) {
+            recs[i].field[f] = strdup(fieldGetters[f](refs[i]));
+            if(recs[i].field[f] != NULL)
+                TextNormalize(recs[i].field[f], recs[i].field[f]);
+            else
+                recs[i].field[f] = strdup("");
+        }
+    }
+    free(refs);
+    return recs;
+}
+
+static void freeLiveRecords(LiveRecord *recs, size_t n) {
+    for(size_t i = 0; i < n; i++) {
+        for(int f = 0; f < N_FIELD; f++)
+            free(recs[i].field[f]);
+    }
+    free(recs);
+}
+
+/**
+ * 正規化した文字列からcharsが文字までの部分文字列をランダムに取り出してdstの後ろに加える
+ */
+static void appendSubstring(char *dst, size_t dstSize, const char *str, int chars) {
+    size_t len = strlen(str), starts[MAX_LINE], nStart = 0;
+    for(size_t i = 0; (i < len) && (nStart < MAX_LINE); i++) {
+        if(((unsigned char)str[i] & 0xc0) != 0x80)
+            starts[nStart++] = i;
+    }
+    if(nStart == 0)
+        return;
+    size_t from = (size_t)rand()%nStart;
+    size_t to = (from+(size_t)chars < nStart) ? starts[from+(size_t)chars] : len;
+    size_t used = strlen(dst);
+    snprintf(dst+used, dstSize-used, "%.*s", (int)(to-starts[from]), str+starts[from]);
+}
+
+/**
+ * レコードに現れる文字列から1語を作ってkeyの後ろに加える
+ * @param field 取り出すフィールド。負ならランダムに選ぶ
+ */
+static void appendWord(char *key, size_t size, const LiveRecord *recs, size_t n, int field) {
+    const LiveRecord *r = &recs[(size_t)rand()%n];
+    if(field < 0)
+        field = rand()%N_FIELD;
+    appendSubstring(key, size, r->field[field], (field == 0) ? 7 : 1+rand()%4);
+}
+
+/**
+ * 単独の語、空白で区切った複数の語、OR, NOT, フィールド指定、郵便番号の範囲を使う検索キーを作る
+ */
+static void makeKey(char *key, size_t size, const LiveRecord *recs, size_t n) {
+    *key = '\0';
+    switch(rand()%10) {
+    case 0:
+        snprintf(key, size, "%s", fixedKeys[(size_t)rand()%N_FIXED_KEY]);
+        break;
+    case 1:
+        /* 郵便番号の前方一致にならないよう全桁を使う */
+        appendSubstring(key, size, recs[(size_t)rand()%n].field[0], 7);
+        if(rand()%2 == 0)
+            key[1+rand()%6] = '\0';
+        break;
+    case 2:
+        appendWord(key, size, recs, n, -1);
+        strncat(key, " ", size-strlen(key)-1);
+        appendWord(key, size, recs, n, -1);
+        break;
+    case 3:
+        appendWord(key, size, recs, n, -1);
+        strncat(key, (rand()%2 == 0) ? " NOT " : " OR ", size-strlen(key)-1);
+        appendWord(key, size, recs, n, -1);
+        break;
+    case 4:
+        strncat(key, "NOT ", size-strlen(key)-1);
+        appendWord(key, size, recs, n, -1);
+        strncat(key, " ", size-strlen(key)-1);
+        appendWord(key, size, recs, n, -1);
+        break;
+    case 5: {
+        int field = 1+rand()%(int)N_FIELD_PREFIX;
+        strncat(key, fieldPrefixes[field-1], size-strlen(key)-1);
+        appendWord(key, size, recs, n, field+3*(rand()%2));
+        if(rand()%2 == 0) {
+            strncat(key, " ", size-strlen(key)-1);
+            appendWord(key, size, recs, n, -1);
+        }
+        break;
+    }
+    case 6: {
+        char lo[16] = "", hi[16] = "";
+        appendSubstring(lo, sizeof(lo), recs[(size_t)rand()%n].field[0], 7);
+        appendSubstring(hi, sizeof(hi), recs[(size_t)rand()%n].field[0], 7);
+        hi[1+rand()%6] = '\0';
+        if(rand()%3 == 0)
+            snprintf(key, size, CODE_PREFIX "%s", hi);
+        else
+            snprintf(key, size, CODE_PREFIX "%s" CODE_RANGE_SEPARATOR "%s", lo, hi);
+        break;
+    }
+    default:
+        appendWord(key, size, recs, n, -1);
+        break;
+    }
+}
+
+/**
+ * レコードが検索条件の1項を満たすか、フィールドを1つずつstrstrで比べて調べる
+ * @param word 正規化したキーの1語
+ */
+static int matchWord(const LiveRecord *r, const char *word) {
+    for(size_t i = 0; i < N_FIELD_PREFIX; i++) {
+        size_t len = strlen(fieldPrefixes[i]);
+        if(strncmp(word, fieldPrefixes[i], len) == 0)
+            return (strstr(r->field[1+i], word+len) != NULL) || (strstr(r->field[4+i], word+len) != NULL);
+    }
+    if(strncmp(word, CODE_PREFIX, strlen(CODE_PREFIX)) == 0) {
+        char lo[MAX_QUERY];
+        snprintf(lo, sizeof(lo), "%s", word+strlen(CODE_PREFIX));
+        char *sep = strstr(lo, CODE_RANGE_SEPARATOR);
+        const char *hi = lo;
+        if(sep != NULL) {
+            *sep = '\0';
+            hi = sep+strlen(CODE_RANGE_SEPARATOR);
+        }
+        return (strcmp(r->field[0], lo) >= 0) && (strncmp(r->field[0], hi, strlen(hi)) <= 0);
+    }
+    if(strcmp(r->field[0], word) == 0)
+        return 1;
+    for(int f = 1; f < N_FIELD; f++) {
+        if(strstr(r->field[f], word) != NULL)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * 全レコードを順に調べてkeyに一致するものを求める。インデックスを使う検索の正解にする
+ * 語の区切り、OR, NOTの扱いはPostalNumberSearchの説明のとおり
+ * @return 一致したレコードの数
+ */
+static size_t scanRecords(const LiveRecord *recs, size_t n, const char *key, PostalNumberRef *result) {
+    char norm[MAX_QUERY*2];
+    if(!PostalNumberNormalizeKey(key, norm, sizeof(norm)))
+        return 0;
+    const char *words[MAX_QUERY];
+    int negated[MAX_QUERY], joined[MAX_QUERY];
+    size_t nWord = 0, nTerm = 0;
+    for(char *w = strtok(norm, " "); w != NULL; w = strtok(NULL, " "))
+        words[nWord++] = w;
+    int negate = 0, join = 0, allNegated = 1;
+    for(size_t i = 0; i < nWord; i++) {
+        int last = (i+1 == nWord);
+        if(!last && (strcmp(words[i], "OR") == 0) && (nTerm > 0)) {
+            join = 1;
+            continue;
+        }
+        if(!last && (strcmp(words[i], "NOT") == 0)) {
+            negate = 1;
+            continue;
+        }
+        words[nTerm] = words[i];
+        negated[nTerm] = negate;
+        joined[nTerm] = join;
+        allNegated &= negate;
+        nTerm++;
+        negate = join = 0;
+    }
+    if((nTerm > 0) && allNegated)
+        return 0;
+    size_t count = 0;
+    for(size_t i = 0; i < n; i++) {
+        /* 節はORでつないだ項の並びで、全ての節を満たせば一致する */
+        int match = 1, clause = 0;
+        for(size_t t = 0; t < nTerm; t++) {
+            if(!joined[t]) {
+                if(t > 0)
+                    match &= clause;
+                clause = 0;
+            }
+            clause |= (matchWord(&recs[i], words[t]) != negated[t]);
+        }
+        if(nTerm > 0)
+            match &= clause;
+        if(match)
+            result[count++] = recs[i].ref;
+    }
+    return count;
+}
+
+/**
+ * PostalNumberSearchRefとPostalNumberCountの結果を、全レコードを順に調べた結果と比べる
+ * 途中で打ち切る検索は、全件の結果の先頭と同じになることを確かめる
+ * @param nKey 決まったキーの他に試すキーの数
+ * @return 一致しなかったキーの数
+ */
+static int checkSearch(const char *phase, int nKey) {
+    size_t n;
+    LiveRecord *recs = getLiveRecords(&n);
+    PostalNumberRef *expect = (PostalNumberRef *)malloc((n+1)*sizeof(PostalNumberRef));
+    PostalNumberRef *found = (PostalNumberRef *)malloc((n+1)*sizeof(PostalNumberRef));
+    if((recs == NULL) || (expect == NULL) || (found == NULL) || (n == 0)) {
+        printf("search %s: no records\n", phase);
+        free(expect);
+        free(found);
+        if(recs != NULL)
+            freeLiveRecords(recs, n);
+        return 1;
+    }
+    int failures = 0;
+    for(int k = 0; k < nKey+(int)N_FIXED_KEY; k++) {
+        char key[MAX_QUERY];
+        if(k < (int)N_FIXED_KEY)
+            snprintf(key, sizeof(key), "%s", fixedKeys[k]);
+        else
+            makeKey(key, sizeof(key), recs, n);
+        size_t nExpect = scanRecords(recs, n, key, expect);
+        size_t nFound = PostalNumberSearchRef(key, found, n+1);
+        PostalNumberRef page[PAGE_SIZE];
+        size_t nPage = PostalNumberSearchRef(key, page, PAGE_SIZE);
+        size_t nCount = PostalNumberCount(key);
+        int ok = (nFound == nExpect) && (memcmp(found, expect, nFound*sizeof(PostalNumberRef)) == 0)
+            && (nCount == nExpect) && (nPage == ((nExpect < PAGE_SIZE) ? nExpect : PAGE_SIZE))
+            && (memcmp(page, expect, nPage*sizeof(PostalNumberRef)) == 0);
+        if(!ok) {
+            size_t i = 0;
+            while((i < nFound) && (i < nExpect) && (found[i] == expect[i]))
+                i++;
+            printf("search %s [%s]: %zu records (count %zu, page %zu), expected %zu; first difference at %zu\n",
+                   phase, key, nFound, nCount, nPage, nExpect, i);
+            failures++;
+        }
+    }
+    printf("search %s: %s (%zu records)\n", phase, (failures == 0) ? "ok" : "FAILED", n);
+    free(expect);
+    free(found);
+    freeLiveRecords(recs, n);
+    return failures;
+}
+
+/**
+ * レコードから取り出した語を、1〜2文字の置換、挿入、削除で崩したあいまい検索のキーを作る
+ */
+static void makeFuzzyKey(char *key, size_t size, const LiveRecord *recs, size_t n) {
+    char word[MAX_QUERY] = "", other[MAX_QUERY] = "";
+    const LiveRecord *r = &recs[(size_t)rand()%n];
+    appendSubstring(word, sizeof(word), r->field[1+rand()%(N_FIELD-1)], 2+rand()%7);
+    appendWord(other, sizeof(other), recs, n, -1); /* 置換や挿入に使う文字 */
+    uint32_t cps[MAX_QUERY];
+    int len = decodeUtf8(word, cps, MAX_QUERY);
+    for(int edits = rand()%3; (edits > 0) && (len > 0); edits--) {
+        int pos = rand()%len;
+        int kind = rand()%3;
+        if(kind == 0) {
+            memmove(cps+pos, cps+pos+1, (size_t)(len-pos-1)*sizeof(uint32_t));
+            len--;
+        } else {
+            uint32_t c;
+            if(decodeUtf8(other, &c, 1) == 0)
+                c = 'x';
+            if((kind == 1) && (len < MAX_QUERY-1)) {
+                memmove(cps+pos+1, cps+pos, (size_t)(len-pos)*sizeof(uint32_t));
+                len++;
+            }
+            cps[pos] = c;
+        }
+    }
+    /* コードポイントの列をUTF-8に戻す */
+    size_t used = 0;
+    for(int i = 0; (i < len) && (used+5 < size); i++) {
+        uint32_t c = cps[i];
+        if(c < 0x80)
+            key[used++] = (char)c;
+        else if(c < 0x800) {
+            key[used++] = (char)(0xc0 | (c >> 6));
+            key[used++] = (char)(0x80 | (c & 0x3f));
+        } else {
+            key[used++] = (char)(0xe0 | (c >> 12));
+            key[used++] = (char)(0x80 | ((c >> 6) & 0x3f));
+            key[used++] = (char)(0x80 | (c & 0x3f));
+        }
+    }
+    key[used] = '\0';
+}
+
+/**
+ * PostalNumberSearchFuzzyの結果を、全レコードの各フィールドとの編集距離を動的計画法で
+ * 求めた結果と比べる。順序は距離が小さい順、同じならレコード順
+ * 途中で打ち切る検索は、全件の結果の先頭と同じになることを確かめる
+ * @return 一致しなかったキーの数
+ */
+static int checkFuzzy(const char *phase) {
+    size_t n;
+    LiveRecord *recs = getLiveRecords(&n);
+    PostalNumberRef *expect = (PostalNumberRef *)malloc((n+1)*sizeof(PostalNumberRef));
+    PostalNumberRef *found = (PostalNumberRef *)malloc((n+1)*sizeof(PostalNumberRef));
+    int *dists = (int *)malloc((n+1)*sizeof(int));
+    int *expectDists = (int *)malloc((n+1)*sizeof(int));
+    int *recDists = (int *)malloc((n+1)*sizeof(int));
+    int failures = 0;
+    if((recs == NULL) || (expect == NULL) || (found == NULL) || (dists == NULL) || (expectDists == NULL)
+       || (recDists == NULL) || (n == 0)) {
+        printf("fuzzy %s: no records\n", phase);
+        failures = 1;
+        goto done;
+    }
+    for(int k = 0; k < FUZZY_KEYS; k++) {
+        char key[MAX_QUERY], norm[MAX_QUERY];
+        makeFuzzyKey(key, sizeof(key), recs, n);
+        int maxDistance = rand()%(FUZZY_MAX_DISTANCE+1);
+        /* PostalNumberSearchFuzzyと同じく、正規化して空白を除いたキーを比べる */
+        snprintf(norm, sizeof(norm), "%s", key);
+        TextNormalize(norm, norm);
+        uint32_t cps[MAX_QUERY];
+        int len = decodeUtf8(norm, cps, MAX_QUERY);
+        size_t nExpect = 0;
+        if((len > 0) && (len <= TEXT_APPROX_MAX)) {
+            int limit = (maxDistance < len) ? maxDistance : len-1;
+            for(size_t i = 0; i < n; i++) {
+                recDists[i] = len;
+                for(int f = 1; f < N_FIELD; f++) {
+                    int d = editDistance(cps, len, recs[i].field[f]);
+                    if(d < recDists[i])
+                        recDists[i] = d;
+                }
+            }
+            for(int d = 0; d <= limit; d++) {
+                for(size_t i = 0; i < n; i++) {
+                    if(recDists[i] == d) {
+                        expectDists[nExpect] = d;
+                        expect[nExpect++] = recs[i].ref;
+                    }
+                }
+            }
+        }
+        size_t nFound = PostalNumberSearchFuzzy(key, maxDistance, found, dists, n+1);
+        PostalNumberRef page[PAGE_SIZE];
+        size_t nPage = PostalNumberSearchFuzzy(key, maxDistance, page, NULL, PAGE_SIZE);
+        int ok = (nFound == nExpect) && (memcmp(found, expect, nFound*sizeof(PostalNumberRef)) == 0)
+            && (memcmp(dists, expectDists, nFound*sizeof(int)) == 0)
+            && (nPage == ((nExpect < PAGE_SIZE) ? nExpect : PAGE_SIZE))
+            && (memcmp(page, expect, nPage*sizeof(PostalNumberRef)) == 0);
+        if(!ok) {
+            size_t i = 0;
+            while((i < nFound) && (i < nExpect) && (found[i] == expect[i]) && (dists[i] == expectDists[i]))
+                i++;
+            printf("fuzzy %s [%s] distance %d: %zu records (page %zu), expected %zu; first difference at %zu\n",
+                   phase, key, maxDistance, nFound, nPage, nExpect, i);
+            failures++;
+        }
+    }
+    printf("fuzzy %s: %s\n", phase, (failures == 0) ? "ok" : "FAILED");
+done:
+    free(expect);
+    free(found);
+    free(dists);
+    free(expectDists);
+    free(recDists);
+    if(recs != NULL)
+        freeLiveRecords(recs, n);
+    return failures;
+}
+
+/**
+ * PostalNumberSearchBatchの結果を、キーごとにPostalNumberSearchRefを呼んだ結果と比べる
+ * 該当の多い短いキーを多く混ぜ、結果の最大数を大きくすればテキスト列の1度の走査でまとめて探し、
+ * 小さくすればキーごとにインデックスで探す。同じキーを繰り返したものも混ぜる
+ * @param nRound まとめて検索する回数
+ * @return 一致しなかったキーの数
+ */
+static int checkBatch(const char *phase, int nRound) {
+    size_t n;
+    LiveRecord *recs = getLiveRecords(&n);
+    const size_t sizes[] = {PAGE_SIZE, 1000, n+1};
+    char (*keys)[MAX_QUERY] = (char (*)[MAX_QUERY])malloc(BATCH_KEYS*sizeof(*keys));
+    const char *keyPtrs[BATCH_KEYS];
+    PostalNumberRef *result = (PostalNumberRef *)malloc(BATCH_KEYS*(n+1)*sizeof(PostalNumberRef));
+    PostalNumberRef *single = (PostalNumberRef *)malloc((n+1)*sizeof(PostalNumberRef));
+    size_t counts[BATCH_KEYS];
+    int failures = 0;
+    if((recs == NULL) || (keys == NULL) || (result == NULL) || (single == NULL) || (n == 0)) {
+        printf("batch %s: no records\n", phase);
+        failures = 1;
+        goto done;
+    }
+    for(int round = 0; round < nRound; round++) {
+        for(int k = 0; k < BATCH_KEYS; k++) {
+            keys[k][0] = '\0';
+            int kind = rand()%4;
+            if((kind == 0) && (k > 0))
+                snprintf(keys[k], MAX_QUERY, "%s", keys[rand()%k]);
+            else if(kind == 1)
+                appendSubstring(keys[k], MAX_QUERY, recs[(size_t)rand()%n].field[1+rand()%(N_FIELD-1)], 1+rand()%2);
+            else
+                makeKey(keys[k], MAX_QUERY, recs, n);
+            keyPtrs[k] = keys[k];
+        }
+        for(size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+            size_t resultSize = sizes[s];
+            if(!PostalNumberSearchBatch(keyPtrs, BATCH_KEYS, result, resultSize, counts)) {
+                printf("batch %s: out of memory\n", phase);
+                failures++;
+                continue;
+            }
+            for(int k = 0; k < BATCH_KEYS; k++) {
+                size_t nSingle = PostalNumberSearchRef(keys[k], single, resultSize);
+                if((counts[k] != nSingle)
+                   || (memcmp(result+(size_t)k*resultSize, single, nSingle*sizeof(PostalNumberRef)) != 0)) {
+                    printf("batch %s [%s] size %zu: %zu records, expected %zu\n", phase, keys[k], resultSize,
+                           counts[k], nSingle);
+                    failures++;
+                }
+            }
+        }
+    }
+    printf("batch %s: %s\n", phase, (failures == 0) ? "ok" : "FAILED");
+done:
+    free(keys);
+    free(result);
+    free(single);
+    if(recs != NULL)
+        freeLiveRecords(recs, n);
+    return failures;
+}
+
+/**
+ * データベースを使う検査を、作ったばかりの版、差分を適用した版、インデックスを作り直した版、
+ * FM-indexだけを持つ版のそれぞれで行う
+ * @return 一致しなかった数
+ */
+static int checkDB(void) {
+    int failures = 0;
+    if(!createDB()) {
+        printf("failed to create DB in %s\n", checkDir);
+        return 1;
+    }
+    failures += checkSearch("base", SEARCH_KEYS)+checkFuzzy("base")+checkBatch("base", BATCH_ROUNDS);
+    if(applyDelta(checkFiles[1], DELTA_ADDS, checkFiles[2], DELTA_DELS))
+        failures += checkSearch("delta", SEARCH_KEYS)+checkFuzzy("delta")+checkBatch("delta", BATCH_ROUNDS);
+    else {
+        printf("failed to apply delta\n");
+        failures++;
+    }
+    if(applyDelta(checkFiles[3], FOLD_ADDS, NULL, 0))
+        failures += checkSearch("fold", SEARCH_KEYS)+checkFuzzy("fold")+checkBatch("fold", BATCH_ROUNDS);
+    else {
+        printf("failed to apply delta\n");
+        failures++;
+    }
+    PostalNumberSetMemoryOptions(POSTAL_NUMBER_MEMORY_COMPACT);
+    if(PostalNumberReloadDB() == nBaseLine)
+        failures += checkSearch("compact", COMPACT_KEYS)+checkBatch("compact", 1);
+    else {
+        printf("failed to reload DB\n");
+        failures++;
+    }
+    PostalNumberRelease();
+    for(size_t i = 0; i < sizeof(checkFiles)/sizeof(checkFiles[0]); i++)
+        unlink(checkFiles[i]);
+    rmdir(checkDir);
+    for(size_t i = 0; i < nBaseLine; i++)
+        free(baseLines[i]);
+    free(baseLines);
+    return failures;
+}
+
+/* 各実装の結果を単純な方法と比べる。一致しないものがあれば終了ステータスを1にする */
+int main(int argc, char *argv[]) {
+    srand((argc > 1) ? (unsigned)strtoul(argv[1], NULL, 0) : 1);
+    int failures = checkTextMatch();
+    failures += checkApprox();
+    failures += checkDB();
+    if(failures != 0) {
+        printf("%d mismatches\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,138 @@
+#include "csvScan.h"
+#include <stdint.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#define BLOCK 64 /* 一度に区切り文字を探すバイト数 */
+
+/* p[0, BLOCK)の区切り文字の位置をビットで返す */
+typedef uint64_t (*MaskFunc)(const char *p);
+
+static MaskFunc maskKernel = NULL;
+static const char *kernelName = NULL;
+static pthread_once_t kernelOnce = PTHREAD_ONCE_INIT;
+
+static int isSpecial(char c) {
+    return (c == ',') || (c == '"') || (c == '\n');
+}
+
+/**
+ * 汎用実装。p[0, len)を1バイトずつ調べる
+ */
+static uint64_t maskScalar(const char *p, size_t len) {
+    uint64_t mask = 0;
+    for(size_t i = 0; i < len; i++) {
+        if(isSpecial(p[i]))
+            mask |= 1ULL << i;
+    }
+    return mask;
+}
+
+static uint64_t maskBlockScalar(const char *p) {
+    return maskScalar(p, BLOCK);
+}
+
+#ifdef HAVE_X86_SIMD
+/**
+ * SSE2実装。16バイトずつ3種類の区切り文字と比べる
+ */
+static uint64_t maskSSE2(const char *p) {
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i newline = _mm_set1_epi8('\n');
+    uint64_t mask = 0;
+    for(int i = 0; i < BLOCK; i += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(p+i));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b, comma), _mm_cmpeq_epi8(b, quote)),
+                                   _mm_cmpeq_epi8(b, newline));
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(hit) << i;
+    }
+    return mask;
+}
+
+/**
+ * AVX2実装。maskSSE2と同じ方法で32バイトずつ調べる
+ */
+__attribute__((target("avx2")))
+static uint64_t maskAVX2(const char *p) {
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    uint64_t mask = 0;
+    for(int i = 0; i < BLOCK; i += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p+i));
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(b, comma), _mm256_cmpeq_epi8(b, quote)),
+                                      _mm256_cmpeq_epi8(b, newline));
+        mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(hit) << i;
+    }
+    return mask;
+}
+#endif
+
+/* CPUが対応している中で最も速い実装を選ぶ */
+static void selectKernel(void) {
+    maskKernel = maskBlockScalar;
+    kernelName = "scalar";
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        maskKernel = maskAVX2;
+        kernelName = "avx2";
+    } else if(__builtin_cpu_supports("sse2")) {
+        maskKernel = maskSSE2;
+        kernelName = "sse2";
+    }
+#endif
+}
+
+/* 前後の空白、ダブルクォート、'\r'を除いてフィールドを加える */
+static void addField(CsvField *fields, size_t *n, size_t maxField, const char *begin, const char *end) {
+    if(*n >= maxField)
+        return;
+    while((begin < end) && ((*begin == ' ') || (*begin == '"')))
+        begin++;
+    while((begin < end) && ((end[-1] == ' ') || (end[-1] == '"') || (end[-1] == '\r')))
+        end--;
+    fields[*n].begin = begin;
+    fields[*n].len = (size_t)(end-begin);
+    (*n)++;
+}
+
+const char *CsvScanLine(const char *p, const char *end, CsvField *fields, size_t maxField, size_t *nField) {
+    pthread_once(&kernelOnce, selectKernel);
+    const char *line = p, *field = p;
+    int quoted = 0;
+    *nField = 0;
+    while(p < end) {
+        size_t len = ((size_t)(end-p) >= BLOCK) ? BLOCK : (size_t)(end-p);
+        uint64_t mask = (len == BLOCK) ? maskKernel(p) : maskScalar(p, len);
+        /* 区切り文字のある位置だけを順に見る */
+        while(mask != 0) {
+            const char *q = p+__builtin_ctzll(mask);
+            mask &= mask-1;
+            if(*q == '"') {
+                quoted = !quoted;
+                continue;
+            }
+            if(quoted)
+                continue;
+            addField(fields, nField, maxField, field, q);
+            field = q+1;
+            if(*q == '\n')
+                return q+1;
+        }
+        p += len;
+    }
+    /* 改行で終わらない最終行 */
+    if(line < end)
+        addField(fields, nField, maxField, field, end);
+    return end;
+}
+
+const char *CsvScanKernelName(void) {
+    pthread_once(&kernelOnce, selectKernel);
+    return kernelName;
+}
@@ -0,0 +1,34 @@
+#ifndef CSVSCAN_H
+#define CSVSCAN_H
+
+#include <stddef.h>
+
+/**
+ * CSVの1フィールドの範囲。元の領域を指し、コピーしない
+ */
+typedef struct {
+    const char *begin;
+    size_t len;
+} CsvField;
+
+/**
+ * buf[p, end)の先頭から1行分のフィールドを取り出す
+ * カンマ、ダブルクォート、改行をCPUに合わせてAVX2、SSE2、汎用のいずれかの実装で
+ * まとめて探す。ダブルクォートで囲まれた中のカンマと改行は区切りとみなさない。
+ * 各フィールドは前後の空白、ダブルクォート、行末の'\r'を除いた範囲にする
+ * @param p 行の先頭
+ * @param end 領域の終わり。'\0'で終わっていなくてよい
+ * @param fields 各フィールドの範囲を格納する配列
+ * @param maxField fieldsの要素数。これより後ろのフィールドは捨てる
+ * @param nField fieldsに格納したフィールド数を格納する場所
+ * @return 次の行の先頭。最終行ならend
+ */
+extern const char *CsvScanLine(const char *p, const char *end, CsvField *fields, size_t maxField, size_t *nField);
+
+/**
+ * CsvScanLineが使う実装の名前を得る
+ * @return "avx2", "sse2", "scalar"のいずれか
+ */
+extern const char *CsvScanKernelName(void);
+
+#endif /* CSVSCAN_H */
@@ -0,0 +1,28 @@
+#include "postalNumber.h"
+#include "textMatch.h"
+#include "csvScan.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_THREADS 8 /* 既定で試す最大スレッド数 */
+
+/* スレッド数を変えてCSVの取り込み時間を計測する */
+int main(int argc, char *argv[]) {
+    int maxThreads = (argc > 1) ? atoi(argv[1]) : MAX_THREADS;
+    printf("substring matcher: %s\n", TextMatchKernelName());
+    printf("CSV scanner: %s\n", CsvScanKernelName());
+    printf("threads records    read   parse   merge   index   total  parse MB/s\n");
+    for(int n = 1; n <= maxThreads; n++) {
+        if(PostalNumberLoadDBParallel(n) == 0) {
+            printf("Failed to load DB.\n");
+            return 1;
+        }
+        PostalNumberLoadStat st;
+        PostalNumberGetLoadStat(&st);
+        printf("%7d %7zu %7.3f %7.3f %7.3f %7.3f %7.3f %11.1f\n",
+               st.nThread, st.records, st.readSec, st.parseSec, st.mergeSec,
+               st.indexSec, st.totalSec, st.bytes/st.parseSec/1e6);
+    }
+
+    return 0;
+}
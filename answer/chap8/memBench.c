@@ -0,0 +1,164 @@
+#include "postalNumber.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+#define N_KEYS 20000 /* 検索するキーの数 */
+#define ROUNDS 5 /* キーを繰り返し検索する回数 */
+#define RESULT_SIZE 64 /* 1回の検索で受け取る結果の数 */
+#define ALL_CODES "code:0000000..9999999" /* 全レコードを得る検索キー */
+
+/* 検索中に数えるハードウェアカウンタ */
+#define DTLB(result) (PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | ((result) << 16))
+typedef struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    int fd; /* 開けなければ-1 */
+} Counter;
+
+static Counter counters[] = {
+    {"dTLB-loads", PERF_TYPE_HW_CACHE, DTLB(PERF_COUNT_HW_CACHE_RESULT_ACCESS), -1},
+    {"dTLB-misses", PERF_TYPE_HW_CACHE, DTLB(PERF_COUNT_HW_CACHE_RESULT_MISS), -1},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, -1},
+};
+#define N_COUNTER (sizeof(counters)/sizeof(counters[0]))
+
+/* 比べるメモリの設定 */
+static const struct {
+    const char *name;
+    int options;
+} configs[] = {
+    {"default", 0},
+    {"huge", POSTAL_NUMBER_MEMORY_HUGE},
+    {"huge+lock", POSTAL_NUMBER_MEMORY_HUGE|POSTAL_NUMBER_MEMORY_LOCK},
+    {"compact", POSTAL_NUMBER_MEMORY_COMPACT},
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+/* このスレッドのユーザ空間の分だけを数えるカウンタを開く。止めた状態で開く */
+static int openCounter(const Counter *c) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = c->type;
+    attr.config = c->config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ * 取り込んだDBから検索キーを作る。郵便番号と町域名を交互に、
+ * レコードをばらばらな順に選んでDB全体を不規則に参照させる
+ * returns: キーの数。取り出せなければ0
+ */
+static size_t makeKeys(char **keys, size_t n, size_t nDb) {
+    PostalNumberRef *all = (PostalNumberRef *)malloc(nDb*sizeof(PostalNumberRef));
+    if(all == NULL)
+        return 0;
+    size_t nAll = PostalNumberSearchRef(ALL_CODES, all, nDb);
+    uint64_t x = 88172645463325252ULL;
+    size_t nKey = 0;
+    for(size_t i = 0; (nAll > 0) && (i < n); i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        PostalNumberRef ref = all[x%nAll];
+        const char *key = (i%2 == 0) ? PostalNumberCode(ref) : PostalNumberTown(ref);
+        if((keys[nKey] = strdup(key)) != NULL)
+            nKey++;
+    }
+    free(all);
+    PostalNumberRelease();
+    return nKey;
+}
+
+/* DBを置くメモリを変えて検索し、時間とTLBミスを比べる */
+int main(int argc, char *argv[]) {
+    int rounds = (argc > 1) ? atoi(argv[1]) : ROUNDS;
+    static char *keys[N_KEYS];
+    size_t nKey = 0;
+    PostalNumberSetScanThreads(1); /* カウンタはこのスレッドの分だけ数える */
+    for(size_t i = 0; i < N_COUNTER; i++) {
+        counters[i].fd = openCounter(&counters[i]);
+        if(counters[i].fd < 0)
+            printf("%s: not available\n", counters[i].name);
+    }
+    printf("config    memory                 locked      MB    load  search   queries/s");
+    for(size_t i = 0; i < N_COUNTER; i++)
+        printf(" %13s", counters[i].name);
+    printf("  miss%%\n");
+    for(size_t c = 0; c < sizeof(configs)/sizeof(configs[0]); c++) {
+        PostalNumberSetMemoryOptions(configs[c].options);
+        size_t nDb = PostalNumberLoadDB();
+        if(nDb == 0) {
+            printf("Failed to load DB.\n");
+            return 1;
+        }
+        PostalNumberLoadStat st;
+        PostalNumberGetLoadStat(&st);
+        if((nKey == 0) && ((nKey = makeKeys(keys, N_KEYS, nDb)) == 0)) {
+            printf("No keys.\n");
+            return 1;
+        }
+        /* 結果の郵便番号も読んで、レコードとarenaまで参照させる */
+        PostalNumberRef res[RESULT_SIZE];
+        size_t sum = 0;
+        for(size_t i = 0; i < N_COUNTER; i++) {
+            if(counters[i].fd >= 0) {
+                ioctl(counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+        double start = now();
+        for(int r = 0; r < rounds; r++) {
+            for(size_t k = 0; k < nKey; k++) {
+                size_t n = PostalNumberSearchRef(keys[k], res, RESULT_SIZE);
+                for(size_t i = 0; i < n; i++)
+                    sum += (unsigned char)PostalNumberCode(res[i])[6];
+            }
+        }
+        double sec = now()-start;
+        uint64_t value[N_COUNTER];
+        for(size_t i = 0; i < N_COUNTER; i++) {
+            value[i] = 0;
+            if(counters[i].fd >= 0) {
+                ioctl(counters[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+                if(read(counters[i].fd, &value[i], sizeof(value[i])) != sizeof(value[i]))
+                    value[i] = 0;
+            }
+        }
+        PostalNumberRelease();
+        printf("%-9s %-22s %6s %7.1f %7.3f %7.3f %11.0f", configs[c].name, PostalNumberBackingName(st.backing),
+               st.locked ? "yes" : "no", st.memoryBytes/1e6, st.totalSec, sec, nKey*(double)rounds/sec);
+        for(size_t i = 0; i < N_COUNTER; i++) {
+            if(counters[i].fd >= 0)
+                printf(" %13llu", (unsigned long long)value[i]);
+            else
+                printf(" %13s", "-");
+        }
+        if((counters[0].fd >= 0) && (counters[1].fd >= 0) && (value[0] > 0))
+            printf(" %6.2f\n", value[1]*100.0/value[0]);
+        else
+            printf(" %6s\n", "-");
+        if(sum == 1)
+            printf("\n"); /* 結果を読んだことを消されないようにする */
+    }
+    for(size_t i = 0; i < nKey; i++)
+        free(keys[i]);
+
+    return 0;
+}
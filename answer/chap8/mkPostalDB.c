@@ -0,0 +1,18 @@
+#include "postalNumber.h"
+#include <stdio.h>
+
+int main(int argc, char *argv[]) {
+    const char *path = (argc > 1) ? argv[1] : POSTAL_NUMBER_IMAGE;
+    size_t n = PostalNumberLoadDBParallel(0); /* 常にCSVから作り直す */
+    if(n == 0) {
+        printf("Failed to load DB.\n");
+        return 1;
+    }
+    if(!PostalNumberSaveDB(path)) {
+        printf("Failed to write %s\n", path);
+        return 1;
+    }
+    printf("Wrote %zu records to %s\n", n, path);
+
+    return 0;
+}
@@ -1,8 +1,10 @@
 #include "postalNumber.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define SEARCH_SIZE 100 /* 検索結果の最大取得数 */
+#define BATCH_KEYS 4096 /* バッチモードで一度にまとめて検索するキーの数 */
 
 static void getString(char *buf, size_t buflen) {
     int ch;
@@ -20,18 +22,77 @@ static void getString(char *buf, size_t buflen) {
     *buf = '\0';
 }
 
-int main(void) {
+static void printResult(const char *key, const PostalNumberRef *res, size_t n) {
+    printf("Search for '%s':\n", key);
+    for(size_t i = 0; i < n; i++) {
+        printf("  %s %s %s %s\n", PostalNumberCode(res[i]), PostalNumberPref(res[i]),
+               PostalNumberCity(res[i]), PostalNumberTown(res[i]));
+    }
+}
+
+/**
+ * ファイルの各行を検索キーとし、BATCH_KEYS行ずつまとめて検索して結果を書く
+ * returns: 成功した場合0
+ */
+static int runBatch(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL) {
+        perror(path);
+        return 1;
+    }
+    char **keys = (char **)calloc(BATCH_KEYS, sizeof(char *));
+    PostalNumberRef *res = (PostalNumberRef *)malloc(BATCH_KEYS*SEARCH_SIZE*sizeof(PostalNumberRef));
+    size_t *counts = (size_t *)malloc(BATCH_KEYS*sizeof(size_t));
+    int status = ((keys != NULL) && (res != NULL) && (counts != NULL)) ? 0 : 1;
+    char *line = NULL;
+    size_t lineSize = 0, n = 0;
+    int eof = 0;
+    while((status == 0) && !eof) {
+        ssize_t len = getline(&line, &lineSize, fp);
+        eof = (len < 0);
+        if(!eof) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if((keys[n++] = strdup(line)) == NULL)
+                status = 1;
+        }
+        if((n == BATCH_KEYS) || ((n > 0) && eof)) {
+            if(!PostalNumberSearchBatch((const char *const *)keys, n, res, SEARCH_SIZE, counts))
+                status = 1;
+            for(size_t i = 0; i < n; i++) {
+                if(status == 0)
+                    printResult(keys[i], res+i*SEARCH_SIZE, counts[i]);
+                free(keys[i]);
+            }
+            n = 0;
+        }
+    }
+    for(size_t i = 0; i < n; i++)
+        free(keys[i]);
+    if(status != 0)
+        fprintf(stderr, "%s: out of memory\n", path);
+    free(line);
+    free(keys);
+    free(res);
+    free(counts);
+    fclose(fp);
+    return status;
+}
+
+/**
+ * 引数が無ければ検索キーを1つ読んで検索する
+ * キーのファイルを指定するとバッチモードになり、その各行を検索した結果を順に書く
+ */
+int main(int argc, char **argv) {
     PostalNumberLoadDB();
+    if(argc > 1)
+        return runBatch(argv[1]);
     printf("Search ? ");
     fflush(stdout);
     char buf[128];
     getString(buf, sizeof(buf));
-    printf("Search for '%s':\n", buf);
-    PostalNumber res[SEARCH_SIZE];
-    size_t n = PostalNumberSearch(buf, res, SEARCH_SIZE);
-    for(size_t i = 0; i < n; i++) {
-        printf("  %s %s %s %s\n", res[i].code, res[i].pref, res[i].city, res[i].town);
-    }
+    PostalNumberRef res[SEARCH_SIZE];
+    size_t n = PostalNumberSearchRef(buf, res, SEARCH_SIZE);
+    printResult(buf, res, n);
 
     return 1;
 }
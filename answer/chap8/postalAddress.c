@@ -0,0 +1,728 @@
+#include "postalAddress.h"
+#include "textNorm.h"
+#include "roaring.h"
+#include "textAho.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+
+#define GEO_PATTERNS 5 /* 住所の照合で1レコードから作るパターンの数 */
+#define TOWN_NOT_LISTED "以下に掲載がない場合" /* 町域名が無いことを表す町域名 */
+
+static size_t completeEntries(const PostalDB *db, const char *key, uint32_t *top);
+static uint32_t liveEntryRecord(const PostalDB *db, const CompleteEntry *e);
+static size_t completeAdded(const PostalDB *db, const char *key, PostalNumberCompletion *result, size_t n,
+                            size_t resultSize);
+static int compareGeoOutput(const void *a, const void *b);
+static size_t geocodeAdded(const PostalDB *db, const char *norm, uint32_t node, PostalNumberRef *result, size_t n,
+                           size_t resultSize, int *level);
+
+size_t PostalNumberComplete(const char *prefix, PostalNumberCompletion *result, size_t resultSize) {
+    const PostalDB *db = pinLatest();
+    if(isCompact(db)) {
+        errno = ENOTSUP; /* 候補の索引を作っていない */
+        return 0;
+    }
+    char *norm = strdup(prefix);
+    if(norm == NULL)
+        return 0;
+    TextNormalize(norm, norm);
+    uint32_t top[COMPLETE_TOP];
+    size_t nTop = completeEntries(db, norm, top), n = 0;
+    for(size_t i = 0; (i < nTop) && (n < resultSize); i++) {
+        const CompleteEntry *e = &db->completeEntries[top[i]];
+        uint32_t rec = liveEntryRecord(db, e);
+        if(rec == NO_RECORD)
+            continue;
+        result[n].ref = rec;
+        result[n++].level = (e->last == FIELD_PREF) ? 1 : (e->last == FIELD_CITY) ? 2 : 3;
+    }
+    if(db->nDb > db->nIndexed)
+        n = completeAdded(db, norm, result, n, resultSize);
+    free(norm);
+    return n;
+}
+
+size_t PostalNumberGeocode(const char *address, PostalNumberRef *result, size_t resultSize, int *level) {
+    const PostalDB *db = pinLatest();
+    if(level != NULL)
+        *level = 0;
+    if(isCompact(db)) {
+        errno = ENOTSUP; /* 住所のオートマトンを作っていない */
+        return 0;
+    }
+    char *norm = strdup(address);
+    if(norm == NULL)
+        return 0;
+    TextNormalize(norm, norm);
+    GeoOutput key = {TextAhoLongest(&db->geo, norm), 0, 0, 0};
+    const GeoOutput *out = NULL;
+    if(key.node != 0)
+        out = (const GeoOutput *)bsearch(&key, db->geoOutputs, db->nGeoOutput, sizeof(GeoOutput), compareGeoOutput);
+    size_t n = 0;
+    int found = 0;
+    if(out != NULL) {
+        for(uint32_t i = 0; (i < out->count) && (n < resultSize); i++) {
+            uint32_t rec = db->geoRecords[out->begin+i];
+            if((db->deleted == NULL) || !RoaringContains(db->deleted, rec))
+                result[n++] = rec;
+        }
+        found = (int)out->level;
+    }
+    if(db->nDb > db->nIndexed)
+        n = geocodeAdded(db, norm, (out != NULL) ? key.node : 0, result, n, resultSize, &found);
+    free(norm);
+    if((level != NULL) && (n > 0))
+        *level = found;
+    return n;
+}
+
+/* 見出しを1バイトずつ読むもの */
+typedef struct {
+    const char *text[3]; /* 見出しを作る文字列。使わないものはNULL */
+    int i;               /* 読んでいる文字列 */
+    const char *p;       /* 次に読む位置 */
+} TextCursor;
+
+static void textInit(TextCursor *c, const char *a, const char *b, const char *d) {
+    c->text[0] = a;
+    c->text[1] = b;
+    c->text[2] = d;
+    c->i = 0;
+    c->p = a;
+}
+
+/* 次のバイトを返す。終わりなら-1 */
+static int textNext(TextCursor *c) {
+    while((c->p != NULL) && (*c->p == '\0'))
+        c->p = (++c->i < 3) ? c->text[c->i] : NULL;
+    return (c->p != NULL) ? (unsigned char)*(c->p++) : -1;
+}
+
+/* 候補の見出しを読む準備をする */
+static void entryText(const PostalDB *db, const CompleteEntry *e, TextCursor *c) {
+    const Record *r = &db->normRecords[e->rec];
+    const char *pref = (e->first == FIELD_PREF) ? STR(db, r->pref) : NULL;
+    const char *city = (e->last >= FIELD_CITY) ? STR(db, r->city) : NULL;
+    const char *town = (e->last >= FIELD_TOWN) ? STR(db, r->town) : NULL;
+    if(pref != NULL)
+        textInit(c, pref, city, town);
+    else
+        textInit(c, city, town, NULL);
+}
+
+/* 候補aがbより上位か。短い住所、レコード数の多いもの、見出し順の順にする */
+static int isBetterEntry(const PostalDB *db, uint32_t a, uint32_t b) {
+    const CompleteEntry *x = &db->completeEntries[a], *y = &db->completeEntries[b];
+    if(x->last != y->last)
+        return x->last < y->last;
+    if(x->count != y->count)
+        return x->count > y->count;
+    return a < b;
+}
+
+/* 同じ住所を表す候補か。都道府県名から始まるものと市区町村名から始まるものは同じになりうる */
+static int isSameAddress(const PostalDB *db, uint32_t a, uint32_t b) {
+    const CompleteEntry *x = &db->completeEntries[a], *y = &db->completeEntries[b];
+    const Record *r = &db->normRecords[x->rec], *s = &db->normRecords[y->rec];
+    return (x->last == y->last) && (r->pref == s->pref)
+        && ((x->last < FIELD_CITY) || (r->city == s->city))
+        && ((x->last < FIELD_TOWN) || (r->town == s->town));
+}
+
+/**
+ * 候補eを上位から並べた最大COMPLETE_TOP個のtopに加える
+ * 同じ住所の候補は上位の方だけを残す
+ */
+static void addTop(const PostalDB *db, uint32_t *top, size_t *n, uint32_t e) {
+    if((*n >= COMPLETE_TOP) && !isBetterEntry(db, e, top[*n-1]))
+        return; /* 同じ住所の候補があってもそれより下位 */
+    for(size_t i = 0; i < *n; i++) {
+        if(!isSameAddress(db, top[i], e))
+            continue;
+        if(!isBetterEntry(db, e, top[i]))
+            return;
+        memmove(&top[i], &top[i+1], (*n-i-1)*sizeof(uint32_t));
+        (*n)--;
+        break;
+    }
+    size_t pos = *n;
+    while((pos > 0) && isBetterEntry(db, e, top[pos-1]))
+        pos--;
+    if(pos >= COMPLETE_TOP)
+        return;
+    if(*n < COMPLETE_TOP)
+        (*n)++;
+    memmove(&top[pos+1], &top[pos], (*n-pos-1)*sizeof(uint32_t));
+    top[pos] = e;
+}
+
+/* 候補を見出し順に並べるための組 */
+typedef struct {
+    TextCursor text;
+    const char *str;  /* 見出しをつないだもの。並べ替えの比較を速くするため作っておく */
+    const char *pref; /* 市区町村名から始まる候補も都道府県ごとに分ける */
+    CompleteEntry entry;
+} CompleteKey;
+
+static int compareCompleteKey(const void *a, const void *b) {
+    const CompleteKey *x = (const CompleteKey *)a, *y = (const CompleteKey *)b;
+    int c = strcmp(x->str, y->str);
+    if(c != 0)
+        return c;
+    /* 見出しが同じなら同じ住所どうしが隣り合い、その中ではファイル順になるようにする */
+    const CompleteEntry *e = &x->entry, *f = &y->entry;
+    if(e->last != f->last)
+        return (e->last > f->last) - (e->last < f->last);
+    if(e->first != f->first)
+        return (e->first > f->first) - (e->first < f->first);
+    if(x->pref != y->pref)
+        return (x->pref > y->pref) - (x->pref < y->pref);
+    for(int i = 0; i < 3; i++) {
+        if(x->text.text[i] != y->text.text[i])
+            return (x->text.text[i] > y->text.text[i]) - (x->text.text[i] < y->text.text[i]);
+    }
+    return (e->rec > f->rec) - (e->rec < f->rec);
+}
+
+/* 同じ住所の候補か */
+static int isSameKey(const CompleteKey *x, const CompleteKey *y) {
+    return (x->entry.first == y->entry.first) && (x->entry.last == y->entry.last) && (x->pref == y->pref)
+        && (x->text.text[0] == y->text.text[0]) && (x->text.text[1] == y->text.text[1])
+        && (x->text.text[2] == y->text.text[2]);
+}
+
+static int compareCompleteNode(const void *a, const void *b) {
+    const CompleteNode *x = (const CompleteNode *)a, *y = (const CompleteNode *)b;
+    if(x->lo != y->lo)
+        return (x->lo > y->lo) - (x->lo < y->lo);
+    return (x->hi > y->hi) - (x->hi < y->hi);
+}
+
+/* 見出しの先頭から一致するバイト数 */
+static uint32_t commonPrefix(const CompleteKey *x, const CompleteKey *y) {
+    uint32_t n = 0;
+    while((x->str[n] != '\0') && (x->str[n] == y->str[n]))
+        n++;
+    return n;
+}
+
+/* 1レコードから作る候補の見出しの最初と最後のフィールド */
+static const uint8_t completeKinds[5][2] = {
+    {FIELD_PREF, FIELD_PREF}, {FIELD_PREF, FIELD_CITY}, {FIELD_PREF, FIELD_TOWN},
+    {FIELD_CITY, FIELD_CITY}, {FIELD_CITY, FIELD_TOWN}
+};
+
+/**
+ * 1レコードから作る候補を、直前のレコードと住所の同じ階層が続く間はまとめてkeysに加える
+ * prev: 直前のレコード。先頭ならNULL
+ * last: 種類ごとに最後に加えた候補の位置
+ * returns: 加えた後の候補の数
+ */
+static size_t addCompleteKeys(const PostalDB *db, uint32_t rec, const Record *prev, CompleteKey *keys, size_t n, size_t *last) {
+    const Record *r = &db->normRecords[rec];
+    int changed[3]; /* pref, city, townの各階層で直前と住所が変わったか */
+    changed[0] = (prev == NULL) || (prev->pref != r->pref);
+    changed[1] = changed[0] || (prev->city != r->city);
+    changed[2] = changed[1] || (prev->town != r->town);
+    for(int k = 0; k < 5; k++) {
+        int level = (completeKinds[k][1] == FIELD_PREF) ? 0 : (completeKinds[k][1] == FIELD_CITY) ? 1 : 2;
+        if(*STR(db, recordField(r, completeKinds[k][1])) == '\0')
+            continue; /* 空のフィールドで終わる候補は1つ上の階層と同じ見出しになる */
+        if(!changed[level] && (last[k] != SIZE_MAX)) {
+            keys[last[k]].entry.count++;
+            continue;
+        }
+        CompleteKey *key = &keys[n];
+        memset(key, 0, sizeof(*key));
+        key->entry.rec = rec;
+        key->entry.count = 1;
+        key->entry.first = completeKinds[k][0];
+        key->entry.last = completeKinds[k][1];
+        key->pref = STR(db, r->pref);
+        entryText(db, &key->entry, &key->text);
+        last[k] = n++;
+    }
+    return n;
+}
+
+void buildCompleteIndex(PostalDB *db) {
+    size_t cap = db->nDb*5, n = 0, nNode = 0, nodeCap = 0;
+    CompleteKey *keys = (CompleteKey *)malloc((cap > 0 ? cap : 1)*sizeof(CompleteKey));
+    uint32_t *lcp = NULL, *stackLcp = NULL, *stackLo = NULL;
+    char *text = NULL;
+    if(keys == NULL)
+        goto fail;
+    size_t last[5] = {SIZE_MAX, SIZE_MAX, SIZE_MAX, SIZE_MAX, SIZE_MAX};
+    for(size_t rec = 0; rec < db->nDb; rec++)
+        n = addCompleteKeys(db, (uint32_t)rec, (rec > 0) ? &db->normRecords[rec-1] : NULL, keys, n, last);
+    size_t textSize = 0;
+    for(size_t i = 0; i < n; i++) {
+        for(int j = 0; (j < 3) && (keys[i].text.text[j] != NULL); j++)
+            textSize += strlen(keys[i].text.text[j]);
+        textSize++;
+    }
+    text = (char *)malloc(textSize > 0 ? textSize : 1);
+    if(text == NULL)
+        goto fail;
+    char *p = text;
+    for(size_t i = 0; i < n; i++) {
+        TextCursor c = keys[i].text;
+        int b;
+        keys[i].str = p;
+        while((b = textNext(&c)) >= 0)
+            *(p++) = (char)b;
+        *(p++) = '\0';
+    }
+    qsort(keys, n, sizeof(CompleteKey), compareCompleteKey);
+    /* 離れた位置に現れた同じ住所をまとめる */
+    size_t m = 0;
+    for(size_t i = 0; i < n; i++) {
+        if((m > 0) && isSameKey(&keys[m-1], &keys[i]))
+            keys[m-1].entry.count += keys[i].entry.count;
+        else
+            keys[m++] = keys[i];
+    }
+    n = m;
+    db->completeEntries = (CompleteEntry *)malloc((n > 0 ? n : 1)*sizeof(CompleteEntry));
+    lcp = (uint32_t *)malloc((n+1)*sizeof(uint32_t));
+    stackLcp = (uint32_t *)malloc((n+1)*sizeof(uint32_t));
+    stackLo = (uint32_t *)malloc((n+1)*sizeof(uint32_t));
+    if((db->completeEntries == NULL) || (lcp == NULL) || (stackLcp == NULL) || (stackLo == NULL))
+        goto fail;
+    db->nCompleteEntry = n;
+    for(size_t i = 0; i < n; i++) {
+        db->completeEntries[i] = keys[i].entry;
+        lcp[i] = (i > 0) ? commonPrefix(&keys[i-1], &keys[i]) : 0;
+    }
+    lcp[n] = 0;
+    free(keys);
+    free(text);
+    keys = NULL;
+    text = NULL;
+    /*
+     * 共通接頭辞の長さがl以上の極大の範囲を、長さを積んだスタックで列挙する。
+     * 範囲は子から親の順に見つかり、最後に全体の範囲が残る
+     */
+    size_t depth = 0;
+    stackLcp[0] = 0;
+    stackLo[0] = 0;
+    for(size_t i = 1; i <= n; i++) {
+        uint32_t lo = (uint32_t)i-1;
+        while((depth > 0) ? (lcp[i] < stackLcp[depth]) : (i == n)) {
+            lo = stackLo[depth];
+            if(i-lo > COMPLETE_TOP) {
+                if(nNode >= nodeCap) {
+                    nodeCap = (nodeCap == 0) ? 1024 : nodeCap*2;
+                    CompleteNode *p = (CompleteNode *)realloc(db->completeNodes, nodeCap*sizeof(CompleteNode));
+                    if(p == NULL)
+                        goto fail;
+                    db->completeNodes = p;
+                }
+                db->completeNodes[nNode].lo = lo;
+                db->completeNodes[nNode++].hi = (uint32_t)i;
+            }
+            if(depth == 0)
+                break;
+            depth--;
+        }
+        if((i < n) && (lcp[i] > stackLcp[depth])) {
+            depth++;
+            stackLcp[depth] = lcp[i];
+            stackLo[depth] = lo;
+        }
+    }
+    qsort(db->completeNodes, nNode, sizeof(CompleteNode), compareCompleteNode);
+    db->completeTop = (uint32_t *)malloc((nNode > 0 ? nNode : 1)*COMPLETE_TOP*sizeof(uint32_t));
+    if(db->completeTop == NULL)
+        goto fail;
+    db->nCompleteNode = nNode;
+    for(size_t i = 0; i < nNode; i++) {
+        CompleteNode *node = &db->completeNodes[i];
+        uint32_t *top = db->completeTop+i*COMPLETE_TOP;
+        size_t nTop = 0;
+        for(uint32_t e = node->lo; e < node->hi; e++)
+            addTop(db, top, &nTop, e);
+        while(nTop < COMPLETE_TOP)
+            top[nTop++] = NO_RECORD;
+        node->top = (uint32_t)(i*COMPLETE_TOP);
+    }
+    free(lcp);
+    free(stackLcp);
+    free(stackLo);
+    return;
+
+fail:
+    free(keys);
+    free(text);
+    free(lcp);
+    free(stackLcp);
+    free(stackLo);
+    freeCompleteIndex(db);
+}
+
+void freeCompleteIndex(PostalDB *db) {
+    free(db->completeEntries);
+    free(db->completeNodes);
+    free(db->completeTop);
+    db->completeEntries = NULL;
+    db->completeNodes = NULL;
+    db->completeTop = NULL;
+    db->nCompleteEntry = db->nCompleteNode = 0;
+}
+
+/* 候補eの見出しの先頭lenバイトとkeyを比べる */
+static int compareEntryPrefix(const PostalDB *db, const CompleteEntry *e, const char *key, size_t len) {
+    TextCursor c;
+    entryText(db, e, &c);
+    for(size_t i = 0; i < len; i++) {
+        int x = textNext(&c), y = (unsigned char)key[i];
+        if(x != y)
+            return (x > y) - (x < y); /* 見出しが短ければ-1 */
+    }
+    return 0;
+}
+
+static int comparePrefix(const PostalDB *db, uint32_t e, const char *key, size_t len) {
+    return compareEntryPrefix(db, &db->completeEntries[e], key, len);
+}
+
+/**
+ * 見出しがkeyで始まる候補のうち上位のものを求める
+ * 候補の範囲を二分探索で求め、COMPLETE_TOPより多ければその節に前もって求めた上位の候補を、
+ * 少なければ範囲の候補を順位で並べたものを使う
+ * top: COMPLETE_TOP個の候補番号を格納する場所
+ * returns: 候補の数
+ */
+static size_t completeEntries(const PostalDB *db, const char *key, uint32_t *top) {
+    size_t len = strlen(key);
+    size_t lo = 0, hi = db->nCompleteEntry;
+    while(lo < hi) {
+        size_t mid = lo+(hi-lo)/2;
+        if(comparePrefix(db, (uint32_t)mid, key, len) < 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    size_t end = db->nCompleteEntry;
+    hi = lo;
+    while(hi < end) {
+        size_t mid = hi+(end-hi)/2;
+        if(comparePrefix(db, (uint32_t)mid, key, len) <= 0)
+            hi = mid+1;
+        else
+            end = mid;
+    }
+    size_t n = 0;
+    if(hi-lo > COMPLETE_TOP) {
+        CompleteNode target = {(uint32_t)lo, (uint32_t)hi, 0};
+        const CompleteNode *node = (const CompleteNode *)bsearch(&target, db->completeNodes, db->nCompleteNode,
+                                                                 sizeof(CompleteNode), compareCompleteNode);
+        if(node != NULL) {
+            while((n < COMPLETE_TOP) && (db->completeTop[node->top+n] != NO_RECORD)) {
+                top[n] = db->completeTop[node->top+n];
+                n++;
+            }
+            return n;
+        }
+    }
+    for(size_t e = lo; e < hi; e++)
+        addTop(db, top, &n, (uint32_t)e);
+    return n;
+}
+
+/**
+ * 候補eの住所を持つレコードのうち、削除していないファイル順で最初のものを求める
+ * 代表のレコードを差分で削除していれば、同じ都道府県（都道府県より細かい候補なら市区町村）の
+ * レコードの範囲から、住所の同じ後のレコードを探す。代表は畳み込む時に選び直す
+ * returns: レコード番号。同じ住所のレコードを全て削除していればNO_RECORD
+ */
+static uint32_t liveEntryRecord(const PostalDB *db, const CompleteEntry *e) {
+    if((db->deleted == NULL) || !RoaringContains(db->deleted, e->rec))
+        return e->rec;
+    const Record *r = &db->normRecords[e->rec];
+    const FieldDict *dict = (e->last == FIELD_PREF) ? &db->prefDict : &db->cityDict;
+    RecordRange all = {e->rec+1, (uint32_t)db->nIndexed};
+    const RecordRange *ranges = &all;
+    size_t nRange = 1;
+    if(dict->values != NULL) {
+        const FieldValue *v = &dict->values[dict->ids[e->rec]];
+        ranges = &dict->ranges[v->rangeOffset];
+        nRange = v->nRange;
+    }
+    uint32_t left = e->count-1; /* 代表の他に同じ住所を持つレコードの数 */
+    for(size_t i = 0; (i < nRange) && (left > 0); i++) {
+        uint32_t begin = (ranges[i].begin > e->rec) ? ranges[i].begin : e->rec+1;
+        for(uint32_t rec = begin; (rec < ranges[i].end) && (left > 0); rec++) {
+            const Record *s = &db->normRecords[rec];
+            if((s->pref != r->pref) || ((e->last >= FIELD_CITY) && (s->city != r->city))
+               || ((e->last >= FIELD_TOWN) && (s->town != r->town)))
+                continue;
+            if(!RoaringContains(db->deleted, rec))
+                return rec;
+            left--;
+        }
+    }
+    return NO_RECORD;
+}
+
+/* レコードaとbの正規化した住所が、levelの細かさ（1: pref, 2: city, 3: town）まで同じか */
+static int isSameAddressRecord(const PostalDB *db, uint32_t a, uint32_t b, int level) {
+    const Record *r = &db->normRecords[a], *s = &db->normRecords[b];
+    return (strcmp(STR(db, r->pref), STR(db, s->pref)) == 0)
+        && ((level < 2) || (strcmp(STR(db, r->city), STR(db, s->city)) == 0))
+        && ((level < 3) || (strcmp(STR(db, r->town), STR(db, s->town)) == 0));
+}
+
+/**
+ * 差分で追加したレコードの候補のうち見出しがkeyで始まるものを、同じ細かさの候補の後に加える
+ * レコード数は数えないので、同じ細かさの中ではインデックスの候補より下位にする。
+ * 格納済みの候補と同じ住所のものは加えない
+ * key: 正規化した入力中の文字列
+ * n: resultに格納済みの候補の数
+ * returns: resultの候補の数
+ */
+static size_t completeAdded(const PostalDB *db, const char *key, PostalNumberCompletion *result, size_t n,
+                            size_t resultSize) {
+    size_t len = strlen(key);
+    for(uint32_t rec = (uint32_t)db->nIndexed; rec < db->nDb; rec++) {
+        if((db->deleted != NULL) && RoaringContains(db->deleted, rec))
+            continue;
+        for(int k = 0; k < 5; k++) {
+            CompleteEntry e = {rec, 1, completeKinds[k][0], completeKinds[k][1]};
+            if((*STR(db, recordField(&db->normRecords[rec], e.last)) == '\0')
+               || (compareEntryPrefix(db, &e, key, len) != 0))
+                continue;
+            int level = (e.last == FIELD_PREF) ? 1 : (e.last == FIELD_CITY) ? 2 : 3;
+            size_t pos = n;
+            for(size_t i = 0; (i < n) && (pos != SIZE_MAX); i++) {
+                if((result[i].level == level) && isSameAddressRecord(db, result[i].ref, rec, level))
+                    pos = SIZE_MAX;
+            }
+            if(pos == SIZE_MAX)
+                continue;
+            while((pos > 0) && (result[pos-1].level > level))
+                pos--;
+            if(pos >= resultSize)
+                continue;
+            if(n < resultSize)
+                n++;
+            memmove(&result[pos+1], &result[pos], (n-pos-1)*sizeof(PostalNumberCompletion));
+            result[pos].ref = rec;
+            result[pos].level = level;
+        }
+    }
+    return n;
+}
+
+static int compareGeoOutput(const void *a, const void *b) {
+    uint32_t x = ((const GeoOutput *)a)->node, y = ((const GeoOutput *)b)->node;
+    return (x > y) - (x < y);
+}
+
+/**
+ * 照合に使う町域名を作る。括弧書きの注記（"(次のビルを除く)"等）を除き、
+ * 町域名が無いことを表すものは空にする
+ * town: 正規化した町域名
+ * notListed: 正規化したTOWN_NOT_LISTED
+ * dst: 結果を格納する場所（strlen(town)+1バイト以上）
+ */
+static void geoTownName(const char *town, const char *notListed, char *dst) {
+    size_t len = strcspn(town, "(");
+    memcpy(dst, town, len);
+    dst[len] = '\0';
+    if(strcmp(dst, notListed) == 0)
+        dst[0] = '\0';
+}
+
+/**
+ * レコードのk番目の照合パターンを作る。pref, pref+city, city, pref+city+town, city+townの順
+ * notListed: 正規化したTOWN_NOT_LISTED
+ * dst: 結果を格納する場所（正規化したpref, city, townの長さの和+1バイト以上）
+ * returns: パターンの住所の細かさ（1: pref, 2: city, 3: town）。
+ *          1つ上の階層のパターンと同じになる場合は0で、dstは空文字列にする
+ */
+static int geoPattern(const PostalDB *db, const Record *r, int k, const char *notListed, char *dst) {
+    static const int level[GEO_PATTERNS] = {1, 2, 2, 3, 3};
+    const char *city = STR(db, r->city);
+    char *p = dst;
+    *dst = '\0';
+    if((k >= 1) && (*city == '\0'))
+        return 0;
+    if((k != 2) && (k != 4))
+        p = stpcpy(p, STR(db, r->pref));
+    if(k >= 1)
+        p = stpcpy(p, city);
+    if(k >= 3) {
+        geoTownName(STR(db, r->town), notListed, p);
+        if(*p == '\0') {
+            *dst = '\0';
+            return 0;
+        }
+    }
+    return level[k];
+}
+
+/* UTF-8の文字数。TextAhoの節の深さと同じ数え方 */
+static size_t codePointCount(const char *str) {
+    size_t n = 0;
+    uint32_t c;
+    while(*str != '\0') {
+        str = nextCodePoint(str, &c);
+        n++;
+    }
+    return n;
+}
+
+/**
+ * 差分で追加したレコードの照合パターンのうちaddressに現れる最も長いものを探し、それを持つレコードを加える
+ * インデックスで見つかったパターンより長ければそれに代え、同じパターンならその後に加える
+ * norm: 正規化した住所
+ * node: インデックスで見つかったパターンの終わりの節。無ければ0
+ * n: resultに格納済みのレコード数
+ * level: 格納済みのレコードの住所の細かさ。代えた場合は書き換える
+ * returns: resultのレコード数
+ */
+static size_t geocodeAdded(const PostalDB *db, const char *norm, uint32_t node, PostalNumberRef *result, size_t n,
+                           size_t resultSize, int *level) {
+    char notListed[sizeof(TOWN_NOT_LISTED)];
+    TextNormalize(TOWN_NOT_LISTED, notListed);
+    char pattern[sizeof(CsvRecord)], best[sizeof(CsvRecord)];
+    size_t bestLen = (node != 0) ? db->geo.nodes[node].depth : 0, bestEnd = 0;
+    int found = 0;
+    for(uint32_t rec = (uint32_t)db->nIndexed; rec < db->nDb; rec++) {
+        if((db->deleted != NULL) && RoaringContains(db->deleted, rec))
+            continue;
+        for(int k = 0; k < GEO_PATTERNS; k++) {
+            const char *hit;
+            if((geoPattern(db, &db->normRecords[rec], k, notListed, pattern) == 0)
+               || ((hit = strstr(norm, pattern)) == NULL))
+                continue;
+            /* 同じ長さなら先に現れたもの。インデックスのものとは同じパターンの場合だけ並べる */
+            size_t len = codePointCount(pattern), end = (size_t)(hit-norm)+strlen(pattern);
+            if((len > bestLen) || ((len == bestLen) && (found ? (end < bestEnd) : (TextAhoLongest(&db->geo, pattern) == node)))) {
+                strcpy(best, pattern);
+                bestLen = len;
+                bestEnd = end;
+                found = 1;
+            }
+        }
+    }
+    if(!found)
+        return n;
+    if((node == 0) || (bestLen > db->geo.nodes[node].depth)) {
+        n = 0;
+        *level = 0;
+    }
+    for(uint32_t rec = (uint32_t)db->nIndexed; (rec < db->nDb) && (n < resultSize); rec++) {
+        if((db->deleted != NULL) && RoaringContains(db->deleted, rec))
+            continue;
+        int matched = 0;
+        for(int k = 0; k < GEO_PATTERNS; k++) {
+            int lv = geoPattern(db, &db->normRecords[rec], k, notListed, pattern);
+            if((lv > 0) && (strcmp(pattern, best) == 0)) {
+                matched = 1;
+                if(*level < lv)
+                    *level = lv;
+            }
+        }
+        if(matched)
+            result[n++] = rec;
+    }
+    return n;
+}
+
+void buildGeocodeIndex(PostalDB *db) {
+    char notListed[sizeof(TOWN_NOT_LISTED)];
+    TextNormalize(TOWN_NOT_LISTED, notListed);
+    size_t nPattern = db->nDb*GEO_PATTERNS, textSize = 0;
+    for(size_t rec = 0; rec < db->nDb; rec++) {
+        const Record *r = &db->normRecords[rec];
+        size_t pref = strlen(STR(db, r->pref)), city = strlen(STR(db, r->city)), town = strlen(STR(db, r->town));
+        textSize += pref*3+city*4+town*2+GEO_PATTERNS;
+    }
+    char *text = (char *)malloc(textSize > 0 ? textSize : 1);
+    const char **patterns = (const char **)malloc((nPattern > 0 ? nPattern : 1)*sizeof(char *));
+    uint32_t *terminal = (uint32_t *)malloc((nPattern > 0 ? nPattern : 1)*sizeof(uint32_t));
+    uint32_t *slot = NULL;
+    if((text == NULL) || (patterns == NULL) || (terminal == NULL))
+        goto fail;
+    char *p = text;
+    for(size_t rec = 0; rec < db->nDb; rec++) {
+        for(int k = 0; k < GEO_PATTERNS; k++) {
+            patterns[rec*GEO_PATTERNS+k] = p;
+            geoPattern(db, &db->normRecords[rec], k, notListed, p);
+            p += strlen(p)+1;
+        }
+    }
+    if(!TextAhoBuild(patterns, nPattern, &db->geo, terminal))
+        goto fail;
+    free(text);
+    free(patterns);
+    text = NULL;
+    patterns = NULL;
+    /* 同じレコードの別のパターンが同じ節で終わる場合は1度だけ数える */
+    for(size_t i = 0; i < nPattern; i++) {
+        for(size_t j = i-i%GEO_PATTERNS; j < i; j++) {
+            if(terminal[j] == terminal[i])
+                terminal[i] = 0;
+        }
+    }
+    /* 節ごとのレコード数を数えてから、節の順に並べる */
+    slot = (uint32_t *)calloc(db->geo.nNode, sizeof(uint32_t));
+    if(slot == NULL)
+        goto fail;
+    for(size_t i = 0; i < nPattern; i++) {
+        if(terminal[i] != 0) {
+            slot[terminal[i]]++;
+            db->nGeoRecord++;
+        }
+    }
+    for(size_t v = 0; v < db->geo.nNode; v++)
+        db->nGeoOutput += (slot[v] > 0);
+    db->geoOutputs = (GeoOutput *)malloc((db->nGeoOutput > 0 ? db->nGeoOutput : 1)*sizeof(GeoOutput));
+    db->geoRecords = (uint32_t *)malloc((db->nGeoRecord > 0 ? db->nGeoRecord : 1)*sizeof(uint32_t));
+    if((db->geoOutputs == NULL) || (db->geoRecords == NULL))
+        goto fail;
+    uint32_t nOut = 0, begin = 0;
+    for(size_t v = 0; v < db->geo.nNode; v++) {
+        if(slot[v] == 0)
+            continue;
+        GeoOutput *out = &db->geoOutputs[nOut];
+        out->node = (uint32_t)v;
+        out->level = 0;
+        out->begin = begin;
+        out->count = 0;
+        begin += slot[v];
+        slot[v] = nOut++; /* 以降は節の出力の番号 */
+    }
+    for(size_t i = 0; i < nPattern; i++) {
+        static const uint32_t level[GEO_PATTERNS] = {1, 2, 2, 3, 3};
+        if(terminal[i] == 0)
+            continue;
+        GeoOutput *out = &db->geoOutputs[slot[terminal[i]]];
+        db->geoRecords[out->begin+out->count++] = (uint32_t)(i/GEO_PATTERNS);
+        if(out->level < level[i%GEO_PATTERNS])
+            out->level = level[i%GEO_PATTERNS];
+    }
+    free(terminal);
+    free(slot);
+    return;
+
+fail:
+    free(text);
+    free(patterns);
+    free(terminal);
+    free(slot);
+    freeGeocodeIndex(db);
+}
+
+void freeGeocodeIndex(PostalDB *db) {
+    TextAhoFree(&db->geo);
+    free(db->geoOutputs);
+    free(db->geoRecords);
+    db->geoOutputs = NULL;
+    db->geoRecords = NULL;
+    db->nGeoOutput = db->nGeoRecord = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef POSTALADDRESS_H
+#define POSTALADDRESS_H
+
+#include "postalDB.h"
+
+/**
+ * 入力補完の候補と節ごとの上位の候補を作る
+ * 候補を見出し順に並べると、同じ接頭辞を持つものは連続した範囲になる。
+ * 隣り合う見出しの共通接頭辞の長さから、そのような範囲（文字の木の節）を列挙する。
+ * 候補がCOMPLETE_TOPより多い節だけ、範囲を調べて上位の候補を求めておく。
+ * 作れなかった場合は入力補完の候補を返さない
+ */
+extern void buildCompleteIndex(PostalDB *db);
+
+/**
+ * 入力補完の候補を解放する
+ */
+extern void freeCompleteIndex(PostalDB *db);
+
+/**
+ * 住所の照合に使うオートマトンを作る
+ * レコードごとに、正規化した都道府県名、都道府県名+市区町村名、市区町村名、
+ * 都道府県名+市区町村名+町域名、市区町村名+町域名の5つをパターンとし、
+ * パターンの終わりの節ごとにそれを住所に持つレコードを並べる
+ * 作れなかった場合は住所の照合で何も見つからない
+ */
+extern void buildGeocodeIndex(PostalDB *db);
+
+/**
+ * 住所の照合に使うオートマトンを解放する
+ */
+extern void freeGeocodeIndex(PostalDB *db);
+
+#endif /* POSTALADDRESS_H */
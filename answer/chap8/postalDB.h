@@ -0,0 +1,456 @@
+#ifndef POSTALDB_H
+#define POSTALDB_H
+
+/*
+ * 取り込んだ郵便番号データベースとインデックスの内部表現
+ * postalNumber.cと、イメージファイル(postalImage.c)、差分(postalDelta.c)、
+ * 入力補完と住所の照合(postalAddress.c)、検索条件の解析とFM-indexでの検索(postalQuery.c)で共有する
+ * postalNumber.hの利用者は使わないこと
+ */
+
+#include "postalNumber.h"
+#include "roaring.h"
+#include "textAho.h"
+#include "textFM.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define DBFILE "KEN_ALL_UTF8.CSV"
+#define MAX_KEY_GRAMS 64 /* 検索キーから取り出すgramの最大数 */
+#define COMPLETE_TOP POSTAL_NUMBER_COMPLETE_MAX /* 入力補完で範囲ごとに前もって求めておく候補の数 */
+
+/**
+ * 郵便番号データベースのレコード
+ * 文字列はすべてarenaに重複なく格納し、その先頭位置を持つ
+ */
+typedef struct {
+    uint32_t code; /* 郵便番号 */
+    uint32_t pref; /* 都道府県名 */
+    uint32_t city; /* 市区町村名 */
+    uint32_t town; /* 町域名 */
+    uint32_t prefKana; /* 都道府県名の読み（半角カタカナ）*/
+    uint32_t cityKana; /* 市区町村名の読み */
+    uint32_t townKana; /* 町域名の読み */
+} Record;
+
+/**
+ * CSVの1行から取り出したレコード
+ * 読みは公開用のPostalNumberには含めず、PostalNumberPrefKana等でだけ得られる
+ */
+typedef struct {
+    char code[16];
+    char pref[128];
+    char city[256];
+    char town[256];
+    char prefKana[128];
+    char cityKana[256];
+    char townKana[512];
+} CsvRecord;
+
+/**
+ * 文字gram転置インデックスのエントリ
+ * gramは1文字(unigram)または連続する2文字(bigram)のコードポイントを詰めたもの
+ */
+typedef struct {
+    uint64_t gram;   /* 0は空きエントリ */
+    uint32_t offset; /* postingBlocks中の開始位置 */
+    uint32_t count;  /* 該当レコード数 */
+} GramEntry;
+
+/**
+ * 圧縮したレコード番号列のブロック
+ * gramごとの昇順のレコード番号列をPOSTING_BLOCK件ずつに区切り、ブロック先頭の
+ * レコード番号はここに持つ。2件目以降は直前との差を可変長整数（7ビットずつ、
+ * 続きがあれば最上位ビットを立てる）にしてpostingBytesに詰める
+ */
+typedef struct {
+    uint32_t first;  /* ブロック先頭のレコード番号 */
+    uint32_t offset; /* 2件目以降の差のpostingBytes中の開始位置 */
+} PostingBlock;
+
+/**
+ * 圧縮したレコード番号列を先頭から順に読むもの
+ */
+typedef struct {
+    const PostingBlock *blocks; /* このgramのブロック列 */
+    const uint8_t *base;        /* postingBytes */
+    uint32_t count;             /* 件数 */
+    uint32_t pos;               /* 今の要素の位置。countなら読み終わった */
+    uint32_t rec;               /* 今の要素 */
+    const uint8_t *next;        /* 次の要素の差の位置 */
+} PostingCursor;
+
+#define NO_RECORD UINT32_MAX
+
+/**
+ * pref, cityの値ごとの辞書エントリ。値は名前と読みの組
+ * 値の種類は少なく、同じ値のレコードはファイル中で連続しているので、
+ * 該当レコードを範囲の並びで持つ
+ */
+typedef struct {
+    uint32_t value;       /* arena中の位置 */
+    uint32_t reading;     /* 読みのarena中の位置 */
+    uint32_t rangeOffset; /* ranges中の開始位置 */
+    uint32_t nRange;      /* 範囲の数 */
+    uint32_t nRecord;     /* 該当レコード数 */
+} FieldValue;
+
+/* レコード番号の範囲[begin, end) */
+typedef struct {
+    uint32_t begin;
+    uint32_t end;
+} RecordRange;
+
+/**
+ * 入力補完の候補。都道府県名か市区町村名から始まり、firstからlastまでのフィールドを
+ * 正規化してつないだものを見出しにする。同じ住所のレコードは1つの候補にまとめる
+ */
+typedef struct {
+    uint32_t rec;   /* 代表のレコード（ファイル順で最初のもの）*/
+    uint32_t count; /* 同じ住所のレコード数 */
+    uint8_t first;  /* 見出しの最初のフィールド。FIELD_PREFかFIELD_CITY */
+    uint8_t last;   /* 見出しの最後のフィールド */
+} CompleteEntry;
+
+/**
+ * 見出しが同じ接頭辞を持つ候補の範囲。見出し順の並びの中で連続し、
+ * 文字の木（compressed trie）の節にあたる。候補がCOMPLETE_TOPより多い節だけを持つ
+ */
+typedef struct {
+    uint32_t lo;    /* 範囲[lo, hi) */
+    uint32_t hi;
+    uint32_t top;   /* 上位の候補のcompleteTop中の開始位置 */
+} CompleteNode;
+
+/**
+ * 住所の照合に使うパターンの終わりの節と、そのパターンを住所に持つレコード
+ */
+typedef struct {
+    uint32_t node;  /* パターンの終わりの節 */
+    uint32_t level; /* パターンの住所の細かさ。1: pref, 2: city, 3: town */
+    uint32_t begin; /* geoRecords中の開始位置 */
+    uint32_t count; /* レコード数 */
+} GeoOutput;
+
+/**
+ * 1フィールド分の列。値の辞書と、レコードごとの値の番号を持つ
+ * 値の種類がMAX_FIELD_VALUESを超える場合は作らない（valuesがNULL）
+ */
+#define MAX_FIELD_VALUES 65535
+typedef struct {
+    FieldValue *values;   /* 出現順 */
+    size_t nValue;
+    RecordRange *ranges;  /* 値ごとにレコード順 */
+    size_t nRange;
+    uint16_t *ids;        /* レコードごとの値の番号 */
+} FieldDict;
+
+/**
+ * 取り込んだDBとインデックス一式（スナップショット）
+ * 公開した後は書き換えず、参照するスレッドが無くなってから解放する
+ */
+typedef struct PostalDB_ {
+    Record *records;
+    Record *normRecords;    /* 検索用にTextNormalizeした各フィールド。recordsと同じ並び */
+    size_t nDb;
+    char *arena;            /* '\0'終端の文字列を詰めた領域 */
+    size_t arenaSize;
+
+    /*
+     * 差分ファイルで加えた変更。インデックスは先頭nIndexed件の分だけを持ち、
+     * 差分で追加したそれ以降のレコードは検索時に順に調べる。DELTA_FOLD_RECORDSを超えたら作り直す
+     */
+    size_t nIndexed;        /* インデックスを作ったレコード数 */
+    Roaring *deleted;       /* 削除したレコード番号。無ければNULL */
+    size_t recordCap;       /* records, normRecordsの大きさ。0なら追記できない */
+    size_t arenaCap;        /* arenaの大きさ。0なら追記できない */
+    struct PostalDB_ *parent; /* 配列を共有している前の版。差分を適用した版だけが持つ */
+    int ownsRecords;        /* 差分を適用した版で、records, normRecords, arenaを確保し直した */
+
+    /* 文字gram転置インデックス */
+    GramEntry *gramTable;   /* オープンアドレス法のハッシュ表 */
+    size_t gramTableSize;   /* 2のべき乗 */
+    size_t nGram;
+    PostingBlock *postingBlocks; /* gramごとのブロック列を並べたもの。末尾に番兵を1つ置く */
+    size_t nPostingBlock;   /* 番兵を除くブロック数 */
+    uint8_t *postingBytes;  /* ブロック内の差の列 */
+    size_t postingBytesSize;
+
+    /* 郵便番号の完全一致用ハッシュインデックス */
+    uint32_t *codeTable;    /* 郵便番号ごとの先頭レコード番号+1。0は空き */
+    size_t codeTableSize;   /* 2のべき乗 */
+    uint32_t *codeNext;     /* 同じ郵便番号を持つ次のレコード番号 */
+    uint32_t *codeOrder;    /* 郵便番号順（同じならレコード順）に並べたレコード番号 */
+    int textHasDigit;       /* 正規化したpref, city, townとその読みのどれかに半角数字を含むレコードがある */
+
+    /*
+     * 全レコードの正規化したpref, city, townとその読みを'\0'区切りで1列に並べたテキスト列
+     * レコードiの分はtextColumn[textOffsets[i], textOffsets[i+1])
+     */
+    char *textColumn;
+    size_t textColumnSize;
+    uint32_t *textOffsets;
+
+    FieldDict prefDict;
+    FieldDict cityDict;
+
+    /* 入力補完。候補を見出し順に並べ、節ごとに上位の候補を持つ */
+    CompleteEntry *completeEntries;
+    size_t nCompleteEntry;
+    CompleteNode *completeNodes; /* (lo, hi)順 */
+    size_t nCompleteNode;
+    uint32_t *completeTop;  /* 節ごとにCOMPLETE_TOP個の候補番号を上位から並べたもの。足りない分はNO_RECORD */
+
+    /* 住所の照合。住所名のパターンを探すオートマトンと、パターンごとのレコード */
+    TextAho geo;
+    GeoOutput *geoOutputs;  /* node順 */
+    size_t nGeoOutput;
+    uint32_t *geoRecords;   /* パターンごとにファイル順に並べたレコード番号 */
+    size_t nGeoRecord;
+
+    /*
+     * 圧縮した自己索引。POSTAL_NUMBER_MEMORY_COMPACTで取り込んだ場合だけ持ち（fm.nが0でない）、
+     * テキスト列、文字gramインデックス、正規化した文字列の代わりに使う。文書はレコード
+     */
+    TextFM fm;
+
+    void *image;            /* イメージファイルのマップ先か、イメージと同じ並びに詰めた領域 */
+    size_t imageSize;
+    int backing;            /* imageのメモリ（POSTAL_NUMBER_BACKING_*）*/
+    int locked;             /* imageをmlockした */
+
+    uint64_t version;       /* 公開した順に振る版番号 */
+    int refCount;           /* 公開中であることと、参照しているスレッドの数 */
+} PostalDB;
+
+#define STR(db, off) ((db)->arena+(off))
+
+/* 検索条件の対象フィールド */
+#define FIELD_CODE 1
+#define FIELD_PREF 2
+#define FIELD_CITY 4
+#define FIELD_TOWN 8
+#define FIELD_ANY (FIELD_CODE|FIELD_PREF|FIELD_CITY|FIELD_TOWN)
+
+/**
+ * 重複を除いた文字列の格納領域
+ */
+typedef struct {
+    char *arena;        /* '\0'終端の文字列を詰めた領域 */
+    size_t size;
+    uint32_t *table;    /* 文字列番号+1のハッシュ表。0は空き */
+    size_t tableSize;   /* 2のべき乗 */
+    uint32_t *offsets;  /* 文字列番号ごとのarena中の位置 */
+    size_t nStr;
+} StringPool;
+
+/**
+ * 検索条件を満たしうるレコードを順に取り出すもの
+ */
+#define CANDIDATES_SCAN 0   /* 全レコード。インデックスで扱えない項はこのままで、候補を取り出さない */
+#define CANDIDATES_GRAM 1   /* 転置インデックスの積集合と郵便番号の一致 */
+#define CANDIDATES_RANGE 2  /* 列の値の範囲 */
+typedef struct {
+    const PostalDB *db;
+    int kind;
+    uint32_t next;          /* SCAN, RANGE: 次に返すレコード */
+    size_t cost;            /* 取り出す候補数の見積もり */
+    /* CANDIDATES_GRAM */
+    const GramEntry *lists[MAX_KEY_GRAMS]; /* 件数の少ない順 */
+    PostingCursor cursors[MAX_KEY_GRAMS];  /* listsのそれぞれを読む位置 */
+    size_t nList;
+    int primed;             /* gramRecを求めた */
+    uint32_t gramRec;       /* 積集合の次のレコード */
+    uint32_t codeRec;       /* 郵便番号が一致する次のレコード */
+    /* CANDIDATES_RANGE */
+    RecordRange *ranges;    /* レコード順 */
+    size_t nRange;
+    size_t rangePos;
+} Candidates;
+
+/* 以下はpostalNumber.cが各モジュールに提供する */
+
+/**
+ * FM-indexだけを持つ版か
+ */
+extern int isCompact(const PostalDB *db);
+
+/**
+ * レコードの正規化した郵便番号。FM-indexだけを持つ版では元のものと同じ場合に限り正規化したものを捨てている
+ */
+extern const char *codeOf(const PostalDB *db, uint32_t rec);
+
+/**
+ * このスレッドが使うスナップショットを公開中の最新のものにする
+ * 既に最新を参照していればロックも参照数の操作もしない
+ */
+extern PostalDB *pinLatest(void);
+
+/**
+ * recordsとnormRecordsの全件のインデックスを作る
+ * compact: FM-indexだけを作る
+ */
+extern void buildIndexes(PostalDB *db, int compact);
+
+/**
+ * レコード順に並んだresult[0, count)に、郵便番号がkeyに一致するstart番以降のレコードを挿入する
+ * 同じ郵便番号のレコードは少ないので単純に詰め直す。削除したレコードは加えない
+ * returns: 挿入後の数
+ */
+extern size_t mergeCodeMatches(const PostalDB *db, const char *key, uint32_t start, uint32_t *result, size_t count, size_t resultSize);
+
+/**
+ * スナップショットのDBとインデックスを解放する
+ */
+extern void freeSnapshot(PostalDB *db);
+
+/**
+ * 配列ごとに確保したDBとインデックスを解放する
+ */
+extern void freeArrays(PostalDB *db);
+
+/**
+ * 文字列プールを用意する
+ * arenaSize: 格納する文字列の合計の上限
+ * maxStr: 格納する文字列の数の上限
+ * returns: 成功した場合1, 失敗した場合0
+ */
+extern int poolInit(StringPool *pool, size_t arenaSize, size_t maxStr);
+
+/**
+ * 文字列の格納領域を解放する
+ */
+extern void poolFree(StringPool *pool);
+
+/**
+ * ファイル全体を読み取り専用でマップする。行の解析は範囲で行うので書き換えない
+ * data: 先頭を格納する場所。空のファイルならNULL
+ * size: バイト数を格納する場所
+ * returns: 成功した場合1, 失敗した場合0
+ */
+extern int mapFile(const char *path, const char **data, size_t *size);
+
+/**
+ * mapFileでマップしたファイルを外す
+ */
+extern void unmapFile(const char *data, size_t size);
+
+/**
+ * CSVの1行を解析する。使うフィールドだけをtmpにコピーし、足りないフィールドは空にする
+ * returns: レコードとして取り込む行なら1。次の行の先頭を*nextに格納する
+ */
+extern int parseLine(const char *line, const char *end, CsvRecord *tmp, const char **next);
+
+/**
+ * arenaの文字列を指すレコードをプールに格納し直す。dstはrecと同じでもよい
+ */
+extern void reinternRecord(StringPool *pool, const PostalDB *db, const Record *rec, Record *dst);
+
+/**
+ * 1レコード分の各フィールドを検索用に正規化する
+ */
+extern void normalizeRecord(CsvRecord *rec);
+
+/**
+ * レコードの配列と文字列の領域を解放する
+ */
+extern void freeDB(PostalDB *db);
+
+/**
+ * レコードが検索条件に一致するか調べる
+ * rec: 正規化したレコード
+ * key: 正規化した検索キー
+ */
+extern int isMatch(const PostalDB *db, const Record *rec, const char *key);
+
+/**
+ * 空でない半角数字だけの文字列か調べる
+ */
+extern int isDigits(const char *str);
+
+/**
+ * 郵便番号がkeyに一致する最初のレコードを探す
+ * returns: レコード番号。無ければNO_RECORD
+ */
+extern uint32_t findCode(const PostalDB *db, const char *key);
+
+/**
+ * レコードのフィールドのarena中の位置を得る
+ */
+extern uint32_t recordField(const Record *rec, int field);
+
+/**
+ * レコードのフィールドの読みのarena中の位置を得る。読みの無いフィールドは空文字列
+ */
+extern uint32_t recordReading(const Record *rec, int field);
+
+/**
+ * 郵便番号がlo以上で、先頭hiLen文字がhi以下のレコードの、codeOrder上の範囲を求める
+ * lo, hiが同じなら前方一致になる
+ */
+extern void findCodeRange(const PostalDB *db, const char *lo, const char *hi, size_t *begin, size_t *end);
+
+/**
+ * UTF-8の1文字を取り出してコードポイントをcpに格納し、次の文字のアドレスを返す。
+ * 不正なバイトは1バイトずつ0x110000以上の値として取り出す
+ */
+extern const char *nextCodePoint(const char *str, uint32_t *cp);
+
+/**
+ * gramの値を作る。unigramはc2に0を指定する
+ */
+extern uint64_t makeGram(uint32_t c1, uint32_t c2);
+
+/**
+ * gramのエントリを探す
+ * returns: エントリへのポインタ。見つからない場合NULL
+ */
+extern const GramEntry *findGram(const PostalDB *db, uint64_t gram);
+
+/**
+ * 数字だけのキーがインデックスを作ったレコードのテキストに現れうるか調べる
+ * 現れなければ郵便番号のハッシュインデックスだけで答えられる。
+ * 「１丁目」等を含むDBでも、キーのgramが1つでもインデックスに無ければ現れない
+ * returns: 現れうる場合1
+ */
+extern int textMayContain(const PostalDB *db, const char *key);
+
+/**
+ * keyを含むレコードの候補を転置インデックスから取り出す準備をする
+ * withCode: 郵便番号がkeyに一致するレコードも候補にする
+ * returns: インデックスで扱えないキーの場合0
+ */
+extern int initGramCandidates(Candidates *c, const PostalDB *db, const char *key, uint32_t start, int withCode);
+
+/**
+ * 列dictでmatchが真の値を持つレコードを候補とする準備をする
+ * 異なる値の範囲は重ならないので、先頭順に並べればレコード順に取り出せる
+ * returns: メモリが足りない場合0
+ */
+extern int initRangeCandidates(Candidates *c, const PostalDB *db, const FieldDict *dict, const uint8_t *match, uint32_t start);
+
+/**
+ * レコード番号を昇順に並べるqsortの比較関数
+ */
+extern int compareRecord(const void *a, const void *b);
+
+/**
+ * 郵便番号がlo..hiの範囲にあるレコードを候補とする準備をする
+ * 郵便番号順の列から該当する部分のうちstart以降のものを取り出し、レコード順の範囲に直す。
+ * 少なければ並べ替え、多ければレコードごとのビット列に印を付けて順に拾う
+ * returns: 郵便番号順の列が無い場合、メモリが足りない場合0
+ */
+extern int initCodeCandidates(Candidates *c, const PostalDB *db, const char *lo, const char *hi, uint32_t start);
+
+/**
+ * 次の候補を取り出す
+ * returns: レコード番号。無ければNO_RECORD
+ */
+extern uint32_t nextCandidate(Candidates *c);
+
+/**
+ * 候補を取り出すのに使った領域を解放する
+ */
+extern void freeCandidates(Candidates *c);
+
+#endif /* POSTALDB_H */
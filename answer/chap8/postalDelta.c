@@ -0,0 +1,283 @@
+#include "postalDelta.h"
+#include "postalImage.h"
+#include "textNorm.h"
+#include "roaring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+int readDeltaFile(const char *path, CsvRecord **recs, size_t *n) {
+    *recs = NULL;
+    *n = 0;
+    if(path == NULL)
+        return 1;
+    const char *buf;
+    size_t size;
+    if(!mapFile(path, &buf, &size))
+        return 0;
+    size_t cap = 0;
+    int ok = 1;
+    const char *line = buf;
+    while(line < buf+size) {
+        if(*n >= cap) {
+            cap = (cap == 0) ? 64 : cap*2;
+            CsvRecord *p = (CsvRecord *)realloc(*recs, cap*sizeof(CsvRecord));
+            if(p == NULL) {
+                ok = 0;
+                break;
+            }
+            *recs = p;
+        }
+        if(parseLine(line, buf+size, &(*recs)[*n], &line))
+            (*n)++;
+    }
+    unmapFile(buf, size);
+    if(!ok) {
+        free(*recs);
+        *recs = NULL;
+        *n = 0;
+    }
+    return ok;
+}
+
+/* 元の各フィールドがtmpと一致するレコードか調べる */
+static int isSameRecord(const PostalDB *db, uint32_t rec, const CsvRecord *tmp) {
+    const Record *r = &db->records[rec];
+    return (strcmp(STR(db, r->code), tmp->code) == 0)
+        && (strcmp(STR(db, r->pref), tmp->pref) == 0)
+        && (strcmp(STR(db, r->city), tmp->city) == 0)
+        && (strcmp(STR(db, r->town), tmp->town) == 0)
+        && (strcmp(STR(db, r->prefKana), tmp->prefKana) == 0)
+        && (strcmp(STR(db, r->cityKana), tmp->cityKana) == 0)
+        && (strcmp(STR(db, r->townKana), tmp->townKana) == 0);
+}
+
+static int isDeleted(const PostalDB *db, const Roaring *removed, uint32_t rec) {
+    return RoaringContains(removed, rec) || ((db->deleted != NULL) && RoaringContains(db->deleted, rec));
+}
+
+/**
+ * 削除ファイルの1行に当たる、まだ削除していないレコードを探す
+ * インデックスを作ったレコードは郵便番号のハッシュインデックスで、追加したレコードは順に探す
+ * returns: レコード番号。無ければNO_RECORD
+ */
+static uint32_t findDeltaTarget(const PostalDB *db, const Roaring *removed, const CsvRecord *tmp) {
+    char code[sizeof(tmp->code)];
+    TextNormalize(tmp->code, code);
+    if(db->codeTable != NULL) {
+        for(uint32_t rec = findCode(db, code); rec != NO_RECORD; rec = db->codeNext[rec]) {
+            if(!isDeleted(db, removed, rec) && isSameRecord(db, rec, tmp))
+                return rec;
+        }
+    } else {
+        for(uint32_t rec = 0; rec < db->nIndexed; rec++) {
+            if(!isDeleted(db, removed, rec) && isSameRecord(db, rec, tmp))
+                return rec;
+        }
+    }
+    for(uint32_t rec = (uint32_t)db->nIndexed; rec < db->nDb; rec++) {
+        if(!isDeleted(db, removed, rec) && isSameRecord(db, rec, tmp))
+            return rec;
+    }
+    return NO_RECORD;
+}
+
+/* 文字列をarenaの末尾に追記し、その位置を返す。大きさは確保済みであること */
+static uint32_t appendString(PostalDB *db, const char *str) {
+    size_t len = strlen(str)+1;
+    uint32_t off = (uint32_t)db->arenaSize;
+    memcpy(db->arena+off, str, len);
+    db->arenaSize += len;
+    return off;
+}
+
+/* 1レコード分の文字列を追記し、その位置をdstに格納する */
+static void appendRecord(PostalDB *db, const CsvRecord *src, Record *dst) {
+    dst->code = appendString(db, src->code);
+    dst->pref = appendString(db, src->pref);
+    dst->city = appendString(db, src->city);
+    dst->town = appendString(db, src->town);
+    dst->prefKana = appendString(db, src->prefKana);
+    dst->cityKana = appendString(db, src->cityKana);
+    dst->townKana = appendString(db, src->townKana);
+}
+
+static size_t recordBytes(const CsvRecord *rec) {
+    return strlen(rec->code)+strlen(rec->pref)+strlen(rec->city)+strlen(rec->town)
+        +strlen(rec->prefKana)+strlen(rec->cityKana)+strlen(rec->townKana)+7;
+}
+
+/**
+ * recordsとarenaに追記できるようにする
+ * 前の版の配列に空きがあれば共有したまま末尾に書き足す。前の版が参照するのは
+ * 自分の件数と大きさまでなので、検索中のスレッドに影響しない。
+ * 空きが無ければ1/8の余裕を持たせて確保し直して写す。これは追記する量に比べて
+ * まれにしか起こらないので、ならせば手間は差分の大きさに比例する
+ * returns: メモリが足りない場合0
+ */
+static int reserveDelta(PostalDB *db, size_t nAdd, size_t bytes) {
+    size_t nNeed = db->nDb+nAdd, arenaNeed = db->arenaSize+bytes;
+    if((arenaNeed > UINT32_MAX) || (nNeed >= NO_RECORD))
+        return 0;
+    if((nNeed <= db->recordCap) && (arenaNeed <= db->arenaCap))
+        return 1;
+    size_t recordCap = nNeed+nNeed/8, arenaCap = arenaNeed+arenaNeed/8;
+    Record *records = (Record *)malloc(recordCap*sizeof(Record));
+    Record *normRecords = (Record *)malloc(recordCap*sizeof(Record));
+    char *arena = (char *)malloc(arenaCap);
+    if((records == NULL) || (normRecords == NULL) || (arena == NULL)) {
+        free(records);
+        free(normRecords);
+        free(arena);
+        return 0;
+    }
+    memcpy(records, db->records, db->nDb*sizeof(Record));
+    memcpy(normRecords, db->normRecords, db->nDb*sizeof(Record));
+    memcpy(arena, db->arena, db->arenaSize);
+    db->records = records;
+    db->normRecords = normRecords;
+    db->arena = arena;
+    db->recordCap = recordCap;
+    db->arenaCap = arenaCap;
+    db->ownsRecords = 1;
+    return 1;
+}
+
+/**
+ * 差分を適用する版dbに、前の版srcのレコードの配列とインデックスを写す（共有する）
+ * 削除したレコード、版番号と参照数は写さない。参照数は検索中のスレッドが書き換えている
+ */
+static void shareSnapshot(PostalDB *db, const PostalDB *src) {
+    db->records = src->records;
+    db->normRecords = src->normRecords;
+    db->nDb = src->nDb;
+    db->arena = src->arena;
+    db->arenaSize = src->arenaSize;
+    db->nIndexed = src->nIndexed;
+    db->recordCap = src->recordCap;
+    db->arenaCap = src->arenaCap;
+
+    db->gramTable = src->gramTable;
+    db->gramTableSize = src->gramTableSize;
+    db->nGram = src->nGram;
+    db->postingBlocks = src->postingBlocks;
+    db->nPostingBlock = src->nPostingBlock;
+    db->postingBytes = src->postingBytes;
+    db->postingBytesSize = src->postingBytesSize;
+
+    db->codeTable = src->codeTable;
+    db->codeTableSize = src->codeTableSize;
+    db->codeNext = src->codeNext;
+    db->codeOrder = src->codeOrder;
+    db->textHasDigit = src->textHasDigit;
+
+    db->textColumn = src->textColumn;
+    db->textColumnSize = src->textColumnSize;
+    db->textOffsets = src->textOffsets;
+    db->prefDict = src->prefDict;
+    db->cityDict = src->cityDict;
+
+    db->completeEntries = src->completeEntries;
+    db->nCompleteEntry = src->nCompleteEntry;
+    db->completeNodes = src->completeNodes;
+    db->nCompleteNode = src->nCompleteNode;
+    db->completeTop = src->completeTop;
+
+    db->geo = src->geo;
+    db->geoOutputs = src->geoOutputs;
+    db->nGeoOutput = src->nGeoOutput;
+    db->geoRecords = src->geoRecords;
+    db->nGeoRecord = src->nGeoRecord;
+
+    db->fm = src->fm;
+
+    db->image = src->image;
+    db->imageSize = src->imageSize;
+    db->backing = src->backing;
+    db->locked = src->locked;
+}
+
+PostalDB *buildDelta(PostalDB *cur, const CsvRecord *adds, size_t nAdd, const CsvRecord *dels, size_t nDel) {
+    PostalDB *db = (PostalDB *)calloc(1, sizeof(PostalDB));
+    Roaring *removed = RoaringCreate();
+    if((db == NULL) || (removed == NULL)) {
+        free(db);
+        RoaringFree(removed);
+        return NULL;
+    }
+    shareSnapshot(db, cur);
+    db->parent = cur;
+    for(size_t i = 0; i < nDel; i++) {
+        uint32_t rec = findDeltaTarget(cur, removed, &dels[i]);
+        if((rec != NO_RECORD) && !RoaringAdd(removed, rec))
+            goto fail;
+    }
+    if(cur->deleted != NULL) {
+        /* 前の版の削除を引き継ぐ */
+        db->deleted = RoaringOr(cur->deleted, removed);
+        if(db->deleted == NULL)
+            goto fail;
+    } else if(RoaringCardinality(removed) > 0) {
+        db->deleted = removed;
+        removed = NULL;
+    }
+    RoaringFree(removed);
+    removed = NULL;
+
+    size_t bytes = 0;
+    for(size_t i = 0; i < nAdd; i++)
+        bytes += recordBytes(&adds[i])*2; /* 元の文字列と正規化したもの */
+    if(!reserveDelta(db, nAdd, bytes))
+        goto fail;
+    for(size_t i = 0; i < nAdd; i++) {
+        CsvRecord tmp = adds[i];
+        appendRecord(db, &tmp, &db->records[db->nDb]);
+        normalizeRecord(&tmp);
+        appendRecord(db, &tmp, &db->normRecords[db->nDb]);
+        db->nDb++;
+    }
+    return db;
+
+fail:
+    RoaringFree(removed);
+    if(db->ownsRecords)
+        freeDB(db);
+    RoaringFree(db->deleted);
+    free(db);
+    return NULL;
+}
+
+PostalDB *foldDelta(const PostalDB *src, int options) {
+    PostalDB *db = (PostalDB *)calloc(1, sizeof(PostalDB));
+    if(db == NULL)
+        return NULL;
+    size_t n = (src->nDb > 0) ? src->nDb : 1;
+    StringPool pool;
+    db->records = (Record *)malloc(n*sizeof(Record));
+    db->normRecords = (Record *)malloc(n*sizeof(Record));
+    if((db->records == NULL) || (db->normRecords == NULL) || !poolInit(&pool, src->arenaSize, n*14)) {
+        freeDB(db);
+        free(db);
+        return NULL;
+    }
+    for(uint32_t rec = 0; rec < src->nDb; rec++) {
+        if((src->deleted != NULL) && RoaringContains(src->deleted, rec))
+            continue;
+        reinternRecord(&pool, src, &src->records[rec], &db->records[db->nDb]);
+        reinternRecord(&pool, src, &src->normRecords[rec], &db->normRecords[db->nDb++]);
+    }
+    db->arena = pool.arena;
+    db->arenaSize = pool.size;
+    char *shrunk = (char *)realloc(db->arena, db->arenaSize);
+    if(shrunk != NULL)
+        db->arena = shrunk;
+    pool.arena = NULL;
+    poolFree(&pool);
+    buildIndexes(db, 0);
+    if(options != 0)
+        packSnapshot(db, (options & POSTAL_NUMBER_MEMORY_HUGE) != 0);
+    if((options & POSTAL_NUMBER_MEMORY_LOCK) && (db->image != NULL))
+        db->locked = mlock(db->image, db->imageSize) == 0;
+    return db;
+}
@@ -0,0 +1,28 @@
+#ifndef POSTALDELTA_H
+#define POSTALDELTA_H
+
+#include "postalDB.h"
+
+/**
+ * 差分ファイルの各行をレコードとして読み込む
+ * recs: 読み込んだレコードの配列を格納する場所（使い終わったらfreeする）
+ * n: レコード数を格納する場所
+ * returns: 成功した場合1, 失敗した場合0
+ */
+extern int readDeltaFile(const char *path, CsvRecord **recs, size_t *n);
+
+/**
+ * curに差分を適用した版を作る。インデックスはcurと共有する
+ * returns: 新しい版。メモリが足りない場合NULL
+ */
+extern PostalDB *buildDelta(PostalDB *cur, const CsvRecord *adds, size_t nAdd, const CsvRecord *dels, size_t nDel);
+
+/**
+ * 差分を適用した版から、削除していないレコードを詰め直して全件のインデックスを作り直した版を作る
+ * 前の版とは何も共有しない
+ * options: 新しい版を置くメモリ（POSTAL_NUMBER_MEMORY_*）
+ * returns: 新しい版。メモリが足りない場合NULL
+ */
+extern PostalDB *foldDelta(const PostalDB *src, int options);
+
+#endif /* POSTALDELTA_H */
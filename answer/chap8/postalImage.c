@@ -0,0 +1,480 @@
+#include "postalImage.h"
+#include "textAho.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define HUGE_PAGE_SIZE (2 << 20) /* DBを置く領域の大きさと位置を揃える単位 */
+
+/**
+ * イメージファイルの領域
+ */
+enum {
+    SECTION_RECORDS,
+    SECTION_NORM_RECORDS,
+    SECTION_ARENA,
+    SECTION_GRAM_TABLE,
+    SECTION_POSTING_BLOCKS,
+    SECTION_POSTING_BYTES,
+    SECTION_CODE_TABLE,
+    SECTION_CODE_NEXT,
+    SECTION_CODE_ORDER,
+    SECTION_TEXT_COLUMN,
+    SECTION_TEXT_OFFSETS,
+    SECTION_PREF_VALUES,
+    SECTION_PREF_RANGES,
+    SECTION_PREF_IDS,
+    SECTION_CITY_VALUES,
+    SECTION_CITY_RANGES,
+    SECTION_CITY_IDS,
+    SECTION_COMPLETE_ENTRIES,
+    SECTION_COMPLETE_NODES,
+    SECTION_COMPLETE_TOP,
+    SECTION_GEO_NODES,
+    SECTION_GEO_EDGES,
+    SECTION_GEO_OUTPUTS,
+    SECTION_GEO_RECORDS,
+    N_SECTION
+};
+
+typedef struct {
+    uint64_t offset;        /* ファイル先頭からの位置 */
+    uint64_t size;          /* バイト数 */
+} ImageSection;
+
+#define IMAGE_TMP_SUFFIX ".tmp" /* 書き出し中のイメージファイルの名前に付ける */
+
+/**
+ * イメージファイルのヘッダ
+ * ヘッダの後ろに各領域を8バイト境界に揃えて並べる
+ */
+#define IMAGE_MAGIC "POSTALDB"
+#define IMAGE_VERSION 9
+#define IMAGE_BYTE_ORDER 0x01020304
+
+static uint64_t checksum(uint64_t sum, const void *data, size_t len);
+static int attachImage(PostalDB *db);
+static void *allocRegion(size_t size, int huge, size_t *regionSize, int *backing);
+
+typedef struct {
+    char magic[8];          /* IMAGE_MAGIC */
+    uint32_t version;       /* IMAGE_VERSION */
+    uint32_t byteOrder;     /* 作成した環境のバイト順（IMAGE_BYTE_ORDER）*/
+    uint64_t sourceSize;    /* 元のCSVファイルの大きさ */
+    int64_t sourceMtime;    /* 元のCSVファイルの更新時刻 */
+    uint64_t checksum;      /* ヘッダより後ろの内容のチェックサム */
+    uint64_t totalSize;
+    uint64_t nDb;
+    uint64_t nGram;
+    uint64_t textHasDigit;
+    ImageSection sections[N_SECTION];
+} ImageHeader;
+
+/* チェックサムを計算する。lenは8の倍数 */
+static uint64_t checksum(uint64_t sum, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    for(size_t i = 0; i < len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p+i, 8);
+        sum = (sum ^ w)*0x100000001b3ULL;
+        sum ^= sum >> 29;
+    }
+    return sum;
+}
+
+/**
+ * 領域を8バイト境界に揃えて書き出す
+ * returns: 書き出した領域の位置。失敗した場合0
+ */
+static uint64_t writeSection(FILE *fp, const void *data, size_t len, uint64_t *sum) {
+    static const char pad[8];
+    long off = ftell(fp);
+    size_t padLen = (8-len%8)%8;
+    if((off < 0) || (fwrite(data, 1, len, fp) != len) || (fwrite(pad, 1, padLen, fp) != padLen))
+        return 0;
+    /* 端数の部分は0で埋めたものとしてチェックサムを取る */
+    *sum = checksum(*sum, data, len-len%8);
+    if(padLen > 0) {
+        char last[8] = {0};
+        memcpy(last, (const char *)data+len-len%8, len%8);
+        *sum = checksum(*sum, last, 8);
+    }
+    return (uint64_t)off;
+}
+
+/**
+ * 書き出す各領域の先頭とバイト数を得る
+ */
+static void getSections(const PostalDB *db, const void *data[N_SECTION], size_t size[N_SECTION]) {
+    data[SECTION_RECORDS] = db->records;
+    size[SECTION_RECORDS] = db->nDb*sizeof(Record);
+    data[SECTION_NORM_RECORDS] = db->normRecords;
+    size[SECTION_NORM_RECORDS] = (db->normRecords != NULL) ? db->nDb*sizeof(Record) : 0;
+    data[SECTION_ARENA] = db->arena;
+    size[SECTION_ARENA] = db->arenaSize;
+    data[SECTION_GRAM_TABLE] = db->gramTable;
+    size[SECTION_GRAM_TABLE] = db->gramTableSize*sizeof(GramEntry);
+    data[SECTION_POSTING_BLOCKS] = db->postingBlocks;
+    size[SECTION_POSTING_BLOCKS] = (db->nPostingBlock+1)*sizeof(PostingBlock);
+    data[SECTION_POSTING_BYTES] = db->postingBytes;
+    size[SECTION_POSTING_BYTES] = db->postingBytesSize;
+    data[SECTION_CODE_TABLE] = db->codeTable;
+    size[SECTION_CODE_TABLE] = db->codeTableSize*sizeof(uint32_t);
+    data[SECTION_CODE_NEXT] = db->codeNext;
+    size[SECTION_CODE_NEXT] = db->nDb*sizeof(uint32_t);
+    data[SECTION_CODE_ORDER] = db->codeOrder;
+    size[SECTION_CODE_ORDER] = (db->codeOrder != NULL) ? db->nDb*sizeof(uint32_t) : 0;
+    data[SECTION_TEXT_COLUMN] = db->textColumn;
+    size[SECTION_TEXT_COLUMN] = db->textColumnSize;
+    data[SECTION_TEXT_OFFSETS] = db->textOffsets;
+    size[SECTION_TEXT_OFFSETS] = (db->nDb+1)*sizeof(uint32_t);
+    /* 作らなかった列は大きさ0の領域にする */
+    const FieldDict *dicts[2] = {&db->prefDict, &db->cityDict};
+    for(int i = 0; i < 2; i++) {
+        const FieldDict *dict = dicts[i];
+        int id = (i == 0) ? SECTION_PREF_VALUES : SECTION_CITY_VALUES;
+        int ok = dict->values != NULL;
+        data[id] = dict->values;
+        size[id] = ok ? dict->nValue*sizeof(FieldValue) : 0;
+        data[id+1] = dict->ranges;
+        size[id+1] = ok ? dict->nRange*sizeof(RecordRange) : 0;
+        data[id+2] = dict->ids;
+        size[id+2] = ok ? db->nDb*sizeof(uint16_t) : 0;
+    }
+    /* 入力補完を作らなかった場合も大きさ0の領域にする */
+    data[SECTION_COMPLETE_ENTRIES] = db->completeEntries;
+    size[SECTION_COMPLETE_ENTRIES] = db->nCompleteEntry*sizeof(CompleteEntry);
+    data[SECTION_COMPLETE_NODES] = db->completeNodes;
+    size[SECTION_COMPLETE_NODES] = db->nCompleteNode*sizeof(CompleteNode);
+    data[SECTION_COMPLETE_TOP] = db->completeTop;
+    size[SECTION_COMPLETE_TOP] = db->nCompleteNode*COMPLETE_TOP*sizeof(uint32_t);
+    /* 住所の照合も同様。節は番兵を含めて書く */
+    data[SECTION_GEO_NODES] = db->geo.nodes;
+    size[SECTION_GEO_NODES] = (db->geo.nodes != NULL) ? (db->geo.nNode+1)*sizeof(TextAhoNode) : 0;
+    data[SECTION_GEO_EDGES] = db->geo.edges;
+    size[SECTION_GEO_EDGES] = db->geo.nEdge*sizeof(TextAhoEdge);
+    data[SECTION_GEO_OUTPUTS] = db->geoOutputs;
+    size[SECTION_GEO_OUTPUTS] = db->nGeoOutput*sizeof(GeoOutput);
+    data[SECTION_GEO_RECORDS] = db->geoRecords;
+    size[SECTION_GEO_RECORDS] = db->nGeoRecord*sizeof(uint32_t);
+}
+
+size_t sectionBytes(const PostalDB *db) {
+    const void *data[N_SECTION];
+    size_t size[N_SECTION];
+    getSections(db, data, size);
+    size_t bytes = 0;
+    for(int i = 0; i < N_SECTION; i++)
+        bytes += size[i];
+    return bytes;
+}
+
+int PostalNumberSaveDB(const char *path) {
+    const PostalDB *db = pinLatest();
+    if((db->records == NULL) || (db->gramTable == NULL) || (db->codeTable == NULL) || (db->textColumn == NULL))
+        return 0;
+    if(db->parent != NULL)
+        return 0; /* 差分はインデックスに入っていない */
+    if(path == NULL)
+        path = POSTAL_NUMBER_IMAGE;
+    /* 書きかけのファイルを他のプロセスがマップしないよう、別名で書いてから置き換える */
+    size_t tmpSize = strlen(path)+sizeof(IMAGE_TMP_SUFFIX);
+    char *tmpPath = (char *)malloc(tmpSize);
+    if(tmpPath == NULL)
+        return 0;
+    snprintf(tmpPath, tmpSize, "%s" IMAGE_TMP_SUFFIX, path);
+    FILE *fp = fopen(tmpPath, "wb");
+    if(fp == NULL) {
+        free(tmpPath);
+        return 0;
+    }
+    ImageHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+    h.version = IMAGE_VERSION;
+    h.byteOrder = IMAGE_BYTE_ORDER;
+    struct stat st;
+    if(stat(DBFILE, &st) == 0) {
+        h.sourceSize = (uint64_t)st.st_size;
+        h.sourceMtime = (int64_t)st.st_mtime;
+    }
+    h.nDb = db->nDb;
+    h.nGram = db->nGram;
+    h.textHasDigit = db->textHasDigit;
+    const void *data[N_SECTION];
+    size_t size[N_SECTION];
+    getSections(db, data, size);
+    uint64_t sum = 0;
+    int ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    for(int i = 0; ok && (i < N_SECTION); i++) {
+        h.sections[i].size = size[i];
+        ok = (h.sections[i].offset = writeSection(fp, data[i], size[i], &sum)) != 0;
+    }
+    if(ok) {
+        /* 全部書けたらヘッダを完成させる */
+        h.checksum = sum;
+        h.totalSize = (uint64_t)ftell(fp);
+        ok = (fseek(fp, 0, SEEK_SET) == 0) && (fwrite(&h, sizeof(h), 1, fp) == 1);
+    }
+    if(fclose(fp) != 0)
+        ok = 0;
+    if(ok)
+        ok = rename(tmpPath, path) == 0;
+    if(!ok)
+        unlink(tmpPath);
+    free(tmpPath);
+    return ok;
+}
+
+/* 領域がイメージの中に収まっているか調べる */
+static int inImage(const ImageHeader *h, const ImageSection *sec) {
+    return (sec->offset >= sizeof(ImageHeader)) && (sec->offset%8 == 0)
+        && (sec->offset <= h->totalSize) && (sec->size <= h->totalSize-sec->offset);
+}
+
+/* 2のべき乗個の要素からなる領域か調べる */
+static int isPowerOfTwoArray(const ImageSection *sec, size_t elemSize) {
+    uint64_t n = sec->size/elemSize;
+    return (sec->size%elemSize == 0) && (n > 0) && ((n & (n-1)) == 0);
+}
+
+/**
+ * イメージ中の列を取り出す。大きさ0の領域なら列は無い
+ * returns: 大きさが正しければ1
+ */
+static int mapFieldDict(const PostalDB *db, FieldDict *dict, char *base, const ImageSection *sec) {
+    memset(dict, 0, sizeof(*dict));
+    if(sec[0].size == 0)
+        return (sec[1].size == 0) && (sec[2].size == 0);
+    if((sec[0].size%sizeof(FieldValue) != 0) || (sec[1].size%sizeof(RecordRange) != 0)
+       || (sec[2].size != db->nDb*sizeof(uint16_t)))
+        return 0;
+    dict->values = (FieldValue *)(base+sec[0].offset);
+    dict->nValue = sec[0].size/sizeof(FieldValue);
+    dict->ranges = (RecordRange *)(base+sec[1].offset);
+    dict->nRange = sec[1].size/sizeof(RecordRange);
+    dict->ids = (uint16_t *)(base+sec[2].offset);
+    return 1;
+}
+
+/**
+ * ファイル全体をallocRegionで確保した領域に読み込み、読み取り専用にする
+ * returns: 領域の先頭。失敗した場合NULL
+ */
+static void *readImage(int fd, size_t size, int huge, size_t *regionSize, int *backing) {
+    char *p = (char *)allocRegion(size, huge, regionSize, backing);
+    if(p == NULL)
+        return NULL;
+    for(size_t done = 0; done < size; ) {
+        ssize_t n = pread(fd, p+done, size-done, (off_t)done);
+        if(n <= 0) {
+            munmap(p, *regionSize);
+            return NULL;
+        }
+        done += (size_t)n;
+    }
+    mprotect(p, *regionSize, PROT_READ);
+    return p;
+}
+
+PostalDB *mapImage(int huge) {
+    int fd = open(POSTAL_NUMBER_IMAGE, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+    struct stat st;
+    if((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(ImageHeader))) {
+        close(fd);
+        return NULL;
+    }
+    size_t mapSize = (size_t)st.st_size, regionSize = mapSize;
+    int backing = POSTAL_NUMBER_BACKING_FILE;
+    void *p = huge ? readImage(fd, mapSize, 1, &regionSize, &backing) : mmap(NULL, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); /* マップはcloseしても残る */
+    if((p == MAP_FAILED) || (p == NULL))
+        return NULL;
+    const ImageHeader *h = (const ImageHeader *)p;
+    const ImageSection *sec = h->sections;
+    int ok = (memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) == 0)
+        && (h->version == IMAGE_VERSION)
+        && (h->byteOrder == IMAGE_BYTE_ORDER)
+        && (h->totalSize == (uint64_t)mapSize)
+        && (h->nDb < UINT32_MAX);
+    for(int i = 0; ok && (i < N_SECTION); i++)
+        ok = inImage(h, &sec[i]);
+    ok = ok && (sec[SECTION_RECORDS].size == h->nDb*sizeof(Record))
+        && (sec[SECTION_NORM_RECORDS].size == h->nDb*sizeof(Record))
+        && (sec[SECTION_ARENA].size > 0)
+        && isPowerOfTwoArray(&sec[SECTION_GRAM_TABLE], sizeof(GramEntry))
+        && (sec[SECTION_POSTING_BLOCKS].size%sizeof(PostingBlock) == 0)
+        && (sec[SECTION_POSTING_BLOCKS].size > 0)
+        && isPowerOfTwoArray(&sec[SECTION_CODE_TABLE], sizeof(uint32_t))
+        && (sec[SECTION_CODE_NEXT].size == h->nDb*sizeof(uint32_t))
+        && ((sec[SECTION_CODE_ORDER].size == 0) || (sec[SECTION_CODE_ORDER].size == h->nDb*sizeof(uint32_t)))
+        && (sec[SECTION_TEXT_OFFSETS].size == (h->nDb+1)*sizeof(uint32_t))
+        && (sec[SECTION_COMPLETE_ENTRIES].size%sizeof(CompleteEntry) == 0)
+        && (sec[SECTION_COMPLETE_NODES].size%sizeof(CompleteNode) == 0)
+        && (sec[SECTION_COMPLETE_TOP].size == sec[SECTION_COMPLETE_NODES].size/sizeof(CompleteNode)*COMPLETE_TOP*sizeof(uint32_t))
+        && (sec[SECTION_GEO_NODES].size%sizeof(TextAhoNode) == 0)
+        && (sec[SECTION_GEO_EDGES].size%sizeof(TextAhoEdge) == 0)
+        && (sec[SECTION_GEO_OUTPUTS].size%sizeof(GeoOutput) == 0)
+        && (sec[SECTION_GEO_RECORDS].size%sizeof(uint32_t) == 0);
+    /* 元のCSVが更新されていたら作り直しが必要 */
+    if(ok && (stat(DBFILE, &st) == 0))
+        ok = (h->sourceSize == (uint64_t)st.st_size) && (h->sourceMtime == (int64_t)st.st_mtime);
+    if(ok) {
+        const char *base = (const char *)p;
+        const ImageSection *a = &sec[SECTION_ARENA];
+        ok = (checksum(0, base+sizeof(ImageHeader), h->totalSize-sizeof(ImageHeader)) == h->checksum)
+            && (base[a->offset+a->size-1] == '\0');
+    }
+    PostalDB *db = ok ? (PostalDB *)calloc(1, sizeof(PostalDB)) : NULL;
+    if(db == NULL) {
+        munmap(p, regionSize);
+        return NULL;
+    }
+    db->image = p;
+    db->imageSize = regionSize;
+    db->backing = backing;
+    if(!attachImage(db)) {
+        freeSnapshot(db);
+        return NULL;
+    }
+    return db;
+}
+
+/**
+ * db->imageにあるイメージの各領域をDBとインデックスとして使う
+ * 範囲外を参照しないよう、テキスト列の区切りとブロック列の番兵が正しいことを確かめる
+ * returns: 正しければ1
+ */
+static int attachImage(PostalDB *db) {
+    char *base = (char *)db->image;
+    const ImageHeader *h = (const ImageHeader *)base;
+    const ImageSection *sec = h->sections;
+    db->nDb = db->nIndexed = h->nDb;
+    db->nGram = h->nGram;
+    db->textHasDigit = (int)h->textHasDigit;
+    db->records = (Record *)(base+sec[SECTION_RECORDS].offset);
+    db->normRecords = (Record *)(base+sec[SECTION_NORM_RECORDS].offset);
+    db->arena = base+sec[SECTION_ARENA].offset;
+    db->arenaSize = sec[SECTION_ARENA].size;
+    db->gramTable = (GramEntry *)(base+sec[SECTION_GRAM_TABLE].offset);
+    db->gramTableSize = sec[SECTION_GRAM_TABLE].size/sizeof(GramEntry);
+    db->postingBlocks = (PostingBlock *)(base+sec[SECTION_POSTING_BLOCKS].offset);
+    db->nPostingBlock = sec[SECTION_POSTING_BLOCKS].size/sizeof(PostingBlock)-1;
+    db->postingBytes = (uint8_t *)(base+sec[SECTION_POSTING_BYTES].offset);
+    db->postingBytesSize = sec[SECTION_POSTING_BYTES].size;
+    db->codeTable = (uint32_t *)(base+sec[SECTION_CODE_TABLE].offset);
+    db->codeTableSize = sec[SECTION_CODE_TABLE].size/sizeof(uint32_t);
+    db->codeNext = (uint32_t *)(base+sec[SECTION_CODE_NEXT].offset);
+    if(sec[SECTION_CODE_ORDER].size > 0)
+        db->codeOrder = (uint32_t *)(base+sec[SECTION_CODE_ORDER].offset);
+    db->textColumn = base+sec[SECTION_TEXT_COLUMN].offset;
+    db->textColumnSize = sec[SECTION_TEXT_COLUMN].size;
+    db->textOffsets = (uint32_t *)(base+sec[SECTION_TEXT_OFFSETS].offset);
+    if(sec[SECTION_COMPLETE_ENTRIES].size > 0) {
+        db->completeEntries = (CompleteEntry *)(base+sec[SECTION_COMPLETE_ENTRIES].offset);
+        db->nCompleteEntry = sec[SECTION_COMPLETE_ENTRIES].size/sizeof(CompleteEntry);
+        db->completeNodes = (CompleteNode *)(base+sec[SECTION_COMPLETE_NODES].offset);
+        db->nCompleteNode = sec[SECTION_COMPLETE_NODES].size/sizeof(CompleteNode);
+        db->completeTop = (uint32_t *)(base+sec[SECTION_COMPLETE_TOP].offset);
+    }
+    if(sec[SECTION_GEO_NODES].size > 0) {
+        db->geo.nodes = (TextAhoNode *)(base+sec[SECTION_GEO_NODES].offset);
+        db->geo.nNode = sec[SECTION_GEO_NODES].size/sizeof(TextAhoNode)-1;
+        db->geo.edges = (TextAhoEdge *)(base+sec[SECTION_GEO_EDGES].offset);
+        db->geo.nEdge = sec[SECTION_GEO_EDGES].size/sizeof(TextAhoEdge);
+        db->geoOutputs = (GeoOutput *)(base+sec[SECTION_GEO_OUTPUTS].offset);
+        db->nGeoOutput = sec[SECTION_GEO_OUTPUTS].size/sizeof(GeoOutput);
+        db->geoRecords = (uint32_t *)(base+sec[SECTION_GEO_RECORDS].offset);
+        db->nGeoRecord = sec[SECTION_GEO_RECORDS].size/sizeof(uint32_t);
+    }
+    return (db->textOffsets[0] == 0) && (db->textOffsets[db->nDb] == db->textColumnSize)
+        && (db->postingBlocks[db->nPostingBlock].offset == db->postingBytesSize)
+        && ((db->geo.nodes == NULL) || (db->geo.nodes[db->geo.nNode].edge == db->geo.nEdge))
+        && mapFieldDict(db, &db->prefDict, base, &sec[SECTION_PREF_VALUES])
+        && mapFieldDict(db, &db->cityDict, base, &sec[SECTION_CITY_VALUES]);
+}
+
+/**
+ * 大きさsizeの読み書きできる匿名領域を確保する。大きさと位置はHUGE_PAGE_SIZEに揃える
+ * huge: MAP_HUGETLBで確保する。できなければ透過的ヒュージページを使うようmadviseする
+ * regionSize: 確保した大きさを格納する場所
+ * backing: 領域のメモリ（POSTAL_NUMBER_BACKING_*）を格納する場所
+ * returns: 領域の先頭。失敗した場合NULL
+ */
+static void *allocRegion(size_t size, int huge, size_t *regionSize, int *backing) {
+    size_t len = (size+HUGE_PAGE_SIZE-1)/HUGE_PAGE_SIZE*HUGE_PAGE_SIZE;
+#ifdef MAP_HUGETLB
+    if(huge) {
+        /* 前もって予約されたヒュージページが足りなければ失敗する */
+        void *p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if(p != MAP_FAILED) {
+            *regionSize = len;
+            *backing = POSTAL_NUMBER_BACKING_HUGETLB;
+            return p;
+        }
+    }
+#endif
+    /* ヒュージページの境界から始まるよう、余分に取ってから前後を返す */
+    char *raw = (char *)mmap(NULL, len+HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(raw == MAP_FAILED)
+        return NULL;
+    char *p = (char *)(((uintptr_t)raw+HUGE_PAGE_SIZE-1) & ~(uintptr_t)(HUGE_PAGE_SIZE-1));
+    if(p > raw)
+        munmap(raw, (size_t)(p-raw));
+    if(raw+HUGE_PAGE_SIZE > p)
+        munmap(p+len, (size_t)(raw+HUGE_PAGE_SIZE-p));
+    *regionSize = len;
+    *backing = POSTAL_NUMBER_BACKING_PAGES;
+#ifdef MADV_HUGEPAGE
+    if(huge && (madvise(p, len, MADV_HUGEPAGE) == 0))
+        *backing = POSTAL_NUMBER_BACKING_THP;
+#endif
+    return p;
+}
+
+int packSnapshot(PostalDB *db, int huge) {
+    if((db->nDb == 0) || (db->records == NULL) || (db->gramTable == NULL) || (db->codeTable == NULL)
+       || (db->textColumn == NULL))
+        return 0;
+    const void *data[N_SECTION];
+    size_t size[N_SECTION];
+    getSections(db, data, size);
+    ImageHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+    h.version = IMAGE_VERSION;
+    h.byteOrder = IMAGE_BYTE_ORDER;
+    h.nDb = db->nDb;
+    h.nGram = db->nGram;
+    h.textHasDigit = db->textHasDigit;
+    uint64_t off = sizeof(h);
+    for(int i = 0; i < N_SECTION; i++) {
+        h.sections[i].offset = off;
+        h.sections[i].size = size[i];
+        off += (size[i]+7)/8*8;
+    }
+    h.totalSize = off;
+    size_t regionSize;
+    int backing;
+    char *base = (char *)allocRegion((size_t)h.totalSize, huge, &regionSize, &backing);
+    if(base == NULL)
+        return 0;
+    memcpy(base, &h, sizeof(h));
+    for(int i = 0; i < N_SECTION; i++) {
+        if(size[i] > 0)
+            memcpy(base+h.sections[i].offset, data[i], size[i]);
+    }
+    mprotect(base, regionSize, PROT_READ);
+    freeArrays(db);
+    db->image = base;
+    db->imageSize = regionSize;
+    db->backing = backing;
+    return attachImage(db); /* 写したばかりなので必ず正しい */
+}
@@ -0,0 +1,28 @@
+#ifndef POSTALIMAGE_H
+#define POSTALIMAGE_H
+
+#include "postalDB.h"
+
+/**
+ * イメージと同じ並びに置く領域の大きさの和を求める
+ */
+extern size_t sectionBytes(const PostalDB *db);
+
+/**
+ * イメージファイルを読み取り専用でマップし、DBとインデックスとして使う。
+ * 複数のプロセスが同じイメージをマップすれば物理ページは共有される
+ * huge: マップせずにヒュージページの領域に読み込む。物理ページは共有されない
+ * returns: スナップショット。無い、壊れている、元のCSVより古い場合NULL
+ */
+extern PostalDB *mapImage(int huge);
+
+/**
+ * 配列ごとに確保したDBとインデックスを、イメージファイルと同じ並びで1つの領域に詰め直す
+ * 大きな配列を連続した領域に集めるので、ヒュージページに載せたりまとめてmlockしたりできる
+ * 詰め直した後はイメージファイルを読み込んだ場合と同じに扱う
+ * huge: ヒュージページの領域にする
+ * returns: 成功した場合1。作れなかったインデックスがあるかメモリが足りない場合0で、dbは元のまま
+ */
+extern int packSnapshot(PostalDB *db, int huge);
+
+#endif /* POSTALIMAGE_H */
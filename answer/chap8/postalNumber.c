@@ -1,95 +1,2372 @@
-#include "postalNumber.h"
-#include <stdio.h>
+#include "postalDB.h"
+#include "postalImage.h"
+#include "postalDelta.h"
+#include "postalAddress.h"
+#include "postalQuery.h"
+#include "scanPool.h"
+#include "textMatch.h"
+#include "textNorm.h"
+#include "roaring.h"
+#include "csvScan.h"
+#include "textApprox.h"
+#include "textAho.h"
+#include "textFM.h"
+#include <stdlib.h>
+#include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
 
+#define MAX_LOAD_THREADS 64 /* CSV読み込みスレッド数の上限 */
+#define REF_BATCH 64 /* PostalNumberSearchで最初に探すレコード数 */
+#define REF_BATCH_MAX 1024 /* PostalNumberSearchで一度に探すレコード数の上限。この分の作業領域をスタックに取る */
+#define MAX_SCAN_THREADS 64 /* 全件検索スレッド数の上限 */
+#define PARALLEL_SCAN_MIN 16384 /* これより少ない範囲は並列化せずに調べる */
+#define POSTING_BLOCK 128 /* 圧縮したレコード番号列を区切る件数 */
+#define COUNT_GRAM_LISTS 2 /* 数えるときに積を取るgramの列の数の上限 */
+#define DELTA_FOLD_RECORDS 1024 /* 差分で追加したレコードがこれより多くなったらインデックスを作り直す */
+#define FUZZY_MAX_DISTANCE 3 /* あいまい検索で許す編集距離の上限 */
+#define IDEOGRAPHIC_SPACE "\xe3\x80\x80" /* 全角空白。検索キーの区切りとして扱う */
+#define CODE_SORT_MAX 4096 /* 郵便番号の範囲の該当がこれより多ければ並べ替えずにビット列で整列する */
 
-#define DBFILE "KEN_ALL_UTF8.CSV"
-#define MAX_RECORDS 150000
+/* あいまい検索で見つかったレコードと編集距離 */
+typedef struct {
+    uint32_t rec;
+    int distance;
+} FuzzyHit;
 
-static PostalNumber db[MAX_RECORDS];
-static size_t nDb = 0;
+int isCompact(const PostalDB *db) {
+    return db->fm.n > 0;
+}
+
+const char *codeOf(const PostalDB *db, uint32_t rec) {
+    return STR(db, (db->normRecords != NULL) ? db->normRecords[rec].code : db->records[rec].code);
+}
+
+/**
+ * CSV読み込みスレッドごとのデータ
+ */
+typedef struct {
+    pthread_t thread;
+    const char *begin;  /* 担当範囲の先頭 */
+    const char *end;    /* 担当範囲の終わり */
+    StringPool pool;    /* 担当範囲内で重複を除いた文字列 */
+    Record *records;    /* 各フィールドはpool中の文字列番号 */
+    Record *normRecords;
+    size_t nRecords;
+    int failed;         /* メモリ不足 */
+} LoadChunk;
+
+static PostalNumberLoadStat loadStat;
+static int memoryOptions = 0; /* POSTAL_NUMBER_MEMORY_*。loadMutexの中で読み書きする */
+
+/* インデックスを使えない検索で全件を並列に調べるスレッドプール */
+static ScanPool *scanPool = NULL;
+static int scanThreads = 0; /* 0ならCPU数 */
+static pthread_mutex_t scanPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * 公開中のスナップショット。差し替えはdbMutexの中で行う。
+ * 各スレッドは使っているスナップショットをpinKeyに保持し、参照数で解放を遅らせる
+ */
+static PostalDB *currentDB = NULL;
+static uint64_t dbVersion = 0;
+static pthread_mutex_t dbMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t loadMutex = PTHREAD_MUTEX_INITIALIZER; /* 取り込みは一度に1つ */
+static pthread_key_t pinKey;
+static pthread_once_t pinOnce = PTHREAD_ONCE_INIT;
+static PostalDB emptyDB; /* 取り込む前に検索された場合に使う */
+
+/**
+ * スナップショットの参照を1つ手放す。最後の参照なら解放する
+ */
+static void releaseDB(PostalDB *db) {
+    if((db != NULL) && (db != &emptyDB) && (__atomic_sub_fetch(&db->refCount, 1, __ATOMIC_ACQ_REL) == 0))
+        freeSnapshot(db);
+}
+
+static void unpinThread(void *arg) {
+    releaseDB((PostalDB *)arg);
+}
+
+static void initPinKey(void) {
+    pthread_key_create(&pinKey, unpinThread); /* スレッド終了時に手放す */
+}
+
+PostalDB *pinLatest(void) {
+    pthread_once(&pinOnce, initPinKey);
+    PostalDB *db = (PostalDB *)pthread_getspecific(pinKey);
+    PostalDB *latest = __atomic_load_n(&currentDB, __ATOMIC_ACQUIRE);
+    if((db != NULL) && (db == ((latest != NULL) ? latest : &emptyDB)))
+        return db;
+    /* 差し替えと参照数の増加が入れ違わないようにロックする */
+    pthread_mutex_lock(&dbMutex);
+    latest = currentDB;
+    if(latest != NULL)
+        __atomic_add_fetch(&latest->refCount, 1, __ATOMIC_RELAXED);
+    else
+        latest = &emptyDB;
+    pthread_mutex_unlock(&dbMutex);
+    pthread_setspecific(pinKey, latest);
+    releaseDB(db);
+    return latest;
+}
+
+/**
+ * このスレッドが使っているスナップショットを得る。まだ無ければ最新のものを使う
+ */
+static PostalDB *pinned(void) {
+    pthread_once(&pinOnce, initPinKey);
+    PostalDB *db = (PostalDB *)pthread_getspecific(pinKey);
+    return (db != NULL) ? db : pinLatest();
+}
+
+/**
+ * スナップショットを公開し、前のものは参照が無くなった時に解放する
+ */
+static void publishDB(PostalDB *db) {
+    db->refCount = 1; /* currentDBからの参照 */
+    pthread_mutex_lock(&dbMutex);
+    PostalDB *old = currentDB;
+    db->version = ++dbVersion;
+    __atomic_store_n(&currentDB, db, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&dbMutex);
+    releaseDB(old);
+}
+
+static char *normalizeQuery(const char *key);
+static size_t searchRecords(const PostalDB *db, const char *key, uint32_t start, uint32_t *result, size_t resultSize);
+static size_t searchIndexed(const PostalDB *db, const char *key, uint32_t start, uint32_t *result, size_t resultSize);
+static void toPostalNumber(const PostalDB *db, const Record *rec, PostalNumber *dst);
+static int loadCSV(PostalDB *db, int nThread);
+static double now(void);
+static size_t strHash(const char *str);
+static void buildTextColumn(PostalDB *db);
+static void freeTextColumn(PostalDB *db);
+static void buildFieldDict(const PostalDB *db, FieldDict *dict, int field);
+static void freeFieldDict(FieldDict *dict);
+static void buildCodeIndex(PostalDB *db);
+static void buildCodeOrder(PostalDB *db);
+static void freeCodeIndex(PostalDB *db);
+static void buildGramIndex(PostalDB *db);
+static int compressPostings(PostalDB *db, const uint32_t *postings);
+static void freeGramIndex(PostalDB *db);
+static size_t searchByGramIndex(const PostalDB *db, const char *key, uint32_t start, uint32_t *result, size_t resultSize);
+static size_t countRecords(const PostalDB *db, const char *key, size_t limit);
+static size_t searchFuzzy(const PostalDB *db, const char *key, int maxDistance, size_t limit, FuzzyHit **hits);
+static int searchBatch(const PostalDB *db, char **keys, size_t n, uint32_t *result, size_t resultSize, size_t *counts);
+static void buildFMIndex(PostalDB *db);
+static int compactArena(PostalDB *db);
+
+/**
+ * CSVファイルを読み込んでスナップショットを作る
+ * compact: インデックスの代わりにFM-indexを作る
+ * returns: スナップショット。CSVを読めないかメモリが足りない場合NULL
+ */
+static PostalDB *buildSnapshot(int nThread, int compact) {
+    memset(&loadStat, 0, sizeof(loadStat));
+    double start = now();
+    PostalDB *db = (PostalDB *)calloc(1, sizeof(PostalDB));
+    if(db == NULL)
+        return NULL;
+    if(nThread <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nThread = (n > 0) ? (int)n : 1;
+    }
+    if(nThread > MAX_LOAD_THREADS)
+        nThread = MAX_LOAD_THREADS;
+    if(!loadCSV(db, nThread)) {
+        freeDB(db);
+        free(db);
+        return NULL;
+    }
+    double indexStart = now();
+    buildIndexes(db, compact);
+    double end = now();
+    loadStat.indexSec = end-indexStart;
+    loadStat.totalSec = end-start;
+    loadStat.records = db->nDb;
+    return db;
+}
 
-static void trim(const char *str, char *dst, size_t dstSize);
-static char *fetch(char *str);
+void buildIndexes(PostalDB *db, int compact) {
+    buildTextColumn(db);
+    buildCodeIndex(db);
+    if(compact)
+        buildFMIndex(db);
+    else {
+        buildGramIndex(db);
+        buildFieldDict(db, &db->prefDict, FIELD_PREF);
+        buildFieldDict(db, &db->cityDict, FIELD_CITY);
+        buildCompleteIndex(db);
+        buildGeocodeIndex(db);
+    }
+    db->nIndexed = db->nDb;
+}
 
+/**
+ * DBを取り込んで公開する
+ * useImage: 最新のイメージファイルがあればそれをマップする
+ * keepOld: 1件も取り込めなかった場合は公開せず、今のDBを使い続ける
+ * returns: 取り込んだレコード数
+ */
+static size_t loadDB(int nThread, int useImage, int keepOld) {
+    pthread_mutex_lock(&loadMutex);
+    double start = now();
+    int huge = (memoryOptions & POSTAL_NUMBER_MEMORY_HUGE) != 0;
+    int compact = (memoryOptions & POSTAL_NUMBER_MEMORY_COMPACT) != 0;
+    PostalDB *db = (useImage && !compact) ? mapImage(huge) : NULL; /* イメージはFM-indexを持たない */
+    if(db != NULL) {
+        memset(&loadStat, 0, sizeof(loadStat));
+        loadStat.fromImage = 1;
+        loadStat.records = db->nDb;
+    } else if(((db = buildSnapshot(nThread, compact)) != NULL) && (memoryOptions != 0) && !compact)
+        packSnapshot(db, huge); /* 詰め直せなければ配列ごとに確保したまま使う */
+    if(db != NULL) {
+        if((memoryOptions & POSTAL_NUMBER_MEMORY_LOCK) && (db->image != NULL))
+            db->locked = mlock(db->image, db->imageSize) == 0;
+        loadStat.memoryBytes = sectionBytes(db)+TextFMSize(&db->fm);
+        loadStat.backing = db->backing;
+        loadStat.locked = db->locked;
+        loadStat.totalSec = now()-start;
+    }
+    size_t n = 0;
+    if((db != NULL) && ((db->nDb > 0) || !keepOld)) {
+        n = db->nDb;
+        publishDB(db);
+    } else if(db != NULL)
+        freeSnapshot(db);
+    pthread_mutex_unlock(&loadMutex);
+    return n;
+}
 
 size_t PostalNumberLoadDB() {
-    nDb = 0;
-    FILE *fp = fopen(DBFILE, "r");
-    if(fp == NULL)
-        return nDb;
-    char buf[1024], *cp, *xcp;
-    while(fgets(buf, sizeof(buf)-1, fp) != NULL) {
-        buf[sizeof(buf)-1] = '\0';
-        cp = buf;
-        /* 3番目のフィールドがcode */
-        cp = fetch(cp);
-        cp = fetch(cp);
-        xcp = fetch(cp);
-        trim(cp, db[nDb].code, sizeof(db[nDb].code));
-        if(db[nDb].code[0] == '\0')
+    return loadDB(0, 1, 0);
+}
+
+size_t PostalNumberLoadDBParallel(int nThread) {
+    return loadDB(nThread, 0, 0);
+}
+
+size_t PostalNumberReloadDB(void) {
+    return loadDB(0, 1, 1);
+}
+
+uint64_t PostalNumberVersion(void) {
+    pthread_mutex_lock(&dbMutex);
+    uint64_t version = (currentDB != NULL) ? currentDB->version : 0;
+    pthread_mutex_unlock(&dbMutex);
+    return version;
+}
+
+void PostalNumberRelease(void) {
+    pthread_once(&pinOnce, initPinKey);
+    PostalDB *db = (PostalDB *)pthread_getspecific(pinKey);
+    pthread_setspecific(pinKey, NULL);
+    releaseDB(db);
+}
+
+void PostalNumberGetLoadStat(PostalNumberLoadStat *stat) {
+    *stat = loadStat;
+}
+
+void PostalNumberSetMemoryOptions(int options) {
+    pthread_mutex_lock(&loadMutex);
+    memoryOptions = options;
+    pthread_mutex_unlock(&loadMutex);
+}
+
+const char *PostalNumberBackingName(int backing) {
+    switch(backing) {
+    case POSTAL_NUMBER_BACKING_HEAP:
+        return "heap";
+    case POSTAL_NUMBER_BACKING_FILE:
+        return "file mapping";
+    case POSTAL_NUMBER_BACKING_PAGES:
+        return "anonymous pages";
+    case POSTAL_NUMBER_BACKING_THP:
+        return "transparent huge pages";
+    case POSTAL_NUMBER_BACKING_HUGETLB:
+        return "hugetlb";
+    default:
+        return "unknown";
+    }
+}
+
+size_t PostalNumberSearch(const char *key, PostalNumber *result, size_t resultSize) {
+    /* 少しずつレコード番号で検索し、見つかったものだけを展開する。
+       続きがあれば一度に探す数を倍にして、検索し直す回数を抑える */
+    const PostalDB *db = pinLatest();
+    char *norm = normalizeQuery(key);
+    size_t count = 0, batch = REF_BATCH;
+    if((norm != NULL) && isCompact(db)) {
+        /* FM-indexは該当を全て求めてから並べるので、少しずつ探すと毎回求め直すことになる。1度で求める */
+        uint32_t *recs;
+        size_t n = locateAll(db, norm, &recs);
+        for(size_t i = 0; (n != (size_t)-1) && (i < n) && (count < resultSize); i++)
+            toPostalNumber(db, &db->records[recs[i]], &result[count++]);
+        free(recs);
+        free(norm);
+        return count;
+    }
+    PostalNumberRef refs[REF_BATCH_MAX];
+    uint32_t start = 0;
+    while((norm != NULL) && (count < resultSize)) {
+        size_t want = resultSize-count;
+        if(want > batch)
+            want = batch;
+        size_t n = searchRecords(db, norm, start, refs, want);
+        for(size_t i = 0; i < n; i++)
+            toPostalNumber(db, &db->records[refs[i]], &result[count++]);
+        if(n < want)
+            break;
+        start = refs[n-1]+1;
+        if(batch < REF_BATCH_MAX)
+            batch *= 2;
+    }
+    free(norm);
+    return count;
+}
+
+size_t PostalNumberSearchRef(const char *key, PostalNumberRef *result, size_t resultSize) {
+    const PostalDB *db = pinLatest();
+    char *norm = normalizeQuery(key);
+    size_t n = (norm != NULL) ? searchRecords(db, norm, 0, result, resultSize) : 0;
+    free(norm);
+    return n;
+}
+
+int PostalNumberSearchBatch(const char *const *keys, size_t n, PostalNumberRef *result, size_t resultSize, size_t *counts) {
+    const PostalDB *db = pinLatest();
+    char **norms = (char **)calloc(n > 0 ? n : 1, sizeof(char *));
+    int ok = (norms != NULL);
+    for(size_t i = 0; ok && (i < n); i++)
+        ok = ((norms[i] = normalizeQuery(keys[i])) != NULL);
+    ok = ok && searchBatch(db, norms, n, result, resultSize, counts);
+    for(size_t i = 0; (norms != NULL) && (i < n); i++)
+        free(norms[i]);
+    free(norms);
+    if(!ok) {
+        for(size_t i = 0; i < n; i++)
+            counts[i] = 0;
+    }
+    return ok;
+}
+
+size_t PostalNumberCount(const char *key) {
+    const PostalDB *db = pinLatest();
+    char *norm = normalizeQuery(key);
+    size_t n = (norm != NULL) ? countRecords(db, norm, SIZE_MAX) : 0;
+    free(norm);
+    return n;
+}
+
+int PostalNumberExists(const char *key) {
+    const PostalDB *db = pinLatest();
+    char *norm = normalizeQuery(key);
+    int found = (norm != NULL) && (countRecords(db, norm, 1) > 0);
+    free(norm);
+    return found;
+}
+
+int PostalNumberHasFeature(int feature) {
+    const PostalDB *db = pinLatest();
+    switch(feature) {
+    case POSTAL_NUMBER_FEATURE_FUZZY:
+    case POSTAL_NUMBER_FEATURE_COMPLETE:
+    case POSTAL_NUMBER_FEATURE_GEOCODE:
+        return !isCompact(db);
+    default:
+        return 0;
+    }
+}
+
+size_t PostalNumberSearchFuzzy(const char *key, int maxDistance, PostalNumberRef *result, int *distance, size_t resultSize) {
+    const PostalDB *db = pinLatest();
+    if(isCompact(db)) {
+        errno = ENOTSUP; /* レコードごとの正規化した文字列を持たない */
+        return 0;
+    }
+    if(maxDistance < 0)
+        maxDistance = 0;
+    if(maxDistance > FUZZY_MAX_DISTANCE)
+        maxDistance = FUZZY_MAX_DISTANCE;
+    /* 語の区切りは解釈せず、空白を除いた全体を1つの文字列として比べる */
+    char *norm = strdup(key);
+    if(norm == NULL)
+        return 0;
+    TextNormalize(norm, norm);
+    FuzzyHit *hits;
+    size_t n = searchFuzzy(db, norm, maxDistance, resultSize, &hits);
+    for(size_t i = 0; i < n; i++) {
+        result[i] = hits[i].rec;
+        if(distance != NULL)
+            distance[i] = hits[i].distance;
+    }
+    free(hits);
+    free(norm);
+    return n;
+}
+
+void PostalNumberCursorInit(PostalNumberCursor *cursor) {
+    cursor->next = 0;
+    cursor->done = 0;
+    cursor->version = pinLatest()->version; /* 続きも同じスナップショットから取り出す */
+}
+
+size_t PostalNumberSearchNext(const char *key, PostalNumberCursor *cursor, PostalNumberRef *result, size_t resultSize) {
+    const PostalDB *db = pinned();
+    if(db->version != cursor->version)
+        cursor->done = 1; /* レコード番号が別の版を指している */
+    if(cursor->done || (resultSize == 0))
+        return 0;
+    char *norm = normalizeQuery(key);
+    if(norm == NULL)
+        return 0;
+    size_t n = searchRecords(db, norm, cursor->next, result, resultSize);
+    free(norm);
+    if(n < resultSize)
+        cursor->done = 1; /* 最後まで調べた */
+    else
+        cursor->next = result[n-1]+1;
+    return n;
+}
+
+const char *PostalNumberCode(PostalNumberRef ref) {
+    const PostalDB *db = pinned();
+    return STR(db, db->records[ref].code);
+}
+
+const char *PostalNumberPref(PostalNumberRef ref) {
+    const PostalDB *db = pinned();
+    return STR(db, db->records[ref].pref);
+}
+
+const char *PostalNumberCity(PostalNumberRef ref) {
+    const PostalDB *db = pinned();
+    return STR(db, db->records[ref].city);
+}
+
+const char *PostalNumberTown(PostalNumberRef ref) {
+    const PostalDB *db = pinned();
+    return STR(db, db->records[ref].town);
+}
+
+const char *PostalNumberPrefKana(PostalNumberRef ref) {
+    const PostalDB *db = pinned();
+    return STR(db, db->records[ref].prefKana);
+}
+
+const char *PostalNumberCityKana(PostalNumberRef ref) {
+    const PostalDB *db = pinned();
+    return STR(db, db->records[ref].cityKana);
+}
+
+const char *PostalNumberTownKana(PostalNumberRef ref) {
+    const PostalDB *db = pinned();
+    return STR(db, db->records[ref].townKana);
+}
+
+int PostalNumberNormalizeKey(const char *key, char *dst, size_t dstSize) {
+    char *norm = normalizeQuery(key);
+    if(norm == NULL)
+        return 0;
+    size_t len = strlen(norm);
+    int ok = len < dstSize;
+    if(ok)
+        memcpy(dst, norm, len+1);
+    free(norm);
+    return ok;
+}
+
+/**
+ * 検索キーを記録と比べられる形にする
+ * 空白（全角を含む）で区切った各語をTextNormalizeし、1つの半角空白でつなぐ
+ * returns: 正規化したキー（使い終わったらfreeする）。メモリが足りない場合NULL
+ */
+static char *normalizeQuery(const char *key) {
+    size_t len = strlen(key);
+    char *norm = (char *)malloc(len+1);
+    if(norm == NULL)
+        return NULL;
+    char *d = norm;
+    const char *cp = key;
+    while(*cp != '\0') {
+        while(isQuerySpace(*cp) || (strncmp(cp, IDEOGRAPHIC_SPACE, strlen(IDEOGRAPHIC_SPACE)) == 0))
+            cp += isQuerySpace(*cp) ? 1 : strlen(IDEOGRAPHIC_SPACE);
+        const char *word = cp;
+        while((*cp != '\0') && !isQuerySpace(*cp) && (strncmp(cp, IDEOGRAPHIC_SPACE, strlen(IDEOGRAPHIC_SPACE)) != 0))
+            cp++;
+        if(cp == word)
+            break;
+        if(d > norm)
+            *(d++) = ' ';
+        memcpy(d, word, (size_t)(cp-word));
+        d[cp-word] = '\0';
+        d += TextNormalize(d, d);
+    }
+    *d = '\0';
+    return norm;
+}
+
+void PostalNumberSetScanThreads(int nThread) {
+    pthread_mutex_lock(&scanPoolMutex);
+    ScanPoolDestroy(scanPool);
+    scanPool = NULL;
+    scanThreads = nThread;
+    pthread_mutex_unlock(&scanPoolMutex);
+}
+
+/**
+ * 全件検索用のスレッドプールを得る。初めて使う時に作る
+ * returns: プール。1スレッドで調べる場合NULL
+ */
+static ScanPool *getScanPool(void) {
+    pthread_mutex_lock(&scanPoolMutex);
+    if(scanPool == NULL) {
+        int n = scanThreads;
+        if(n <= 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            n = (cpus > 0) ? (int)cpus : 1;
+        }
+        if(n > MAX_SCAN_THREADS)
+            n = MAX_SCAN_THREADS;
+        if(n > 1)
+            scanPool = ScanPoolCreate(n);
+    }
+    ScanPool *pool = scanPool;
+    pthread_mutex_unlock(&scanPoolMutex);
+    return pool;
+}
+
+/**
+ * テキスト列中の位置offを含むレコードを[rec, end)から二分探索で探す
+ */
+static uint32_t recordAt(const PostalDB *db, uint32_t off, uint32_t rec, uint32_t end) {
+    while(rec+1 < end) {
+        uint32_t mid = rec+(end-rec)/2;
+        if(db->textOffsets[mid] <= off)
+            rec = mid;
+        else
+            end = mid;
+    }
+    return rec;
+}
+
+/**
+ * [begin, end)のレコードのテキスト列からkeyを含むものを探す
+ * keyを探すとそのレコードの残りは飛ばして、次のレコードから探し続ける。
+ * 区切りの'\0'をまたいで一致することはないので、フィールド単位のstrstrと同じ結果になる
+ * arg: 検索するスナップショットとキー（空文字列ではないこと）
+ */
+typedef struct {
+    const PostalDB *db;
+    const char *key;
+} ScanArg;
+
+static size_t scanTextRange(uint32_t begin, uint32_t end, uint32_t *result, size_t resultSize, const void *arg) {
+    const PostalDB *db = ((const ScanArg *)arg)->db;
+    const char *key = ((const ScanArg *)arg)->key;
+    size_t keyLen = strlen(key);
+    const char *p = db->textColumn+db->textOffsets[begin];
+    const char *e = db->textColumn+db->textOffsets[end];
+    size_t count = 0;
+    uint32_t rec = begin;
+    while((count < resultSize) && (p < e)) {
+        const char *hit = TextMatchFind(p, (size_t)(e-p), key, keyLen);
+        if(hit == NULL)
+            break;
+        rec = recordAt(db, (uint32_t)(hit-db->textColumn), rec, end);
+        result[count++] = rec;
+        p = db->textColumn+db->textOffsets[++rec];
+    }
+    return count;
+}
+
+/**
+ * テキスト列を調べて検索する。範囲が広ければ複数スレッドで分担する
+ * 郵便番号が一致するレコードはハッシュインデックスから得て、レコード順に混ぜる
+ */
+static size_t searchByTextColumn(const PostalDB *db, const char *key, uint32_t start, uint32_t *result, size_t resultSize) {
+    if((start >= db->nIndexed) || (resultSize == 0))
+        return 0;
+    size_t count = (size_t)-1;
+    ScanArg arg = {db, key};
+    ScanPool *pool;
+    if((db->nIndexed-start >= PARALLEL_SCAN_MIN) && ((pool = getScanPool()) != NULL))
+        count = ScanPoolRun(pool, start, (uint32_t)db->nIndexed, scanTextRange, &arg, result, resultSize);
+    if(count == (size_t)-1)
+        count = scanTextRange(start, (uint32_t)db->nIndexed, result, resultSize, &arg);
+    return mergeCodeMatches(db, key, start, result, count, resultSize);
+}
+
+size_t mergeCodeMatches(const PostalDB *db, const char *key, uint32_t start, uint32_t *result, size_t count, size_t resultSize) {
+    for(uint32_t rec = findCode(db, key); rec != NO_RECORD; rec = db->codeNext[rec]) {
+        if((rec < start) || ((db->deleted != NULL) && RoaringContains(db->deleted, rec)))
             continue;
-        /* 7番目のフィールドがpref */
-        cp = fetch(xcp);
-        cp = fetch(cp);
-        cp = fetch(cp);
-        xcp = fetch(cp);
-        trim(cp, db[nDb].pref, sizeof(db[nDb].pref));
-        /* 8番目のフィールドがcity */
-        cp = xcp;
-        xcp = fetch(cp);
-        trim(cp, db[nDb].city, sizeof(db[nDb].city));
-        /* 9番目のフィールドがtown */
-        cp = xcp;
-        xcp = fetch(cp);
-        trim(cp, db[nDb].town, sizeof(db[nDb].town));
-        if(++nDb >= MAX_RECORDS)
+        size_t i = count;
+        while((i > 0) && (result[i-1] > rec))
+            i--;
+        if((i > 0) && (result[i-1] == rec))
+            continue; /* テキストでも一致していた */
+        if(i >= resultSize)
             break;
+        if(count < resultSize)
+            count++;
+        memmove(result+i+1, result+i, (count-1-i)*sizeof(uint32_t));
+        result[i] = rec;
     }
-    fclose(fp);
-    return nDb;
+    return count;
 }
 
-size_t PostalNumberSearch(const char *key, PostalNumber *result, size_t resultSize) {
+/**
+ * start番以降のレコードから条件に一致するものをレコード順に探す
+ * インデックスを作ったレコードから削除したものを除いて探し、続けて差分で追加したレコードを調べる
+ * result: 該当レコード番号を格納する配列
+ * returns: 該当レコードの数
+ */
+static size_t searchRecords(const PostalDB *db, const char *key, uint32_t start, uint32_t *result, size_t resultSize) {
     size_t count = 0;
-    size_t i = 0;
-    while((count < resultSize) && (i < nDb)) {
-        if((strcmp(db[i].code, key) == 0)
-           || (strstr(db[i].pref, key) != NULL)
-           || (strstr(db[i].city, key) != NULL)
-           || (strstr(db[i].town, key) != NULL)) {
-            result[count++] = db[i];
+    while((start < db->nIndexed) && (count < resultSize)) {
+        size_t want = resultSize-count;
+        size_t n = searchIndexed(db, key, start, result+count, want);
+        uint32_t last = (n > 0) ? result[count+n-1] : 0;
+        if(db->deleted != NULL) {
+            size_t kept = count;
+            for(size_t i = count; i < count+n; i++) {
+                if(!RoaringContains(db->deleted, result[i]))
+                    result[kept++] = result[i];
+            }
+            count = kept;
+        } else
+            count += n;
+        if(n < want)
+            break;
+        start = last+1;
+    }
+    if((db->nDb > db->nIndexed) && (count < resultSize)) {
+        if(start < db->nIndexed)
+            start = (uint32_t)db->nIndexed;
+        count += searchAdded(db, key, start, result+count, resultSize-count);
+    }
+    return count;
+}
+
+/**
+ * インデックスを作ったレコードのうちstart番以降から、条件に一致するものをレコード順に探す
+ * returns: 該当レコードの数
+ */
+static size_t searchIndexed(const PostalDB *db, const char *key, uint32_t start, uint32_t *result, size_t resultSize) {
+    if(isCompoundQuery(key) && !isCompact(db))
+        return searchQuery(db, key, start, result, resultSize);
+    /* テキストに現れない数字だけのキーは郵便番号の完全一致しかありえないので、ハッシュを引くだけで済ませる */
+    if((db->codeTable != NULL) && isDigits(key) && !textMayContain(db, key)) {
+        size_t count = 0;
+        for(uint32_t rec = findCode(db, key); (rec != NO_RECORD) && (count < resultSize); rec = db->codeNext[rec]) {
+            if(rec >= start)
+                result[count++] = rec;
+        }
+        return count;
+    }
+    /* インデックスが使えればそれで候補を絞り込む */
+    if((db->gramTable != NULL) && (db->codeTable != NULL)) {
+        size_t count = searchByGramIndex(db, key, start, result, resultSize);
+        if(count != (size_t)-1)
+            return count;
+    }
+    /* 空文字列はどのレコードにも含まれる */
+    if(*key == '\0') {
+        size_t count = 0;
+        for(size_t i = start; (i < db->nIndexed) && (count < resultSize); i++)
+            result[count++] = (uint32_t)i;
+        return count;
+    }
+    if(isCompact(db))
+        return searchByFMIndex(db, key, start, result, resultSize);
+    /* インデックスが使えないキーはテキスト列を調べる */
+    if((db->textColumn != NULL) && (db->codeTable != NULL))
+        return searchByTextColumn(db, key, start, result, resultSize);
+    size_t count = 0;
+    size_t i = start;
+    while((count < resultSize) && (i < db->nIndexed)) {
+        if(isMatch(db, &db->normRecords[i], key)) {
+            result[count++] = (uint32_t)i;
         }
         i++;
     }
     return count;
 }
 
+void freeSnapshot(PostalDB *db) {
+    if(db->parent != NULL) {
+        /* 共有している配列とインデックスは前の版と一緒に解放する */
+        if(db->ownsRecords)
+            freeDB(db);
+        RoaringFree(db->deleted);
+        releaseDB(db->parent);
+    } else if(db->image != NULL) {
+        /* 各領域はマップした中を指しているので、個別には解放せずマップごと外す */
+        munmap(db->image, db->imageSize);
+    } else
+        freeArrays(db);
+    free(db);
+}
+
+void freeArrays(PostalDB *db) {
+    TextFMFree(&db->fm);
+    freeFieldDict(&db->prefDict);
+    freeFieldDict(&db->cityDict);
+    freeCompleteIndex(db);
+    freeGeocodeIndex(db);
+    freeTextColumn(db);
+    freeGramIndex(db);
+    freeCodeIndex(db);
+    freeDB(db);
+}
+
 /**
- * カンマで区切られた要素を取り出す。カンマが'\0'に変更され、
- * その次のアドレスを返す
+ * レコードを公開用の構造体に展開する
  */
-static char *fetch(char *str) {
-    while((*str != ',') && (*str != '\n') && (*str != '\r') && (*str != '\0'))
-        str++;
-    if(*str != '\0')
-        *(str++) = '\0';
-    return str;
+static void toPostalNumber(const PostalDB *db, const Record *rec, PostalNumber *dst) {
+    strcpy(dst->code, STR(db, rec->code));
+    strcpy(dst->pref, STR(db, rec->pref));
+    strcpy(dst->city, STR(db, rec->city));
+    strcpy(dst->town, STR(db, rec->town));
+}
+
+/**
+ * 文字列をプールに格納する。すでに同じ文字列があればそれを使う
+ * returns: 文字列の番号。番号0は空文字列
+ */
+static uint32_t poolIntern(StringPool *pool, const char *str) {
+    if(*str == '\0')
+        return 0;
+    size_t mask = pool->tableSize-1;
+    size_t i = strHash(str) & mask;
+    while(pool->table[i] != 0) {
+        uint32_t id = pool->table[i]-1;
+        if(strcmp(pool->arena+pool->offsets[id], str) == 0)
+            return id;
+        i = (i+1) & mask;
+    }
+    size_t len = strlen(str)+1;
+    uint32_t id = (uint32_t)pool->nStr++;
+    pool->offsets[id] = (uint32_t)pool->size;
+    memcpy(pool->arena+pool->size, str, len);
+    pool->size += len;
+    pool->table[i] = id+1;
+    return id;
+}
+
+int poolInit(StringPool *pool, size_t arenaSize, size_t maxStr) {
+    pool->tableSize = 16;
+    while(pool->tableSize < maxStr*2)
+        pool->tableSize *= 2;
+    pool->arena = (char *)malloc(arenaSize+1);
+    pool->table = (uint32_t *)calloc(pool->tableSize, sizeof(uint32_t));
+    pool->offsets = (uint32_t *)malloc((maxStr+1)*sizeof(uint32_t));
+    if((pool->arena == NULL) || (pool->table == NULL) || (pool->offsets == NULL)) {
+        poolFree(pool);
+        return 0;
+    }
+    /* 番号0は空文字列 */
+    pool->arena[0] = '\0';
+    pool->size = 1;
+    pool->offsets[0] = 0;
+    pool->nStr = 1;
+    return 1;
+}
+
+void poolFree(StringPool *pool) {
+    free(pool->arena);
+    free(pool->table);
+    free(pool->offsets);
+    pool->arena = NULL;
+    pool->table = NULL;
+    pool->offsets = NULL;
+}
+
+int mapFile(const char *path, const char **data, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return 0;
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+    *data = NULL;
+    *size = (size_t)st.st_size;
+    if(*size > 0) {
+        void *p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p == MAP_FAILED) {
+            close(fd);
+            return 0;
+        }
+        madvise(p, *size, MADV_SEQUENTIAL); /* 先頭から一度だけ読む */
+        *data = (const char *)p;
+    }
+    close(fd);
+    return 1;
+}
+
+void unmapFile(const char *data, size_t size) {
+    if(data != NULL)
+        munmap((void *)data, size);
+}
+
+#define CSV_FIELDS 9 /* 取り込みに使う先頭からのフィールド数 */
+
+/* フィールドの範囲をdstSizeに収まるだけコピーする */
+static void copyField(const CsvField *field, char *dst, size_t dstSize) {
+    size_t len = (field->len < dstSize) ? field->len : dstSize-1;
+    memcpy(dst, field->begin, len);
+    dst[len] = '\0';
+}
+
+int parseLine(const char *line, const char *end, CsvRecord *tmp, const char **next) {
+    CsvField field[CSV_FIELDS];
+    size_t nField;
+    *next = CsvScanLine(line, end, field, CSV_FIELDS, &nField);
+    for(size_t i = nField; i < CSV_FIELDS; i++)
+        field[i].len = 0;
+    /* 3番目のフィールドがcode */
+    if(field[2].len == 0)
+        return 0;
+    copyField(&field[2], tmp->code, sizeof(tmp->code));
+    /* 4〜6番目のフィールドがpref, city, townの読み */
+    copyField(&field[3], tmp->prefKana, sizeof(tmp->prefKana));
+    copyField(&field[4], tmp->cityKana, sizeof(tmp->cityKana));
+    copyField(&field[5], tmp->townKana, sizeof(tmp->townKana));
+    /* 7〜9番目のフィールドがpref, city, town */
+    copyField(&field[6], tmp->pref, sizeof(tmp->pref));
+    copyField(&field[7], tmp->city, sizeof(tmp->city));
+    copyField(&field[8], tmp->town, sizeof(tmp->town));
+    return 1;
+}
+
+/**
+ * 1レコード分の文字列をプールに格納し、文字列番号をdstに格納する
+ */
+static void internRecord(StringPool *pool, const CsvRecord *src, Record *dst) {
+    dst->code = poolIntern(pool, src->code);
+    dst->pref = poolIntern(pool, src->pref);
+    dst->city = poolIntern(pool, src->city);
+    dst->town = poolIntern(pool, src->town);
+    dst->prefKana = poolIntern(pool, src->prefKana);
+    dst->cityKana = poolIntern(pool, src->cityKana);
+    dst->townKana = poolIntern(pool, src->townKana);
+}
+
+void reinternRecord(StringPool *pool, const PostalDB *db, const Record *rec, Record *dst) {
+    uint32_t src[] = {rec->code, rec->pref, rec->city, rec->town, rec->prefKana, rec->cityKana, rec->townKana};
+    uint32_t *fields[] = {&dst->code, &dst->pref, &dst->city, &dst->town, &dst->prefKana, &dst->cityKana, &dst->townKana};
+    for(size_t j = 0; j < sizeof(fields)/sizeof(fields[0]); j++)
+        *fields[j] = pool->offsets[poolIntern(pool, STR(db, src[j]))];
+}
+
+void normalizeRecord(CsvRecord *rec) {
+    TextNormalize(rec->code, rec->code);
+    TextNormalize(rec->pref, rec->pref);
+    TextNormalize(rec->city, rec->city);
+    TextNormalize(rec->town, rec->town);
+    TextNormalize(rec->prefKana, rec->prefKana);
+    TextNormalize(rec->cityKana, rec->cityKana);
+    TextNormalize(rec->townKana, rec->townKana);
+}
+
+/* 文字列番号のレコードを、番号からarena中の位置への対応mapで置き換えたものを作る */
+static void remapRecord(const uint32_t *map, const Record *src, Record *dst) {
+    dst->code = map[src->code];
+    dst->pref = map[src->pref];
+    dst->city = map[src->city];
+    dst->town = map[src->town];
+    dst->prefKana = map[src->prefKana];
+    dst->cityKana = map[src->cityKana];
+    dst->townKana = map[src->townKana];
+}
+
+/**
+ * 読み込みスレッド処理
+ * 担当範囲の行を解析し、スレッド専用の文字列プールとレコード配列に格納する。
+ * レコードの各フィールドはプール内の文字列番号で持つ。
+ * 検索用に正規化したフィールドも同じプールに格納し、normRecordsに持つ
+ */
+static void *doLoadChunk(void *arg) {
+    LoadChunk *chunk = (LoadChunk *)arg;
+    size_t lines = 0;
+    for(const char *cp = chunk->begin; (cp = memchr(cp, '\n', chunk->end-cp)) != NULL; cp++)
+        lines++;
+    lines++; /* 改行で終わらない最終行の分 */
+    chunk->records = (Record *)malloc(lines*sizeof(Record));
+    chunk->normRecords = (Record *)malloc(lines*sizeof(Record));
+    /* 正規化した文字列は元より長くならないので、文字列の合計は範囲の2倍に収まる */
+    if((chunk->records == NULL) || (chunk->normRecords == NULL)
+       || !poolInit(&chunk->pool, (chunk->end-chunk->begin)*2, lines*14)) {
+        chunk->failed = 1;
+        return NULL;
+    }
+    CsvRecord tmp; /* 1レコード分の作業領域 */
+    const char *line = chunk->begin;
+    while(line < chunk->end) {
+        if(parseLine(line, chunk->end, &tmp, &line)) {
+            internRecord(&chunk->pool, &tmp, &chunk->records[chunk->nRecords]);
+            normalizeRecord(&tmp);
+            internRecord(&chunk->pool, &tmp, &chunk->normRecords[chunk->nRecords++]);
+        }
+    }
+    return NULL;
 }
 
 /**
- * 文字列の前後の空白、ダブルクォートを取り除いたものをコピーする
+ * CSVファイルを読み込んでrecordsとarenaを作る。
+ * ファイルを行の境目で区切ってnThread個のスレッドで並列に解析し、
+ * 結果をファイル順に連結するので、スレッド数によらず同じ内容になる
+ * returns: 成功した場合1, 失敗した場合0
  */
-static void trim(const char *str, char *dst, size_t dstSize) {
-    char *xdst = dst;
-    dstSize--; /* 終端の'\0'の分を確保 */
-    while((*str == ' ') || (*str == '"'))
+static int loadCSV(PostalDB *db, int nThread) {
+    double t = now();
+    const char *buf;
+    size_t size;
+    if(!mapFile(DBFILE, &buf, &size))
+        return 0;
+    loadStat.bytes = size;
+    loadStat.readSec = now()-t;
+
+    /* 行の境目で区切って各スレッドに割り当てる。KEN_ALLはダブルクォート内に改行を含まないので改行だけで区切る */
+    t = now();
+    LoadChunk chunk[MAX_LOAD_THREADS];
+    memset(chunk, 0, sizeof(chunk));
+    const char *cp = buf;
+    for(int i = 0; i < nThread; i++) {
+        const char *end = (i == nThread-1) ? buf+size : buf+size/nThread*(i+1);
+        if(end < cp)
+            end = cp;
+        if(end < buf+size) {
+            const char *eol = memchr(end, '\n', buf+size-end);
+            end = (eol == NULL) ? buf+size : eol+1;
+        }
+        chunk[i].begin = cp;
+        chunk[i].end = end;
+        cp = end;
+    }
+    int nStarted = 0;
+    for(int i = 1; i < nThread; i++) {
+        if(pthread_create(&chunk[i].thread, NULL, doLoadChunk, &chunk[i]) != 0)
+            break;
+        nStarted = i;
+    }
+    doLoadChunk(&chunk[0]); /* 先頭の範囲は自スレッドで処理する */
+    for(int i = nStarted+1; i < nThread; i++)
+        doLoadChunk(&chunk[i]); /* スレッドを作れなかった範囲 */
+    for(int i = 1; i <= nStarted; i++)
+        pthread_join(chunk[i].thread, NULL);
+    unmapFile(buf, size); /* 文字列は各プールにコピー済み */
+    loadStat.nThread = nStarted+1;
+    loadStat.parseSec = now()-t;
+
+    /* ファイル順に連結し、文字列は全体で重複を除き直す */
+    t = now();
+    int ok = 1;
+    size_t total = 0, maxStr = 1, arenaMax = 1;
+    for(int i = 0; i < nThread; i++) {
+        ok = ok && !chunk[i].failed;
+        total += chunk[i].nRecords;
+        maxStr += chunk[i].pool.nStr;
+        arenaMax += chunk[i].pool.size;
+    }
+    StringPool pool = {0};
+    uint32_t *map = NULL;
+    ok = ok && ((db->records = (Record *)malloc((total > 0 ? total : 1)*sizeof(Record))) != NULL)
+        && ((db->normRecords = (Record *)malloc((total > 0 ? total : 1)*sizeof(Record))) != NULL)
+        && poolInit(&pool, arenaMax, maxStr)
+        && ((map = (uint32_t *)malloc(maxStr*sizeof(uint32_t))) != NULL);
+    for(int i = 0; ok && (i < nThread); i++) {
+        StringPool *local = &chunk[i].pool;
+        /* 番号順がファイル中の出現順なので、全体のプールでも出現順に並ぶ */
+        for(size_t id = 0; id < local->nStr; id++)
+            map[id] = pool.offsets[poolIntern(&pool, local->arena+local->offsets[id])];
+        for(size_t j = 0; j < chunk[i].nRecords; j++) {
+            remapRecord(map, &chunk[i].records[j], &db->records[db->nDb]);
+            remapRecord(map, &chunk[i].normRecords[j], &db->normRecords[db->nDb++]);
+        }
+    }
+    for(int i = 0; i < nThread; i++) {
+        free(chunk[i].records);
+        free(chunk[i].normRecords);
+        poolFree(&chunk[i].pool);
+    }
+    free(map);
+    free(pool.table);
+    free(pool.offsets);
+    if(!ok) {
+        free(pool.arena);
+        return 0;
+    }
+    /* 余った領域を返す */
+    db->arena = pool.arena;
+    db->arenaSize = pool.size;
+    char *shrunk = (char *)realloc(db->arena, db->arenaSize);
+    if(shrunk != NULL)
+        db->arena = shrunk;
+    loadStat.mergeSec = now()-t;
+    return 1;
+}
+
+/* 経過時間計測用の現在時刻（秒）*/
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+void freeDB(PostalDB *db) {
+    free(db->records);
+    free(db->normRecords);
+    free(db->arena);
+    db->records = NULL;
+    db->normRecords = NULL;
+    db->arena = NULL;
+    db->nDb = db->arenaSize = 0;
+}
+
+int PostalNumberApplyDelta(const char *addPath, const char *delPath) {
+    CsvRecord *adds = NULL, *dels = NULL;
+    size_t nAdd = 0, nDel = 0;
+    if(!readDeltaFile(addPath, &adds, &nAdd) || !readDeltaFile(delPath, &dels, &nDel)) {
+        free(adds);
+        return 0;
+    }
+    pthread_mutex_lock(&loadMutex);
+    /* 取り込みはloadMutexの中でしか行わないので、curはこの間差し替わらない */
+    pthread_mutex_lock(&dbMutex);
+    PostalDB *cur = currentDB;
+    if(cur != NULL)
+        __atomic_add_fetch(&cur->refCount, 1, __ATOMIC_RELAXED); /* 新しい版のparentとしての参照 */
+    pthread_mutex_unlock(&dbMutex);
+    PostalDB *db = NULL;
+    if((cur != NULL) && isCompact(cur))
+        errno = ENOTSUP; /* FM-indexしか持たない版は、追加したレコードを調べる正規化した文字列を持たない */
+    else if(cur != NULL)
+        db = buildDelta(cur, adds, nAdd, dels, nDel);
+    if((db != NULL) && (db->nDb-db->nIndexed > DELTA_FOLD_RECORDS)) {
+        /* 順に調べるレコードが増えすぎたら作り直す。作れなければ畳み込まずに公開する */
+        PostalDB *folded = foldDelta(db, memoryOptions);
+        if(folded != NULL) {
+            freeSnapshot(db); /* parentとしての参照もここで手放す */
+            db = folded;
+        }
+    }
+    if(db != NULL)
+        publishDB(db);
+    else
+        releaseDB(cur);
+    pthread_mutex_unlock(&loadMutex);
+    free(adds);
+    free(dels);
+    return db != NULL;
+}
+
+int isMatch(const PostalDB *db, const Record *rec, const char *key) {
+    return (strcmp(STR(db, rec->code), key) == 0)
+        || (strstr(STR(db, rec->pref), key) != NULL)
+        || (strstr(STR(db, rec->city), key) != NULL)
+        || (strstr(STR(db, rec->town), key) != NULL)
+        || (strstr(STR(db, rec->prefKana), key) != NULL)
+        || (strstr(STR(db, rec->cityKana), key) != NULL)
+        || (strstr(STR(db, rec->townKana), key) != NULL);
+}
+
+int isDigits(const char *str) {
+    if(*str == '\0')
+        return 0;
+    while((*str >= '0') && (*str <= '9'))
         str++;
-    while((*str != '\0') && (dstSize > 0)) {
-        *(xdst++) = *(str++);
-        dstSize--;
+    return *str == '\0';
+}
+
+static size_t strHash(const char *str) {
+    uint64_t h = 0xcbf29ce484222325ULL; /* FNV-1a */
+    while(*str != '\0') {
+        h ^= (unsigned char)*(str++);
+        h *= 0x100000001b3ULL;
+    }
+    return (size_t)(h ^ (h >> 32));
+}
+
+uint32_t findCode(const PostalDB *db, const char *key) {
+    size_t mask = db->codeTableSize-1;
+    size_t i = strHash(key) & mask;
+    while(db->codeTable[i] != 0) {
+        uint32_t rec = db->codeTable[i]-1;
+        if(strcmp(codeOf(db, rec), key) == 0)
+            return rec;
+        i = (i+1) & mask;
+    }
+    return NO_RECORD;
+}
+
+/**
+ * 全レコードの正規化したpref, city, townとその読みを'\0'区切りで1列に並べたテキスト列を作る
+ * 作れなかった場合はレコードごとに調べる
+ */
+static void buildTextColumn(PostalDB *db) {
+    size_t size = 0;
+    for(size_t i = 0; i < db->nDb; i++) {
+        const Record *rec = &db->normRecords[i];
+        size += strlen(STR(db, rec->pref))+strlen(STR(db, rec->city))+strlen(STR(db, rec->town))
+            +strlen(STR(db, rec->prefKana))+strlen(STR(db, rec->cityKana))+strlen(STR(db, rec->townKana))+6;
+    }
+    if(size > UINT32_MAX)
+        return;
+    db->textColumn = (char *)malloc(size > 0 ? size : 1);
+    db->textOffsets = (uint32_t *)malloc((db->nDb+1)*sizeof(uint32_t));
+    if((db->textColumn == NULL) || (db->textOffsets == NULL)) {
+        freeTextColumn(db);
+        return;
+    }
+    char *p = db->textColumn;
+    for(size_t i = 0; i < db->nDb; i++) {
+        const Record *rec = &db->normRecords[i];
+        db->textOffsets[i] = (uint32_t)(p-db->textColumn);
+        p = stpcpy(p, STR(db, rec->pref))+1;
+        p = stpcpy(p, STR(db, rec->city))+1;
+        p = stpcpy(p, STR(db, rec->town))+1;
+        p = stpcpy(p, STR(db, rec->prefKana))+1;
+        p = stpcpy(p, STR(db, rec->cityKana))+1;
+        p = stpcpy(p, STR(db, rec->townKana))+1;
+    }
+    db->textOffsets[db->nDb] = (uint32_t)size;
+    db->textColumnSize = size;
+}
+
+static void freeTextColumn(PostalDB *db) {
+    free(db->textColumn);
+    free(db->textOffsets);
+    db->textColumn = NULL;
+    db->textOffsets = NULL;
+    db->textColumnSize = 0;
+}
+
+uint32_t recordField(const Record *rec, int field) {
+    switch(field) {
+    case FIELD_PREF:
+        return rec->pref;
+    case FIELD_CITY:
+        return rec->city;
+    case FIELD_TOWN:
+        return rec->town;
+    default:
+        return rec->code;
+    }
+}
+
+uint32_t recordReading(const Record *rec, int field) {
+    switch(field) {
+    case FIELD_PREF:
+        return rec->prefKana;
+    case FIELD_CITY:
+        return rec->cityKana;
+    case FIELD_TOWN:
+        return rec->townKana;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * fieldの列を作る。値は正規化した名前と読みの組で、番号は出現順に振る
+ * 1回目の走査で値ごとの件数と範囲の数を数え、2回目で範囲を書き込む。
+ * 値の種類が多すぎる場合やメモリが足りない場合は作らない
+ */
+static void buildFieldDict(const PostalDB *db, FieldDict *dict, int field) {
+    /* 文字列はarena中で重複が無いので、位置が同じなら同じ値 */
+    size_t tableSize = (MAX_FIELD_VALUES+1)*2;
+    size_t mask = tableSize-1;
+    uint32_t *table = (uint32_t *)calloc(tableSize, sizeof(uint32_t)); /* 値の番号+1 */
+    uint32_t *last = (uint32_t *)malloc(MAX_FIELD_VALUES*sizeof(uint32_t)); /* 値ごとの直前のレコード */
+    memset(dict, 0, sizeof(*dict));
+    dict->values = (FieldValue *)malloc(MAX_FIELD_VALUES*sizeof(FieldValue));
+    dict->ids = (uint16_t *)malloc((db->nDb > 0 ? db->nDb : 1)*sizeof(uint16_t));
+    if((table == NULL) || (last == NULL) || (dict->values == NULL) || (dict->ids == NULL))
+        goto fail;
+    for(size_t rec = 0; rec < db->nDb; rec++) {
+        uint32_t off = recordField(&db->normRecords[rec], field);
+        uint32_t reading = recordReading(&db->normRecords[rec], field);
+        size_t i = (size_t)((off^(reading*0x9e3779b9u))*2654435761u) & mask;
+        while((table[i] != 0) && ((dict->values[table[i]-1].value != off) || (dict->values[table[i]-1].reading != reading)))
+            i = (i+1) & mask;
+        if(table[i] == 0) {
+            if(dict->nValue >= MAX_FIELD_VALUES)
+                goto fail;
+            FieldValue *v = &dict->values[dict->nValue];
+            memset(v, 0, sizeof(*v));
+            v->value = off;
+            v->reading = reading;
+            last[dict->nValue] = NO_RECORD;
+            table[i] = (uint32_t)++dict->nValue;
+        }
+        uint32_t id = table[i]-1;
+        FieldValue *v = &dict->values[id];
+        dict->ids[rec] = (uint16_t)id;
+        v->nRecord++;
+        if((last[id] == NO_RECORD) || (last[id]+1 != rec))
+            v->nRange++;
+        last[id] = (uint32_t)rec;
+    }
+    /* 範囲の数が確定したのでranges上の位置を割り当てる */
+    for(size_t id = 0; id < dict->nValue; id++) {
+        dict->values[id].rangeOffset = (uint32_t)dict->nRange;
+        dict->nRange += dict->values[id].nRange;
+        dict->values[id].nRange = 0;
+        last[id] = NO_RECORD;
+    }
+    dict->ranges = (RecordRange *)malloc((dict->nRange > 0 ? dict->nRange : 1)*sizeof(RecordRange));
+    if(dict->ranges == NULL)
+        goto fail;
+    for(size_t rec = 0; rec < db->nDb; rec++) {
+        uint32_t id = dict->ids[rec];
+        FieldValue *v = &dict->values[id];
+        RecordRange *r = &dict->ranges[v->rangeOffset];
+        if((last[id] == NO_RECORD) || (last[id]+1 != rec)) {
+            r[v->nRange].begin = (uint32_t)rec;
+            r[v->nRange++].end = (uint32_t)rec+1;
+        } else
+            r[v->nRange-1].end = (uint32_t)rec+1;
+        last[id] = (uint32_t)rec;
+    }
+    /* 余った領域を返す */
+    FieldValue *shrunk = (FieldValue *)realloc(dict->values, (dict->nValue > 0 ? dict->nValue : 1)*sizeof(FieldValue));
+    if(shrunk != NULL)
+        dict->values = shrunk;
+    free(table);
+    free(last);
+    return;
+
+fail:
+    free(table);
+    free(last);
+    freeFieldDict(dict);
+}
+
+static void freeFieldDict(FieldDict *dict) {
+    free(dict->values);
+    free(dict->ranges);
+    free(dict->ids);
+    memset(dict, 0, sizeof(*dict));
+}
+
+/**
+ * 郵便番号のハッシュインデックスを作る。同じ郵便番号のレコードは
+ * codeNextでファイル順につなぐ
+ */
+static void buildCodeIndex(PostalDB *db) {
+    db->codeTableSize = 16;
+    while(db->codeTableSize < db->nDb*2)
+        db->codeTableSize *= 2;
+    db->codeTable = (uint32_t *)calloc(db->codeTableSize, sizeof(uint32_t));
+    db->codeNext = (uint32_t *)malloc((db->nDb > 0 ? db->nDb : 1)*sizeof(uint32_t));
+    if((db->codeTable == NULL) || (db->codeNext == NULL)) {
+        freeCodeIndex(db);
+        return;
+    }
+    /* 後ろから登録すると、各郵便番号の先頭がファイル順で最初のレコードになる */
+    size_t mask = db->codeTableSize-1;
+    db->textHasDigit = 0;
+    for(size_t rec = db->nDb; rec-- > 0; ) {
+        const Record *p = &db->normRecords[rec];
+        size_t i = strHash(STR(db, p->code)) & mask;
+        while((db->codeTable[i] != 0) && (db->normRecords[db->codeTable[i]-1].code != p->code))
+            i = (i+1) & mask;
+        db->codeNext[rec] = (db->codeTable[i] != 0) ? db->codeTable[i]-1 : NO_RECORD;
+        db->codeTable[i] = (uint32_t)rec+1;
+        if((strpbrk(STR(db, p->pref), "0123456789") != NULL)
+           || (strpbrk(STR(db, p->city), "0123456789") != NULL)
+           || (strpbrk(STR(db, p->town), "0123456789") != NULL)
+           || (strpbrk(STR(db, p->prefKana), "0123456789") != NULL)
+           || (strpbrk(STR(db, p->cityKana), "0123456789") != NULL)
+           || (strpbrk(STR(db, p->townKana), "0123456789") != NULL))
+            db->textHasDigit = 1;
+    }
+    buildCodeOrder(db);
+}
+
+/* 郵便番号順に並べるための組 */
+typedef struct {
+    const char *code;
+    uint32_t rec;
+} CodeKey;
+
+static int compareCodeKey(const void *a, const void *b) {
+    const CodeKey *x = (const CodeKey *)a, *y = (const CodeKey *)b;
+    int c = strcmp(x->code, y->code);
+    return (c != 0) ? c : (x->rec > y->rec)-(x->rec < y->rec);
+}
+
+/**
+ * 前方一致と範囲の検索に使う、郵便番号順のレコード番号列を作る
+ * 作れなかった場合はそれらの検索で全件を調べる
+ */
+static void buildCodeOrder(PostalDB *db) {
+    CodeKey *keys = (CodeKey *)malloc((db->nDb > 0 ? db->nDb : 1)*sizeof(CodeKey));
+    db->codeOrder = (uint32_t *)malloc((db->nDb > 0 ? db->nDb : 1)*sizeof(uint32_t));
+    if((keys == NULL) || (db->codeOrder == NULL)) {
+        free(keys);
+        free(db->codeOrder);
+        db->codeOrder = NULL;
+        return;
+    }
+    for(size_t i = 0; i < db->nDb; i++) {
+        keys[i].code = STR(db, db->normRecords[i].code);
+        keys[i].rec = (uint32_t)i;
+    }
+    qsort(keys, db->nDb, sizeof(CodeKey), compareCodeKey);
+    for(size_t i = 0; i < db->nDb; i++)
+        db->codeOrder[i] = keys[i].rec;
+    free(keys);
+}
+
+void findCodeRange(const PostalDB *db, const char *lo, const char *hi, size_t *begin, size_t *end) {
+    size_t hiLen = strlen(hi);
+    size_t a = 0, b = db->nIndexed;
+    while(a < b) {
+        size_t mid = a+(b-a)/2;
+        if(strcmp(codeOf(db, db->codeOrder[mid]), lo) < 0)
+            a = mid+1;
+        else
+            b = mid;
+    }
+    *begin = a;
+    b = db->nIndexed;
+    while(a < b) {
+        size_t mid = a+(b-a)/2;
+        if(strncmp(codeOf(db, db->codeOrder[mid]), hi, hiLen) <= 0)
+            a = mid+1;
+        else
+            b = mid;
+    }
+    *end = a;
+}
+
+static void freeCodeIndex(PostalDB *db) {
+    free(db->codeTable);
+    free(db->codeNext);
+    free(db->codeOrder);
+    db->codeTable = NULL;
+    db->codeNext = NULL;
+    db->codeOrder = NULL;
+    db->codeTableSize = 0;
+}
+
+const char *nextCodePoint(const char *str, uint32_t *cp) {
+    const unsigned char *s = (const unsigned char *)str;
+    uint32_t c = s[0];
+    int len;
+    if(c < 0x80)
+        len = 0;
+    else if((c >= 0xc0) && (c < 0xe0)) {
+        c &= 0x1f;
+        len = 1;
+    } else if((c >= 0xe0) && (c < 0xf0)) {
+        c &= 0x0f;
+        len = 2;
+    } else if((c >= 0xf0) && (c < 0xf8)) {
+        c &= 0x07;
+        len = 3;
+    } else {
+        *cp = 0x110000+s[0];
+        return str+1;
+    }
+    for(int i = 1; i <= len; i++) {
+        if((s[i] & 0xc0) != 0x80) {
+            /* 継続バイトが足りない */
+            *cp = 0x110000+s[0];
+            return str+1;
+        }
+        c = (c << 6) | (s[i] & 0x3f);
+    }
+    *cp = c;
+    return str+len+1;
+}
+
+uint64_t makeGram(uint32_t c1, uint32_t c2) {
+    return ((uint64_t)(c1+1) << 32) | (c2 == 0 ? 0 : c2+1);
+}
+
+static size_t gramHash(uint64_t gram) {
+    gram ^= gram >> 29;
+    gram *= 0xbf58476d1ce4e5b9ULL;
+    gram ^= gram >> 32;
+    return (size_t)gram;
+}
+
+/**
+ * gramのエントリか、無い場合は挿入先の空きエントリを探す
+ */
+static GramEntry *gramSlot(const PostalDB *db, uint64_t gram) {
+    size_t mask = db->gramTableSize-1;
+    size_t i = gramHash(gram) & mask;
+    while((db->gramTable[i].gram != 0) && (db->gramTable[i].gram != gram))
+        i = (i+1) & mask;
+    return &db->gramTable[i];
+}
+
+const GramEntry *findGram(const PostalDB *db, uint64_t gram) {
+    const GramEntry *e = gramSlot(db, gram);
+    return (e->gram != 0) ? e : NULL;
+}
+
+int textMayContain(const PostalDB *db, const char *key) {
+    if(!db->textHasDigit)
+        return 0;
+    if(isCompact(db)) {
+        size_t row;
+        return TextFMFind(&db->fm, key, &row) > 0;
+    }
+    if(db->gramTable == NULL)
+        return 1;
+    if(key[1] == '\0')
+        return findGram(db, makeGram((unsigned char)key[0], 0)) != NULL;
+    for(size_t i = 0; key[i+1] != '\0'; i++) {
+        if(findGram(db, makeGram((unsigned char)key[i], (unsigned char)key[i+1])) == NULL)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * gramのエントリを探し、無い場合は作成する
+ */
+static GramEntry *addGram(PostalDB *db, uint64_t gram) {
+    GramEntry *e = gramSlot(db, gram);
+    if(e->gram == 0) {
+        e->gram = gram;
+        db->nGram++;
+    }
+    return e;
+}
+
+/* ハッシュ表を倍の大きさに作り直す */
+static int growGramTable(PostalDB *db) {
+    GramEntry *old = db->gramTable;
+    size_t oldSize = db->gramTableSize;
+    db->gramTableSize = (oldSize == 0) ? 4096 : oldSize*2;
+    db->gramTable = (GramEntry *)calloc(db->gramTableSize, sizeof(GramEntry));
+    if(db->gramTable == NULL) {
+        db->gramTable = old;
+        db->gramTableSize = oldSize;
+        return 0;
     }
+    db->nGram = 0;
+    for(size_t i = 0; i < oldSize; i++) {
+        if(old[i].gram != 0)
+            *addGram(db, old[i].gram) = old[i];
+    }
+    free(old);
+    return 1;
+}
+
+/**
+ * 1フィールド分のgramをgramsに追加する
+ * returns: 追加後のgram数
+ */
+static size_t collectGrams(const char *str, uint64_t *grams, size_t n) {
+    uint32_t prev = 0, c;
+    int hasPrev = 0;
+    while(*str != '\0') {
+        str = nextCodePoint(str, &c);
+        grams[n++] = makeGram(c, 0);
+        if(hasPrev)
+            grams[n++] = makeGram(prev, c);
+        prev = c;
+        hasPrev = 1;
+    }
+    return n;
+}
+
+static int compareGram(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * 1レコード分のgramを重複を除いて取り出す
+ * grams: 1文字につき2個分の大きさが必要
+ * returns: gram数
+ */
+static size_t recordGrams(const PostalDB *db, const Record *rec, uint64_t *grams) {
+    size_t n = 0;
+    n = collectGrams(STR(db, rec->pref), grams, n);
+    n = collectGrams(STR(db, rec->city), grams, n);
+    n = collectGrams(STR(db, rec->town), grams, n);
+    n = collectGrams(STR(db, rec->prefKana), grams, n);
+    n = collectGrams(STR(db, rec->cityKana), grams, n);
+    n = collectGrams(STR(db, rec->townKana), grams, n);
+    qsort(grams, n, sizeof(uint64_t), compareGram);
+    size_t m = 0;
+    for(size_t i = 0; i < n; i++) {
+        if((m == 0) || (grams[m-1] != grams[i]))
+            grams[m++] = grams[i];
+    }
+    return m;
+}
+
+/**
+ * 全レコードの正規化したpref, city, townとその読みから文字gramの転置インデックスを作る。
+ * codeの完全一致は郵便番号のハッシュインデックスで扱う。
+ * 1回目の走査で件数を数え、2回目でpostingsにレコード番号を書き込み、最後に圧縮する。
+ * 作れなかった場合はインデックス無しで全件検索する
+ */
+static void buildGramIndex(PostalDB *db) {
+    static uint64_t grams[sizeof(CsvRecord)*2];
+    uint32_t *postings = NULL; /* 圧縮前のレコード番号列 */
+    size_t total = 0;
+    for(int pass = 0; pass < 2; pass++) {
+        if(pass == 1) {
+            /* 件数が確定したのでpostings上の位置を割り当てる */
+            for(size_t i = 0; i < db->gramTableSize; i++) {
+                db->gramTable[i].offset = (uint32_t)total;
+                total += db->gramTable[i].count;
+                db->gramTable[i].count = 0;
+            }
+            postings = (uint32_t *)malloc((total > 0 ? total : 1)*sizeof(uint32_t));
+            if(postings == NULL)
+                goto fail;
+        }
+        for(size_t i = 0; i < db->nDb; i++) {
+            size_t n = recordGrams(db, &db->normRecords[i], grams);
+            for(size_t j = 0; j < n; j++) {
+                if((pass == 0) && ((db->nGram+1)*2 > db->gramTableSize)) {
+                    /* 負荷率が1/2を超えないように拡張する */
+                    if(!growGramTable(db))
+                        goto fail;
+                }
+                GramEntry *e = addGram(db, grams[j]); /* 2回目は必ず見つかる */
+                if(pass == 0)
+                    e->count++;
+                else
+                    postings[e->offset+e->count++] = (uint32_t)i;
+            }
+        }
+    }
+    if(compressPostings(db, postings)) {
+        free(postings);
+        return;
+    }
+
+fail:
+    free(postings);
+    freeGramIndex(db);
+}
+
+/* 可変長整数のバイト数 */
+static size_t varintSize(uint32_t v) {
+    size_t n = 1;
+    while(v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static uint8_t *writeVarint(uint8_t *p, uint32_t v) {
+    while(v >= 0x80) {
+        *(p++) = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *(p++) = (uint8_t)v;
+    return p;
+}
+
+static uint32_t readVarint(const uint8_t **p) {
+    const uint8_t *s = *p;
+    uint32_t v = 0;
+    int shift = 0;
+    uint8_t b;
     do {
-        *(xdst--) = '\0';
-    } while((dst <= xdst) && ((*xdst == ' ') || (*xdst == '"')));
+        b = *(s++);
+        v |= (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while(b & 0x80);
+    *p = s;
+    return v;
+}
+
+/**
+ * gramごとのレコード番号列をブロックに区切って圧縮する
+ * postings: 各エントリのoffsetから始まる昇順のレコード番号列。エントリのoffsetは
+ * postingBlocks中の位置に置き換える
+ * returns: メモリが足りない場合0
+ */
+static int compressPostings(PostalDB *db, const uint32_t *postings) {
+    size_t nBlock = 0, nByte = 0;
+    for(size_t i = 0; i < db->gramTableSize; i++) {
+        const GramEntry *e = &db->gramTable[i];
+        nBlock += (e->count+POSTING_BLOCK-1)/POSTING_BLOCK;
+        for(uint32_t j = 1; j < e->count; j++) {
+            if(j%POSTING_BLOCK != 0)
+                nByte += varintSize(postings[e->offset+j]-postings[e->offset+j-1]);
+        }
+    }
+    if(nByte > UINT32_MAX)
+        return 0;
+    db->postingBlocks = (PostingBlock *)malloc((nBlock+1)*sizeof(PostingBlock));
+    db->postingBytes = (uint8_t *)malloc(nByte > 0 ? nByte : 1);
+    if((db->postingBlocks == NULL) || (db->postingBytes == NULL))
+        return 0;
+    PostingBlock *b = db->postingBlocks;
+    uint8_t *p = db->postingBytes;
+    for(size_t i = 0; i < db->gramTableSize; i++) {
+        GramEntry *e = &db->gramTable[i];
+        const uint32_t *list = postings+e->offset;
+        e->offset = (uint32_t)(b-db->postingBlocks);
+        for(uint32_t j = 0; j < e->count; j++) {
+            if(j%POSTING_BLOCK == 0) {
+                b->first = list[j];
+                (b++)->offset = (uint32_t)(p-db->postingBytes);
+            } else
+                p = writeVarint(p, list[j]-list[j-1]);
+        }
+    }
+    /* 番兵。最後のブロックの終わりを示す */
+    b->first = NO_RECORD;
+    b->offset = (uint32_t)nByte;
+    db->nPostingBlock = nBlock;
+    db->postingBytesSize = nByte;
+    return 1;
+}
+
+static void freeGramIndex(PostalDB *db) {
+    free(db->gramTable);
+    free(db->postingBlocks);
+    free(db->postingBytes);
+    db->gramTable = NULL;
+    db->postingBlocks = NULL;
+    db->postingBytes = NULL;
+    db->gramTableSize = db->nGram = db->nPostingBlock = db->postingBytesSize = 0;
+}
+
+/**
+ * gramのレコード番号列を先頭から読む準備をする
+ */
+static void postingInit(const PostalDB *db, const GramEntry *e, PostingCursor *cur) {
+    cur->blocks = db->postingBlocks+e->offset;
+    cur->base = db->postingBytes;
+    cur->count = e->count;
+    cur->pos = 0;
+    if(cur->count > 0) {
+        cur->rec = cur->blocks[0].first;
+        cur->next = cur->base+cur->blocks[0].offset;
+    }
+}
+
+/* 次の要素に進む */
+static void postingNext(PostingCursor *cur) {
+    if(++cur->pos >= cur->count) {
+        cur->pos = cur->count;
+        return;
+    }
+    if(cur->pos%POSTING_BLOCK == 0) {
+        const PostingBlock *b = &cur->blocks[cur->pos/POSTING_BLOCK];
+        cur->rec = b->first;
+        cur->next = cur->base+b->offset;
+    } else
+        cur->rec += readVarint(&cur->next);
+}
+
+/**
+ * target以上の最初の要素まで進む
+ * targetを含みうるブロックを先頭のレコード番号から指数探索で探し、その中だけを読む
+ */
+static void postingSeek(PostingCursor *cur, uint32_t target) {
+    if((cur->pos >= cur->count) || (cur->rec >= target))
+        return;
+    uint32_t nBlock = (cur->count+POSTING_BLOCK-1)/POSTING_BLOCK;
+    uint32_t lo = cur->pos/POSTING_BLOCK; /* blocks[lo].first < target */
+    uint32_t step = 1, hi = lo+1;
+    while((hi < nBlock) && (cur->blocks[hi].first <= target)) {
+        lo = hi;
+        hi += step;
+        step *= 2;
+    }
+    if(hi > nBlock)
+        hi = nBlock;
+    while(lo+1 < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if(cur->blocks[mid].first <= target)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if(lo > cur->pos/POSTING_BLOCK) {
+        cur->pos = lo*POSTING_BLOCK;
+        cur->rec = cur->blocks[lo].first;
+        cur->next = cur->base+cur->blocks[lo].offset;
+    }
+    while((cur->pos < cur->count) && (cur->rec < target))
+        postingNext(cur);
+}
+
+int initGramCandidates(Candidates *c, const PostalDB *db, const char *key, uint32_t start, int withCode) {
+    const char *cp = key;
+    uint32_t prev = 0, ch;
+    int hasPrev = 0, noText = 0;
+    c->db = db;
+    c->kind = CANDIDATES_GRAM;
+    c->nList = 0;
+    c->ranges = NULL;
+    if((db->gramTable == NULL) || (db->codeTable == NULL) || (*key == '\0'))
+        return 0; /* 空文字列は全件に一致する */
+    while(*cp != '\0') {
+        cp = nextCodePoint(cp, &ch);
+        if(ch >= 0x110000)
+            return 0; /* 不正なUTF-8 */
+        if(hasPrev && (c->nList < MAX_KEY_GRAMS) && !noText) {
+            const GramEntry *e = findGram(db, makeGram(prev, ch));
+            if(e == NULL)
+                noText = 1; /* どのレコードにも現れない並び */
+            else
+                c->lists[c->nList++] = e;
+        }
+        prev = ch;
+        hasPrev = 1;
+    }
+    if((c->nList == 0) && !noText) {
+        /* 1文字だけのキー */
+        const GramEntry *e = findGram(db, makeGram(prev, 0));
+        if(e == NULL)
+            noText = 1;
+        else
+            c->lists[c->nList++] = e;
+    }
+    if(noText)
+        c->nList = 0;
+
+    /* 件数の少ない順に並べる */
+    for(size_t i = 1; i < c->nList; i++) {
+        const GramEntry *e = c->lists[i];
+        size_t j = i;
+        while((j > 0) && (c->lists[j-1]->count > e->count)) {
+            c->lists[j] = c->lists[j-1];
+            j--;
+        }
+        c->lists[j] = e;
+    }
+    for(size_t i = 0; i < c->nList; i++)
+        postingInit(db, c->lists[i], &c->cursors[i]);
+    if(c->nList > 0)
+        postingSeek(&c->cursors[0], start);
+    c->cost = (c->nList > 0) ? c->cursors[0].count-c->cursors[0].pos : 0;
+    c->primed = 0;
+    c->codeRec = withCode ? findCode(db, key) : NO_RECORD;
+    while(c->codeRec < start) {
+        c->codeRec = db->codeNext[c->codeRec];
+        c->cost++;
+    }
+    return 1;
+}
+
+/**
+ * 最も短い列を順に見て、他の全ての列に含まれる次のレコードを求める
+ * 他の列が先に進んだら、最も短い列もそこまで読み飛ばす
+ */
+static uint32_t nextGramRecord(Candidates *c) {
+    if(c->nList == 0)
+        return NO_RECORD;
+    PostingCursor *first = &c->cursors[0];
+    while(first->pos < first->count) {
+        uint32_t rec = first->rec;
+        size_t i;
+        for(i = 1; i < c->nList; i++) {
+            PostingCursor *cur = &c->cursors[i];
+            postingSeek(cur, rec);
+            if(cur->pos >= cur->count) {
+                first->pos = first->count; /* 積集合はもう増えない */
+                return NO_RECORD;
+            }
+            if(cur->rec != rec)
+                break;
+        }
+        if(i == c->nList) {
+            postingNext(first);
+            return rec;
+        }
+        postingSeek(first, c->cursors[i].rec);
+    }
+    return NO_RECORD;
+}
+
+static int compareRange(const void *a, const void *b) {
+    uint32_t x = ((const RecordRange *)a)->begin, y = ((const RecordRange *)b)->begin;
+    return (x > y) - (x < y);
+}
+
+int initRangeCandidates(Candidates *c, const PostalDB *db, const FieldDict *dict, const uint8_t *match, uint32_t start) {
+    size_t n = 0;
+    c->db = db;
+    c->kind = CANDIDATES_RANGE;
+    c->next = start;
+    c->cost = 0;
+    c->nRange = 0;
+    c->rangePos = 0;
+    for(size_t id = 0; id < dict->nValue; id++) {
+        if(match[id])
+            n += dict->values[id].nRange;
+    }
+    c->ranges = (RecordRange *)malloc((n > 0 ? n : 1)*sizeof(RecordRange));
+    if(c->ranges == NULL)
+        return 0;
+    for(size_t id = 0; id < dict->nValue; id++) {
+        const FieldValue *v = &dict->values[id];
+        if(!match[id])
+            continue;
+        memcpy(c->ranges+c->nRange, dict->ranges+v->rangeOffset, v->nRange*sizeof(RecordRange));
+        c->nRange += v->nRange;
+        c->cost += v->nRecord;
+    }
+    qsort(c->ranges, c->nRange, sizeof(RecordRange), compareRange);
+    return 1;
+}
+
+int compareRecord(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+int initCodeCandidates(Candidates *c, const PostalDB *db, const char *lo, const char *hi, uint32_t start) {
+    size_t begin, end;
+    c->db = db;
+    c->kind = CANDIDATES_RANGE;
+    c->next = start;
+    c->nRange = 0;
+    c->rangePos = 0;
+    c->ranges = NULL;
+    if(db->codeOrder == NULL)
+        return 0;
+    findCodeRange(db, lo, hi, &begin, &end);
+    size_t n = (end > begin) ? end-begin : 0;
+    uint32_t *recs = (uint32_t *)malloc((n > 0 ? n : 1)*sizeof(uint32_t));
+    if(recs == NULL)
+        return 0;
+    size_t m = 0;
+    for(size_t i = begin; i < end; i++) {
+        if(db->codeOrder[i] >= start)
+            recs[m++] = db->codeOrder[i];
+    }
+    c->ranges = (RecordRange *)malloc((m > 0 ? m : 1)*sizeof(RecordRange));
+    if(c->ranges == NULL) {
+        free(recs);
+        return 0;
+    }
+    if(m > CODE_SORT_MAX) {
+        size_t nWord = (db->nIndexed-start+63)/64;
+        uint64_t *bits = (uint64_t *)calloc(nWord, sizeof(uint64_t));
+        if(bits == NULL) {
+            free(recs);
+            return 0;
+        }
+        for(size_t i = 0; i < m; i++)
+            bits[(recs[i]-start)/64] |= 1ULL << ((recs[i]-start)%64);
+        m = 0;
+        for(size_t w = 0; w < nWord; w++) {
+            for(uint64_t x = bits[w]; x != 0; x &= x-1)
+                recs[m++] = start+(uint32_t)(w*64+__builtin_ctzll(x));
+        }
+        free(bits);
+    } else
+        qsort(recs, m, sizeof(uint32_t), compareRecord);
+    /* 連続するレコードは1つの範囲にまとめる */
+    for(size_t i = 0; i < m; i++) {
+        if((c->nRange > 0) && (c->ranges[c->nRange-1].end == recs[i]))
+            c->ranges[c->nRange-1].end++;
+        else {
+            c->ranges[c->nRange].begin = recs[i];
+            c->ranges[c->nRange++].end = recs[i]+1;
+        }
+    }
+    c->cost = m;
+    free(recs);
+    return 1;
+}
+
+uint32_t nextCandidate(Candidates *c) {
+    const PostalDB *db = c->db;
+    switch(c->kind) {
+    case CANDIDATES_GRAM: {
+        if(!c->primed) {
+            c->gramRec = nextGramRecord(c);
+            c->primed = 1;
+        }
+        /* 郵便番号が一致するレコードとレコード順に混ぜる */
+        uint32_t rec = (c->gramRec < c->codeRec) ? c->gramRec : c->codeRec;
+        if(rec == NO_RECORD)
+            return NO_RECORD;
+        if(c->gramRec == rec)
+            c->gramRec = nextGramRecord(c);
+        if(c->codeRec == rec)
+            c->codeRec = db->codeNext[rec];
+        return rec;
+    }
+    case CANDIDATES_RANGE:
+        while(c->rangePos < c->nRange) {
+            const RecordRange *r = &c->ranges[c->rangePos];
+            if(c->next < r->begin)
+                c->next = r->begin;
+            if(c->next < r->end)
+                return c->next++;
+            c->rangePos++;
+        }
+        return NO_RECORD;
+    default:
+        return (c->next < db->nIndexed) ? c->next++ : NO_RECORD;
+    }
+}
+
+void freeCandidates(Candidates *c) {
+    free(c->ranges);
+    c->ranges = NULL;
+}
+
+/**
+ * 転置インデックスで候補レコードを絞り込んで検索する。
+ * 各gramのレコード番号列の積集合を件数の少ない順に取り、候補を元の条件で確かめる。
+ * 郵便番号が一致するレコードはハッシュインデックスから得て、レコード順に混ぜる
+ * returns: 該当レコードの数。インデックスで扱えないキーの場合(size_t)-1
+ */
+static size_t searchByGramIndex(const PostalDB *db, const char *key, uint32_t start, uint32_t *result, size_t resultSize) {
+    Candidates c;
+    if(!initGramCandidates(&c, db, key, start, 1))
+        return (size_t)-1;
+    size_t count = 0;
+    uint32_t rec;
+    while((count < resultSize) && ((rec = nextCandidate(&c)) != NO_RECORD)) {
+        if(isMatch(db, &db->normRecords[rec], key))
+            result[count++] = rec;
+    }
+    return count;
+}
+
+/**
+ * 転置インデックスの積集合を読みながら、候補を元の条件で確かめて数える
+ * 結果の配列を作らず、limitに達したら止める。差分で追加したレコードは含めない
+ * returns: 該当レコードの数（limitまで）。インデックスで扱えないキーの場合(size_t)-1
+ */
+static size_t countByGramIndex(const PostalDB *db, const char *key, size_t limit) {
+    Candidates c;
+    if(!initGramCandidates(&c, db, key, 0, 1))
+        return (size_t)-1;
+    size_t count = 0, keyLen = strlen(key);
+    /* 照合が安いので、長いキーでも件数の少ない列だけで積を取る */
+    if((db->textColumn != NULL) && (c.nList > COUNT_GRAM_LISTS))
+        c.nList = COUNT_GRAM_LISTS;
+    uint32_t rec;
+    while((count < limit) && ((rec = nextCandidate(&c)) != NO_RECORD)) {
+        if((db->deleted != NULL) && RoaringContains(db->deleted, rec))
+            continue;
+        /* テキスト列があれば、フィールドごとに調べずにレコードの範囲を1回で照合する */
+        int match = (db->textColumn != NULL)
+            ? (TextMatchFind(db->textColumn+db->textOffsets[rec], db->textOffsets[rec+1]-db->textOffsets[rec], key, keyLen) != NULL)
+              || (strcmp(STR(db, db->normRecords[rec].code), key) == 0)
+            : isMatch(db, &db->normRecords[rec], key);
+        count += match;
+    }
+    freeCandidates(&c);
+    return count;
+}
+
+/**
+ * 条件に一致するレコードをlimit件まで数える
+ * インデックスの件数で分かればそれを使い、分からなければレコード番号だけを
+ * 少しずつ探して数える。レコードの内容は取り出さない
+ */
+static size_t countRecords(const PostalDB *db, const char *key, size_t limit) {
+    if(isCompact(db) && (*key != '\0'))
+        return countByFMIndex(db, key, limit);
+    size_t count = countByIndex(db, key);
+    if(count != (size_t)-1)
+        return (count < limit) ? count : limit;
+    /* インデックスを作ったレコードは候補を確かめながら数え、差分で追加したレコードだけを探す */
+    uint32_t start = 0;
+    if(!isCompoundQuery(key) && ((count = countByGramIndex(db, key, limit)) != (size_t)-1))
+        start = (uint32_t)db->nIndexed;
+    else
+        count = 0;
+    if((count >= limit) || (start >= db->nDb))
+        return count;
+    uint32_t refs[REF_BATCH_MAX];
+    size_t batch = REF_BATCH;
+    while(count < limit) {
+        size_t want = limit-count;
+        if(want > batch)
+            want = batch;
+        size_t n = searchRecords(db, key, start, refs, want);
+        count += n;
+        if(n < want)
+            break;
+        start = refs[n-1]+1;
+        if(batch < REF_BATCH_MAX)
+            batch *= 2;
+    }
+    return count;
+}
+
+static int compareFuzzyHit(const void *a, const void *b) {
+    const FuzzyHit *x = (const FuzzyHit *)a, *y = (const FuzzyHit *)b;
+    if(x->distance != y->distance)
+        return (x->distance > y->distance) - (x->distance < y->distance);
+    return (x->rec > y->rec) - (x->rec < y->rec);
+}
+
+/* 重複を除いたgramの数 */
+static size_t uniqueGrams(uint64_t *grams, size_t n) {
+    qsort(grams, n, sizeof(uint64_t), compareGram);
+    size_t m = 0;
+    for(size_t i = 0; i < n; i++) {
+        if((m == 0) || (grams[m-1] != grams[i]))
+            grams[m++] = grams[i];
+    }
+    return m;
+}
+
+/**
+ * インデックス済みの各レコードが含むキーのgramの数を数える
+ * 編集1回で失われるキーのgramはbigramなら2つ、unigramなら1つまでなので、
+ * 編集距離dで該当するレコードはキーのgramのうちneed[d]個以上を含む。
+ * 距離がキーの文字数未満なら少なくとも1文字は一致するので、unigramなら必ず1以上になる
+ * need: 距離0〜maxDistanceごとの必要な一致数を格納する場所
+ * nCand: 一致数がneed[maxDistance]以上のレコードの数を格納する場所
+ * returns: 各レコードの一致数（使い終わったらfreeする）。数えられない場合NULL
+ */
+static uint8_t *fuzzyCounts(const PostalDB *db, const char *key, int maxDistance, size_t *need, size_t *nCand) {
+    if(db->gramTable == NULL)
+        return NULL;
+    uint64_t uni[TEXT_APPROX_MAX], bi[TEXT_APPROX_MAX];
+    size_t nUni = 0, nBi = 0;
+    uint32_t prev = 0, c;
+    while((*key != '\0') && (nUni < TEXT_APPROX_MAX)) {
+        key = nextCodePoint(key, &c);
+        if(nUni > 0)
+            bi[nBi++] = makeGram(prev, c);
+        uni[nUni++] = makeGram(c, 0);
+        prev = c;
+    }
+    nUni = uniqueGrams(uni, nUni);
+    nBi = uniqueGrams(bi, nBi);
+    /* bigramで絞り込めなければunigramを使う */
+    int useBigram = (nBi > (size_t)maxDistance*2);
+    const uint64_t *grams = useBigram ? bi : uni;
+    size_t nGram = useBigram ? nBi : nUni;
+    for(int d = 0; d <= maxDistance; d++) {
+        size_t lost = useBigram ? (size_t)d*2 : (size_t)d;
+        need[d] = (nGram > lost) ? nGram-lost : 1;
+    }
+    uint8_t *counts = (uint8_t *)calloc((db->nIndexed > 0) ? db->nIndexed : 1, sizeof(uint8_t));
+    if(counts == NULL)
+        return NULL;
+    *nCand = 0;
+    for(size_t i = 0; i < nGram; i++) {
+        const GramEntry *e = findGram(db, grams[i]);
+        if(e == NULL)
+            continue;
+        PostingCursor cur;
+        for(postingInit(db, e, &cur); cur.pos < cur.count; postingNext(&cur))
+            *nCand += (++counts[cur.rec] == need[maxDistance]);
+    }
+    return counts;
+}
+
+/**
+ * レコードの正規化したpref, city, townとその読みのうち、キーに最も近い部分との編集距離
+ */
+static int fuzzyDistance(const PostalDB *db, const TextApproxPattern *pat, uint32_t rec) {
+    const Record *r = &db->normRecords[rec];
+    const uint32_t fields[] = {r->pref, r->city, r->town, r->prefKana, r->cityKana, r->townKana};
+    int best = INT_MAX;
+    for(size_t i = 0; (i < sizeof(fields)/sizeof(fields[0])) && (best > 0); i++) {
+        int d = TextApproxDistance(pat, STR(db, fields[i]));
+        if(d < best)
+            best = d;
+    }
+    return best;
+}
+
+/* 一致数から候補になるレコード番号を順に並べる。差分で追加したレコードはすべて候補にする */
+static size_t fuzzyCandidates(const PostalDB *db, const uint8_t *counts, size_t need, uint32_t *cands) {
+    size_t n = 0;
+    uint32_t rec = 0;
+    if(counts != NULL) {
+        /* 一致数0のレコードが大半なので8件ずつ読み飛ばす */
+        for(; rec < db->nIndexed; rec++) {
+            uint64_t word;
+            if((rec%8 == 0) && (rec+8 <= db->nIndexed)) {
+                memcpy(&word, counts+rec, sizeof(word));
+                if(word == 0) {
+                    rec += 7;
+                    continue;
+                }
+            }
+            if(counts[rec] >= need)
+                cands[n++] = rec;
+        }
+    }
+    for(; rec < db->nDb; rec++)
+        cands[n++] = rec;
+    return n;
+}
+
+/**
+ * いずれかのフィールドに、キーとの編集距離がmaxDistance以下の部分を含むレコードを、
+ * 距離が小さい順（同じならレコード順）に最大limit件探す
+ * gramの一致数で絞り込んだ候補を、距離0の見込みがあるものから順に距離ごとの段階に分けて
+ * ビット並列法で確かめる。段階dを終えれば距離d以下の該当はすべて分かっているので、
+ * それがlimit件に達した時点でやめる
+ * hits: 結果の配列を格納する場所（使い終わったらfreeする）
+ * returns: 該当レコードの数
+ */
+static size_t searchFuzzy(const PostalDB *db, const char *key, int maxDistance, size_t limit, FuzzyHit **hits) {
+    TextApproxPattern pat;
+    *hits = NULL;
+    if((limit == 0) || !TextApproxCompile(key, &pat))
+        return 0;
+    if(maxDistance >= pat.len)
+        maxDistance = pat.len-1; /* どのレコードでも満たす距離は調べない */
+    size_t need[FUZZY_MAX_DISTANCE+1] = {0}, nCand = 0;
+    uint8_t *counts = fuzzyCounts(db, key, maxDistance, need, &nCand);
+    if(counts == NULL)
+        nCand = db->nIndexed;
+    nCand += db->nDb-db->nIndexed;
+    uint32_t *cands = (uint32_t *)malloc(((nCand > 0) ? nCand : 1)*sizeof(uint32_t));
+    FuzzyHit *h = NULL;
+    size_t n = 0, cap = 0;
+    if(cands != NULL) {
+        nCand = fuzzyCandidates(db, counts, need[maxDistance], cands);
+        size_t found = 0; /* 確かめ終えた距離の該当数 */
+        for(int d = 0; (d <= maxDistance) && (found < limit); d++) {
+            size_t level = 0; /* この段階で見つけた距離dの該当数 */
+            for(size_t i = 0; (i < nCand) && (found+level < limit); i++) {
+                uint32_t rec = cands[i];
+                /* 前の段階で確かめたものと、まだ距離dの見込みがないものを除く */
+                size_t c = ((counts != NULL) && (rec < db->nIndexed)) ? counts[rec] : SIZE_MAX;
+                if((c < need[d]) || ((d > 0) && (c >= need[d-1])))
+                    continue;
+                if((db->deleted != NULL) && RoaringContains(db->deleted, rec))
+                    continue;
+                int dist = fuzzyDistance(db, &pat, rec);
+                if(dist > maxDistance)
+                    continue;
+                if(n >= cap) {
+                    cap = (cap == 0) ? 256 : cap*2;
+                    FuzzyHit *p = (FuzzyHit *)realloc(h, cap*sizeof(FuzzyHit));
+                    if(p == NULL)
+                        break;
+                    h = p;
+                }
+                h[n].rec = rec;
+                h[n++].distance = dist;
+                level += (dist == d);
+            }
+            /* 距離d以下の該当はすべて見つかっている */
+            found = 0;
+            for(size_t i = 0; i < n; i++)
+                found += (h[i].distance <= d);
+        }
+    }
+    free(counts);
+    free(cands);
+    if(n > 0)
+        qsort(h, n, sizeof(FuzzyHit), compareFuzzyHit);
+    *hits = h;
+    return (n < limit) ? n : limit;
+}
+
+/* まとめて検索するキー */
+typedef struct {
+    const char *key;    /* 正規化したキー */
+    size_t index;       /* keys中の位置 */
+    uint32_t *result;   /* 結果を格納する場所 */
+    size_t count;       /* 格納した数 */
+} BatchKey;
+
+/* まとめて走査する状態 */
+typedef struct {
+    const PostalDB *db;
+    BatchKey **nodeKeys; /* 節ごとの、その節で終わるキー。無ければNULL */
+    size_t resultSize;
+    size_t nOpen;       /* 結果がまだresultSize件に達していないキーの数 */
+    uint32_t rec;       /* 読んでいるレコード */
+} BatchScan;
+
+static int compareBatchKey(const void *a, const void *b) {
+    const BatchKey *x = *(const BatchKey *const *)a, *y = *(const BatchKey *const *)b;
+    int c = strcmp(x->key, y->key);
+    if(c != 0)
+        return c;
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/* テキスト列でキーが見つかった位置のレコードを、そのキーの結果に加える */
+static int batchFound(uint32_t node, size_t end, void *arg) {
+    BatchScan *scan = (BatchScan *)arg;
+    const PostalDB *db = scan->db;
+    while(db->textOffsets[scan->rec+1] < end)
+        scan->rec++;
+    BatchKey *k = scan->nodeKeys[node];
+    if((k == NULL) || (k->count >= scan->resultSize) || ((k->count > 0) && (k->result[k->count-1] == scan->rec)))
+        return 0;
+    if((db->deleted != NULL) && RoaringContains(db->deleted, scan->rec))
+        return 0;
+    k->result[k->count++] = scan->rec;
+    if(k->count == scan->resultSize)
+        scan->nOpen--;
+    return scan->nOpen == 0; /* 全てのキーの結果がそろえば残りは読まない */
+}
+
+/**
+ * 1つの文字列として検索するキーを、テキスト列を1度だけ走査してまとめて探す
+ * キーを全て同時に探すオートマトンで各キーが現れるレコードを集め、郵便番号の一致と
+ * 差分で追加したレコードを加える
+ * returns: 成功した場合1。メモリが足りない場合0
+ */
+static int scanBatch(const PostalDB *db, BatchKey **keys, size_t n, size_t resultSize) {
+    const char **patterns = (const char **)malloc(n*sizeof(char *));
+    uint32_t *terminal = (uint32_t *)malloc(n*sizeof(uint32_t));
+    BatchKey **nodeKeys = NULL;
+    TextAho aho;
+    int ok = (patterns != NULL) && (terminal != NULL);
+    for(size_t i = 0; ok && (i < n); i++)
+        patterns[i] = keys[i]->key;
+    ok = ok && TextAhoBuild(patterns, n, &aho, terminal);
+    if(ok && ((nodeKeys = (BatchKey **)calloc(aho.nNode, sizeof(BatchKey *))) == NULL)) {
+        TextAhoFree(&aho);
+        ok = 0;
+    }
+    if(ok) {
+        for(size_t i = 0; i < n; i++)
+            nodeKeys[terminal[i]] = keys[i]; /* 同じキーは除いてあるので節ごとに1つ */
+        nodeKeys[0] = NULL; /* オートマトンが受け付けなかったキー */
+        TextAhoBuildRootTable(&aho); /* 作れなくても遅くなるだけ */
+        BatchScan scan = {db, nodeKeys, resultSize, n, 0};
+        if(resultSize > 0)
+            TextAhoScan(&aho, db->textColumn, db->textOffsets[db->nIndexed], batchFound, &scan);
+        TextAhoFree(&aho);
+        for(size_t i = 0; i < n; i++) {
+            BatchKey *k = keys[i];
+            if(terminal[i] == 0) {
+                k->count = searchRecords(db, k->key, 0, k->result, resultSize);
+                continue;
+            }
+            k->count = mergeCodeMatches(db, k->key, 0, k->result, k->count, resultSize);
+            if((db->nDb > db->nIndexed) && (k->count < resultSize))
+                k->count += searchAdded(db, k->key, (uint32_t)db->nIndexed, k->result+k->count, resultSize-k->count);
+        }
+    }
+    free(patterns);
+    free(terminal);
+    free(nodeKeys);
+    return ok;
+}
+
+/**
+ * 正規化した複数のキーを検索する
+ * 同じキーは1度だけ探す。複数の語やフィールド指定を含むキー、郵便番号だけのキー、
+ * インデックスで扱えないキーはそれぞれインデックスかハッシュで探す。
+ * 残りの1つの文字列として探すキーは、インデックスで確かめる候補数（最大resultSize件）の合計が
+ * レコード数以上なら、テキスト列を1度だけ走査してまとめて探す。走査の手間はレコード1件あたり
+ * 候補1件を確かめるのと同程度なので、その方が速い
+ * returns: 成功した場合1。メモリが足りない場合0
+ */
+static int searchBatch(const PostalDB *db, char **keys, size_t n, uint32_t *result, size_t resultSize, size_t *counts) {
+    BatchKey *batch = (BatchKey *)malloc((n > 0 ? n : 1)*sizeof(BatchKey));
+    BatchKey **sorted = (BatchKey **)malloc((n > 0 ? n : 1)*sizeof(BatchKey *));
+    BatchKey **scanKeys = (BatchKey **)malloc((n > 0 ? n : 1)*sizeof(BatchKey *));
+    int ok = (batch != NULL) && (sorted != NULL) && (scanKeys != NULL);
+    size_t nScan = 0, cost = 0;
+    for(size_t i = 0; ok && (i < n); i++) {
+        batch[i].key = keys[i];
+        batch[i].index = i;
+        batch[i].result = result+i*resultSize;
+        batch[i].count = 0;
+        sorted[i] = &batch[i];
+    }
+    if(ok)
+        qsort(sorted, n, sizeof(BatchKey *), compareBatchKey);
+    /* 同じキーの最初のものだけを探し、まとめて走査できるキーとその手間を見積もる */
+    for(size_t i = 0; ok && (i < n); i++) {
+        BatchKey *k = sorted[i];
+        if((i > 0) && (strcmp(sorted[i-1]->key, k->key) == 0))
+            continue;
+        Candidates c;
+        if((db->textColumn != NULL) && !isCompoundQuery(k->key) && (!isDigits(k->key) || textMayContain(db, k->key))
+           && initGramCandidates(&c, db, k->key, 0, 0)) {
+            cost += (c.cost < resultSize) ? c.cost : resultSize;
+            scanKeys[nScan++] = k;
+            freeCandidates(&c);
+        } else
+            k->count = searchRecords(db, k->key, 0, k->result, resultSize);
+    }
+    if(ok && (cost >= db->nIndexed) && (nScan > 1))
+        ok = scanBatch(db, scanKeys, nScan, resultSize);
+    else {
+        for(size_t i = 0; ok && (i < nScan); i++)
+            scanKeys[i]->count = searchRecords(db, scanKeys[i]->key, 0, scanKeys[i]->result, resultSize);
+    }
+    /* 同じキーには最初のものの結果を写す */
+    for(size_t i = 0; ok && (i < n); i++) {
+        BatchKey *k = sorted[i];
+        if((i > 0) && (strcmp(sorted[i-1]->key, k->key) == 0)) {
+            memcpy(k->result, sorted[i-1]->result, sorted[i-1]->count*sizeof(uint32_t));
+            k->count = sorted[i-1]->count;
+        }
+        counts[k->index] = k->count;
+    }
+    free(batch);
+    free(sorted);
+    free(scanKeys);
+    return ok;
+}
+
+/**
+ * テキスト列からFM-indexを作り、FM-indexで代わりになるテキスト列と正規化した文字列を捨てる
+ * 作れなかった場合はテキスト列で検索する
+ */
+static void buildFMIndex(PostalDB *db) {
+    if((db->textColumn == NULL) || (db->codeTable == NULL) || (db->nDb == 0))
+        return;
+    if(!TextFMBuild(db->textColumn, db->textOffsets, db->nDb, &db->fm))
+        return;
+    freeTextColumn(db);
+    compactArena(db); /* 詰め直せなければ正規化した文字列も残す */
+}
+
+/**
+ * 正規化した郵便番号が全て元のものと同じなら、正規化したレコードを捨て、arenaを元の文字列だけで詰め直す
+ * returns: 詰め直した場合1
+ */
+static int compactArena(PostalDB *db) {
+    for(size_t i = 0; i < db->nDb; i++) {
+        if(strcmp(STR(db, db->normRecords[i].code), STR(db, db->records[i].code)) != 0)
+            return 0;
+    }
+    StringPool pool;
+    if(!poolInit(&pool, db->arenaSize, db->nDb*7))
+        return 0;
+    for(size_t i = 0; i < db->nDb; i++)
+        reinternRecord(&pool, db, &db->records[i], &db->records[i]);
+    free(db->arena);
+    free(db->normRecords);
+    db->normRecords = NULL;
+    db->arena = pool.arena;
+    db->arenaSize = pool.size;
+    char *shrunk = (char *)realloc(db->arena, db->arenaSize);
+    if(shrunk != NULL)
+        db->arena = shrunk;
+    pool.arena = NULL;
+    poolFree(&pool);
+    return 1;
 }
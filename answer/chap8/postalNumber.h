@@ -2,6 +2,7 @@
 #define POSTALNUMBER_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 /**
  * 郵便番号データベースレコード構造体
@@ -14,14 +15,143 @@ typedef struct {
 } PostalNumber;
 
 /**
- * 郵便番号データベースを取り込む
- * returns: 取り込んだレコード数
+ * 郵便番号データベースを取り込み、検索用の文字gram転置インデックスと
+ * 郵便番号のハッシュインデックスを作る
+ * 元のCSVより新しいイメージファイル(PostalNumberSaveDBで作成)があれば、
+ * CSVを読まずにイメージをマップして使う
+ * 取り込んだデータベースは丸ごと新しい版として差し替えるので、他のスレッドが
+ * 検索している最中に呼んでもよい。検索中のスレッドは前の版を使い続け、
+ * どのスレッドも使わなくなった時点で前の版を解放する
+ * CSVを読めなかった場合は差し替えず、今の版（まだ無ければ空のデータベース）を使い続ける
+ * returns: 取り込んだレコード数。読めなかった場合0
  */
 extern size_t PostalNumberLoadDB(void);
 
 /**
- * 郵便番号がkeyに一致するか、または都道府県名、市区町村名、町域名のいずれかに
- * keyを含むレコードを探す
+ * PostalNumberLoadDBと同様にデータベースを取り込み直す
+ * 1件も取り込めなかった場合は差し替えず、今の版を使い続ける
+ * returns: 取り込んだレコード数。差し替えなかった場合0
+ */
+extern size_t PostalNumberReloadDB(void);
+
+/**
+ * 日本郵便の差分ファイル（ADD_YYMM.CSV, DEL_YYMM.CSV）を取り込み中のデータベースに適用する
+ * 削除ファイルの各行は全フィールドが一致するレコードを1件削除し、追加ファイルの各行は
+ * レコードとして末尾に加える。インデックスは作り直さずに前の版と共有し、
+ * 追加したレコードは検索時に順に調べるので、手間は差分の大きさに比例する。
+ * 順に調べるレコードが一定数を超えたら、削除したレコードを除いて全件のインデックスを作り直す
+ * 検索中のスレッドは適用前の版を使い続ける。差分を適用した版はPostalNumberSaveDBで書き出せない
+ * addPath: 追加ファイル名。NULLなら追加しない
+ * delPath: 削除ファイル名。NULLなら削除しない
+ * returns: 成功した場合1。ファイルを読めないかメモリが足りない場合0で、今の版を使い続ける。
+ *          POSTAL_NUMBER_MEMORY_COMPACTで取り込んだ版には適用できず、0を返してerrnoをENOTSUPにする
+ */
+extern int PostalNumberApplyDelta(const char *addPath, const char *delPath);
+
+/**
+ * 今の版の番号を得る。データベースを取り込むたびに増える
+ * returns: 版の番号。まだ取り込んでいなければ0
+ */
+extern uint64_t PostalNumberVersion(void);
+
+/**
+ * このスレッドが使っている版を手放す
+ * 検索を終えて次の検索までしばらく間が空くスレッドは、古い版がいつまでも
+ * 解放されないよう呼んでおくこと。スレッドが終了した場合は自動的に手放す
+ */
+extern void PostalNumberRelease(void);
+
+/**
+ * 郵便番号データベースをCSVファイルから取り込み、インデックスを作る
+ * ファイルを行の境目でnThread個に区切って並列に解析し、ファイル順に連結する
+ * nThread: 解析スレッド数。0以下ならCPU数
+ * returns: 取り込んだレコード数
+ */
+extern size_t PostalNumberLoadDBParallel(int nThread);
+
+/* PostalNumberSetMemoryOptionsに指定するもの */
+#define POSTAL_NUMBER_MEMORY_HUGE 1 /* ヒュージページに置く */
+#define POSTAL_NUMBER_MEMORY_LOCK 2 /* mlockしてページアウトさせない */
+#define POSTAL_NUMBER_MEMORY_COMPACT 4 /* 検索用のテキストとインデックスの代わりにFM-indexだけを持つ */
+
+/**
+ * 以降に取り込むデータベースとインデックスを置くメモリを設定する
+ * 指定があれば全体をイメージファイルと同じ並びで1つの領域に置く（イメージファイルは
+ * マップせずに読み込む）。POSTAL_NUMBER_MEMORY_HUGEならMAP_HUGETLBで確保し、
+ * 確保できなければ透過的ヒュージページを使うようmadviseする
+ * POSTAL_NUMBER_MEMORY_LOCKはイメージファイルをマップする場合にも効く。
+ * 使えなかった方法は黙って諦めるので、結果はPostalNumberGetLoadStatで確かめる
+ * POSTAL_NUMBER_MEMORY_COMPACTなら常にCSVから取り込み、正規化したテキストも文字gramインデックスも
+ * 持たずに、正規化したpref, city, townとその読みのFM-index（圧縮した自己索引）で部分文字列を探す。
+ * メモリは数分の1になるが、検索は遅くなる。複数の語や"pref:"等を使うキーは項ごとに該当を求めて組み合わせる。
+ * あいまい検索、入力補完、住所の照合は使えず（PostalNumberHasFeatureで確かめる）、差分は適用できない。
+ * イメージファイルにも書き出せず、他の指定と組み合わせても1つの領域には詰め直さない
+ * options: POSTAL_NUMBER_MEMORY_*の組み合わせ。0なら設定しない（既定）
+ */
+extern void PostalNumberSetMemoryOptions(int options);
+
+/* データベースとインデックスを置いたメモリ */
+#define POSTAL_NUMBER_BACKING_HEAP 0    /* 配列ごとにmallocした */
+#define POSTAL_NUMBER_BACKING_FILE 1    /* イメージファイルをマップした */
+#define POSTAL_NUMBER_BACKING_PAGES 2   /* 普通のページの匿名領域 */
+#define POSTAL_NUMBER_BACKING_THP 3     /* 透過的ヒュージページを使うようmadviseした匿名領域 */
+#define POSTAL_NUMBER_BACKING_HUGETLB 4 /* MAP_HUGETLBで確保した領域 */
+
+/**
+ * 取り込み時の統計情報
+ */
+typedef struct {
+    int fromImage;    /* イメージファイルをマップした場合1 */
+    int nThread;      /* CSVの解析に使ったスレッド数 */
+    size_t bytes;     /* 読み込んだCSVの大きさ */
+    size_t records;   /* 取り込んだレコード数 */
+    double readSec;   /* CSVの読み込み時間（秒）*/
+    double parseSec;  /* CSVの解析時間 */
+    double mergeSec;  /* 解析結果の連結時間 */
+    double indexSec;  /* インデックス作成時間 */
+    double totalSec;  /* 全体の時間 */
+    int backing;      /* DBとインデックスを置いたメモリ（POSTAL_NUMBER_BACKING_*）*/
+    int locked;       /* mlockできた場合1 */
+    size_t memoryBytes; /* DBとインデックスの大きさ */
+} PostalNumberLoadStat;
+
+/**
+ * 最後に行った取り込みの統計情報を得る
+ * stat: 結果を格納する場所
+ */
+extern void PostalNumberGetLoadStat(PostalNumberLoadStat *stat);
+
+/**
+ * メモリの種類の名前を得る
+ * backing: POSTAL_NUMBER_BACKING_*
+ * returns: 名前
+ */
+extern const char *PostalNumberBackingName(int backing);
+
+#define POSTAL_NUMBER_IMAGE "KEN_ALL_UTF8.img" /* PostalNumberLoadDBが探すイメージファイル */
+
+/**
+ * 取り込み済みのデータベースとインデックスをイメージファイルに書き出す
+ * path: 書き出すファイル名。NULLならPOSTAL_NUMBER_IMAGE
+ * returns: 成功した場合1, 失敗した場合0
+ */
+extern int PostalNumberSaveDB(const char *path);
+
+/**
+ * 郵便番号がkeyに一致するか、または都道府県名、市区町村名、町域名とその読み
+ * （半角カタカナ）のいずれかにkeyを含むレコードを探す
+ * keyを空白（全角空白を含む）で区切った語が複数あれば、各語をすべて満たすレコードを探す。
+ * 例えば"北海道 札幌 中央"は3つの語をそれぞれいずれかのフィールドに含むものになる
+ * 語の間の"OR"はその前後の語のどちらかを満たせばよいことを、語の前の"NOT"は
+ * その語を満たさないことを表す（"札幌 OR 函館 NOT 中央"）
+ * 後ろに語の無い"NOT"・"OR"と先頭の"OR"は演算子ではなく普通の語として探す。
+ * "NOT 中央"や"NOT NOT"のように全ての語に"NOT"が付いたkeyはどのレコードにも一致しない
+ * "pref:", "city:", "town:", "code:"で始まる語はそのフィールドとその読みだけを調べ、
+ * 例えば"pref:東京都 city:港区"は都道府県名に東京都、市区町村名に港区を含むものになる
+ * "code:"は郵便番号の前方一致で、"code:100"は100で始まるもの、
+ * "code:1000000..1009999"はその範囲にあるものになる（上限は前方一致で比べる）
+ * 比べる前にキーとレコードの両方を正規化する。全角英数字は半角、半角カタカナと
+ * ひらがなは全角カタカナとして比べる。結果は元の文字列を返す
  * key: 検索する文字列
  * result: 結果を格納する配列
  * resultSize: resultの要素数
@@ -29,5 +159,181 @@ extern size_t PostalNumberLoadDB(void);
  */
 extern size_t PostalNumberSearch(const char *key, PostalNumber *result, size_t resultSize);
 
+/**
+ * 取り込み済みデータベース中のレコードを指すハンドル（レコード番号）
+ * 得たスレッドの中だけで、そのスレッドが次に検索を始めるか
+ * PostalNumberReleaseを呼ぶまで有効
+ */
+typedef uint32_t PostalNumberRef;
+
+/**
+ * PostalNumberSearchと同じ条件でレコードを探し、レコードの内容をコピーせずに
+ * ハンドルだけを返す。各フィールドはPostalNumberCode等で取り出す
+ * key: 検索する文字列
+ * result: 結果を格納する配列
+ * resultSize: resultの要素数
+ * returns: 該当レコードの数
+ */
+extern size_t PostalNumberSearchRef(const char *key, PostalNumberRef *result, size_t resultSize);
+
+/**
+ * 複数のキーをまとめて検索し、キーごとにPostalNumberSearchRefと同じ結果を返す
+ * 同じキーは1度だけ探し、郵便番号だけのキーはハッシュを、複数の語を含むキーはインデックスを引く。
+ * 該当の多い1つの文字列のキーが多ければ、それらを全て同時に探すオートマトンで
+ * 全件を1度だけ走査してまとめて探すので、キーの数だけ調べ直すことはない
+ * keys: 検索する文字列の配列
+ * n: キーの数
+ * result: 結果を格納する配列（n*resultSize要素）。i番目のキーの結果はresult+i*resultSizeから格納する
+ * resultSize: キーごとの結果の最大数
+ * counts: 各キーについて格納したレコードの数を格納する配列（n要素）
+ * returns: 成功した場合1。メモリが足りない場合0で、countsはすべて0
+ */
+extern int PostalNumberSearchBatch(const char *const *keys, size_t n, PostalNumberRef *result, size_t resultSize, size_t *counts);
+
+/**
+ * PostalNumberSearchと同じ条件に該当するレコードの数を数える。レコードは取り出さない
+ * 1〜2文字の語や都道府県名・市区町村名・郵便番号の範囲だけのキーは、
+ * 検索せずにインデックスの件数から求める
+ * key: 検索する文字列
+ * returns: 該当レコードの数
+ */
+extern size_t PostalNumberCount(const char *key);
+
+/**
+ * PostalNumberSearchと同じ条件に該当するレコードがあるか調べる
+ * 最初の1件が見つかった時点で調べるのをやめる
+ * key: 検索する文字列
+ * returns: ある場合1, 無い場合0
+ */
+extern int PostalNumberExists(const char *key);
+
+/* PostalNumberHasFeatureに指定する機能 */
+#define POSTAL_NUMBER_FEATURE_FUZZY 1    /* PostalNumberSearchFuzzy */
+#define POSTAL_NUMBER_FEATURE_COMPLETE 2 /* PostalNumberComplete */
+#define POSTAL_NUMBER_FEATURE_GEOCODE 3  /* PostalNumberGeocode */
+
+/**
+ * 今の版でその機能を使えるか調べる
+ * POSTAL_NUMBER_MEMORY_COMPACTで取り込んだ版は、あいまい検索、入力補完、住所の照合に
+ * 必要な索引を持たない。使えない機能は0件を返し、errnoをENOTSUPにする
+ * feature: POSTAL_NUMBER_FEATURE_*
+ * returns: 使える場合1、使えない場合0
+ */
+extern int PostalNumberHasFeature(int feature);
+
+/**
+ * 誤字を許して検索する。pref, city, townとその読みのいずれかに、keyとの編集距離
+ * （文字の挿入、削除、置換の回数）がmaxDistance以下の部分を含むレコードを、距離が小さい順
+ * （同じならファイル順）に返す。"札幌市中区"で"札幌市中央区"が距離1で見つかる
+ * keyは正規化して空白を除いた全体を1つの文字列として比べ、語の区切りや"OR"等は解釈しない
+ * 文字gramの一致数で候補を絞り込んでから確かめるので、全件は調べない
+ * key: 検索する文字列（64文字まで）
+ * maxDistance: 許す編集距離（0〜3）。keyの文字数以上なら文字数-1にする
+ * result: 結果を格納する配列
+ * distance: 各結果の編集距離を格納する配列（NULLでもよい）
+ * resultSize: result, distanceの要素数
+ * returns: 格納したレコードの数。POSTAL_NUMBER_MEMORY_COMPACTで取り込んだ場合は0で、errnoはENOTSUP
+ */
+extern size_t PostalNumberSearchFuzzy(const char *key, int maxDistance, PostalNumberRef *result, int *distance, size_t resultSize);
+
+#define POSTAL_NUMBER_COMPLETE_MAX 10 /* PostalNumberCompleteが返す候補の最大数 */
+
+/**
+ * 入力補完の候補
+ */
+typedef struct {
+    PostalNumberRef ref; /* 候補の住所を持つレコード（差分で削除したものを除き、ファイル順で最初のもの）*/
+    int level;           /* 候補の住所の細かさ。1: pref, 2: pref+city, 3: pref+city+town */
+} PostalNumberCompletion;
+
+/**
+ * 入力中の文字列に続く住所の候補を返す（入力補完）
+ * 正規化したprefixで始まる「都道府県名+市区町村名+町域名」か「市区町村名+町域名」を
+ * 住所の粗い順（都道府県、市区町村、町域）、同じ細かさならレコード数の多い順に並べる
+ * "札幌"で札幌市の各区が、"北海道札幌市中央区北"で中央区の北n条の町域が候補になる
+ * 候補の多い接頭辞は上位を前もって求めてあるので、データベースの大きさによらず速い
+ * 差分ファイルで追加したレコードは、同じ細かさの候補の後に加える
+ * prefix: 入力中の文字列
+ * result: 結果を格納する配列
+ * resultSize: resultの要素数（POSTAL_NUMBER_COMPLETE_MAXより多くは返さない）
+ * returns: 格納した候補の数。POSTAL_NUMBER_MEMORY_COMPACTで取り込んだ場合は0で、errnoはENOTSUP
+ */
+extern size_t PostalNumberComplete(const char *prefix, PostalNumberCompletion *result, size_t resultSize);
+
+/**
+ * 住所の文字列から、その住所のレコード（郵便番号）を探す
+ * 正規化したaddressに現れる「都道府県名+市区町村名+町域名」（都道府県名は省いてもよい）の
+ * うち最も長く一致するものを、すべての住所を同時に探すオートマトンでaddressを1度読むだけで求め、
+ * その住所を持つレコードをファイル順に返す。町域名まで一致しなければ市区町村名か都道府県名までで一致したものを返す
+ * 前後の郵便番号や番地は無視する。町域名の括弧書きの注記は照合に使わない
+ * 差分ファイルで追加したレコードも対象にする（インデックスを作り直すまでは順に調べる）
+ * address: 住所（例: "東京都千代田区千代田1-1"）
+ * result: 結果を格納する配列
+ * resultSize: resultの要素数
+ * level: 一致した住所の細かさ（1: pref, 2: pref+city, 3: pref+city+town。無ければ0）を格納する場所（NULLでもよい）
+ * returns: 格納したレコードの数。POSTAL_NUMBER_MEMORY_COMPACTで取り込んだ場合は0で、errnoはENOTSUP
+ */
+extern size_t PostalNumberGeocode(const char *address, PostalNumberRef *result, size_t resultSize, int *level);
+
+/**
+ * インデックスを使えない検索（空文字列や不正なUTF-8のキー）で、
+ * 全件を分担して調べるスレッド数を設定する。検索を始める前に呼ぶこと
+ * スレッドは最初にそのような検索をした時に作り、以降は使い回す
+ * nThread: 呼び出し元スレッドを含むスレッド数。0以下ならCPU数、1なら並列化しない
+ */
+extern void PostalNumberSetScanThreads(int nThread);
+
+/**
+ * 検索の続きを取り出すためのカーソル
+ * メンバは内部用なので直接参照しないこと
+ */
+typedef struct {
+    uint32_t next;    /* 次に調べるレコード番号 */
+    int done;         /* 全て取り出した */
+    uint64_t version; /* 検索している版 */
+} PostalNumberCursor;
+
+/**
+ * カーソルを先頭から検索する状態にする
+ * カーソルで取り出す結果はすべてこの時点の版から探す。途中で同じスレッドが
+ * 別の検索を始めて版が変わった場合、続きは取り出せない（0件を返す）ので、
+ * カーソルは1つずつ使うこと
+ * カーソルの内容はコピーしてよい。同じ版を使っているスレッドなら続きを取り出せる
+ */
+extern void PostalNumberCursorInit(PostalNumberCursor *cursor);
+
+/**
+ * カーソルの位置から検索を続け、続きの該当レコードを返す
+ * 前回の続きから調べるので、先頭から検索し直すことはない
+ * key: 検索する文字列（同じカーソルでは毎回同じものを指定する）
+ * cursor: カーソル。次の呼び出しのために更新される
+ * result: 結果を格納する配列
+ * resultSize: resultの要素数
+ * returns: 該当レコードの数。resultSizeより少なければ全て取り出した
+ */
+extern size_t PostalNumberSearchNext(const char *key, PostalNumberCursor *cursor, PostalNumberRef *result, size_t resultSize);
+
+/**
+ * ハンドルが指すレコードのフィールドを得る。読み（半角カタカナ）はPostalNumberには含めず、ここでだけ得られる
+ * 返す文字列はデータベース内を直接指しているので書き換えてはいけない
+ */
+extern const char *PostalNumberCode(PostalNumberRef ref);
+extern const char *PostalNumberPref(PostalNumberRef ref);
+extern const char *PostalNumberCity(PostalNumberRef ref);
+extern const char *PostalNumberTown(PostalNumberRef ref);
+extern const char *PostalNumberPrefKana(PostalNumberRef ref);
+extern const char *PostalNumberCityKana(PostalNumberRef ref);
+extern const char *PostalNumberTownKana(PostalNumberRef ref);
+
+/**
+ * 検索結果が同じになるキーを同じ文字列に揃える
+ * 検索時と同じ正規化を行い、語の間を1つの半角空白にする
+ * key: 検索する文字列
+ * dst: 結果を格納する場所
+ * dstSize: dstの大きさ
+ * returns: 格納した場合1。dstに収まらない場合0
+ */
+extern int PostalNumberNormalizeKey(const char *key, char *dst, size_t dstSize);
+
 
 #endif /* POSTALNUMBER_H */
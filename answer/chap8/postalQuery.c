@@ -0,0 +1,670 @@
+#include "postalQuery.h"
+#include "textNorm.h"
+#include "roaring.h"
+#include "textFM.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/**
+ * フィールドを限定した検索条件の1項
+ */
+typedef struct {
+    int field;              /* FIELD_PREF等。FIELD_ANYなら限定しない */
+    const char *value;      /* 含まれるべき文字列 */
+    const FieldDict *dict;  /* fieldの列。無ければNULL */
+    uint8_t *match;         /* 列の値ごとにvalueを含むか */
+    const char *hi;         /* FIELD_CODE: 範囲の上限。前方一致ならvalueと同じ */
+    int negated;            /* NOTが付いている */
+    int indexed;            /* 候補をインデックスから得られる */
+    uint32_t pending;       /* 候補から取り出してまだビットマップに加えていないレコード */
+} QueryTerm;
+
+/* 検索キーのフィールド指定 */
+static const struct {
+    const char *prefix;
+    int field;
+} fieldPrefixes[] = {
+    {"pref:", FIELD_PREF},
+    {"city:", FIELD_CITY},
+    {"town:", FIELD_TOWN},
+    {"code:", FIELD_CODE},
+};
+
+#define N_FIELD_PREFIX (sizeof(fieldPrefixes)/sizeof(fieldPrefixes[0]))
+#define CODE_RANGE_SEPARATOR ".." /* "code:lo..hi"で郵便番号の範囲を指定する */
+#define QUERY_OR "OR"   /* "A OR B"でAとBのどちらかを満たせばよい */
+#define QUERY_NOT "NOT" /* "NOT A"でAを満たさないこと */
+#define QUERY_WINDOW_MIN 1024 /* 複数の節の検索で最初にビットマップにするレコード数 */
+#define QUERY_WINDOW 16384 /* 複数の節の検索で一度にビットマップにするレコード数の上限 */
+#define QUERY_BUILD_RATIO 4 /* 候補が最も少ない節のこの倍までの節はビットマップにして積を取る */
+
+int isQuerySpace(char c) {
+    return (c == ' ') || (c == '\t');
+}
+
+/**
+ * 語がフィールド指定で始まっていればそのフィールドを返し、*valueを値の先頭にする
+ * returns: フィールド。指定が無ければFIELD_ANY
+ */
+static int termField(const char *word, const char **value) {
+    for(size_t i = 0; i < N_FIELD_PREFIX; i++) {
+        size_t len = strlen(fieldPrefixes[i].prefix);
+        if(strncmp(word, fieldPrefixes[i].prefix, len) == 0) {
+            *value = word+len;
+            return fieldPrefixes[i].field;
+        }
+    }
+    *value = word;
+    return FIELD_ANY;
+}
+
+int isCompoundQuery(const char *key) {
+    const char *value;
+    if(strchr(key, ' ') != NULL)
+        return 1;
+    return termField(key, &value) != FIELD_ANY;
+}
+
+static int fieldContains(const PostalDB *db, uint32_t rec, int field, const char *value);
+
+/**
+ * レコードが検索条件の1項を満たすか調べる。NOTは考えない
+ */
+static int matchTerm(const PostalDB *db, const QueryTerm *term, uint32_t rec) {
+    if(term->match != NULL)
+        return term->match[term->dict->ids[rec]];
+    if(term->field == FIELD_CODE) {
+        const char *code = codeOf(db, rec);
+        return (strcmp(code, term->value) >= 0) && (strncmp(code, term->hi, strlen(term->hi)) <= 0);
+    }
+    if(term->field == FIELD_ANY)
+        return isMatch(db, &db->normRecords[rec], term->value);
+    return fieldContains(db, rec, term->field, term->value);
+}
+
+/**
+ * 項の候補のうち次に取り出すレコードを、取り出さずに得る
+ */
+static uint32_t peekTerm(const QueryTerm *term, const Candidates *c) {
+    if(c->kind != CANDIDATES_RANGE)
+        return term->pending;
+    if(c->rangePos >= c->nRange)
+        return NO_RECORD;
+    const RecordRange *r = &c->ranges[c->rangePos];
+    return (c->next > r->begin) ? c->next : r->begin;
+}
+
+/**
+ * 項の候補のうちend番より前のもので、項を満たすものをビットマップに加える
+ * 列の値の範囲は確かめずにそのまま加える
+ * returns: メモリが足りない場合0
+ */
+static int fillTerm(const PostalDB *db, QueryTerm *term, Candidates *c, Roaring *bm, uint32_t end) {
+    if(c->kind == CANDIDATES_RANGE) {
+        while(c->rangePos < c->nRange) {
+            const RecordRange *r = &c->ranges[c->rangePos];
+            uint32_t begin = (c->next > r->begin) ? c->next : r->begin;
+            uint32_t stop = (r->end < end) ? r->end : end;
+            if((begin < stop) && !RoaringAddRange(bm, begin, stop))
+                return 0;
+            if(r->end > end) {
+                if(c->next < end)
+                    c->next = end;
+                return 1;
+            }
+            c->rangePos++;
+        }
+        return 1;
+    }
+    while(term->pending < end) {
+        if(matchTerm(db, term, term->pending) && !RoaringAdd(bm, term->pending))
+            return 0;
+        term->pending = nextCandidate(c);
+    }
+    return 1;
+}
+
+/**
+ * ORでつながった項の集まり。いずれかの項を満たせば節を満たす
+ */
+#define PLAN_DRIVER 0   /* 候補を取り出す節 */
+#define PLAN_AND 1      /* ビットマップにして積を取る */
+#define PLAN_ANDNOT 2   /* ビットマップにして差を取る（NOTの項1つだけの節） */
+#define PLAN_CHECK 3    /* 候補ごとに確かめる */
+typedef struct {
+    size_t first;       /* 最初の項の番号。節の項はtermsの中で連続する */
+    size_t nTerm;
+    size_t cost;        /* 各項の候補数の見積もりの和 */
+    int indexed;        /* 全ての項の候補をインデックスから得られる */
+    int positive;       /* NOTの項を含まない */
+    int plan;
+} QueryClause;
+
+/**
+ * 節の項の候補をend番より前まで1つのビットマップにまとめる
+ * returns: 作ったビットマップ。メモリが足りない場合NULL
+ */
+static Roaring *fillClause(const PostalDB *db, const QueryClause *clause, QueryTerm *terms, Candidates *cands, uint32_t end) {
+    Roaring *bm = RoaringCreate();
+    if(bm == NULL)
+        return NULL;
+    for(size_t i = clause->first; i < clause->first+clause->nTerm; i++) {
+        if(!fillTerm(db, &terms[i], &cands[i], bm, end)) {
+            RoaringFree(bm);
+            return NULL;
+        }
+    }
+    return bm;
+}
+
+/**
+ * 正規化した検索キーを項とORでつながった節に分けたもの
+ */
+typedef struct {
+    char *buf;              /* 項ごとに区切ったキーの写し */
+    QueryTerm *terms;
+    size_t nTerm;
+    QueryClause *clauses;
+    size_t nClause;
+    int matchNone;          /* NOTの付かない語が無く、どのレコードにも一致しない */
+} Query;
+
+static void freeQuery(Query *q) {
+    if(q->terms != NULL) {
+        for(size_t i = 0; i < q->nTerm; i++)
+            free(q->terms[i].match);
+    }
+    free(q->buf);
+    free(q->terms);
+    free(q->clauses);
+}
+
+/**
+ * 語が演算子wordと一致するか調べる
+ */
+static int isQueryWord(const char *begin, const char *end, const char *word) {
+    return ((size_t)(end-begin) == strlen(word)) && (strncmp(begin, word, strlen(word)) == 0);
+}
+
+/**
+ * 検索キーを空白で区切り、ORでつながった項を節にまとめる
+ * 末尾のNOT・OR、先頭のORは演算子ではなく語とみなす。
+ * 全ての語にNOTが付いていればmatchNoneを立てる
+ * returns: メモリが足りない場合0
+ */
+static int parseQuery(const char *key, Query *q) {
+    size_t keyLen = strlen(key);
+    size_t maxTerm = keyLen/2+1;
+    memset(q, 0, sizeof(*q));
+    q->buf = (char *)malloc(keyLen+1);
+    q->terms = (QueryTerm *)calloc(maxTerm, sizeof(QueryTerm));
+    q->clauses = (QueryClause *)calloc(maxTerm, sizeof(QueryClause));
+    if((q->buf == NULL) || (q->terms == NULL) || (q->clauses == NULL)) {
+        freeQuery(q);
+        return 0;
+    }
+    memcpy(q->buf, key, keyLen+1);
+    char *cp = q->buf;
+    int negate = 0, join = 0;
+    while(*cp != '\0') {
+        while(isQuerySpace(*cp))
+            *(cp++) = '\0';
+        if(*cp == '\0')
+            break;
+        char *word = cp;
+        while((*cp != '\0') && !isQuerySpace(*cp))
+            cp++;
+        /* 後ろ（ORは前も）に語の無い演算子は普通の語として扱う */
+        const char *rest = cp;
+        while(isQuerySpace(*rest))
+            rest++;
+        if((*rest != '\0') && isQueryWord(word, cp, QUERY_OR) && (q->nTerm > 0)) {
+            join = 1;
+            continue;
+        }
+        if((*rest != '\0') && isQueryWord(word, cp, QUERY_NOT)) {
+            negate = 1;
+            continue;
+        }
+        QueryTerm *term = &q->terms[q->nTerm];
+        term->field = termField(word, &term->value);
+        term->negated = negate;
+        if(term->field == FIELD_CODE) {
+            /* "lo..hi"なら範囲、そうでなければ前方一致 */
+            char *sep = strstr(term->value, CODE_RANGE_SEPARATOR);
+            term->hi = term->value;
+            if((sep != NULL) && (sep < cp)) {
+                *sep = '\0';
+                term->hi = sep+strlen(CODE_RANGE_SEPARATOR);
+            }
+        }
+        if(!join)
+            q->clauses[q->nClause++].first = q->nTerm;
+        q->clauses[q->nClause-1].nTerm++;
+        q->nTerm++;
+        negate = join = 0;
+    }
+    q->matchNone = (q->nTerm > 0);
+    for(size_t i = 0; i < q->nTerm; i++)
+        q->matchNone &= q->terms[i].negated;
+    return 1;
+}
+
+/**
+ * レコードが節を満たすか（いずれかの項を満たすか）調べる
+ */
+static int matchClause(const PostalDB *db, const Query *q, const QueryClause *clause, uint32_t rec) {
+    for(size_t i = clause->first; i < clause->first+clause->nTerm; i++) {
+        if(matchTerm(db, &q->terms[i], rec) != q->terms[i].negated)
+            return 1;
+    }
+    return 0;
+}
+
+size_t searchQuery(const PostalDB *db, const char *key, uint32_t start, uint32_t *result, size_t resultSize) {
+    Query q;
+    Candidates *cands = NULL;
+    size_t count = 0;
+    if(!parseQuery(key, &q))
+        return 0;
+    if(q.matchNone) {
+        freeQuery(&q);
+        return 0;
+    }
+    QueryTerm *terms = q.terms;
+    QueryClause *clauses = q.clauses;
+    size_t nTerm = q.nTerm, nClause = q.nClause;
+    cands = (Candidates *)calloc(nTerm > 0 ? nTerm : 1, sizeof(Candidates));
+    if(cands == NULL)
+        goto done;
+    /* 列の値ごとの一致を求める */
+    for(size_t i = 0; i < nTerm; i++) {
+        QueryTerm *term = &terms[i];
+        if(term->field == FIELD_PREF)
+            term->dict = &db->prefDict;
+        else if(term->field == FIELD_CITY)
+            term->dict = &db->cityDict;
+        if((term->dict == NULL) || (term->dict->values == NULL)) {
+            term->dict = NULL;
+            continue;
+        }
+        term->match = (uint8_t *)malloc(term->dict->nValue > 0 ? term->dict->nValue : 1);
+        if(term->match == NULL)
+            goto done;
+        for(size_t id = 0; id < term->dict->nValue; id++) {
+            const FieldValue *v = &term->dict->values[id];
+            term->match[id] = (strstr(STR(db, v->value), term->value) != NULL)
+                || (strstr(STR(db, v->reading), term->value) != NULL);
+        }
+    }
+    /* 項ごとに候補を取り出す準備をし、節の候補数を見積もる */
+    for(size_t i = 0; i < nTerm; i++) {
+        QueryTerm *term = &terms[i];
+        Candidates *c = &cands[i];
+        if(term->match != NULL)
+            term->indexed = initRangeCandidates(c, db, term->dict, term->match, start);
+        else if(term->field == FIELD_CODE)
+            term->indexed = initCodeCandidates(c, db, term->value, term->hi, start);
+        else
+            term->indexed = initGramCandidates(c, db, term->value, start, term->field == FIELD_ANY);
+        if(term->indexed && (c->kind != CANDIDATES_RANGE))
+            term->pending = nextCandidate(c);
+    }
+    QueryClause *driver = NULL;
+    for(size_t i = 0; i < nClause; i++) {
+        QueryClause *clause = &clauses[i];
+        clause->indexed = clause->positive = 1;
+        for(size_t j = clause->first; j < clause->first+clause->nTerm; j++) {
+            clause->cost += cands[j].cost;
+            clause->indexed &= terms[j].indexed;
+            clause->positive &= !terms[j].negated;
+        }
+        if(clause->indexed && clause->positive && ((driver == NULL) || (clause->cost < driver->cost)))
+            driver = clause;
+    }
+    for(size_t i = 0; i < nClause; i++) {
+        QueryClause *clause = &clauses[i];
+        clause->plan = PLAN_CHECK;
+        if(clause == driver)
+            clause->plan = PLAN_DRIVER;
+        else if((driver != NULL) && clause->indexed && (clause->cost <= driver->cost*QUERY_BUILD_RATIO)) {
+            if(clause->positive)
+                clause->plan = PLAN_AND;
+            else if(clause->nTerm == 1)
+                clause->plan = PLAN_ANDNOT;
+        }
+    }
+
+    uint32_t lo = start, window = QUERY_WINDOW_MIN;
+    while((count < resultSize) && (lo < db->nIndexed)) {
+        if(driver != NULL) {
+            /* 候補の無い部分は飛ばす */
+            uint32_t next = NO_RECORD;
+            for(size_t i = driver->first; i < driver->first+driver->nTerm; i++) {
+                uint32_t rec = peekTerm(&terms[i], &cands[i]);
+                if(rec < next)
+                    next = rec;
+            }
+            if(next == NO_RECORD)
+                break;
+            if(next > lo)
+                lo = next;
+        }
+        uint32_t hi = (db->nIndexed-lo > window) ? lo+window : (uint32_t)db->nIndexed;
+        Roaring *bm;
+        if(driver != NULL)
+            bm = fillClause(db, driver, terms, cands, hi);
+        else if(((bm = RoaringCreate()) != NULL) && !RoaringAddRange(bm, lo, hi)) {
+            RoaringFree(bm);
+            bm = NULL;
+        }
+        for(size_t i = 0; (bm != NULL) && (i < nClause); i++) {
+            const QueryClause *clause = &clauses[i];
+            if((clause->plan != PLAN_AND) && (clause->plan != PLAN_ANDNOT))
+                continue;
+            Roaring *other = fillClause(db, clause, terms, cands, hi);
+            Roaring *next = NULL;
+            if(other != NULL)
+                next = (clause->plan == PLAN_AND) ? RoaringAnd(bm, other) : RoaringAndNot(bm, other);
+            RoaringFree(other);
+            RoaringFree(bm);
+            bm = next;
+        }
+        if(bm == NULL)
+            break;
+        for(uint32_t rec = RoaringNext(bm, lo); (rec != ROARING_NONE) && (count < resultSize); rec = RoaringNext(bm, rec+1)) {
+            size_t i;
+            for(i = 0; i < nClause; i++) {
+                if((clauses[i].plan == PLAN_CHECK) && !matchClause(db, &q, &clauses[i], rec))
+                    break;
+            }
+            if(i == nClause)
+                result[count++] = rec;
+        }
+        RoaringFree(bm);
+        lo = hi;
+        if(window < QUERY_WINDOW)
+            window *= 2; /* 少しだけ求める場合に多く作りすぎない */
+    }
+
+done:
+    if(cands != NULL) {
+        for(size_t i = 0; i < nTerm; i++)
+            freeCandidates(&cands[i]);
+    }
+    free(cands);
+    freeQuery(&q);
+    return count;
+}
+
+size_t searchAdded(const PostalDB *db, const char *key, uint32_t start, uint32_t *result, size_t resultSize) {
+    Query q;
+    int compound = isCompoundQuery(key);
+    if(compound && !parseQuery(key, &q))
+        return 0;
+    if(compound && q.matchNone) {
+        freeQuery(&q);
+        return 0;
+    }
+    size_t count = 0;
+    for(uint32_t rec = start; (rec < db->nDb) && (count < resultSize); rec++) {
+        if((db->deleted != NULL) && RoaringContains(db->deleted, rec))
+            continue;
+        size_t i = 0;
+        if(compound) {
+            while((i < q.nClause) && matchClause(db, &q, &q.clauses[i], rec))
+                i++;
+        }
+        if(compound ? (i == q.nClause) : isMatch(db, &db->normRecords[rec], key))
+            result[count++] = rec;
+    }
+    if(compound)
+        freeQuery(&q);
+    return count;
+}
+
+size_t countByIndex(const PostalDB *db, const char *key) {
+    if((db->nIndexed != db->nDb) || (db->deleted != NULL))
+        return (size_t)-1; /* 差分はインデックスに入っていない */
+    if(*key == '\0')
+        return db->nDb;
+    if((db->codeTable == NULL) || (strchr(key, ' ') != NULL))
+        return (size_t)-1;
+    const char *value;
+    int field = termField(key, &value);
+    if((field == FIELD_PREF) || (field == FIELD_CITY)) {
+        const FieldDict *dict = (field == FIELD_PREF) ? &db->prefDict : &db->cityDict;
+        if(dict->values == NULL)
+            return (size_t)-1;
+        size_t count = 0;
+        for(size_t id = 0; id < dict->nValue; id++) {
+            const FieldValue *v = &dict->values[id];
+            if((strstr(STR(db, v->value), value) != NULL) || (strstr(STR(db, v->reading), value) != NULL))
+                count += v->nRecord;
+        }
+        return count;
+    }
+    if(field == FIELD_CODE) {
+        if(db->codeOrder == NULL)
+            return (size_t)-1;
+        char *lo = strdup(value);
+        if(lo == NULL)
+            return (size_t)-1;
+        char *sep = strstr(lo, CODE_RANGE_SEPARATOR);
+        const char *hi = lo;
+        if(sep != NULL) {
+            *sep = '\0';
+            hi = sep+strlen(CODE_RANGE_SEPARATOR);
+        }
+        size_t begin, end;
+        findCodeRange(db, lo, hi, &begin, &end);
+        free(lo);
+        return (end > begin) ? end-begin : 0;
+    }
+    if(field != FIELD_ANY)
+        return (size_t)-1;
+    if(isDigits(key) && !textMayContain(db, key)) {
+        size_t count = 0;
+        for(uint32_t rec = findCode(db, key); rec != NO_RECORD; rec = db->codeNext[rec])
+            count++;
+        return count;
+    }
+    /* 郵便番号と一致するレコードはgramの列と重なりうるので数えられない */
+    if((db->gramTable == NULL) || (findCode(db, key) != NO_RECORD))
+        return (size_t)-1;
+    uint32_t ch[2] = {0, 0};
+    size_t len = 0;
+    for(const char *cp = key; *cp != '\0'; len++) {
+        if(len >= 2)
+            return (size_t)-1;
+        cp = nextCodePoint(cp, &ch[len]);
+        if(ch[len] >= 0x110000)
+            return (size_t)-1; /* 不正なUTF-8 */
+    }
+    const GramEntry *e = findGram(db, makeGram(ch[0], ch[1]));
+    return (e != NULL) ? e->count : 0;
+}
+
+/**
+ * FM-indexでkeyを含むレコードを求め、重複を除いてレコード順に並べる
+ * extra: 後から加えられるよう余分に確保する要素数
+ * recs: 結果の配列を格納する場所。使い終わったらfreeで解放する
+ * returns: レコードの数。メモリが足りない場合(size_t)-1
+ */
+static size_t locateRecords(const PostalDB *db, const char *key, size_t extra, uint32_t **recs) {
+    size_t row, n = TextFMFind(&db->fm, key, &row);
+    *recs = (uint32_t *)malloc((n+extra > 0 ? n+extra : 1)*sizeof(uint32_t));
+    if(*recs == NULL)
+        return (size_t)-1;
+    for(size_t i = 0; i < n; i++)
+        (*recs)[i] = TextFMLocate(&db->fm, row+i);
+    qsort(*recs, n, sizeof(uint32_t), compareRecord);
+    size_t m = 0;
+    for(size_t i = 0; i < n; i++) {
+        if((m == 0) || ((*recs)[m-1] != (*recs)[i]))
+            (*recs)[m++] = (*recs)[i];
+    }
+    return m;
+}
+
+/**
+ * レコードのフィールドかその読みに、正規化したvalueが含まれるか調べる
+ * FM-indexだけを持つ版で正規化したレコードを捨てている場合は、元の文字列を正規化し直して調べる
+ */
+static int fieldContains(const PostalDB *db, uint32_t rec, int field, const char *value) {
+    if(db->normRecords != NULL)
+        return (strstr(STR(db, recordField(&db->normRecords[rec], field)), value) != NULL)
+            || (strstr(STR(db, recordReading(&db->normRecords[rec], field)), value) != NULL);
+    char buf[sizeof(CsvRecord)]; /* どのフィールドより長い */
+    TextNormalize(STR(db, recordField(&db->records[rec], field)), buf);
+    if(strstr(buf, value) != NULL)
+        return 1;
+    TextNormalize(STR(db, recordReading(&db->records[rec], field)), buf);
+    return strstr(buf, value) != NULL;
+}
+
+/**
+ * FM-indexで検索条件の1項を満たすレコードの集合を求める。NOTは考えない
+ * フィールドを限定した項は、値を含むレコードを求めてからそのフィールドを確かめる
+ * returns: レコードの集合。メモリが足りない場合NULL
+ */
+static Roaring *locateTerm(const PostalDB *db, const QueryTerm *term) {
+    Roaring *bm = RoaringCreate();
+    if(bm == NULL)
+        return NULL;
+    int ok = 1;
+    if(term->field == FIELD_CODE) {
+        size_t begin, end;
+        findCodeRange(db, term->value, term->hi, &begin, &end);
+        for(size_t i = begin; ok && (i < end); i++)
+            ok = RoaringAdd(bm, db->codeOrder[i]);
+    } else if(*term->value == '\0')
+        ok = RoaringAddRange(bm, 0, (uint32_t)db->nDb); /* 空文字列はどのフィールドにも含まれる */
+    else {
+        size_t row, n = TextFMFind(&db->fm, term->value, &row);
+        for(size_t i = 0; ok && (i < n); i++) {
+            uint32_t rec = TextFMLocate(&db->fm, row+i);
+            if(!RoaringContains(bm, rec)
+               && ((term->field == FIELD_ANY) || fieldContains(db, rec, term->field, term->value)))
+                ok = RoaringAdd(bm, rec);
+        }
+        if(term->field == FIELD_ANY) {
+            for(uint32_t rec = findCode(db, term->value); ok && (rec != NO_RECORD); rec = db->codeNext[rec])
+                ok = RoaringAdd(bm, rec);
+        }
+    }
+    if(!ok) {
+        RoaringFree(bm);
+        return NULL;
+    }
+    return bm;
+}
+
+/**
+ * FM-indexで複数の語やフィールド指定を含む検索条件を満たすレコードの集合を求める
+ * searchQueryと同じ条件を、項ごとのレコードの集合の和（NOTの項は補集合）と節どうしの積で求める
+ * returns: レコードの集合。メモリが足りない場合NULL
+ */
+static Roaring *locateQuery(const PostalDB *db, const char *key) {
+    Query q;
+    if(!parseQuery(key, &q))
+        return NULL;
+    Roaring *all = RoaringCreate(), *found = NULL;
+    if((all == NULL) || !RoaringAddRange(all, 0, (uint32_t)db->nDb))
+        goto fail;
+    if(q.matchNone) {
+        /* NOTの項しか無ければ何にも一致しない */
+        if((found = RoaringCreate()) == NULL)
+            goto fail;
+    }
+    for(size_t i = 0; !q.matchNone && (i < q.nClause); i++) {
+        const QueryClause *clause = &q.clauses[i];
+        Roaring *match = RoaringCreate();
+        for(size_t j = clause->first; (match != NULL) && (j < clause->first+clause->nTerm); j++) {
+            Roaring *term = locateTerm(db, &q.terms[j]);
+            if((term != NULL) && q.terms[j].negated) {
+                Roaring *rest = RoaringAndNot(all, term);
+                RoaringFree(term);
+                term = rest;
+            }
+            Roaring *next = (term != NULL) ? RoaringOr(match, term) : NULL;
+            RoaringFree(term);
+            RoaringFree(match);
+            match = next;
+        }
+        if(match == NULL)
+            goto fail;
+        if(found != NULL) {
+            Roaring *next = RoaringAnd(found, match);
+            RoaringFree(found);
+            RoaringFree(match);
+            if((found = next) == NULL)
+                goto fail;
+        } else
+            found = match;
+    }
+    if(found == NULL) {
+        /* 節が無ければ全レコード */
+        found = all;
+        all = NULL;
+    }
+    RoaringFree(all);
+    freeQuery(&q);
+    return found;
+
+fail:
+    RoaringFree(all);
+    RoaringFree(found);
+    freeQuery(&q);
+    return NULL;
+}
+
+size_t locateAll(const PostalDB *db, const char *key, uint32_t **recs) {
+    *recs = NULL;
+    if(isCompoundQuery(key)) {
+        Roaring *bm = locateQuery(db, key);
+        if(bm == NULL)
+            return (size_t)-1;
+        size_t n = (size_t)RoaringCardinality(bm), m = 0;
+        if((*recs = (uint32_t *)malloc((n > 0 ? n : 1)*sizeof(uint32_t))) != NULL) {
+            for(uint32_t rec = RoaringNext(bm, 0); rec != ROARING_NONE; rec = RoaringNext(bm, rec+1))
+                (*recs)[m++] = rec;
+        }
+        RoaringFree(bm);
+        return (*recs != NULL) ? m : (size_t)-1;
+    }
+    if(*key == '\0') {
+        if((*recs = (uint32_t *)malloc((db->nDb > 0 ? db->nDb : 1)*sizeof(uint32_t))) == NULL)
+            return (size_t)-1;
+        for(size_t i = 0; i < db->nDb; i++)
+            (*recs)[i] = (uint32_t)i;
+        return db->nDb;
+    }
+    size_t nCode = 0;
+    for(uint32_t rec = findCode(db, key); rec != NO_RECORD; rec = db->codeNext[rec])
+        nCode++;
+    size_t n = locateRecords(db, key, nCode, recs);
+    return (n != (size_t)-1) ? mergeCodeMatches(db, key, 0, *recs, n, n+nCode) : n;
+}
+
+size_t searchByFMIndex(const PostalDB *db, const char *key, uint32_t start, uint32_t *result, size_t resultSize) {
+    uint32_t *recs;
+    size_t n = locateAll(db, key, &recs), count = 0;
+    for(size_t i = 0; (n != (size_t)-1) && (i < n) && (count < resultSize); i++) {
+        if(recs[i] >= start)
+            result[count++] = recs[i];
+    }
+    free(recs);
+    return count;
+}
+
+size_t countByFMIndex(const PostalDB *db, const char *key, size_t limit) {
+    size_t row;
+    if((limit <= 1) && !isCompoundQuery(key))
+        return ((TextFMFind(&db->fm, key, &row) > 0) || (findCode(db, key) != NO_RECORD)) ? limit : 0;
+    uint32_t *recs;
+    size_t n = locateAll(db, key, &recs);
+    free(recs);
+    return (n == (size_t)-1) ? 0 : (n < limit) ? n : limit;
+}
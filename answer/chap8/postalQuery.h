@@ -0,0 +1,68 @@
+#ifndef POSTALQUERY_H
+#define POSTALQUERY_H
+
+#include "postalDB.h"
+
+/**
+ * 検索キーの語の区切りか調べる
+ */
+extern int isQuerySpace(char c);
+
+/**
+ * 複数の語またはフィールド指定を含む検索キーか調べる
+ * 含まない場合はキー全体を1つの文字列として検索する
+ * key: 正規化した検索キー（語は1つの半角空白で区切られている）
+ */
+extern int isCompoundQuery(const char *key);
+
+/**
+ * 空白で区切った各節をすべて満たすレコードを、インデックスを作ったレコードから探す
+ * "pref:東京都 city:千代田区"のように、項の先頭にpref:, city:, town:を付けると
+ * そのフィールドとその読みだけを調べる。付けない項は郵便番号の一致も含めて全フィールドを調べる。
+ * "A OR B"はAとBのどちらかを満たせばよく、"NOT A"はAを満たさないことを表す。
+ * 都道府県名と市区町村名は値の種類が少ないので、列の値ごとに一度だけ調べて
+ * 該当するレコードの範囲を得る。
+ * 候補の最も少ない節を基にレコード番号の一部分ずつビットマップを作り、
+ * 候補がその数倍以内の節はビットマップにして積（NOTなら差）を取る。
+ * 残りの節は積に残ったレコードごとに確かめるので、手間は最も少ない節の候補数に比例する
+ */
+extern size_t searchQuery(const PostalDB *db, const char *key, uint32_t start, uint32_t *result, size_t resultSize);
+
+/**
+ * 差分で追加したレコードのうちstart番以降から、条件に一致するものを探す
+ * 追加したレコードは少ないので、インデックスを使わずに順に調べる
+ * returns: 該当レコードの数
+ */
+extern size_t searchAdded(const PostalDB *db, const char *key, uint32_t start, uint32_t *result, size_t resultSize);
+
+/**
+ * 検索せずにインデックスの件数から該当レコード数が分かるキーなら、その数を求める
+ * 空文字列、郵便番号、1〜2文字の語（gram1つのレコード番号列がそのまま該当する）、
+ * 都道府県名・市区町村名・郵便番号の範囲の1項だけのキーが対象
+ * returns: 該当レコードの数。分からない場合(size_t)-1
+ */
+extern size_t countByIndex(const PostalDB *db, const char *key);
+
+/**
+ * FM-indexで検索条件に一致するレコードを全て求め、レコード順に並べる
+ * 出現は接尾辞の順に並ぶので、レコード順に一部だけを求めることはできない
+ * recs: 結果の配列を格納する場所。使い終わったらfreeで解放する
+ * returns: レコードの数。メモリが足りない場合(size_t)-1
+ */
+extern size_t locateAll(const PostalDB *db, const char *key, uint32_t **recs);
+
+/**
+ * FM-indexで検索条件に一致するstart番以降のレコードをレコード順に探す
+ * resultSizeに関わらず全ての該当を求めるので、続けて探す場合はlocateAllで1度に求めること
+ * returns: 該当レコードの数
+ */
+extern size_t searchByFMIndex(const PostalDB *db, const char *key, uint32_t start, uint32_t *result, size_t resultSize);
+
+/**
+ * FM-indexで検索条件に一致するレコードを数える
+ * 1件あるかだけなら、1語のキーは出現の範囲の幅と郵便番号のハッシュで分かるので文書を求めない
+ * returns: 該当レコードの数（limitまで）
+ */
+extern size_t countByFMIndex(const PostalDB *db, const char *key, size_t limit);
+
+#endif /* POSTALQUERY_H */
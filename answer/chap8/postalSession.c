@@ -0,0 +1,293 @@
+#include "postalSession.h"
+#include "postalNumber.h"
+#include "resultCache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#define SEARCH_SIZE 100 /* 1ページで返す検索結果の最大数 */
+#define NEXT_COMMAND "NEXT" /* 続きのページを要求するコマンド */
+#define RELOAD_COMMAND "RELOAD" /* データベースを取り込み直す管理コマンド */
+#define STATS_COMMAND "STATS" /* キャッシュの統計情報を返す管理コマンド */
+#define COUNT_COMMAND "COUNT " /* 続く検索キーの該当件数だけを返すコマンド */
+#define EXISTS_COMMAND "EXISTS " /* 続く検索キーに該当があるかだけを返すコマンド */
+#define FUZZY_COMMAND "FUZZY " /* 続く検索キーで誤字を許して検索するコマンド */
+#define FUZZY_DISTANCE 1 /* FUZZYで許す編集距離 */
+#define COMPLETE_COMMAND "COMPLETE " /* 続く入力中の文字列の補完候補を返すコマンド */
+#define GEOCODE_COMMAND "GEOCODE " /* 続く住所の郵便番号を返すコマンド */
+#define DELTA_COMMAND "DELTA " /* 続く年月(YYMM)の差分ファイルを適用する管理コマンド */
+#define DELTA_ADD_FILE "ADD_%s.CSV" /* 追加ファイル名 */
+#define DELTA_DEL_FILE "DEL_%s.CSV" /* 削除ファイル名 */
+#define KEY_SIZE 128 /* 検索キーの最大長+1 */
+#define CACHE_SHARDS 16 /* キャッシュの分割数 */
+
+/* 全接続共通の、最初のページの検索結果のキャッシュ */
+static ResultCache *cache = NULL;
+
+static void getString(FILE *fp, char *buf, size_t buflen) {
+    int ch;
+    buflen--;
+    while((ch = fgetc(fp)) != EOF) {
+        if(ch == '\r')
+            continue;
+        if(ch == '\n')
+            break;
+        if(buflen > 0) {
+            *(buf++) = ch;
+            buflen--;
+        }
+    }
+    *buf = '\0';
+}
+
+/* データベースを取り込み直し、結果をfpに書く */
+static void reload(FILE *fp) {
+    size_t n = PostalNumberReloadDB();
+    if(n > 0) {
+        fprintf(fp, "Reloaded %zu records (version %llu).\n", n, (unsigned long long)PostalNumberVersion());
+        PostalSessionReportDB(fp); /* 取り込み直すと古い版の分だけヒュージページが足りなくなることがある */
+    } else
+        fprintf(fp, "Failed to reload DB.\n");
+    fflush(fp);
+}
+
+/**
+ * 年月yymmの差分ファイルを適用し、結果をfpに書く
+ * 任意のファイルを読ませないよう、年月は4桁の数字に限る
+ */
+static void applyDelta(FILE *fp, const char *yymm) {
+    char addPath[32], delPath[32];
+    if((strlen(yymm) != 4) || (strspn(yymm, "0123456789") != 4)) {
+        fprintf(fp, "Invalid delta '%s'.\n", yymm);
+        return;
+    }
+    snprintf(addPath, sizeof(addPath), DELTA_ADD_FILE, yymm);
+    snprintf(delPath, sizeof(delPath), DELTA_DEL_FILE, yymm);
+    if(PostalNumberApplyDelta(addPath, delPath))
+        fprintf(fp, "Applied delta %s (version %llu).\n", yymm, (unsigned long long)PostalNumberVersion());
+    else
+        fprintf(fp, "Failed to apply delta %s.\n", yymm);
+    fflush(fp);
+}
+
+/* キャッシュの統計情報をfpに書く */
+static void stats(FILE *fp) {
+    fprintf(fp, "DB version %llu\n", (unsigned long long)PostalNumberVersion());
+    PostalSessionReportDB(fp);
+    if(cache == NULL) {
+        fprintf(fp, "Cache disabled.\n");
+        return;
+    }
+    ResultCacheStat st;
+    ResultCacheGetStat(cache, &st);
+    unsigned long total = st.hits+st.misses;
+    fprintf(fp, "Cache hits %lu misses %lu (%.1f%%) evictions %lu entries %zu bytes %zu/%zu\n",
+            st.hits, st.misses, (total > 0) ? st.hits*100.0/total : 0.0, st.evictions,
+            st.entries, st.bytes, st.budget);
+}
+
+/* 該当件数をfpに書く */
+static void count(FILE *fp, const char *key) {
+    fprintf(fp, "Count for '%s': %zu\n", key, PostalNumberCount(key));
+}
+
+/* 該当があるかをfpに書く */
+static void exists(FILE *fp, const char *key) {
+    fprintf(fp, "Exists for '%s': %s\n", key, PostalNumberExists(key) ? "yes" : "no");
+}
+
+/* 誤字を許した検索の結果を編集距離とともにfpに書く */
+static void fuzzy(FILE *fp, const char *key) {
+    if(!PostalNumberHasFeature(POSTAL_NUMBER_FEATURE_FUZZY)) {
+        fprintf(fp, "Fuzzy search is not available.\n");
+        return;
+    }
+    PostalNumberRef res[SEARCH_SIZE];
+    int dist[SEARCH_SIZE];
+    size_t n = PostalNumberSearchFuzzy(key, FUZZY_DISTANCE, res, dist, SEARCH_SIZE);
+    fprintf(fp, "Fuzzy search for '%s':\n", key);
+    for(size_t i = 0; i < n; i++) {
+        fprintf(fp, "  %d %s %s %s %s\n", dist[i], PostalNumberCode(res[i]), PostalNumberPref(res[i]),
+                PostalNumberCity(res[i]), PostalNumberTown(res[i]));
+    }
+}
+
+/* 入力補完の候補を、候補の住所の細かさに応じた部分までfpに書く */
+static void complete(FILE *fp, const char *prefix) {
+    if(!PostalNumberHasFeature(POSTAL_NUMBER_FEATURE_COMPLETE)) {
+        fprintf(fp, "Completion is not available.\n");
+        return;
+    }
+    PostalNumberCompletion res[POSTAL_NUMBER_COMPLETE_MAX];
+    size_t n = PostalNumberComplete(prefix, res, POSTAL_NUMBER_COMPLETE_MAX);
+    fprintf(fp, "Completions for '%s':\n", prefix);
+    for(size_t i = 0; i < n; i++) {
+        fprintf(fp, "  %s%s%s\n", PostalNumberPref(res[i].ref), (res[i].level >= 2) ? PostalNumberCity(res[i].ref) : "",
+                (res[i].level >= 3) ? PostalNumberTown(res[i].ref) : "");
+    }
+}
+
+/* 住所に一致したレコードを一致した細かさとともにfpに書く */
+static void geocode(FILE *fp, const char *address) {
+    if(!PostalNumberHasFeature(POSTAL_NUMBER_FEATURE_GEOCODE)) {
+        fprintf(fp, "Geocode is not available.\n");
+        return;
+    }
+    PostalNumberRef res[SEARCH_SIZE];
+    int level;
+    size_t n = PostalNumberGeocode(address, res, SEARCH_SIZE, &level);
+    fprintf(fp, "Geocode for '%s': level %d\n", address, level);
+    for(size_t i = 0; i < n; i++) {
+        fprintf(fp, "  %s %s %s %s\n", PostalNumberCode(res[i]), PostalNumberPref(res[i]),
+                PostalNumberCity(res[i]), PostalNumberTown(res[i]));
+    }
+}
+
+/**
+ * カーソルの続きの1ページ分の結果をfpに書く
+ * カーソルが前回の続きを覚えているので、先頭から検索し直すことはない
+ */
+static void writePage(FILE *fp, const char *key, PostalNumberCursor *cursor) {
+    PostalNumberRef res[SEARCH_SIZE];
+    size_t n = PostalNumberSearchNext(key, cursor, res, SEARCH_SIZE);
+    for(size_t i = 0; i < n; i++) {
+        fprintf(fp, "  %s %s %s %s\n", PostalNumberCode(res[i]), PostalNumberPref(res[i]),
+                PostalNumberCity(res[i]), PostalNumberTown(res[i]));
+    }
+}
+
+/**
+ * 最初のページの結果をfpに書く
+ * キャッシュにあればその内容と続きの位置を使い、無ければ検索して登録する
+ */
+static void writeFirstPage(FILE *fp, const char *key, PostalNumberCursor *cursor) {
+    char cacheKey[KEY_SIZE];
+    if((cache == NULL) || !PostalNumberNormalizeKey(key, cacheKey, sizeof(cacheKey))) {
+        writePage(fp, key, cursor);
+        return;
+    }
+    /* 値は1ページ目を返した後のカーソルと、送る内容を続けたもの */
+    size_t size;
+    char *value = (char *)ResultCacheGet(cache, cacheKey, cursor->version, &size);
+    if(value != NULL) {
+        memcpy(cursor, value, sizeof(*cursor));
+        fwrite(value+sizeof(*cursor), 1, size-sizeof(*cursor), fp);
+        free(value);
+        return;
+    }
+    char *text = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&text, &len);
+    if(mem == NULL) {
+        writePage(fp, key, cursor);
+        return;
+    }
+    writePage(mem, key, cursor);
+    fclose(mem);
+    fwrite(text, 1, len, fp);
+    value = (char *)malloc(sizeof(*cursor)+len);
+    if(value != NULL) {
+        memcpy(value, cursor, sizeof(*cursor));
+        memcpy(value+sizeof(*cursor), text, len);
+        ResultCachePut(cache, cacheKey, cursor->version, value, sizeof(*cursor)+len);
+        free(value);
+    }
+    free(text);
+}
+
+int PostalSessionEnableCache(size_t budget) {
+    cache = ResultCacheCreate(budget, CACHE_SHARDS);
+    return cache != NULL;
+}
+
+void PostalSessionRun(FILE *fp) {
+    fprintf(fp, "Search ? ");
+    fflush(fp);
+    char buf[KEY_SIZE];
+    getString(fp, buf, sizeof(buf));
+    if(strcmp(buf, RELOAD_COMMAND) == 0) {
+        reload(fp);
+        return;
+    }
+    if(strcmp(buf, STATS_COMMAND) == 0) {
+        stats(fp);
+        return;
+    }
+    if(strncmp(buf, DELTA_COMMAND, strlen(DELTA_COMMAND)) == 0) {
+        applyDelta(fp, buf+strlen(DELTA_COMMAND));
+        return;
+    }
+    if(strncmp(buf, COUNT_COMMAND, strlen(COUNT_COMMAND)) == 0) {
+        count(fp, buf+strlen(COUNT_COMMAND));
+        PostalNumberRelease();
+        return;
+    }
+    if(strncmp(buf, EXISTS_COMMAND, strlen(EXISTS_COMMAND)) == 0) {
+        exists(fp, buf+strlen(EXISTS_COMMAND));
+        PostalNumberRelease();
+        return;
+    }
+    if(strncmp(buf, FUZZY_COMMAND, strlen(FUZZY_COMMAND)) == 0) {
+        fuzzy(fp, buf+strlen(FUZZY_COMMAND));
+        PostalNumberRelease();
+        return;
+    }
+    if(strncmp(buf, COMPLETE_COMMAND, strlen(COMPLETE_COMMAND)) == 0) {
+        complete(fp, buf+strlen(COMPLETE_COMMAND));
+        PostalNumberRelease();
+        return;
+    }
+    if(strncmp(buf, GEOCODE_COMMAND, strlen(GEOCODE_COMMAND)) == 0) {
+        geocode(fp, buf+strlen(GEOCODE_COMMAND));
+        PostalNumberRelease();
+        return;
+    }
+    fprintf(fp, "Search for '%s':\n", buf);
+    PostalNumberCursor cursor;
+    PostalNumberCursorInit(&cursor);
+    writeFirstPage(fp, buf, &cursor);
+    while(!cursor.done) {
+        fprintf(fp, "Next ? ");
+        fflush(fp);
+        char cmd[16];
+        getString(fp, cmd, sizeof(cmd));
+        if(strcmp(cmd, NEXT_COMMAND) != 0)
+            break;
+        writePage(fp, buf, &cursor);
+    }
+    /* 次の接続まで古い版を持ち続けないようにする */
+    PostalNumberRelease();
+}
+
+/* SIGHUPを受けるたびにデータベースを取り込み直すスレッド */
+static void *doReloader(void *arg) {
+    sigset_t *set = (sigset_t *)arg;
+    int sig;
+    while(sigwait(set, &sig) == 0)
+        reload(stdout);
+    return NULL;
+}
+
+int PostalSessionStartReloader(void) {
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    /* 以降に作るスレッドにも引き継がれ、SIGHUPはsigwaitでだけ受け取る */
+    if(pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+        return 0;
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, doReloader, &set) != 0)
+        return 0;
+    pthread_detach(thread);
+    return 1;
+}
+
+void PostalSessionReportDB(FILE *fp) {
+    PostalNumberLoadStat st;
+    PostalNumberGetLoadStat(&st);
+    fprintf(fp, "DB %zu records from %s, memory %s%s (%.1f MB)\n", st.records, st.fromImage ? "image" : "CSV",
+            PostalNumberBackingName(st.backing), st.locked ? ", locked" : "", st.memoryBytes/1e6);
+    fflush(fp);
+}
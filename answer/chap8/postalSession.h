@@ -0,0 +1,46 @@
+#ifndef POSTALSESSION_H
+#define POSTALSESSION_H
+
+#include <stdio.h>
+
+/**
+ * クライアントとの1回の接続を処理する
+ * 検索キーを1行受け取って結果を返す。結果が1ページに収まらない場合は
+ * "Next ? "と尋ね、"NEXT"が送られてくる間は前回の続きを返す
+ * 検索キーの書き方はPostalNumberSearchと同じ（空白で区切った語はすべてを満たすものを探し、"OR"と"NOT"も使える。
+ * "pref:"等でフィールドを、"code:"で郵便番号の範囲を限定できる）
+ * 検索キーの代わりに"RELOAD"が送られてきた場合は、データベースを取り込み直す
+ * "DELTA YYMM"が送られてきた場合は、ADD_YYMM.CSVとDEL_YYMM.CSVの差分を適用する
+ * "STATS"が送られてきた場合は、データベースの版と置いたメモリ、キャッシュの統計情報を返す
+ * "COUNT 検索キー"には該当件数を、"EXISTS 検索キー"には該当があるかを返す
+ * "FUZZY 検索キー"には編集距離1までの誤字を許した結果を、距離の小さい順に1ページ分返す
+ * "COMPLETE 入力中の文字列"には、それに続く住所の候補を最大POSTAL_NUMBER_COMPLETE_MAX件返す
+ * "GEOCODE 住所"には、住所に最も長く一致した町域（無ければ市区町村か都道府県）のレコードを1ページ分返す
+ * fp: クライアントとの通信に使うFILEストリーム
+ */
+extern void PostalSessionRun(FILE *fp);
+
+/**
+ * 全接続で共有する検索結果のキャッシュを使うようにする
+ * 最初のページの結果をキーごとに保持し、同じ検索では検索し直さずに返す
+ * データベースを取り込み直すと古い版の結果は使わない
+ * 接続を受け付ける前に呼ぶこと
+ * budget: キャッシュの大きさの上限（バイト）
+ * returns: 成功した場合1, 失敗した場合0
+ */
+extern int PostalSessionEnableCache(size_t budget);
+
+/**
+ * SIGHUPを受けるたびにデータベースを取り込み直すスレッドを起動する
+ * 他のスレッドを作る前に呼ぶこと（SIGHUPをブロックする設定が引き継がれる）
+ * returns: 成功した場合1, 失敗した場合0
+ */
+extern int PostalSessionStartReloader(void);
+
+/**
+ * 最後に取り込んだデータベースのレコード数と、置いたメモリの種類と大きさを書く
+ * fp: 書き出すFILEストリーム
+ */
+extern void PostalSessionReportDB(FILE *fp);
+
+#endif /* POSTALSESSION_H */
@@ -0,0 +1,266 @@
+#include "resultCache.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_BUCKETS 64 /* 分割ごとのハッシュ表の初期サイズ */
+#define CACHE_LINE 64
+
+/**
+ * キャッシュの要素。キーと値は構造体の直後に続けて確保する
+ */
+typedef struct Entry_ {
+    struct Entry_ *chain;     /* 同じバケットの次の要素 */
+    struct Entry_ *prev;      /* LRUリストで1つ新しい要素 */
+    struct Entry_ *next;      /* LRUリストで1つ古い要素 */
+    size_t hash;
+    uint64_t version;         /* 値の元になったデータの版 */
+    size_t size;              /* 値の大きさ */
+    size_t cost;              /* 要素全体の大きさ */
+    char *key;
+    void *data;
+} Entry;
+
+/**
+ * キャッシュの分割1つ分。各メンバはmutexで保護する
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    Entry **buckets;          /* キーのハッシュ表 */
+    size_t nBucket;           /* 2のべき乗 */
+    Entry lru;                /* LRUリストの番兵。nextが最も新しく、prevが最も古い */
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+    uint64_t version;         /* これまでに見た最新の版 */
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    char pad[CACHE_LINE];     /* 隣の分割とキャッシュラインを共有しないようにする */
+} Shard;
+
+/**
+ * キャッシュ管理構造体
+ */
+struct ResultCache_ {
+    Shard *shards;
+    size_t nShard;            /* 2のべき乗 */
+    size_t budget;
+};
+
+static size_t keyHash(const char *key) {
+    uint64_t h = 0xcbf29ce484222325ULL; /* FNV-1a */
+    while(*key != '\0') {
+        h ^= (unsigned char)*(key++);
+        h *= 0x100000001b3ULL;
+    }
+    return (size_t)(h ^ (h >> 32));
+}
+
+/* 分割の選択に使ったビットを除いてバケットを決める */
+static size_t bucketOf(const ResultCache *cache, const Shard *shard, size_t hash) {
+    return (hash/cache->nShard) & (shard->nBucket-1);
+}
+
+static void lruUnlink(Entry *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void lruPushFront(Shard *shard, Entry *e) {
+    e->prev = &shard->lru;
+    e->next = shard->lru.next;
+    shard->lru.next->prev = e;
+    shard->lru.next = e;
+}
+
+/**
+ * 要素を分割から取り除いて解放する
+ */
+static void removeEntry(ResultCache *cache, Shard *shard, Entry *e) {
+    Entry **pp = &shard->buckets[bucketOf(cache, shard, e->hash)];
+    while(*pp != e)
+        pp = &(*pp)->chain;
+    *pp = e->chain;
+    lruUnlink(e);
+    shard->entries--;
+    shard->bytes -= e->cost;
+    free(e);
+}
+
+/**
+ * 新しい版を見たら、それより古い版の要素をすべて捨てる
+ * @return versionが分割の最新の版より古い場合0
+ */
+static int updateVersion(ResultCache *cache, Shard *shard, uint64_t version) {
+    if(version < shard->version)
+        return 0;
+    if(version > shard->version) {
+        while(shard->lru.next != &shard->lru)
+            removeEntry(cache, shard, shard->lru.next);
+        shard->version = version;
+    }
+    return 1;
+}
+
+/**
+ * キーの要素を探す
+ * @return 見つかった要素。無ければ NULL
+ */
+static Entry *findEntry(ResultCache *cache, Shard *shard, const char *key, size_t hash) {
+    Entry *e = shard->buckets[bucketOf(cache, shard, hash)];
+    while((e != NULL) && ((e->hash != hash) || (strcmp(e->key, key) != 0)))
+        e = e->chain;
+    return e;
+}
+
+/**
+ * ハッシュ表を倍の大きさに作り直す。失敗しても今の表を使い続ける
+ */
+static void growBuckets(ResultCache *cache, Shard *shard) {
+    size_t oldSize = shard->nBucket;
+    Entry **old = shard->buckets;
+    Entry **buckets = (Entry **)calloc(oldSize*2, sizeof(Entry *));
+    if(buckets == NULL)
+        return;
+    shard->buckets = buckets;
+    shard->nBucket = oldSize*2;
+    for(size_t i = 0; i < oldSize; i++) {
+        Entry *e = old[i];
+        while(e != NULL) {
+            Entry *chain = e->chain;
+            size_t b = bucketOf(cache, shard, e->hash);
+            e->chain = buckets[b];
+            buckets[b] = e;
+            e = chain;
+        }
+    }
+    free(old);
+}
+
+ResultCache *ResultCacheCreate(size_t budget, int nShard) {
+    ResultCache *cache = (ResultCache *)calloc(1, sizeof(ResultCache));
+    if(cache == NULL)
+        return NULL;
+    cache->nShard = 1;
+    while((int)cache->nShard < nShard)
+        cache->nShard *= 2;
+    cache->budget = budget;
+    cache->shards = (Shard *)calloc(cache->nShard, sizeof(Shard));
+    if(cache->shards == NULL) {
+        free(cache);
+        return NULL;
+    }
+    for(size_t i = 0; i < cache->nShard; i++) {
+        Shard *shard = &cache->shards[i];
+        shard->nBucket = INITIAL_BUCKETS;
+        shard->buckets = (Entry **)calloc(shard->nBucket, sizeof(Entry *));
+        if(shard->buckets == NULL) {
+            cache->nShard = i;
+            ResultCacheDestroy(cache);
+            return NULL;
+        }
+        pthread_mutex_init(&shard->mutex, NULL);
+        shard->lru.next = shard->lru.prev = &shard->lru;
+        shard->budget = budget/cache->nShard;
+    }
+    return cache;
+}
+
+void ResultCacheDestroy(ResultCache *cache) {
+    if(cache == NULL)
+        return;
+    for(size_t i = 0; i < cache->nShard; i++) {
+        Shard *shard = &cache->shards[i];
+        Entry *e = shard->lru.next;
+        while(e != &shard->lru) {
+            Entry *next = e->next;
+            free(e);
+            e = next;
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    free(cache->shards);
+    free(cache);
+}
+
+void *ResultCacheGet(ResultCache *cache, const char *key, uint64_t version, size_t *size) {
+    size_t hash = keyHash(key);
+    Shard *shard = &cache->shards[hash & (cache->nShard-1)];
+    void *data = NULL;
+    pthread_mutex_lock(&shard->mutex);
+    Entry *e = updateVersion(cache, shard, version) ? findEntry(cache, shard, key, hash) : NULL;
+    if((e != NULL) && (e->version == version) && ((data = malloc(e->size > 0 ? e->size : 1)) != NULL)) {
+        memcpy(data, e->data, e->size);
+        *size = e->size;
+        /* 使われたのでLRUリストの先頭に移す */
+        lruUnlink(e);
+        lruPushFront(shard, e);
+        shard->hits++;
+    } else
+        shard->misses++;
+    pthread_mutex_unlock(&shard->mutex);
+    return data;
+}
+
+int ResultCachePut(ResultCache *cache, const char *key, uint64_t version, const void *data, size_t size) {
+    size_t hash = keyHash(key);
+    Shard *shard = &cache->shards[hash & (cache->nShard-1)];
+    size_t keyLen = strlen(key)+1;
+    size_t cost = sizeof(Entry)+keyLen+size;
+    if(cost > shard->budget)
+        return 0;
+    /* ロックを取る前に要素を作っておく */
+    Entry *e = (Entry *)malloc(cost);
+    if(e == NULL)
+        return 0;
+    e->hash = hash;
+    e->version = version;
+    e->size = size;
+    e->cost = cost;
+    e->key = (char *)(e+1);
+    e->data = e->key+keyLen;
+    memcpy(e->key, key, keyLen);
+    memcpy(e->data, data, size);
+
+    pthread_mutex_lock(&shard->mutex);
+    if(!updateVersion(cache, shard, version)) {
+        /* すでに新しい版の結果を扱っている */
+        pthread_mutex_unlock(&shard->mutex);
+        free(e);
+        return 0;
+    }
+    Entry *old = findEntry(cache, shard, key, hash);
+    if(old != NULL)
+        removeEntry(cache, shard, old);
+    while(shard->bytes+cost > shard->budget) {
+        removeEntry(cache, shard, shard->lru.prev);
+        shard->evictions++;
+    }
+    if(shard->entries >= shard->nBucket)
+        growBuckets(cache, shard);
+    size_t b = bucketOf(cache, shard, hash);
+    e->chain = shard->buckets[b];
+    shard->buckets[b] = e;
+    lruPushFront(shard, e);
+    shard->entries++;
+    shard->bytes += cost;
+    pthread_mutex_unlock(&shard->mutex);
+    return 1;
+}
+
+void ResultCacheGetStat(ResultCache *cache, ResultCacheStat *stat) {
+    memset(stat, 0, sizeof(*stat));
+    stat->budget = cache->budget;
+    for(size_t i = 0; i < cache->nShard; i++) {
+        Shard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        stat->hits += shard->hits;
+        stat->misses += shard->misses;
+        stat->evictions += shard->evictions;
+        stat->entries += shard->entries;
+        stat->bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
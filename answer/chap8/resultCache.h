@@ -0,0 +1,72 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/**
+ * 検索結果キャッシュ型（仮宣言）
+ */
+typedef struct ResultCache_ ResultCache;
+
+/**
+ * キャッシュの統計情報
+ */
+typedef struct {
+    unsigned long hits;       /* 見つかった回数 */
+    unsigned long misses;     /* 見つからなかった回数 */
+    unsigned long evictions;  /* 容量を超えたので追い出した回数 */
+    size_t entries;           /* 保持している要素数 */
+    size_t bytes;             /* 保持している要素の大きさの合計 */
+    size_t budget;            /* 大きさの上限 */
+} ResultCacheStat;
+
+/**
+ * キャッシュを作る
+ * キーのハッシュ値でnShard個に分け、それぞれを別のロックで保護するので、
+ * 複数のスレッドから同時に使っても互いに待たされにくい
+ * 分けたそれぞれで、最も長く使われていない要素から追い出す
+ * @param budget 保持する要素の大きさの合計の上限（バイト）
+ * @param nShard 分割数。2のべき乗に切り上げる
+ * @return 作成したキャッシュへのポインタ。作成に失敗した場合 NULL
+ */
+extern ResultCache *ResultCacheCreate(size_t budget, int nShard);
+
+/**
+ * キャッシュを削除する
+ * @param cache 削除するキャッシュへのポインタ
+ */
+extern void ResultCacheDestroy(ResultCache *cache);
+
+/**
+ * キーに対応する値を取り出す
+ * versionが登録時と異なる要素は古いものとして扱い、見つからなかったことにする
+ * 新しい版を指定されると、その分割にある古い版の要素はすべて捨てる
+ * @param cache 対象キャッシュへのポインタ
+ * @param key キー
+ * @param version 値の元になったデータの版
+ * @param size 値の大きさを格納する場所
+ * @return 値のコピー（使い終わったらfreeする）。見つからなかった場合 NULL
+ */
+extern void *ResultCacheGet(ResultCache *cache, const char *key, uint64_t version, size_t *size);
+
+/**
+ * キーに対応する値を登録する。すでにあれば置き換える
+ * 容量を超える場合は最も長く使われていない要素から追い出す
+ * @param cache 対象キャッシュへのポインタ
+ * @param key キー
+ * @param version 値の元になったデータの版
+ * @param data 値
+ * @param size 値の大きさ
+ * @return 登録した場合1。大きすぎる、メモリが足りない場合0
+ */
+extern int ResultCachePut(ResultCache *cache, const char *key, uint64_t version, const void *data, size_t size);
+
+/**
+ * 統計情報を得る
+ * @param cache 対象キャッシュへのポインタ
+ * @param stat 結果を格納する場所
+ */
+extern void ResultCacheGetStat(ResultCache *cache, ResultCacheStat *stat);
+
+#endif /* RESULTCACHE_H */
@@ -0,0 +1,477 @@
+#include "roaring.h"
+#include <string.h>
+
+#define ARRAY_MAX 4096     /* これより要素が多いコンテナはビット列にする */
+#define BITMAP_WORDS 1024  /* 65536ビット分 */
+
+/**
+ * 上位16ビットが同じ要素をまとめたコンテナ
+ * arrayとbitsのどちらか一方だけを使う
+ */
+typedef struct {
+    uint16_t key;        /* 要素の上位16ビット */
+    uint32_t card;       /* 要素数 */
+    uint32_t cap;        /* arrayの容量 */
+    uint16_t *array;     /* 下位16ビットの昇順の配列 */
+    uint64_t *bits;      /* 下位16ビットのビット列 */
+} Container;
+
+/**
+ * 圧縮ビットマップ管理構造体
+ */
+struct Roaring_ {
+    Container *conts;    /* keyの昇順 */
+    size_t n;
+    size_t cap;
+};
+
+static void freeContainer(Container *c) {
+    free(c->array);
+    free(c->bits);
+    c->array = NULL;
+    c->bits = NULL;
+    c->card = c->cap = 0;
+}
+
+/* keyのコンテナ以降で最初の位置を二分探索で求める */
+static size_t lowerKey(const Roaring *bm, uint16_t key) {
+    size_t lo = 0, hi = bm->n;
+    if((hi > 0) && (bm->conts[hi-1].key < key))
+        return hi; /* 昇順に追加している場合 */
+    while(lo < hi) {
+        size_t mid = lo+(hi-lo)/2;
+        if(bm->conts[mid].key < key)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* 昇順のarray[pos..n)からx以上の最初の位置を指数探索で求める */
+static uint32_t gallop(const uint16_t *array, uint32_t n, uint32_t pos, uint16_t x) {
+    uint32_t step = 1, hi = pos;
+    while((hi < n) && (array[hi] < x)) {
+        pos = hi+1;
+        hi += step;
+        step *= 2;
+    }
+    if(hi > n)
+        hi = n;
+    while(pos < hi) {
+        uint32_t mid = pos+(hi-pos)/2;
+        if(array[mid] < x)
+            pos = mid+1;
+        else
+            hi = mid;
+    }
+    return pos;
+}
+
+static int testBit(const uint64_t *bits, uint16_t x) {
+    return (bits[x/64] >> (x%64)) & 1;
+}
+
+/* 配列コンテナをビット列に変える */
+static int toBitmap(Container *c) {
+    uint64_t *bits = (uint64_t *)calloc(BITMAP_WORDS, sizeof(uint64_t));
+    if(bits == NULL)
+        return 0;
+    for(uint32_t i = 0; i < c->card; i++)
+        bits[c->array[i]/64] |= 1ULL << (c->array[i]%64);
+    free(c->array);
+    c->array = NULL;
+    c->cap = 0;
+    c->bits = bits;
+    return 1;
+}
+
+/* 要素が少なくなったビット列コンテナを配列に変える。できなければビット列のまま */
+static void shrinkBitmap(Container *c) {
+    if((c->bits == NULL) || (c->card > ARRAY_MAX))
+        return;
+    uint16_t *array = (uint16_t *)malloc((c->card > 0 ? c->card : 1)*sizeof(uint16_t));
+    if(array == NULL)
+        return;
+    uint32_t n = 0;
+    for(uint32_t w = 0; w < BITMAP_WORDS; w++) {
+        for(uint64_t x = c->bits[w]; x != 0; x &= x-1)
+            array[n++] = (uint16_t)(w*64+__builtin_ctzll(x));
+    }
+    free(c->bits);
+    c->bits = NULL;
+    c->array = array;
+    c->cap = c->card;
+}
+
+static uint32_t countBits(const uint64_t *bits) {
+    uint32_t n = 0;
+    for(uint32_t w = 0; w < BITMAP_WORDS; w++)
+        n += (uint32_t)__builtin_popcountll(bits[w]);
+    return n;
+}
+
+/**
+ * posの位置にkeyの空のコンテナを挿入する
+ * returns: コンテナ。メモリが足りない場合NULL
+ */
+static Container *insertContainer(Roaring *bm, size_t pos, uint16_t key) {
+    if(bm->n >= bm->cap) {
+        size_t cap = (bm->cap == 0) ? 4 : bm->cap*2;
+        Container *conts = (Container *)realloc(bm->conts, cap*sizeof(Container));
+        if(conts == NULL)
+            return NULL;
+        bm->conts = conts;
+        bm->cap = cap;
+    }
+    memmove(bm->conts+pos+1, bm->conts+pos, (bm->n-pos)*sizeof(Container));
+    bm->n++;
+    Container *c = &bm->conts[pos];
+    memset(c, 0, sizeof(*c));
+    c->key = key;
+    return c;
+}
+
+/* 演算結果のコンテナを末尾に加える。空なら捨てる */
+static int appendContainer(Roaring *bm, Container *c) {
+    if(c->card == 0) {
+        freeContainer(c);
+        return 1;
+    }
+    Container *dst = insertContainer(bm, bm->n, c->key);
+    if(dst == NULL) {
+        freeContainer(c);
+        return 0;
+    }
+    *dst = *c;
+    return 1;
+}
+
+/* コンテナを複製する */
+static int copyContainer(const Container *src, Container *dst) {
+    memset(dst, 0, sizeof(*dst));
+    dst->key = src->key;
+    dst->card = src->card;
+    if(src->bits != NULL) {
+        dst->bits = (uint64_t *)malloc(BITMAP_WORDS*sizeof(uint64_t));
+        if(dst->bits == NULL)
+            return 0;
+        memcpy(dst->bits, src->bits, BITMAP_WORDS*sizeof(uint64_t));
+    } else {
+        dst->array = (uint16_t *)malloc((src->card > 0 ? src->card : 1)*sizeof(uint16_t));
+        if(dst->array == NULL)
+            return 0;
+        memcpy(dst->array, src->array, src->card*sizeof(uint16_t));
+        dst->cap = src->card;
+    }
+    return 1;
+}
+
+Roaring *RoaringCreate(void) {
+    return (Roaring *)calloc(1, sizeof(Roaring));
+}
+
+void RoaringFree(Roaring *bm) {
+    if(bm == NULL)
+        return;
+    for(size_t i = 0; i < bm->n; i++)
+        freeContainer(&bm->conts[i]);
+    free(bm->conts);
+    free(bm);
+}
+
+int RoaringAdd(Roaring *bm, uint32_t x) {
+    uint16_t key = (uint16_t)(x >> 16), low = (uint16_t)x;
+    size_t pos = lowerKey(bm, key);
+    Container *c = ((pos < bm->n) && (bm->conts[pos].key == key)) ? &bm->conts[pos] : insertContainer(bm, pos, key);
+    if(c == NULL)
+        return 0;
+    if(c->bits != NULL) {
+        if(!testBit(c->bits, low)) {
+            c->bits[low/64] |= 1ULL << (low%64);
+            c->card++;
+        }
+        return 1;
+    }
+    uint32_t i = ((c->card > 0) && (c->array[c->card-1] < low)) ? c->card : gallop(c->array, c->card, 0, low);
+    if((i < c->card) && (c->array[i] == low))
+        return 1;
+    if(c->card >= ARRAY_MAX) {
+        if(!toBitmap(c))
+            return 0;
+        c->bits[low/64] |= 1ULL << (low%64);
+        c->card++;
+        return 1;
+    }
+    if(c->card >= c->cap) {
+        uint32_t cap = (c->cap == 0) ? 16 : c->cap*2;
+        if(cap > ARRAY_MAX)
+            cap = ARRAY_MAX;
+        uint16_t *array = (uint16_t *)realloc(c->array, cap*sizeof(uint16_t));
+        if(array == NULL)
+            return 0;
+        c->array = array;
+        c->cap = cap;
+    }
+    memmove(c->array+i+1, c->array+i, (c->card-i)*sizeof(uint16_t));
+    c->array[i] = low;
+    c->card++;
+    return 1;
+}
+
+int RoaringAddRange(Roaring *bm, uint32_t begin, uint32_t end) {
+    while(begin < end) {
+        /* コンテナ1つ分ずつ加える */
+        uint32_t next = ((begin >> 16)+1) << 16;
+        uint32_t stop = ((next == 0) || (next > end)) ? end : next;
+        uint16_t key = (uint16_t)(begin >> 16);
+        size_t pos = lowerKey(bm, key);
+        Container *c = ((pos < bm->n) && (bm->conts[pos].key == key)) ? &bm->conts[pos] : insertContainer(bm, pos, key);
+        if(c == NULL)
+            return 0;
+        if((c->bits == NULL) && (c->card+(stop-begin) > ARRAY_MAX) && !toBitmap(c))
+            return 0;
+        if(c->bits != NULL) {
+            for(uint32_t x = begin; x < stop; x++)
+                c->bits[(x & 0xffff)/64] |= 1ULL << (x%64);
+            c->card = countBits(c->bits);
+        } else {
+            for(uint32_t x = begin; x < stop; x++) {
+                if(!RoaringAdd(bm, x))
+                    return 0;
+            }
+        }
+        if(stop == end)
+            break;
+        begin = stop;
+    }
+    return 1;
+}
+
+int RoaringContains(const Roaring *bm, uint32_t x) {
+    uint16_t key = (uint16_t)(x >> 16), low = (uint16_t)x;
+    size_t pos = lowerKey(bm, key);
+    if((pos >= bm->n) || (bm->conts[pos].key != key))
+        return 0;
+    const Container *c = &bm->conts[pos];
+    if(c->bits != NULL)
+        return testBit(c->bits, low);
+    uint32_t i = gallop(c->array, c->card, 0, low);
+    return (i < c->card) && (c->array[i] == low);
+}
+
+uint32_t RoaringNext(const Roaring *bm, uint32_t from) {
+    uint16_t key = (uint16_t)(from >> 16);
+    uint32_t low = from & 0xffff;
+    for(size_t pos = lowerKey(bm, key); pos < bm->n; pos++) {
+        const Container *c = &bm->conts[pos];
+        if(c->key != key)
+            low = 0; /* 後ろのコンテナは先頭から */
+        uint32_t base = (uint32_t)c->key << 16;
+        if(c->bits != NULL) {
+            uint32_t w = low/64;
+            uint64_t x = c->bits[w] & (~0ULL << (low%64));
+            while(x == 0) {
+                if(++w >= BITMAP_WORDS)
+                    break;
+                x = c->bits[w];
+            }
+            if(w < BITMAP_WORDS)
+                return base+w*64+(uint32_t)__builtin_ctzll(x);
+        } else {
+            uint32_t i = gallop(c->array, c->card, 0, (uint16_t)low);
+            if(i < c->card)
+                return base+c->array[i];
+        }
+    }
+    return ROARING_NONE;
+}
+
+uint64_t RoaringCardinality(const Roaring *bm) {
+    uint64_t n = 0;
+    for(size_t i = 0; i < bm->n; i++)
+        n += bm->conts[i].card;
+    return n;
+}
+
+/* 配列どうしの積。小さい方の各要素を大きい方から探す */
+static int andArrays(const Container *a, const Container *b, Container *out) {
+    if(a->card > b->card) {
+        const Container *t = a;
+        a = b;
+        b = t;
+    }
+    out->array = (uint16_t *)malloc((a->card > 0 ? a->card : 1)*sizeof(uint16_t));
+    if(out->array == NULL)
+        return 0;
+    out->cap = a->card;
+    uint32_t pos = 0;
+    for(uint32_t i = 0; (i < a->card) && (pos < b->card); i++) {
+        pos = gallop(b->array, b->card, pos, a->array[i]);
+        if((pos < b->card) && (b->array[pos] == a->array[i]))
+            out->array[out->card++] = a->array[i];
+    }
+    return 1;
+}
+
+/* 配列の要素のうちビット列に含まれる（含まれない）ものを取り出す */
+static int filterArray(const Container *a, const uint64_t *bits, int keep, Container *out) {
+    out->array = (uint16_t *)malloc((a->card > 0 ? a->card : 1)*sizeof(uint16_t));
+    if(out->array == NULL)
+        return 0;
+    out->cap = a->card;
+    for(uint32_t i = 0; i < a->card; i++) {
+        if(testBit(bits, a->array[i]) == keep)
+            out->array[out->card++] = a->array[i];
+    }
+    return 1;
+}
+
+/* ビット列どうしの演算。op: 0なら積、1なら和、2なら差 */
+static int combineBitmaps(const uint64_t *a, const uint64_t *b, int op, Container *out) {
+    out->bits = (uint64_t *)malloc(BITMAP_WORDS*sizeof(uint64_t));
+    if(out->bits == NULL)
+        return 0;
+    for(uint32_t w = 0; w < BITMAP_WORDS; w++)
+        out->bits[w] = (op == 0) ? (a[w] & b[w]) : (op == 1) ? (a[w] | b[w]) : (a[w] & ~b[w]);
+    out->card = countBits(out->bits);
+    shrinkBitmap(out);
+    return 1;
+}
+
+/* コンテナをビット列として得る。配列なら一時的なビット列を作る */
+static const uint64_t *bitsOf(const Container *c, uint64_t *tmp) {
+    if(c->bits != NULL)
+        return c->bits;
+    memset(tmp, 0, BITMAP_WORDS*sizeof(uint64_t));
+    for(uint32_t i = 0; i < c->card; i++)
+        tmp[c->array[i]/64] |= 1ULL << (c->array[i]%64);
+    return tmp;
+}
+
+Roaring *RoaringAnd(const Roaring *a, const Roaring *b) {
+    Roaring *r = RoaringCreate();
+    if(r == NULL)
+        return NULL;
+    size_t i = 0, j = 0;
+    while((i < a->n) && (j < b->n)) {
+        const Container *ca = &a->conts[i], *cb = &b->conts[j];
+        if(ca->key < cb->key) {
+            i++;
+            continue;
+        }
+        if(cb->key < ca->key) {
+            j++;
+            continue;
+        }
+        Container out;
+        memset(&out, 0, sizeof(out));
+        out.key = ca->key;
+        int ok;
+        if((ca->bits == NULL) && (cb->bits == NULL))
+            ok = andArrays(ca, cb, &out);
+        else if(ca->bits == NULL)
+            ok = filterArray(ca, cb->bits, 1, &out);
+        else if(cb->bits == NULL)
+            ok = filterArray(cb, ca->bits, 1, &out);
+        else
+            ok = combineBitmaps(ca->bits, cb->bits, 0, &out);
+        if(!ok || !appendContainer(r, &out)) {
+            freeContainer(&out);
+            RoaringFree(r);
+            return NULL;
+        }
+        i++;
+        j++;
+    }
+    return r;
+}
+
+Roaring *RoaringOr(const Roaring *a, const Roaring *b) {
+    Roaring *r = RoaringCreate();
+    uint64_t *tmp = (uint64_t *)malloc(BITMAP_WORDS*sizeof(uint64_t));
+    if((r == NULL) || (tmp == NULL))
+        goto fail;
+    size_t i = 0, j = 0;
+    while((i < a->n) || (j < b->n)) {
+        Container out;
+        int ok;
+        if((j >= b->n) || ((i < a->n) && (a->conts[i].key < b->conts[j].key)))
+            ok = copyContainer(&a->conts[i++], &out);
+        else if((i >= a->n) || (b->conts[j].key < a->conts[i].key))
+            ok = copyContainer(&b->conts[j++], &out);
+        else {
+            const Container *ca = &a->conts[i++], *cb = &b->conts[j++];
+            memset(&out, 0, sizeof(out));
+            out.key = ca->key;
+            if((ca->bits == NULL) && (cb->bits == NULL) && (ca->card+cb->card <= ARRAY_MAX)) {
+                /* 配列どうしで収まるなら併合する */
+                ok = (out.array = (uint16_t *)malloc((ca->card+cb->card+1)*sizeof(uint16_t))) != NULL;
+                uint32_t x = 0, y = 0;
+                while(ok && ((x < ca->card) || (y < cb->card))) {
+                    if((y >= cb->card) || ((x < ca->card) && (ca->array[x] < cb->array[y])))
+                        out.array[out.card++] = ca->array[x++];
+                    else if((x >= ca->card) || (cb->array[y] < ca->array[x]))
+                        out.array[out.card++] = cb->array[y++];
+                    else {
+                        out.array[out.card++] = ca->array[x++];
+                        y++;
+                    }
+                }
+                out.cap = ca->card+cb->card+1;
+            } else {
+                uint64_t *tmpB = (uint64_t *)malloc(BITMAP_WORDS*sizeof(uint64_t));
+                ok = (tmpB != NULL) && combineBitmaps(bitsOf(ca, tmp), bitsOf(cb, tmpB), 1, &out);
+                free(tmpB);
+            }
+        }
+        if(!ok || !appendContainer(r, &out)) {
+            freeContainer(&out);
+            goto fail;
+        }
+    }
+    free(tmp);
+    return r;
+
+fail:
+    free(tmp);
+    RoaringFree(r);
+    return NULL;
+}
+
+Roaring *RoaringAndNot(const Roaring *a, const Roaring *b) {
+    Roaring *r = RoaringCreate();
+    uint64_t *tmp = (uint64_t *)malloc(BITMAP_WORDS*sizeof(uint64_t));
+    if((r == NULL) || (tmp == NULL))
+        goto fail;
+    size_t j = 0;
+    for(size_t i = 0; i < a->n; i++) {
+        const Container *ca = &a->conts[i];
+        while((j < b->n) && (b->conts[j].key < ca->key))
+            j++;
+        Container out;
+        int ok;
+        if((j >= b->n) || (b->conts[j].key != ca->key))
+            ok = copyContainer(ca, &out);
+        else {
+            const Container *cb = &b->conts[j];
+            memset(&out, 0, sizeof(out));
+            out.key = ca->key;
+            if(ca->bits == NULL)
+                ok = filterArray(ca, bitsOf(cb, tmp), 0, &out);
+            else
+                ok = combineBitmaps(ca->bits, bitsOf(cb, tmp), 2, &out);
+        }
+        if(!ok || !appendContainer(r, &out)) {
+            freeContainer(&out);
+            goto fail;
+        }
+    }
+    free(tmp);
+    return r;
+
+fail:
+    free(tmp);
+    RoaringFree(r);
+    return NULL;
+}
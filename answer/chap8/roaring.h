@@ -0,0 +1,90 @@
+#ifndef ROARING_H
+#define ROARING_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/**
+ * 圧縮ビットマップ型（仮宣言）
+ * 32ビット整数の集合を上位16ビットごとのコンテナに分けて持つ。各コンテナは
+ * 要素が少なければ下位16ビットの整列済み配列、多ければ65536ビットのビット列にする
+ */
+typedef struct Roaring_ Roaring;
+
+#define ROARING_NONE UINT32_MAX /* RoaringNextで要素が無いことを示す */
+
+/**
+ * 空の集合を作る
+ * @return 作成した集合へのポインタ。作成に失敗した場合 NULL
+ */
+extern Roaring *RoaringCreate(void);
+
+/**
+ * 集合を削除する
+ * @param bm 削除する集合へのポインタ（NULLでもよい）
+ */
+extern void RoaringFree(Roaring *bm);
+
+/**
+ * 要素を追加する。昇順に追加すると速い
+ * @param bm 対象の集合
+ * @param x 追加する要素
+ * @return 成功した場合1。メモリが足りない場合0
+ */
+extern int RoaringAdd(Roaring *bm, uint32_t x);
+
+/**
+ * [begin, end)の要素をすべて追加する
+ * @param bm 対象の集合
+ * @param begin 範囲の先頭
+ * @param end 範囲の終わり
+ * @return 成功した場合1。メモリが足りない場合0
+ */
+extern int RoaringAddRange(Roaring *bm, uint32_t begin, uint32_t end);
+
+/**
+ * 要素を含むか調べる
+ * @param bm 対象の集合
+ * @param x 調べる要素
+ * @return 含む場合1
+ */
+extern int RoaringContains(const Roaring *bm, uint32_t x);
+
+/**
+ * from以上の最小の要素を得る
+ * @param bm 対象の集合
+ * @param from 探し始める値
+ * @return 要素。無ければROARING_NONE
+ */
+extern uint32_t RoaringNext(const Roaring *bm, uint32_t from);
+
+/**
+ * 要素数を得る
+ * @param bm 対象の集合
+ * @return 要素数
+ */
+extern uint64_t RoaringCardinality(const Roaring *bm);
+
+/**
+ * 積集合を作る。配列どうしは小さい方の各要素を大きい方から指数探索するので、
+ * 手間は小さい方の要素数にほぼ比例する
+ * @param a, b 対象の集合
+ * @return 新しく作った集合。メモリが足りない場合 NULL
+ */
+extern Roaring *RoaringAnd(const Roaring *a, const Roaring *b);
+
+/**
+ * 和集合を作る
+ * @param a, b 対象の集合
+ * @return 新しく作った集合。メモリが足りない場合 NULL
+ */
+extern Roaring *RoaringOr(const Roaring *a, const Roaring *b);
+
+/**
+ * 差集合（aに含まれbに含まれないもの）を作る
+ * @param a, b 対象の集合
+ * @return 新しく作った集合。メモリが足りない場合 NULL
+ */
+extern Roaring *RoaringAndNot(const Roaring *a, const Roaring *b);
+
+#endif /* ROARING_H */
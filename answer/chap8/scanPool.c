@@ -0,0 +1,223 @@
+#include "scanPool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SCAN_CHUNK 4096 /* 1チャンクの要素数 */
+#define SCAN_BLOCK 256 /* 打ち切りを確かめる間隔 */
+#define NOT_DONE SIZE_MAX /* 処理が終わっていないチャンクの該当数 */
+
+/**
+ * スレッドプール管理構造体
+ */
+struct ScanPool_ {
+    int nThread;              /* 呼び出し元スレッドを含むスレッド数 */
+    pthread_t *threads;       /* ワーカースレッド（nThread-1個）*/
+    pthread_mutex_t jobLock;  /* 1度に1つのジョブだけを実行するためのロック */
+    pthread_mutex_t mutex;    /* 以下のメンバを保護する */
+    pthread_cond_t start;     /* ジョブの開始・プールの削除を通知する */
+    pthread_cond_t finish;    /* チャンクの処理完了を通知する */
+    unsigned long generation; /* ジョブ番号 */
+    int quit;                 /* プール削除要求 */
+    /* 実行中のジョブ */
+    ScanRangeFunc scan;
+    const void *arg;
+    uint32_t begin, end;
+    size_t resultSize;
+    size_t nChunk;            /* チャンク数 */
+    size_t nextChunk;         /* 次に処理するチャンク */
+    size_t nActive;           /* 処理中のチャンク数 */
+    size_t prefixDone;        /* 先頭から連続して処理を終えたチャンク数 */
+    size_t prefixCount;       /* それらのチャンクの該当数の合計 */
+    size_t stopChunk;         /* これ以降のチャンクは不要 */
+    size_t *chunkCount;       /* チャンクごとの該当数 */
+    uint32_t *scratch;        /* チャンクごとの結果。各チャンクの先頭位置から詰める */
+    size_t capacity;          /* scratchの要素数 */
+};
+
+/**
+ * 1チャンク分を調べる。ロックを外して呼ぶ
+ * @return 該当数
+ */
+static size_t scanChunk(ScanPool *pool, size_t chunk) {
+    uint32_t b = pool->begin+(uint32_t)(chunk*SCAN_CHUNK);
+    uint32_t e = (pool->end-b > SCAN_CHUNK) ? b+SCAN_CHUNK : pool->end;
+    uint32_t *out = pool->scratch+(b-pool->begin);
+    size_t count = 0;
+    for(uint32_t rec = b; (rec < e) && (count < pool->resultSize); rec += SCAN_BLOCK) {
+        /* 前のチャンクだけで足りるようになったら打ち切る */
+        if(chunk >= __atomic_load_n(&pool->stopChunk, __ATOMIC_RELAXED))
+            break;
+        uint32_t blockEnd = (e-rec > SCAN_BLOCK) ? rec+SCAN_BLOCK : e;
+        count += pool->scan(rec, blockEnd, out+count, pool->resultSize-count, pool->arg);
+    }
+    return count;
+}
+
+/**
+ * 未処理のチャンクが無くなるまで取り出して処理する。ロックを取得して呼ぶ
+ */
+static void processChunks(ScanPool *pool) {
+    while((pool->nextChunk < pool->nChunk) && (pool->nextChunk < pool->stopChunk)) {
+        size_t chunk = pool->nextChunk++;
+        pool->nActive++;
+        pthread_mutex_unlock(&pool->mutex);
+        size_t count = scanChunk(pool, chunk);
+        pthread_mutex_lock(&pool->mutex);
+        pool->nActive--;
+        pool->chunkCount[chunk] = count;
+        /* 先頭から連続して終わった分で足りていれば、以降のチャンクを止める */
+        while((pool->prefixDone < pool->nChunk) && (pool->chunkCount[pool->prefixDone] != NOT_DONE))
+            pool->prefixCount += pool->chunkCount[pool->prefixDone++];
+        if((pool->prefixCount >= pool->resultSize) && (pool->prefixDone < pool->stopChunk))
+            __atomic_store_n(&pool->stopChunk, pool->prefixDone, __ATOMIC_RELAXED);
+        pthread_cond_signal(&pool->finish);
+    }
+}
+
+/* ワーカースレッド処理 */
+static void *doScanWorker(void *arg) {
+    ScanPool *pool = (ScanPool *)arg;
+    unsigned long seen = 0;
+    pthread_mutex_lock(&pool->mutex);
+    while(1) {
+        /* 新しいジョブが来るまで待つ */
+        while(!pool->quit && (pool->generation == seen))
+            pthread_cond_wait(&pool->start, &pool->mutex);
+        if(pool->quit)
+            break;
+        seen = pool->generation;
+        processChunks(pool);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+/**
+ * スレッドプールを作る
+ * @param nThread 検索に使うスレッド数（呼び出し元スレッドを含む）
+ * @return 作成したプールへのポインタ。作成に失敗した場合 NULL
+ */
+ScanPool *ScanPoolCreate(int nThread) {
+    if(nThread < 1)
+        return NULL;
+    ScanPool *pool = (ScanPool *)calloc(1, sizeof(ScanPool));
+    if(pool == NULL)
+        return NULL;
+    pool->threads = (pthread_t *)malloc(sizeof(pthread_t)*(nThread > 1 ? nThread-1 : 1));
+    if(pool->threads == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->jobLock, NULL);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->finish, NULL);
+    pool->nThread = 1;
+    for(int i = 0; i < nThread-1; i++) {
+        if(pthread_create(&pool->threads[i], NULL, doScanWorker, pool) != 0)
+            break; /* 作れた分だけで動かす */
+        pool->nThread++;
+    }
+    return pool;
+}
+
+/**
+ * スレッドプールを削除する。スレッドの終了を待ってから戻る
+ * @param pool 削除するプールへのポインタ
+ */
+void ScanPoolDestroy(ScanPool *pool) {
+    if(pool == NULL)
+        return;
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+    for(int i = 0; i < pool->nThread-1; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->jobLock);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->finish);
+    free(pool->threads);
+    free(pool->chunkCount);
+    free(pool->scratch);
+    free(pool);
+}
+
+/**
+ * プールのスレッド数を得る
+ * @param pool 対象プールへのポインタ
+ * @return スレッド数（呼び出し元スレッドを含む）
+ */
+int ScanPoolGetThreadCount(ScanPool *pool) {
+    if(pool == NULL)
+        return 0;
+    return pool->nThread;
+    /* nThreadはcreateの時に決まったら変わることが無いのでロックの必要なし */
+}
+
+/**
+ * [begin, end)の要素をチャンクに分けて複数スレッドで調べ、一致するものを番号順に返す
+ * @return 一致した要素の数。作業領域を確保できなかった場合(size_t)-1
+ */
+size_t ScanPoolRun(ScanPool *pool, uint32_t begin, uint32_t end, ScanRangeFunc scan, const void *arg,
+                   uint32_t *result, size_t resultSize) {
+    if((pool == NULL) || (begin >= end) || (resultSize == 0))
+        return 0;
+    pthread_mutex_lock(&pool->jobLock);
+    /* 作業領域は範囲の大きさに合わせて広げ、次回以降も使い回す */
+    size_t n = end-begin;
+    size_t nChunk = (n+SCAN_CHUNK-1)/SCAN_CHUNK;
+    if(n > pool->capacity) {
+        uint32_t *scratch = (uint32_t *)realloc(pool->scratch, n*sizeof(uint32_t));
+        size_t *chunkCount = (size_t *)realloc(pool->chunkCount, nChunk*sizeof(size_t));
+        if(scratch != NULL)
+            pool->scratch = scratch;
+        if(chunkCount != NULL)
+            pool->chunkCount = chunkCount;
+        if((scratch == NULL) || (chunkCount == NULL)) {
+            pthread_mutex_unlock(&pool->jobLock);
+            return (size_t)-1;
+        }
+        pool->capacity = n;
+    }
+
+    /* ジョブを設定してワーカーを起こし、自分もチャンクを処理する */
+    pthread_mutex_lock(&pool->mutex);
+    pool->scan = scan;
+    pool->arg = arg;
+    pool->begin = begin;
+    pool->end = end;
+    pool->resultSize = resultSize;
+    pool->nChunk = nChunk;
+    pool->nextChunk = 0;
+    pool->nActive = 0;
+    pool->prefixDone = 0;
+    pool->prefixCount = 0;
+    pool->stopChunk = nChunk;
+    for(size_t i = 0; i < nChunk; i++)
+        pool->chunkCount[i] = NOT_DONE;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    processChunks(pool);
+    /* 他のスレッドが処理中のチャンクが終わるのを待つ */
+    while(pool->nActive > 0)
+        pthread_cond_wait(&pool->finish, &pool->mutex);
+    size_t stopChunk = pool->stopChunk;
+    pool->nChunk = 0; /* 遅れて起きたワーカーが何もしないように */
+    pthread_mutex_unlock(&pool->mutex);
+
+    /* チャンクの結果を順に連結する。stopChunkより前は全て処理済み */
+    size_t count = 0;
+    for(size_t i = 0; (i < nChunk) && (i < stopChunk) && (count < resultSize); i++) {
+        size_t m = pool->chunkCount[i];
+        if(m > resultSize-count)
+            m = resultSize-count;
+        memcpy(result+count, pool->scratch+i*SCAN_CHUNK, m*sizeof(uint32_t));
+        count += m;
+    }
+    pthread_mutex_unlock(&pool->jobLock);
+    return count;
+}
@@ -0,0 +1,60 @@
+#ifndef SCANPOOL_H
+#define SCANPOOL_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/**
+ * 範囲検索用スレッドプール型（仮宣言）
+ */
+typedef struct ScanPool_ ScanPool;
+
+/**
+ * [begin, end)の要素から条件に一致するものを番号順に探す関数
+ * @param begin 調べる範囲の先頭
+ * @param end 調べる範囲の終わり
+ * @param result 一致した要素の番号を格納する配列
+ * @param resultSize resultの要素数。これだけ見つかったら打ち切ってよい
+ * @param arg ScanPoolRunに渡した引数
+ * @return 一致した要素の数
+ */
+typedef size_t (*ScanRangeFunc)(uint32_t begin, uint32_t end, uint32_t *result, size_t resultSize, const void *arg);
+
+/**
+ * スレッドプールを作る
+ * @param nThread 検索に使うスレッド数（呼び出し元スレッドを含む）
+ * @return 作成したプールへのポインタ。作成に失敗した場合 NULL
+ */
+extern ScanPool *ScanPoolCreate(int nThread);
+
+/**
+ * スレッドプールを削除する。スレッドの終了を待ってから戻る
+ * @param pool 削除するプールへのポインタ
+ */
+extern void ScanPoolDestroy(ScanPool *pool);
+
+/**
+ * プールのスレッド数を得る
+ * @param pool 対象プールへのポインタ
+ * @return スレッド数（呼び出し元スレッドを含む）
+ */
+extern int ScanPoolGetThreadCount(ScanPool *pool);
+
+/**
+ * [begin, end)の要素をチャンクに分けて複数スレッドで調べ、一致するものを番号順に返す
+ * チャンクごとの結果は番号順に連結する。先頭からresultSize個が揃った時点で、
+ * それより後ろのチャンクは調べるのをやめる
+ * 同時に呼び出された場合は1つずつ順に実行する
+ * @param pool 対象プールへのポインタ
+ * @param begin 調べる範囲の先頭
+ * @param end 調べる範囲の終わり
+ * @param scan 範囲を調べる関数。チャンクをさらに細かく区切って呼ぶ
+ * @param arg scanに渡す引数
+ * @param result 一致した要素の番号を格納する配列
+ * @param resultSize resultの要素数
+ * @return 一致した要素の数。作業領域を確保できなかった場合(size_t)-1
+ */
+extern size_t ScanPoolRun(ScanPool *pool, uint32_t begin, uint32_t end, ScanRangeFunc scan, const void *arg,
+                          uint32_t *result, size_t resultSize);
+
+#endif /* SCANPOOL_H */
@@ -1,4 +1,5 @@
 #include "postalNumber.h"
+#include "postalSession.h"
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -8,38 +9,10 @@
 #include <pthread.h>
 
 #define PORTNO 25000  /* 待ち受けポート番号 */
-#define SEARCH_SIZE 100 /* 検索結果の最大取得数 */
+#define CACHE_SIZE (32 << 20) /* 検索結果キャッシュの大きさ */
+#define DB_MEMORY POSTAL_NUMBER_MEMORY_HUGE /* DBを置くメモリ。ページアウトさせないなら|POSTAL_NUMBER_MEMORY_LOCK */
 #define N_WORKER 4 /* ワーカースレッド数 */
 
-static void getString(FILE *fp, char *buf, size_t buflen) {
-    int ch;
-    buflen--;
-    while((ch = fgetc(fp)) != EOF) {
-        if(ch == '\r')
-            continue;
-        if(ch == '\n')
-            break;
-        if(buflen > 0) {
-            *(buf++) = ch;
-            buflen--;
-        }
-    }
-    *buf = '\0';
-}
-
-static void searchPostalNumber(FILE *fp) {
-    fprintf(fp, "Search ? ");
-    fflush(fp);
-    char buf[128];
-    getString(fp, buf, sizeof(buf));
-    fprintf(fp, "Search for '%s':\n", buf);
-    PostalNumber res[SEARCH_SIZE];
-    size_t n = PostalNumberSearch(buf, res, SEARCH_SIZE);
-    for(size_t i = 0; i < n; i++) {
-        fprintf(fp, "  %s %s %s %s\n", res[i].code, res[i].pref, res[i].city, res[i].town);
-    }
-}
-
 /* ワーカースレッドごとのデータを保持する構造体 */
 typedef struct {
     int id; /* ワーカスレッド番号（デバッグ用）*/
@@ -73,7 +46,7 @@ static void *doWorker(void *arg) {
         }
 
         /* クライアントを端末として検索を実行する */
-        searchPostalNumber(fp);
+        PostalSessionRun(fp);
 
         fclose(fp); /* worker->socもcloseされる */
     }
@@ -83,7 +56,18 @@ static void *doWorker(void *arg) {
 }
 
 int main(void) {
+    PostalNumberSetMemoryOptions(DB_MEMORY);
     PostalNumberLoadDB();
+    PostalSessionReportDB(stdout);
+    /* 再起動せずにデータベースを更新できるようにする */
+    if(!PostalSessionStartReloader()) {
+        printf("Failed to start reloader, abort.\n");
+        return 1;
+    }
+    if(!PostalSessionEnableCache(CACHE_SIZE)) {
+        printf("Failed to create result cache, abort.\n");
+        return 1;
+    }
 
     /* ワーカースレッドの構築 */
     WorkerContext worker[N_WORKER];
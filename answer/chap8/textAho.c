@@ -0,0 +1,320 @@
+#include "textAho.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_NODE UINT32_MAX
+
+/* 並べ替えるパターン */
+typedef struct {
+    const char *text;
+    size_t index; /* patterns中の位置 */
+} Pattern;
+
+/**
+ * UTF-8の1文字を取り出してコードポイントをcpに格納し、次の文字のアドレスを返す。
+ * 不正なバイト（冗長な表現を含む）は1バイトずつ0x110000以上の値として取り出す
+ * avail: strから読んでよいバイト数。'\0'終端の文字列ならSIZE_MAX
+ */
+static const char *decode(const char *str, size_t avail, uint32_t *cp) {
+    static const uint32_t minValue[4] = {0, 0x80, 0x800, 0x10000};
+    const unsigned char *s = (const unsigned char *)str;
+    uint32_t c = s[0];
+    int len;
+    if(c < 0x80) {
+        *cp = c;
+        return str+1;
+    } else if((c >= 0xc0) && (c < 0xe0)) {
+        c &= 0x1f;
+        len = 1;
+    } else if((c >= 0xe0) && (c < 0xf0)) {
+        c &= 0x0f;
+        len = 2;
+    } else if((c >= 0xf0) && (c < 0xf8)) {
+        c &= 0x07;
+        len = 3;
+    } else {
+        *cp = 0x110000+s[0];
+        return str+1;
+    }
+    for(int i = 1; i <= len; i++) {
+        if(((size_t)i >= avail) || ((s[i] & 0xc0) != 0x80)) {
+            *cp = 0x110000+s[0];
+            return str+1;
+        }
+        c = (c << 6) | (s[i] & 0x3f);
+    }
+    if(c < minValue[len]) {
+        *cp = 0x110000+s[0];
+        return str+1;
+    }
+    *cp = c;
+    return str+len+1;
+}
+
+static const char *nextCodePoint(const char *str, uint32_t *cp) {
+    return decode(str, SIZE_MAX, cp);
+}
+
+/**
+ * 正しいUTF-8か。正しいUTF-8どうしはバイト順に並べるとコードポイント順にもなる
+ */
+static int isValidUTF8(const char *s) {
+    uint32_t c;
+    while(*s != '\0') {
+        s = nextCodePoint(s, &c);
+        if(c >= 0x110000)
+            return 0;
+    }
+    return 1;
+}
+
+static int comparePattern(const void *a, const void *b) {
+    const Pattern *x = (const Pattern *)a, *y = (const Pattern *)b;
+    int c = strcmp(x->text, y->text);
+    if(c != 0)
+        return c;
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/* 節sから文字cで移る子。無ければNO_NODE */
+static uint32_t step(const TextAho *aho, uint32_t s, uint32_t c) {
+    uint32_t lo = aho->nodes[s].edge, hi = aho->nodes[s+1].edge;
+    while(lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if(aho->edges[mid].c < c)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return ((lo < aho->nodes[s+1].edge) && (aho->edges[lo].c == c)) ? aho->edges[lo].next : NO_NODE;
+}
+
+/* 容量が足りなければ配列を2倍に広げる */
+static int reserve(uint32_t **array, size_t *cap, size_t need) {
+    if(need <= *cap)
+        return 1;
+    size_t newCap = (*cap > 0) ? *cap*2 : 1024;
+    while(newCap < need)
+        newCap *= 2;
+    uint32_t *p = (uint32_t *)realloc(*array, newCap*sizeof(uint32_t));
+    if(p == NULL)
+        return 0;
+    *array = p;
+    *cap = newCap;
+    return 1;
+}
+
+/*
+ * パターンを辞書順に並べると、直前のパターンとの共通接頭辞の節から先を付け足すだけで
+ * 文字の木ができ、各節の子は文字の順に作られる。できた木を幅優先の順に番号を振り直して
+ * 辺を節ごとに連続させてから、浅い節から順に失敗時の移り先を求める
+ */
+int TextAhoBuild(const char *const *patterns, size_t n, TextAho *aho, uint32_t *terminal) {
+    aho->nodes = NULL;
+    aho->edges = NULL;
+    aho->rootNext = NULL;
+    aho->nNode = aho->nEdge = 0;
+    Pattern *sorted = (Pattern *)malloc((n > 0 ? n : 1)*sizeof(Pattern));
+    uint32_t *parent = NULL, *label = NULL, *path = NULL;
+    uint32_t *childStart = NULL, *children = NULL, *order = NULL, *newId = NULL;
+    uint8_t *isTerminal = NULL;
+    size_t parentCap = 0, labelCap = 0, pathCap = 0, nSorted = 0;
+    if(sorted == NULL)
+        goto fail;
+    for(size_t i = 0; i < n; i++) {
+        terminal[i] = 0;
+        if((patterns[i][0] != '\0') && isValidUTF8(patterns[i])) {
+            sorted[nSorted].text = patterns[i];
+            sorted[nSorted++].index = i;
+        }
+    }
+    qsort(sorted, nSorted, sizeof(Pattern), comparePattern);
+    /* 文字の木を作る。節の番号は作った順 */
+    size_t nOld = 1;
+    if(!reserve(&parent, &parentCap, 1) || !reserve(&label, &labelCap, 1) || !reserve(&path, &pathCap, 1))
+        goto fail;
+    path[0] = 0;
+    const char *prev = NULL;
+    for(size_t i = 0; i < nSorted; i++) {
+        const char *p = sorted[i].text, *q = prev;
+        size_t depth = 0;
+        uint32_t a, b;
+        while((q != NULL) && (*p != '\0') && (*q != '\0')) {
+            const char *p2 = nextCodePoint(p, &a), *q2 = nextCodePoint(q, &b);
+            if(a != b)
+                break;
+            p = p2;
+            q = q2;
+            depth++;
+        }
+        uint32_t node = path[depth];
+        while(*p != '\0') {
+            p = nextCodePoint(p, &a);
+            if(!reserve(&parent, &parentCap, nOld+1) || !reserve(&label, &labelCap, nOld+1)
+               || !reserve(&path, &pathCap, depth+2))
+                goto fail;
+            parent[nOld] = node;
+            label[nOld] = a;
+            node = (uint32_t)nOld++;
+            path[++depth] = node;
+        }
+        terminal[sorted[i].index] = node;
+        prev = sorted[i].text;
+    }
+    free(sorted);
+    free(path);
+    sorted = NULL;
+    path = NULL;
+    /* 節ごとの子の一覧。作った順なので文字の順になる */
+    childStart = (uint32_t *)calloc(nOld+1, sizeof(uint32_t));
+    children = (uint32_t *)malloc(nOld*sizeof(uint32_t));
+    order = (uint32_t *)malloc(nOld*sizeof(uint32_t));
+    newId = (uint32_t *)malloc(nOld*sizeof(uint32_t));
+    isTerminal = (uint8_t *)calloc(nOld, sizeof(uint8_t));
+    aho->nodes = (TextAhoNode *)calloc(nOld+1, sizeof(TextAhoNode));
+    aho->edges = (TextAhoEdge *)malloc(nOld*sizeof(TextAhoEdge));
+    if((childStart == NULL) || (children == NULL) || (order == NULL) || (newId == NULL) || (isTerminal == NULL)
+       || (aho->nodes == NULL) || (aho->edges == NULL))
+        goto fail;
+    for(size_t v = 1; v < nOld; v++)
+        childStart[parent[v]+1]++;
+    for(size_t v = 0; v < nOld; v++)
+        childStart[v+1] += childStart[v];
+    for(size_t v = 1; v < nOld; v++)
+        children[childStart[parent[v]]++] = (uint32_t)v;
+    for(size_t v = nOld; v > 0; v--)
+        childStart[v] = childStart[v-1];
+    childStart[0] = 0;
+    /* 幅優先の順に番号を振り直し、辺を並べる */
+    size_t tail = 1;
+    order[0] = 0;
+    newId[0] = 0;
+    for(size_t v = 0; v < nOld; v++) {
+        uint32_t old = order[v];
+        aho->nodes[v].edge = (uint32_t)aho->nEdge;
+        for(uint32_t i = childStart[old]; i < childStart[old+1]; i++) {
+            uint32_t ch = children[i];
+            newId[ch] = (uint32_t)tail;
+            order[tail++] = ch;
+            aho->edges[aho->nEdge].c = label[ch];
+            aho->edges[aho->nEdge++].next = newId[ch];
+        }
+    }
+    aho->nNode = nOld;
+    aho->nodes[nOld].edge = (uint32_t)aho->nEdge; /* 番兵 */
+    for(size_t i = 0; i < n; i++) {
+        terminal[i] = newId[terminal[i]];
+        isTerminal[terminal[i]] = (terminal[i] != 0);
+    }
+    /* 浅い節から順に、親の移り先から同じ文字で移れるところを探す */
+    for(size_t v = 1; v < nOld; v++) {
+        uint32_t old = order[v], u = newId[parent[old]], c = label[old], fail = 0;
+        if(u != 0) {
+            uint32_t f = aho->nodes[u].fail;
+            for(;;) {
+                uint32_t g = step(aho, f, c);
+                if(g != NO_NODE) {
+                    fail = g;
+                    break;
+                }
+                if(f == 0)
+                    break;
+                f = aho->nodes[f].fail;
+            }
+        }
+        aho->nodes[v].fail = fail;
+        aho->nodes[v].depth = aho->nodes[u].depth+1;
+        aho->nodes[v].out = isTerminal[v] ? (uint32_t)v : aho->nodes[fail].out;
+    }
+    free(parent);
+    free(label);
+    free(childStart);
+    free(children);
+    free(order);
+    free(newId);
+    free(isTerminal);
+    return 1;
+
+fail:
+    free(sorted);
+    free(parent);
+    free(label);
+    free(path);
+    free(childStart);
+    free(children);
+    free(order);
+    free(newId);
+    free(isTerminal);
+    TextAhoFree(aho);
+    return 0;
+}
+
+int TextAhoBuildRootTable(TextAho *aho) {
+    if((aho->nodes == NULL) || (aho->rootNext != NULL))
+        return aho->rootNext != NULL;
+    aho->rootNext = (uint32_t *)calloc(TEXT_AHO_ROOT_CHARS, sizeof(uint32_t));
+    if(aho->rootNext == NULL)
+        return 0;
+    for(uint32_t i = aho->nodes[0].edge; i < aho->nodes[1].edge; i++) {
+        if(aho->edges[i].c < TEXT_AHO_ROOT_CHARS)
+            aho->rootNext[aho->edges[i].c] = aho->edges[i].next;
+    }
+    return 1;
+}
+
+void TextAhoFree(TextAho *aho) {
+    free(aho->nodes);
+    free(aho->edges);
+    free(aho->rootNext);
+    aho->nodes = NULL;
+    aho->edges = NULL;
+    aho->rootNext = NULL;
+    aho->nNode = aho->nEdge = 0;
+}
+
+/* 節sで文字cを読んだ後の節。子が無ければ失敗時の移り先をたどる */
+static uint32_t move(const TextAho *aho, uint32_t s, uint32_t c) {
+    for(;;) {
+        if((s == 0) && (aho->rootNext != NULL) && (c < TEXT_AHO_ROOT_CHARS))
+            return aho->rootNext[c]; /* 子が無ければ根のまま */
+        uint32_t t = step(aho, s, c);
+        if(t != NO_NODE)
+            return t;
+        if(s == 0)
+            return 0;
+        s = aho->nodes[s].fail;
+    }
+}
+
+uint32_t TextAhoLongest(const TextAho *aho, const char *text) {
+    if(aho->nodes == NULL)
+        return 0;
+    uint32_t s = 0, best = 0;
+    while(*text != '\0') {
+        uint32_t c;
+        text = nextCodePoint(text, &c);
+        s = move(aho, s, c);
+        uint32_t out = aho->nodes[s].out;
+        if((out != 0) && (aho->nodes[out].depth > aho->nodes[best].depth))
+            best = out;
+    }
+    return best;
+}
+
+int TextAhoScan(const TextAho *aho, const char *text, size_t len, TextAhoFound found, void *arg) {
+    if(aho->nodes == NULL)
+        return 0;
+    const char *p = text, *end = text+len;
+    uint32_t s = 0;
+    while(p < end) {
+        uint32_t c;
+        p = decode(p, (size_t)(end-p), &c);
+        s = move(aho, s, c);
+        /* この位置で終わるパターンを、失敗時の移り先をたどって長い順に報告する */
+        for(uint32_t out = aho->nodes[s].out; out != 0; out = aho->nodes[aho->nodes[out].fail].out) {
+            if(found(out, (size_t)(p-text), arg))
+                return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+#ifndef TEXTAHO_H
+#define TEXTAHO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TEXT_AHO_ROOT_CHARS 0x10000 /* 根からの遷移表に持つ文字の数（基本多言語面）*/
+
+/**
+ * Aho-Corasick法のオートマトンの節
+ * 節は根（0番）から幅優先の順に並べ、節vの子への辺はedges[nodes[v].edge]から
+ * edges[nodes[v+1].edge]の手前までにある（末尾に番兵の節を置く）
+ */
+typedef struct {
+    uint32_t edge;  /* 子への辺の開始位置 */
+    uint32_t fail;  /* 失敗時に移る節（この節の文字列の最長の真の接尾辞にあたる節）*/
+    uint32_t out;   /* この節の文字列の接尾辞で最長のパターンの終わりの節。無ければ0 */
+    uint32_t depth; /* 根からの文字数 */
+} TextAhoNode;
+
+/* 子への辺 */
+typedef struct {
+    uint32_t c;    /* 文字（コードポイント）*/
+    uint32_t next; /* 子の節 */
+} TextAhoEdge;
+
+/**
+ * 複数のパターンを1度の走査で探すオートマトン
+ * 配列だけでできているので、そのままファイルに書き出してマップしてもよい
+ */
+typedef struct {
+    TextAhoNode *nodes; /* nNode+1個（番兵を含む）*/
+    size_t nNode;
+    TextAhoEdge *edges;
+    size_t nEdge;
+    uint32_t *rootNext; /* 根から文字cで移る節（TEXT_AHO_ROOT_CHARS個）。無ければNULL */
+} TextAho;
+
+/**
+ * UTF-8のパターンの集合からオートマトンを作る。文字単位で遷移する
+ * @param patterns パターンの配列。空のパターンは無視する
+ * @param n パターンの数
+ * @param aho 結果を格納する場所。使い終わったらTextAhoFreeで解放する
+ * @param terminal 各パターンの終わりの節を格納する配列（n要素）。同じパターンは同じ節になる。
+ *                 空のパターンは0
+ * @return 成功した場合1。メモリが足りない場合0
+ */
+extern int TextAhoBuild(const char *const *patterns, size_t n, TextAho *aho, uint32_t *terminal);
+
+/**
+ * 根からの遷移表を作る。長い文字列を何度も走査する場合に呼んでおくと、
+ * パターンの始まりでない文字を辺を探さずに読み飛ばせる
+ * @param aho オートマトン
+ * @return 成功した場合1。メモリが足りない場合0（表が無くても走査はできる）
+ */
+extern int TextAhoBuildRootTable(TextAho *aho);
+
+/**
+ * TextAhoBuildとTextAhoBuildRootTableで確保したメモリを解放する
+ * @param aho オートマトン
+ */
+extern void TextAhoFree(TextAho *aho);
+
+/**
+ * textに現れるパターンのうち最も長いものを探す。textを先頭から1度だけ読む
+ * 同じ長さのものが複数現れる場合は最初に現れたものにする
+ * @param aho オートマトン
+ * @param text 調べるUTF-8の文字列
+ * @return 見つかったパターンの終わりの節。無ければ0
+ */
+extern uint32_t TextAhoLongest(const TextAho *aho, const char *text);
+
+/**
+ * TextAhoScanでパターンが見つかるたびに呼ぶ関数
+ * node: 見つかったパターンの終わりの節
+ * end: textの中でのパターンの終わりの位置（最後の文字の次）
+ * arg: TextAhoScanに渡したもの
+ * returns: 走査をやめる場合0以外
+ */
+typedef int (*TextAhoFound)(uint32_t node, size_t end, void *arg);
+
+/**
+ * text[0, len)に現れるパターンをすべて、現れた順に報告する。textを先頭から1度だけ読む
+ * 同じ位置で終わる複数のパターンは長い順に報告する。'\0'を含んでもよく、
+ * パターンは'\0'をまたいで現れることはない
+ * @param aho オートマトン
+ * @param text 調べるUTF-8の文字列
+ * @param len textのバイト数
+ * @param found パターンが見つかるたびに呼ぶ関数
+ * @param arg foundに渡すもの
+ * @return foundが走査をやめさせた場合1、最後まで読んだ場合0
+ */
+extern int TextAhoScan(const TextAho *aho, const char *text, size_t len, TextAhoFound found, void *arg);
+
+#endif /* TEXTAHO_H */
@@ -0,0 +1,107 @@
+#include "textApprox.h"
+
+#define TABLE_SIZE (TEXT_APPROX_MAX*2) /* 文字のハッシュ表の大きさ。2のべき乗 */
+
+/**
+ * UTF-8の1文字を取り出してコードポイントをcpに格納し、次の文字のアドレスを返す。
+ * 不正なバイトは1バイトずつ0x110000以上の値として取り出す
+ */
+static const char *nextCodePoint(const char *str, uint32_t *cp) {
+    const unsigned char *s = (const unsigned char *)str;
+    uint32_t c = s[0];
+    int len;
+    if(c < 0x80)
+        len = 0;
+    else if((c >= 0xc0) && (c < 0xe0)) {
+        c &= 0x1f;
+        len = 1;
+    } else if((c >= 0xe0) && (c < 0xf0)) {
+        c &= 0x0f;
+        len = 2;
+    } else if((c >= 0xf0) && (c < 0xf8)) {
+        c &= 0x07;
+        len = 3;
+    } else {
+        *cp = 0x110000+s[0];
+        return str+1;
+    }
+    for(int i = 1; i <= len; i++) {
+        if((s[i] & 0xc0) != 0x80) {
+            *cp = 0x110000+s[0];
+            return str+1;
+        }
+        c = (c << 6) | (s[i] & 0x3f);
+    }
+    *cp = c;
+    return str+len+1;
+}
+
+static uint32_t slotOf(uint32_t c) {
+    return (c*0x9e3779b1u) >> 24 & (TABLE_SIZE-1);
+}
+
+/* 文字cが現れるパターン中の位置のビット列 */
+static uint64_t charMask(const TextApproxPattern *pat, uint32_t c) {
+    uint32_t i = slotOf(c);
+    while(pat->chars[i] != 0) {
+        if(pat->chars[i] == c+1)
+            return pat->masks[i];
+        i = (i+1) & (TABLE_SIZE-1);
+    }
+    return 0;
+}
+
+int TextApproxCompile(const char *key, TextApproxPattern *pat) {
+    pat->len = 0;
+    for(int i = 0; i < TABLE_SIZE; i++) {
+        pat->chars[i] = 0;
+        pat->masks[i] = 0;
+    }
+    while(*key != '\0') {
+        if(pat->len >= TEXT_APPROX_MAX)
+            return 0;
+        uint32_t c;
+        key = nextCodePoint(key, &c);
+        uint32_t i = slotOf(c);
+        while((pat->chars[i] != 0) && (pat->chars[i] != c+1))
+            i = (i+1) & (TABLE_SIZE-1);
+        pat->chars[i] = c+1;
+        pat->masks[i] |= 1ULL << pat->len++;
+    }
+    return pat->len > 0;
+}
+
+/*
+ * 動的計画法の表の列ごとの縦方向の差（+1か-1か0）をビット列pv, mvで持ち、
+ * 1文字ごとに列全体をまとめて更新する。textのどこから始まってもよいので最上行は常に0
+ */
+int TextApproxDistance(const TextApproxPattern *pat, const char *text) {
+    int m = pat->len;
+    uint64_t last = 1ULL << (m-1);
+    uint64_t pv = (m == 64) ? ~0ULL : (1ULL << m)-1;
+    uint64_t mv = 0;
+    int score = m, best = m;
+    while((*text != '\0') && (best > 0)) {
+        uint32_t c;
+        if((unsigned char)*text < 0x80)
+            c = (unsigned char)*(text++);
+        else
+            text = nextCodePoint(text, &c);
+        uint64_t eq = charMask(pat, c);
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv)+pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        if(ph & last)
+            score++;
+        else if(mh & last)
+            score--;
+        ph <<= 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+        if(score < best)
+            best = score;
+    }
+    return best;
+}
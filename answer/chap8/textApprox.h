@@ -0,0 +1,36 @@
+#ifndef TEXTAPPROX_H
+#define TEXTAPPROX_H
+
+#include <stdint.h>
+
+#define TEXT_APPROX_MAX 64 /* パターンの最大文字数 */
+
+/**
+ * 近似照合用に前処理したパターン
+ * パターンの文字（コードポイント）ごとに、現れる位置のビット列を持つ
+ * メンバは内部用なので直接参照しないこと
+ */
+typedef struct {
+    int len;                          /* パターンの文字数 */
+    uint32_t chars[TEXT_APPROX_MAX*2]; /* 文字のハッシュ表。0は空き（文字+1を格納） */
+    uint64_t masks[TEXT_APPROX_MAX*2]; /* charsと同じ位置の文字が現れる位置 */
+} TextApproxPattern;
+
+/**
+ * UTF-8の文字列をパターンとして前処理する
+ * @param key パターン
+ * @param pat 結果を格納する場所
+ * @return 成功した場合1。空か、TEXT_APPROX_MAX文字より長い場合0
+ */
+extern int TextApproxCompile(const char *key, TextApproxPattern *pat);
+
+/**
+ * textの部分文字列とパターンの編集距離（文字の挿入、削除、置換の回数）の最小値を求める
+ * Myersのビット並列法で、textの1文字につき数回のビット演算で済む
+ * @param pat TextApproxCompileで前処理したパターン
+ * @param text 調べるUTF-8の文字列
+ * @return 編集距離。0ならtextはパターンを含む
+ */
+extern int TextApproxDistance(const TextApproxPattern *pat, const char *text);
+
+#endif /* TEXTAPPROX_H */
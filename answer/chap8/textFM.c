@@ -0,0 +1,376 @@
+#include "textFM.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define FM_END 0 /* 文書の終わりの文字番号 */
+#define FM_SEP 1 /* フィールドの区切りの文字番号 */
+#define FM_RAW_CHARS (0x110000+0x100+2) /* 番号を振る前の文字の種類（不正なバイトと区切りを含む）*/
+#define BLOCK_WORDS 4 /* 順位を持つ間隔（語数）*/
+
+/**
+ * UTF-8の1文字を取り出してコードポイントをcpに格納し、次の文字のアドレスを返す。
+ * 不正なバイト（冗長な表現を含む）は1バイトずつ0x110000以上の値として取り出す
+ * avail: strから読んでよいバイト数
+ */
+static const char *decode(const char *str, size_t avail, uint32_t *cp) {
+    static const uint32_t minValue[4] = {0, 0x80, 0x800, 0x10000};
+    const unsigned char *s = (const unsigned char *)str;
+    uint32_t c = s[0];
+    int len;
+    if(c < 0x80) {
+        *cp = c;
+        return str+1;
+    } else if((c >= 0xc0) && (c < 0xe0)) {
+        c &= 0x1f;
+        len = 1;
+    } else if((c >= 0xe0) && (c < 0xf0)) {
+        c &= 0x0f;
+        len = 2;
+    } else if((c >= 0xf0) && (c < 0xf8)) {
+        c &= 0x07;
+        len = 3;
+    } else {
+        *cp = 0x110000+s[0];
+        return str+1;
+    }
+    for(int i = 1; i <= len; i++) {
+        if(((size_t)i >= avail) || ((s[i] & 0xc0) != 0x80)) {
+            *cp = 0x110000+s[0];
+            return str+1;
+        }
+        c = (c << 6) | (s[i] & 0x3f);
+    }
+    if(c < minValue[len]) {
+        *cp = 0x110000+s[0];
+        return str+1;
+    }
+    *cp = c;
+    return str+len+1;
+}
+
+static int bitsInit(TextFMBits *b, size_t n) {
+    size_t nWord = (n/64+1+BLOCK_WORDS-1)/BLOCK_WORDS*BLOCK_WORDS; /* 末尾の位置nも読めるよう1語余分に取る */
+    b->n = n;
+    b->words = (uint64_t *)calloc(nWord, sizeof(uint64_t));
+    b->ranks = (uint32_t *)malloc((nWord/BLOCK_WORDS+1)*sizeof(uint32_t));
+    return (b->words != NULL) && (b->ranks != NULL);
+}
+
+static void bitsFree(TextFMBits *b) {
+    free(b->words);
+    free(b->ranks);
+    b->words = NULL;
+    b->ranks = NULL;
+    b->n = 0;
+}
+
+static size_t bitsWords(const TextFMBits *b) {
+    return (b->n/64+1+BLOCK_WORDS-1)/BLOCK_WORDS*BLOCK_WORDS;
+}
+
+/* ビットを立て終えた後に順位を求めておく */
+static void bitsRank(TextFMBits *b) {
+    size_t nWord = bitsWords(b);
+    uint32_t r = 0;
+    for(size_t w = 0; w < nWord; w++) {
+        if(w%BLOCK_WORDS == 0)
+            b->ranks[w/BLOCK_WORDS] = r;
+        r += (uint32_t)__builtin_popcountll(b->words[w]);
+    }
+    b->ranks[nWord/BLOCK_WORDS] = r;
+}
+
+static int bitAt(const TextFMBits *b, size_t i) {
+    return (int)((b->words[i/64] >> (i%64)) & 1);
+}
+
+/* [0, i)の1の数 */
+static size_t rank1(const TextFMBits *b, size_t i) {
+    size_t w = i/64, r = b->ranks[w/BLOCK_WORDS];
+    for(size_t k = w/BLOCK_WORDS*BLOCK_WORDS; k < w; k++)
+        r += (size_t)__builtin_popcountll(b->words[k]);
+    if(i%64 != 0)
+        r += (size_t)__builtin_popcountll(b->words[w] & ((1ULL << (i%64))-1));
+    return r;
+}
+
+/* 文字番号cの、BWTの[0, i)での出現数 */
+static size_t rankChar(const TextFM *fm, uint32_t c, size_t i) {
+    for(int l = 0; l < fm->nLevel; l++) {
+        size_t r = rank1(&fm->levels[l], i);
+        i = ((c >> (fm->nLevel-1-l)) & 1) ? fm->zeros[l]+r : i-r;
+    }
+    return i-fm->starts[c];
+}
+
+/* 行iの接尾辞の1文字前から始まる接尾辞の行（LF写像）*/
+static size_t lf(const TextFM *fm, size_t i) {
+    uint32_t c = 0;
+    for(int l = 0; l < fm->nLevel; l++) {
+        const TextFMBits *b = &fm->levels[l];
+        int bit = bitAt(b, i);
+        size_t r = rank1(b, i);
+        i = bit ? fm->zeros[l]+r : i-r;
+        c = (c << 1) | (uint32_t)bit;
+    }
+    return fm->counts[c]+(i-fm->starts[c]);
+}
+
+/*
+ * 接尾辞の比較。文書の終わりは文書ごとに異なる文字とみなし、テキスト中の位置の順に並べる。
+ * こうするとどの接尾辞も異なり、同じ文字の前にある接尾辞どうしの順はその文字を除いても変わらない
+ */
+static int compareSuffix(const void *a, const void *b) {
+    const uint32_t *x = *(const uint32_t *const *)a, *y = *(const uint32_t *const *)b;
+    const uint32_t *p = x, *q = y;
+    while(*p == *q) {
+        if(*p == FM_END)
+            return (x > y) - (x < y);
+        p++;
+        q++;
+    }
+    return (*p > *q) - (*p < *q);
+}
+
+/* 位置posを含む文書の番号 */
+static size_t docAt(const uint32_t *docStart, size_t nDoc, size_t pos) {
+    size_t lo = 0, hi = nDoc;
+    while(hi-lo > 1) {
+        size_t mid = lo+(hi-lo)/2;
+        if(docStart[mid] <= pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * テキストを文字番号の列にして接尾辞を並べ、BWTを作る。文書の終わりの前はたどらないよう、
+ * 各文書の先頭は必ず標本にする。BWTは文字番号の上位ビットから順に、各段で0のものを前、
+ * 1のものを後ろに安定に分けながらビット列にする（ウェーブレット行列）
+ */
+int TextFMBuild(const char *text, const uint32_t *offsets, size_t nDoc, TextFM *fm) {
+    memset(fm, 0, sizeof(*fm));
+    size_t bytes = offsets[nDoc]-offsets[0];
+    if(bytes+nDoc >= UINT32_MAX)
+        return 0;
+    uint32_t *t = (uint32_t *)malloc((bytes+nDoc+1)*sizeof(uint32_t));
+    uint32_t *docStart = (uint32_t *)malloc((nDoc+1)*sizeof(uint32_t));
+    uint32_t *map = (uint32_t *)calloc(FM_RAW_CHARS, sizeof(uint32_t));
+    const uint32_t **suffixes = NULL;
+    uint32_t *bwt = NULL, *next = NULL, *freq = NULL;
+    if((t == NULL) || (docStart == NULL) || (map == NULL))
+        goto fail;
+    /* 区切りを1、文字をコードポイント+2にした列。番号を詰める前の値で並べても順は同じ */
+    size_t n = 0;
+    for(size_t d = 0; d < nDoc; d++) {
+        const char *p = text+offsets[d], *end = text+offsets[d+1];
+        docStart[d] = (uint32_t)n;
+        while(p < end) {
+            uint32_t c;
+            if(*p == '\0') {
+                t[n++] = FM_SEP;
+                p++;
+            } else {
+                p = decode(p, (size_t)(end-p), &c);
+                t[n++] = c+2;
+            }
+        }
+        t[n++] = FM_END;
+    }
+    docStart[nDoc] = (uint32_t)n;
+    fm->n = n;
+    fm->nDoc = nDoc;
+    /* 現れる文字だけに順に番号を振る */
+    map[FM_END] = map[FM_SEP] = 1;
+    for(size_t i = 0; i < n; i++)
+        map[t[i]] = 1;
+    fm->nChar = 2;
+    for(uint32_t c = 2; c < FM_RAW_CHARS; c++)
+        fm->nChar += map[c];
+    fm->chars = (uint32_t *)malloc(fm->nChar*sizeof(uint32_t));
+    if(fm->chars == NULL)
+        goto fail;
+    fm->chars[FM_END] = fm->chars[FM_SEP] = 0; /* 使わない */
+    map[FM_END] = FM_END;
+    map[FM_SEP] = FM_SEP;
+    for(uint32_t c = 2, id = 2; c < FM_RAW_CHARS; c++) {
+        if(map[c] != 0) {
+            fm->chars[id] = c-2;
+            map[c] = id++;
+        }
+    }
+    for(size_t i = 0; i < n; i++)
+        t[i] = map[t[i]];
+    free(map);
+    map = NULL;
+    fm->nLevel = 1;
+    while(((size_t)1 << fm->nLevel) < fm->nChar)
+        fm->nLevel++;
+
+    /* 接尾辞を並べ、BWTと標本を作る */
+    suffixes = (const uint32_t **)malloc((n > 0 ? n : 1)*sizeof(uint32_t *));
+    bwt = (uint32_t *)malloc((n > 0 ? n : 1)*sizeof(uint32_t));
+    freq = (uint32_t *)calloc(fm->nChar, sizeof(uint32_t));
+    fm->counts = (uint32_t *)malloc((fm->nChar+1)*sizeof(uint32_t));
+    fm->starts = (uint32_t *)malloc(fm->nChar*sizeof(uint32_t));
+    fm->samples = (uint32_t *)malloc((n/TEXT_FM_SAMPLE+nDoc+1)*sizeof(uint32_t)); /* 文書ごとに端数の1つまで */
+    if((suffixes == NULL) || (bwt == NULL) || (freq == NULL) || (fm->counts == NULL) || (fm->starts == NULL)
+       || (fm->samples == NULL) || !bitsInit(&fm->sampled, n))
+        goto fail;
+    for(size_t i = 0; i < n; i++)
+        suffixes[i] = t+i;
+    qsort(suffixes, n, sizeof(uint32_t *), compareSuffix);
+    size_t nSample = 0;
+    for(size_t i = 0; i < n; i++) {
+        size_t pos = (size_t)(suffixes[i]-t), doc = docAt(docStart, nDoc, pos);
+        bwt[i] = (pos > 0) ? t[pos-1] : t[n-1];
+        freq[bwt[i]]++;
+        if((pos-docStart[doc])%TEXT_FM_SAMPLE == 0) {
+            fm->sampled.words[i/64] |= 1ULL << (i%64);
+            fm->samples[nSample++] = (uint32_t)doc;
+        }
+    }
+    bitsRank(&fm->sampled);
+    uint32_t *shrunk = (uint32_t *)realloc(fm->samples, (nSample > 0 ? nSample : 1)*sizeof(uint32_t));
+    if(shrunk != NULL)
+        fm->samples = shrunk;
+    free(suffixes);
+    free(t);
+    free(docStart);
+    suffixes = NULL;
+    t = docStart = NULL;
+    fm->counts[0] = 0;
+    for(size_t c = 0; c < fm->nChar; c++)
+        fm->counts[c+1] = fm->counts[c]+freq[c];
+
+    /* ウェーブレット行列 */
+    next = (uint32_t *)malloc((n > 0 ? n : 1)*sizeof(uint32_t));
+    if(next == NULL)
+        goto fail;
+    for(int l = 0; l < fm->nLevel; l++) {
+        int shift = fm->nLevel-1-l;
+        TextFMBits *b = &fm->levels[l];
+        if(!bitsInit(b, n))
+            goto fail;
+        size_t zeros = 0;
+        for(size_t i = 0; i < n; i++) {
+            if((bwt[i] >> shift) & 1)
+                b->words[i/64] |= 1ULL << (i%64);
+            else
+                zeros++;
+        }
+        bitsRank(b);
+        fm->zeros[l] = zeros;
+        size_t z = 0, o = zeros;
+        for(size_t i = 0; i < n; i++) {
+            if((bwt[i] >> shift) & 1)
+                next[o++] = bwt[i];
+            else
+                next[z++] = bwt[i];
+        }
+        uint32_t *tmp = bwt;
+        bwt = next;
+        next = tmp;
+    }
+    for(uint32_t c = 0; c < fm->nChar; c++) {
+        size_t s = 0;
+        for(int l = 0; l < fm->nLevel; l++) {
+            size_t r = rank1(&fm->levels[l], s);
+            s = ((c >> (fm->nLevel-1-l)) & 1) ? fm->zeros[l]+r : s-r;
+        }
+        fm->starts[c] = (uint32_t)s;
+    }
+    free(bwt);
+    free(next);
+    free(freq);
+    return 1;
+
+fail:
+    free(t);
+    free(docStart);
+    free(map);
+    free(suffixes);
+    free(bwt);
+    free(next);
+    free(freq);
+    TextFMFree(fm);
+    return 0;
+}
+
+void TextFMFree(TextFM *fm) {
+    for(int l = 0; l < TEXT_FM_MAX_LEVEL; l++)
+        bitsFree(&fm->levels[l]);
+    bitsFree(&fm->sampled);
+    free(fm->chars);
+    free(fm->counts);
+    free(fm->starts);
+    free(fm->samples);
+    memset(fm, 0, sizeof(*fm));
+}
+
+/* 文字の番号。現れない文字ならFM_END */
+static uint32_t charId(const TextFM *fm, uint32_t c) {
+    size_t lo = 2, hi = fm->nChar;
+    while(lo < hi) {
+        size_t mid = lo+(hi-lo)/2;
+        if(fm->chars[mid] < c)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return ((lo < fm->nChar) && (fm->chars[lo] == c)) ? (uint32_t)lo : FM_END;
+}
+
+/* パターンを後ろから1文字ずつ読み、その文字から始まる範囲に狭めていく */
+size_t TextFMFind(const TextFM *fm, const char *pattern, size_t *row) {
+    *row = 0;
+    if(fm->n == 0)
+        return 0;
+    size_t len = strlen(pattern), m = 0;
+    uint32_t *ids = (uint32_t *)malloc((len > 0 ? len : 1)*sizeof(uint32_t));
+    if(ids == NULL)
+        return 0;
+    for(const char *p = pattern; *p != '\0'; ) {
+        uint32_t c;
+        p = decode(p, (size_t)(pattern+len-p), &c);
+        ids[m++] = charId(fm, c);
+    }
+    size_t sp = 0, ep = fm->n;
+    for(size_t k = m; (k > 0) && (sp < ep); k--) {
+        uint32_t c = ids[k-1];
+        if(c == FM_END) {
+            ep = sp;
+            break;
+        }
+        sp = fm->counts[c]+rankChar(fm, c, sp);
+        ep = fm->counts[c]+rankChar(fm, c, ep);
+    }
+    free(ids);
+    *row = sp;
+    return (ep > sp) ? ep-sp : 0;
+}
+
+uint32_t TextFMLocate(const TextFM *fm, size_t row) {
+    while(!bitAt(&fm->sampled, row))
+        row = lf(fm, row);
+    return fm->samples[rank1(&fm->sampled, row)];
+}
+
+static size_t bitsSize(const TextFMBits *b) {
+    if(b->words == NULL)
+        return 0;
+    size_t nWord = bitsWords(b);
+    return nWord*sizeof(uint64_t)+(nWord/BLOCK_WORDS+1)*sizeof(uint32_t);
+}
+
+size_t TextFMSize(const TextFM *fm) {
+    if(fm->n == 0)
+        return 0;
+    size_t size = bitsSize(&fm->sampled)+fm->nChar*sizeof(uint32_t)*3+sizeof(uint32_t)
+        +rank1(&fm->sampled, fm->n)*sizeof(uint32_t);
+    for(int l = 0; l < fm->nLevel; l++)
+        size += bitsSize(&fm->levels[l]);
+    return size;
+}
@@ -0,0 +1,80 @@
+#ifndef TEXTFM_H
+#define TEXTFM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TEXT_FM_MAX_LEVEL 22 /* 文字番号のビット数の上限（不正なバイトを含むコードポイントの範囲まで）*/
+#define TEXT_FM_SAMPLE 8 /* 文書中の位置がこの倍数の行で、文書番号を標本として持つ */
+
+/**
+ * 順位（ある位置より前の1の数）を定数時間で求められるビット列
+ */
+typedef struct {
+    uint64_t *words;
+    uint32_t *ranks; /* 4語ごとの、それより前の1の数 */
+    size_t n;        /* ビット数 */
+} TextFMBits;
+
+/**
+ * 文書の集合のFM-index（圧縮した自己索引）
+ * 文書を区切りをつけて1列につないだテキストのBurrows-Wheeler変換を、文字（コードポイント）の
+ * 番号のウェーブレット行列として持つ。元のテキストも接尾辞配列も持たず、パターンの出現回数を
+ * パターンの長さに比例する手間で数え、各出現を含む文書を標本までたどって求める
+ */
+typedef struct {
+    size_t n;            /* テキストの文字数（区切りを含む）。0なら作っていない */
+    size_t nDoc;
+    int nLevel;          /* 文字番号のビット数 */
+    TextFMBits levels[TEXT_FM_MAX_LEVEL]; /* 上位ビットから順の各段 */
+    size_t zeros[TEXT_FM_MAX_LEVEL]; /* 各段の0の数 */
+    uint32_t *chars;     /* 文字番号2以降の文字（昇順）。0は文書の終わり、1はフィールドの区切り */
+    size_t nChar;        /* 文字番号の数 */
+    uint32_t *counts;    /* 文字番号ごとの、それより小さい文字の数（nChar+1個）*/
+    uint32_t *starts;    /* 文字番号ごとの、最後の段でのその文字の開始位置 */
+    TextFMBits sampled;  /* 標本を持つ行 */
+    uint32_t *samples;   /* 標本の行の文書番号。行順 */
+} TextFM;
+
+/**
+ * 文書の集合からFM-indexを作る
+ * @param text UTF-8の文書を並べたもの。文書iはtext[offsets[i], offsets[i+1])で、中の'\0'はフィールドの
+ *             区切りとする。パターンは区切りや文書の境目をまたいで現れることはない
+ * @param offsets 各文書の開始位置（nDoc+1個）
+ * @param nDoc 文書の数
+ * @param fm 結果を格納する場所。使い終わったらTextFMFreeで解放する
+ * @return 成功した場合1。メモリが足りない場合0
+ */
+extern int TextFMBuild(const char *text, const uint32_t *offsets, size_t nDoc, TextFM *fm);
+
+/**
+ * TextFMBuildで確保したメモリを解放する
+ * @param fm FM-index
+ */
+extern void TextFMFree(TextFM *fm);
+
+/**
+ * パターンの出現を探す。出現は接尾辞の順に並べた行の連続した範囲になる
+ * @param fm FM-index
+ * @param pattern 探すUTF-8の文字列
+ * @param row 範囲の先頭の行を格納する場所
+ * @return 出現回数（範囲の行数）。空のパターンは全ての行に一致する
+ */
+extern size_t TextFMFind(const TextFM *fm, const char *pattern, size_t *row);
+
+/**
+ * 行の出現を含む文書を求める。標本を持つ行まで、テキストを1文字ずつ前にたどる
+ * @param fm FM-index
+ * @param row TextFMFindで得た範囲中の行
+ * @return 文書番号
+ */
+extern uint32_t TextFMLocate(const TextFM *fm, size_t row);
+
+/**
+ * FM-indexが使うメモリの大きさを得る
+ * @param fm FM-index
+ * @return バイト数
+ */
+extern size_t TextFMSize(const TextFM *fm);
+
+#endif /* TEXTFM_H */
@@ -0,0 +1,143 @@
+#include "textMatch.h"
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+typedef const char *(*FindFunc)(const char *text, size_t len, const char *key, size_t keyLen);
+
+static FindFunc findKernel = NULL;
+static const char *kernelName = NULL;
+static pthread_once_t kernelOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * 汎用実装。先頭のバイトをmemchrで探してから残りを比べる
+ */
+static const char *findScalar(const char *text, size_t len, const char *key, size_t keyLen) {
+    if(keyLen == 0)
+        return text;
+    const char *end = text+len;
+    while((size_t)(end-text) >= keyLen) {
+        const char *p = (const char *)memchr(text, key[0], (size_t)(end-text)-keyLen+1);
+        if(p == NULL)
+            return NULL;
+        if(memcmp(p+1, key+1, keyLen-1) == 0)
+            return p;
+        text = p+1;
+    }
+    return NULL;
+}
+
+#ifdef HAVE_X86_SIMD
+/**
+ * SSE2実装。16か所の候補位置について、keyの先頭と末尾のバイトが
+ * 一致するかをまとめて調べ、両方一致した位置だけ残りを比べる
+ */
+static const char *findSSE2(const char *text, size_t len, const char *key, size_t keyLen) {
+    if((keyLen < 2) || (keyLen > len))
+        return findScalar(text, len, key, keyLen);
+    const __m128i first = _mm_set1_epi8(key[0]);
+    const __m128i last = _mm_set1_epi8(key[keyLen-1]);
+    size_t i = 0;
+    for(; i+keyLen-1+16 <= len; i += 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i *)(text+i));
+        __m128i bl = _mm_loadu_si128((const __m128i *)(text+i+keyLen-1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(bf, first),
+                                                                  _mm_cmpeq_epi8(bl, last)));
+        while(mask != 0) {
+            unsigned bit = (unsigned)__builtin_ctz(mask);
+            if(memcmp(text+i+bit+1, key+1, keyLen-2) == 0)
+                return text+i+bit;
+            mask &= mask-1;
+        }
+    }
+    /* 16バイトに満たない残りは汎用実装で調べる */
+    return findScalar(text+i, len-i, key, keyLen);
+}
+
+/**
+ * AVX2実装。findSSE2と同じ方法で32か所ずつ調べる
+ */
+__attribute__((target("avx2")))
+static const char *findAVX2(const char *text, size_t len, const char *key, size_t keyLen) {
+    if((keyLen < 2) || (keyLen > len))
+        return findScalar(text, len, key, keyLen);
+    const __m256i first = _mm256_set1_epi8(key[0]);
+    const __m256i last = _mm256_set1_epi8(key[keyLen-1]);
+    size_t i = 0;
+    for(; i+keyLen-1+32 <= len; i += 32) {
+        __m256i bf = _mm256_loadu_si256((const __m256i *)(text+i));
+        __m256i bl = _mm256_loadu_si256((const __m256i *)(text+i+keyLen-1));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(bf, first),
+                                                                        _mm256_cmpeq_epi8(bl, last)));
+        while(mask != 0) {
+            unsigned bit = (unsigned)__builtin_ctz(mask);
+            if(memcmp(text+i+bit+1, key+1, keyLen-2) == 0)
+                return text+i+bit;
+            mask &= mask-1;
+        }
+    }
+    return findSSE2(text+i, len-i, key, keyLen);
+}
+#endif
+
+/* CPUが対応している中で最も速い実装を選ぶ */
+static void selectKernel(void) {
+    findKernel = findScalar;
+    kernelName = "scalar";
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        findKernel = findAVX2;
+        kernelName = "avx2";
+    } else if(__builtin_cpu_supports("sse2")) {
+        findKernel = findSSE2;
+        kernelName = "sse2";
+    }
+#endif
+}
+
+/**
+ * text[0, len)の中でkey[0, keyLen)が最初に現れる位置を探す
+ * @return 見つかった位置。見つからない場合NULL
+ */
+const char *TextMatchFind(const char *text, size_t len, const char *key, size_t keyLen) {
+    pthread_once(&kernelOnce, selectKernel);
+    return findKernel(text, len, key, keyLen);
+}
+
+/**
+ * TextMatchFindが使う実装の名前を得る
+ */
+const char *TextMatchKernelName(void) {
+    pthread_once(&kernelOnce, selectKernel);
+    return kernelName;
+}
+
+/**
+ * TextMatchFindが使う実装を切り替える
+ */
+int TextMatchSetKernel(const char *name) {
+    pthread_once(&kernelOnce, selectKernel);
+    if(strcmp(name, "scalar") == 0) {
+        findKernel = findScalar;
+        kernelName = "scalar";
+        return 1;
+    }
+#ifdef HAVE_X86_SIMD
+    if((strcmp(name, "sse2") == 0) && __builtin_cpu_supports("sse2")) {
+        findKernel = findSSE2;
+        kernelName = "sse2";
+        return 1;
+    }
+    if((strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        findKernel = findAVX2;
+        kernelName = "avx2";
+        return 1;
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef TEXTMATCH_H
+#define TEXTMATCH_H
+
+#include <stddef.h>
+
+/**
+ * text[0, len)の中でkey[0, keyLen)が最初に現れる位置を探す
+ * CPUに合わせてAVX2、SSE2、汎用のいずれかの実装を使う。どれも結果は同じ
+ * @param text 探す対象（'\0'を含んでもよい）
+ * @param len textの長さ
+ * @param key 探す文字列
+ * @param keyLen keyの長さ
+ * @return 見つかった位置。見つからない場合NULL
+ */
+extern const char *TextMatchFind(const char *text, size_t len, const char *key, size_t keyLen);
+
+/**
+ * TextMatchFindが使う実装の名前を得る
+ * @return "avx2", "sse2", "scalar"のいずれか
+ */
+extern const char *TextMatchKernelName(void);
+
+/**
+ * TextMatchFindが使う実装を切り替える。実装ごとの結果を比べるためのもので、検索中に呼ばないこと
+ * @param name "avx2", "sse2", "scalar"のいずれか
+ * @return 切り替えた場合1。CPUが対応していない実装なら0で、今の実装のまま
+ */
+extern int TextMatchSetKernel(const char *name);
+
+#endif /* TEXTMATCH_H */
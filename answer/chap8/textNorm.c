@@ -0,0 +1,125 @@
+#include "textNorm.h"
+#include <stdint.h>
+
+/* 半角カタカナ(U+FF61〜U+FF9F)に対応する全角の文字 */
+static const uint16_t halfKana[] = {
+    0x3002, 0x300C, 0x300D, 0x3001, 0x30FB, 0x30F2, 0x30A1, 0x30A3, /* ｡｢｣､･ｦｧｨ */
+    0x30A5, 0x30A7, 0x30A9, 0x30E3, 0x30E5, 0x30E7, 0x30C3, 0x30FC, /* ｩｪｫｬｭｮｯｰ */
+    0x30A2, 0x30A4, 0x30A6, 0x30A8, 0x30AA, 0x30AB, 0x30AD, 0x30AF, /* ｱｲｳｴｵｶｷｸ */
+    0x30B1, 0x30B3, 0x30B5, 0x30B7, 0x30B9, 0x30BB, 0x30BD, 0x30BF, /* ｹｺｻｼｽｾｿﾀ */
+    0x30C1, 0x30C4, 0x30C6, 0x30C8, 0x30CA, 0x30CB, 0x30CC, 0x30CD, /* ﾁﾂﾃﾄﾅﾆﾇﾈ */
+    0x30CE, 0x30CF, 0x30D2, 0x30D5, 0x30D8, 0x30DB, 0x30DE, 0x30DF, /* ﾉﾊﾋﾌﾍﾎﾏﾐ */
+    0x30E0, 0x30E1, 0x30E2, 0x30E4, 0x30E6, 0x30E8, 0x30E9, 0x30EA, /* ﾑﾒﾓﾔﾕﾖﾗﾘ */
+    0x30EB, 0x30EC, 0x30ED, 0x30EF, 0x30F3, 0x309B, 0x309C,         /* ﾙﾚﾛﾜﾝﾞﾟ */
+};
+
+/**
+ * UTF-8の1文字を取り出す
+ * returns: バイト数。不正なバイト列なら0
+ */
+static size_t decode(const unsigned char *s, uint32_t *cp) {
+    size_t len;
+    uint32_t c = s[0];
+    if(c < 0x80) {
+        *cp = c;
+        return 1;
+    } else if((c >= 0xc2) && (c < 0xe0)) {
+        c &= 0x1f;
+        len = 2;
+    } else if((c >= 0xe0) && (c < 0xf0)) {
+        c &= 0x0f;
+        len = 3;
+    } else if((c >= 0xf0) && (c < 0xf5)) {
+        c &= 0x07;
+        len = 4;
+    } else
+        return 0;
+    for(size_t i = 1; i < len; i++) {
+        if((s[i] & 0xc0) != 0x80)
+            return 0;
+        c = (c << 6) | (s[i] & 0x3f);
+    }
+    *cp = c;
+    return len;
+}
+
+static char *encode(char *d, uint32_t c) {
+    if(c < 0x80) {
+        *(d++) = (char)c;
+    } else if(c < 0x800) {
+        *(d++) = (char)(0xc0 | (c >> 6));
+        *(d++) = (char)(0x80 | (c & 0x3f));
+    } else if(c < 0x10000) {
+        *(d++) = (char)(0xe0 | (c >> 12));
+        *(d++) = (char)(0x80 | ((c >> 6) & 0x3f));
+        *(d++) = (char)(0x80 | (c & 0x3f));
+    } else {
+        *(d++) = (char)(0xf0 | (c >> 18));
+        *(d++) = (char)(0x80 | ((c >> 12) & 0x3f));
+        *(d++) = (char)(0x80 | ((c >> 6) & 0x3f));
+        *(d++) = (char)(0x80 | (c & 0x3f));
+    }
+    return d;
+}
+
+/* カ行、サ行、タ行、ハ行のカタカナか */
+static int isVoiceable(uint32_t c) {
+    if((c >= 0x30AB) && (c <= 0x30C2))
+        return (c-0x30AB)%2 == 0; /* カ〜ヂ */
+    if((c >= 0x30C4) && (c <= 0x30C8))
+        return (c-0x30C4)%2 == 0; /* ツ〜ト */
+    if((c >= 0x30CF) && (c <= 0x30DD))
+        return (c-0x30CF)%3 == 0; /* ハ〜ホ */
+    return 0;
+}
+
+/* 1文字分の幅とかなを統一する。空白なら0を返す */
+static uint32_t fold(uint32_t c) {
+    if((c == ' ') || (c == '\t') || (c == 0x3000))
+        return 0;
+    if((c >= 0xFF01) && (c <= 0xFF5E))
+        return c-0xFEE0; /* 全角英数字・記号 */
+    if((c >= 0xFF61) && (c <= 0xFF9F))
+        return halfKana[c-0xFF61];
+    if(((c >= 0x3041) && (c <= 0x3096)) || (c == 0x309D) || (c == 0x309E))
+        return c+0x60; /* ひらがな */
+    return c;
+}
+
+size_t TextNormalize(const char *src, char *dst) {
+    const unsigned char *s = (const unsigned char *)src;
+    char *d = dst;
+    while(*s != '\0') {
+        uint32_t c;
+        size_t len = decode(s, &c);
+        if(len == 0) {
+            /* 不正なバイトはそのまま写す */
+            *(d++) = (char)*(s++);
+            continue;
+        }
+        s += len;
+        c = fold(c);
+        if(c == 0)
+            continue;
+        /* 後ろに続く濁点・半濁点を合成する。書き込みは読み終えた位置より前なので上書きしない */
+        uint32_t mark;
+        size_t markLen = decode(s, &mark);
+        if(markLen > 0) {
+            int voiced = (mark == 0xFF9E) || (mark == 0x3099) || (mark == 0x309B);
+            int semi = (mark == 0xFF9F) || (mark == 0x309A) || (mark == 0x309C);
+            if(voiced && isVoiceable(c)) {
+                c++;
+                s += markLen;
+            } else if(voiced && (c == 0x30A6)) {
+                c = 0x30F4; /* ヴ */
+                s += markLen;
+            } else if(semi && (c >= 0x30CF) && (c <= 0x30DD) && ((c-0x30CF)%3 == 0)) {
+                c += 2;
+                s += markLen;
+            }
+        }
+        d = encode(d, c);
+    }
+    *d = '\0';
+    return (size_t)(d-dst);
+}
@@ -0,0 +1,19 @@
+#ifndef TEXTNORM_H
+#define TEXTNORM_H
+
+#include <stddef.h>
+
+/**
+ * 検索で比べるための形に文字列を正規化する（NFKC相当の幅の統一とかなの統一）
+ * - 全角英数字・記号は半角にする
+ * - 半角カタカナは全角にし、後ろの濁点・半濁点は合成する
+ * - ひらがなはカタカナにする
+ * - 空白（半角、全角、タブ）は取り除く
+ * 結果は元より長くならない
+ * @param src 正規化する文字列
+ * @param dst 結果を格納する場所（strlen(src)+1バイト以上）。srcと同じでもよい
+ * @return 結果の長さ
+ */
+extern size_t TextNormalize(const char *src, char *dst);
+
+#endif /* TEXTNORM_H */